@@ -57,9 +57,11 @@ LOCAL_SRC_FILES := \
 	transport_usb.c \
 	commandline.c \
 	adb_client.c \
+	mux.c \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	ignore.c \
 	$(EXTRA_SRCS) \
 	$(USB_SRCS) \
 	shlist.c \
@@ -75,9 +77,10 @@ endif
 
 LOCAL_CFLAGS += -O2 -g -DADB_HOST=1 -Wall -Wno-unused-parameter
 LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE -DSH_HISTORY
+LOCAL_C_INCLUDES += external/zlib
 LOCAL_MODULE := adb
 
-LOCAL_STATIC_LIBRARIES := libzipfile libunz libinotifytools $(EXTRA_STATIC_LIBS)
+LOCAL_STATIC_LIBRARIES := libzipfile libunz libz libinotifytools libmincrypt $(EXTRA_STATIC_LIBS)
 ifeq ($(USE_SYSDEPS_WIN32),)
 	LOCAL_STATIC_LIBRARIES += libcutils
 endif
@@ -121,6 +124,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_service.c \
+	watch_service.c \
 	jdwp_service.c \
 	framebuffer_service.c \
 	remount_service.c \
@@ -130,6 +134,7 @@ LOCAL_SRC_FILES := \
 
 LOCAL_CFLAGS := -O2 -g -DADB_HOST=0 -Wall -Wno-unused-parameter
 LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
+LOCAL_C_INCLUDES += external/zlib
 
 # TODO: This should probably be board specific, whether or not the kernel has
 # the gadget driver; rather than relying on the architecture type.
@@ -144,11 +149,11 @@ LOCAL_MODULE_PATH := $(TARGET_ROOT_OUT_SBIN)
 LOCAL_UNSTRIPPED_PATH := $(TARGET_ROOT_OUT_SBIN_UNSTRIPPED)
 
 ifeq ($(TARGET_SIMULATOR),true)
-  LOCAL_STATIC_LIBRARIES := libcutils libinotifytools
+  LOCAL_STATIC_LIBRARIES := libcutils libinotifytools libmincrypt libz
   LOCAL_LDLIBS += -lpthread
   include $(BUILD_HOST_EXECUTABLE)
 else
-  LOCAL_STATIC_LIBRARIES := libcutils libc libinotifytools
+  LOCAL_STATIC_LIBRARIES := libcutils libc libinotifytools libmincrypt libz
   include $(BUILD_EXECUTABLE)
 endif
 
@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -128,19 +129,149 @@ void  adb_trace_init(void)
 }
 
 
+/* Packets, and the MAX_PAYLOAD buffers handed out by apacket_reserve(),
+** are recycled through free lists instead of going back to malloc for
+** every OKAY and every A_WRTE.  Every transport thread and the fdevent
+** loop allocate packets, so the lists are shared under packet_pool_lock.
+** At most PACKET_POOL_MAX packets and PACKET_POOL_MAX_LARGE buffers are
+** kept; anything freed beyond that goes back to the system.
+*/
+#define PACKET_POOL_MAX         256
+#define PACKET_POOL_MAX_LARGE   16
+
+ADB_MUTEX_DEFINE( packet_pool_lock );
+
+static struct {
+    apacket *packets;           /* free packets, chained through next */
+    unsigned char *buffers;     /* free buffers, chained through the
+                                ** header slot in front of the data */
+    unsigned free_packets;
+    unsigned free_buffers;
+
+        /* packets and buffers handed out, and the most ever at once */
+    unsigned used_packets;
+    unsigned used_buffers;
+    unsigned peak_packets;
+    unsigned peak_buffers;
+} packet_pool;
+
 apacket *get_apacket(void)
 {
-    apacket *p = malloc(sizeof(apacket));
-    if(p == 0) fatal("failed to allocate an apacket");
-    memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
+    apacket *p;
+
+    adb_mutex_lock(&packet_pool_lock);
+    p = packet_pool.packets;
+    if(p) {
+        packet_pool.packets = p->next;
+        packet_pool.free_packets--;
+    }
+    if(++packet_pool.used_packets > packet_pool.peak_packets) {
+        packet_pool.peak_packets = packet_pool.used_packets;
+        D("packet pool: peak of %u packets in use\n", packet_pool.peak_packets);
+    }
+    adb_mutex_unlock(&packet_pool_lock);
+
+    if(p == 0) {
+        p = malloc(sizeof(apacket));
+        if(p == 0) fatal("failed to allocate an apacket");
+    }
+    memset(p, 0, offsetof(apacket, payload));
+    p->data = p->payload;
+    p->size = MAX_PAYLOAD_V1;
     return p;
 }
 
+static void put_buffer(unsigned char *data, unsigned size)
+{
+    unsigned char *buf = data - sizeof(amessage);
+
+    if(size == MAX_PAYLOAD) {
+        adb_mutex_lock(&packet_pool_lock);
+        packet_pool.used_buffers--;
+        if(packet_pool.free_buffers < PACKET_POOL_MAX_LARGE) {
+            *(unsigned char**) buf = packet_pool.buffers;
+            packet_pool.buffers = buf;
+            packet_pool.free_buffers++;
+            buf = 0;
+        }
+        adb_mutex_unlock(&packet_pool_lock);
+    }
+    free(buf);
+}
+
+/* make sure the packet can hold size bytes of payload.  Only called
+** before anything has been stored in the packet, so the old contents
+** are not preserved.  Anything larger than the inline buffer gets a
+** pooled MAX_PAYLOAD buffer.
+*/
+void apacket_reserve(apacket *p, unsigned size)
+{
+    unsigned char *buf = 0;
+
+    if(size <= p->size) return;
+
+    if(p->data != p->payload) {
+        put_buffer(p->data, p->size);
+    }
+
+    if(size <= MAX_PAYLOAD) {
+        size = MAX_PAYLOAD;
+        adb_mutex_lock(&packet_pool_lock);
+        buf = packet_pool.buffers;
+        if(buf) {
+            packet_pool.buffers = *(unsigned char**) buf;
+            packet_pool.free_buffers--;
+        }
+        if(++packet_pool.used_buffers > packet_pool.peak_buffers) {
+            packet_pool.peak_buffers = packet_pool.used_buffers;
+            D("packet pool: peak of %u large buffers in use\n",
+              packet_pool.peak_buffers);
+        }
+        adb_mutex_unlock(&packet_pool_lock);
+    }
+
+    if(buf == 0) {
+        buf = malloc(sizeof(amessage) + size);
+        if(buf == 0) fatal("failed to allocate an apacket buffer");
+    }
+    p->data = buf + sizeof(amessage);
+    p->size = size;
+}
+
 void put_apacket(apacket *p)
 {
+    if(p->data != p->payload) {
+        put_buffer(p->data, p->size);
+    }
+
+    adb_mutex_lock(&packet_pool_lock);
+    packet_pool.used_packets--;
+    if(packet_pool.free_packets < PACKET_POOL_MAX) {
+        p->next = packet_pool.packets;
+        packet_pool.packets = p;
+        packet_pool.free_packets++;
+        p = 0;
+    }
+    adb_mutex_unlock(&packet_pool_lock);
+
     free(p);
 }
 
+#if ADB_HOST
+/* the pool's counters, as "host:packet-stats" reports them */
+static void packet_pool_stats(char *buf, size_t len)
+{
+    adb_mutex_lock(&packet_pool_lock);
+    snprintf(buf, len,
+             "packets: %u in use, %u at most, %u free\n"
+             "large buffers: %u in use, %u at most, %u free",
+             packet_pool.used_packets, packet_pool.peak_packets,
+             packet_pool.free_packets, packet_pool.used_buffers,
+             packet_pool.peak_buffers, packet_pool.free_buffers);
+    adb_mutex_unlock(&packet_pool_lock);
+}
+#endif
+
 void handle_online(void)
 {
     D("adb: online\n");
@@ -226,15 +357,10 @@ static void send_connect(atransport *t)
     cp->msg.command = A_CNXN;
     cp->msg.arg0 = A_VERSION;
     cp->msg.arg1 = MAX_PAYLOAD;
-    snprintf((char*) cp->data, sizeof cp->data, "%s::",
+    snprintf((char*) cp->data, cp->size, "%s::",
             HOST ? "host" : adb_device_banner);
     cp->msg.data_length = strlen((char*) cp->data) + 1;
     send_packet(cp, t);
-#if ADB_HOST
-        /* XXX why sleep here? */
-    // allow the device some time to respond to the connect message
-    adb_sleep_ms(1000);
-#endif
 }
 
 static char *connection_state_name(atransport *t)
@@ -330,6 +456,9 @@ void handle_packet(apacket *p, atransport *t)
             t->connection_state = CS_OFFLINE;
             handle_offline(t);
         }
+        t->max_payload = negotiated_payload(p->msg.arg1);
+        D("peer max payload %d, using %d\n", p->msg.arg1, t->max_payload);
+        t->window = p->msg.arg0 >= A_VERSION_WINDOW ? ADB_WINDOW : 1;
         parse_banner((char*) p->data, t);
         handle_online();
         if(!HOST) send_connect(t);
@@ -357,6 +486,8 @@ void handle_packet(apacket *p, atransport *t)
                 if(s->peer == 0) {
                     s->peer = create_remote_socket(p->msg.arg0, t);
                     s->peer->peer = s;
+                } else {
+                    remote_socket_acked(s->peer);
                 }
                 s->ready(s);
             }
@@ -828,6 +959,28 @@ int launch_server()
 }
 #endif
 
+/* The end of the pipe launch_server() waits on for our "OK".  It is kept
+** aside before start_logging() takes over stderr, and only written to
+** once the first devices are online.
+*/
+#ifdef HAVE_WIN32_PROC
+static HANDLE ready_handle = INVALID_HANDLE_VALUE;
+#elif defined(HAVE_FORKEXEC)
+static int ready_fd = -1;
+#endif
+
+static void server_ready(void)
+{
+#ifdef HAVE_WIN32_PROC
+    DWORD  count;
+    WriteFile( ready_handle, "OK\n", 3, &count, NULL );
+#elif defined(HAVE_FORKEXEC)
+    adb_write(ready_fd, "OK\n", 3);
+    adb_close(ready_fd);
+    ready_fd = -1;
+#endif
+}
+
 int adb_main(int is_daemon)
 {
 #if !ADB_HOST
@@ -856,6 +1009,10 @@ int adb_main(int is_daemon)
     if(install_listener("tcp:5037", "*smartsocket*", NULL)) {
         exit(1);
     }
+#ifndef HAVE_WIN32_IPC
+        /* cheaper to connect to than the tcp port; clients try it first */
+    install_listener("localabstract:" ADB_LOCAL_SOCKET, "*smartsocket*", NULL);
+#endif
 #else
     /* run adbd in secure mode if ro.secure is set and
     ** we are not in the emulator
@@ -947,14 +1104,17 @@ int adb_main(int is_daemon)
 
     if (is_daemon)
     {
-        // inform our parent that we are up and running.
+        // inform our parent that we are up and running, once the
+        // devices that are already plugged in are.
 #ifdef HAVE_WIN32_PROC
-        DWORD  count;
-        WriteFile( GetStdHandle( STD_OUTPUT_HANDLE ), "OK\n", 3, &count, NULL );
+        ready_handle = GetStdHandle( STD_OUTPUT_HANDLE );
 #elif defined(HAVE_FORKEXEC)
-        fprintf(stderr, "OK\n");
+        fflush(stderr);
+        ready_fd = dup(STDERR_FILENO);
+        close_on_exec(ready_fd);
 #endif
         start_logging();
+        notify_when_ready(server_ready);
     }
 
     fdevent_loop();
@@ -1090,6 +1250,33 @@ done:
         return 0;
     }
 
+    // how many packets and large buffers are in use, and the most ever
+    if (!strcmp(service, "packet-stats")) {
+        char stats[256];
+        packet_pool_stats(stats, sizeof stats);
+        snprintf(buf, sizeof buf, "OKAY%04x%s", (unsigned)strlen(stats), stats);
+        writex(reply_fd, buf, strlen(buf));
+        return 0;
+    }
+
+#ifndef HAVE_WIN32_IPC
+    // the connection becomes a mux channel, see mux.c
+    if (!strcmp(service, "mux")) {
+        int fd = dup(reply_fd);
+
+        if (fd < 0) {
+            sendfailmsg(reply_fd, "cannot start mux channel");
+            return 0;
+        }
+        close_on_exec(fd);
+        snprintf(buf, sizeof buf, "OKAY%04x", ADB_SERVER_VERSION);
+        if (writex(fd, buf, strlen(buf)) || mux_start(fd, 1) == 0) {
+            adb_close(fd);
+        }
+        return 0;
+    }
+#endif
+
     if(!strncmp(service,"get-serialno",strlen("get-serialno"))) {
         char *out = "unknown";
          transport = acquire_one_transport(CS_ANY, ttype, serial, NULL);
@@ -19,7 +19,15 @@
 
 #include <limits.h>
 
-#define MAX_PAYLOAD 4096
+    /* payload size spoken by adb 1.0 peers, and the size of the
+    ** buffer every apacket carries inline
+    */
+#define MAX_PAYLOAD_V1  (4*1024)
+
+    /* largest payload we advertise in CNXN; each transport uses the
+    ** smaller of this and what its peer advertised
+    */
+#define MAX_PAYLOAD     (256*1024)
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -28,12 +36,18 @@
 #define A_CLSE 0x45534c43
 #define A_WRTE 0x45545257
 
-#define A_VERSION 0x01000000        // ADB protocol version
+#define A_VERSION 0x01000001        // ADB protocol version
+
+    /* peers at or above this version let each stream have
+    ** ADB_WINDOW writes awaiting READY instead of just one
+    */
+#define A_VERSION_WINDOW 0x01000001
+#define ADB_WINDOW  8
 
 #define ADB_VERSION_MAJOR 1         // Used for help/version information
 #define ADB_VERSION_MINOR 0         // Used for help/version information
 
-#define ADB_SERVER_VERSION    26    // Increment this when we want to force users to start a new adb server
+#define ADB_SERVER_VERSION    27    // Increment this when we want to force users to start a new adb server
 
 typedef struct amessage amessage;
 typedef struct apacket apacket;
@@ -60,8 +74,18 @@ struct apacket
     unsigned len;
     unsigned char *ptr;
 
+        /* the payload buffer and its capacity.  data points at the
+        ** inline payload below unless apacket_reserve() had to give
+        ** the packet a larger one.  Either way the sizeof(amessage)
+        ** bytes before data are free for the header, so transports
+        ** can send header and payload with a single write.
+        */
+    unsigned char *data;
+    unsigned size;
+
+        /* msg must immediately precede payload */
     amessage msg;
-    unsigned char data[MAX_PAYLOAD];
+    unsigned char payload[MAX_PAYLOAD_V1];
 };
 
 /* An asocket represents one half of a connection between a local and
@@ -158,6 +182,27 @@ typedef enum transport_type {
         kTransportHost,
 } transport_type;
 
+/* A single-producer/single-consumer queue of packets between a transport
+** thread and the main loop.  The socketpair beside it only carries
+** wakeups: "not empty" from producer_fd to consumer_fd when the consumer
+** is asleep, "not full" the other way when the producer is.
+*/
+#define PACKET_RING_SIZE 256
+
+typedef struct packet_ring packet_ring;
+
+struct packet_ring
+{
+    apacket *slot[PACKET_RING_SIZE];
+    volatile unsigned head;         /* only moved by the producer */
+    volatile unsigned tail;         /* only moved by the consumer */
+    volatile int consumer_sleeping;
+    volatile int producer_waiting;
+    volatile int closed;            /* the consumer is gone */
+    int producer_fd;
+    int consumer_fd;
+};
+
 struct atransport
 {
     atransport *next;
@@ -168,6 +213,12 @@ struct atransport
     void (*close)(atransport *t);
     void (*kick)(atransport *t);
 
+        /* from_remote carries what the output thread reads to the
+        ** main loop, to_remote what the input thread is to write.  fd
+        ** and transport_socket are from_remote's two ends.
+        */
+    packet_ring from_remote;
+    packet_ring to_remote;
     int fd;
     int transport_socket;
     fdevent transport_fde;
@@ -176,6 +227,16 @@ struct atransport
     int connection_state;
     transport_type type;
 
+        /* largest payload either side may send, settled by CNXN */
+    unsigned max_payload;
+        /* the same, as the input thread last read it from a CNXN, so that
+        ** check_header() need not wait for the main loop; 0 before one
+        */
+    unsigned read_max_payload;
+
+        /* writes a stream may have awaiting READY, settled by CNXN */
+    unsigned window;
+
         /* usb handle or socket fd as needed */
     usb_handle *usb;
     int sfd;
@@ -227,6 +288,7 @@ asocket *create_local_socket(int fd);
 asocket *create_local_service_socket(const char *destination);
 
 asocket *create_remote_socket(unsigned id, atransport *t);
+void remote_socket_acked(asocket *s);
 void connect_to_remote(asocket *s, const char *destination);
 void connect_to_smartsocket(asocket *s);
 
@@ -276,16 +338,44 @@ void unregister_transport(atransport *t);
 
 void register_usb_transport(usb_handle *h, const char *serial, unsigned writeable);
 
+/* the usb code calls this once its first scan for devices is registered */
+void usb_scan_complete(void);
+
+/* calls func from the main loop once the first usb scan is in and every
+** transport it found is past CNXN, or after ADB_READY_TIMEOUT ms at most
+*/
+#define ADB_READY_TIMEOUT 3000
+void notify_when_ready(void (*func)(void));
+
+/* many streams over one connection to the server, see mux.c.
+** mux_start() pumps fd in a thread of its own, serving OPENs if server
+** is set, and mux_open() returns a new stream for a client to use like
+** a connection of its own, or -1.
+*/
+typedef struct mux_channel mux_channel;
+mux_channel *mux_start(int fd, int server);
+int mux_open(mux_channel *c);
+
 /* this should only be used for transports with connection_state == CS_NOPERM */
 void unregister_usb_transport(usb_handle *usb);
+/* the same, but safe while the transport's registration is still pending;
+** usb is closed once it is done
+*/
+void forget_usb_transport(usb_handle *usb);
 
 atransport *find_transport(const char *serial);
 
 int service_to_fd(const char *name);
 #if ADB_HOST
 asocket *host_service_to_socket(const char*  name, const char *serial);
-// Watcher for ADBLink
-void *watcher(void *path);
+// ADBLink: one watcher thread follows the folders of every link in the
+// list, each link is then brought up and down with its device
+struct linkinfo;
+int link_watch_start(struct linkinfo *links);
+int link_up(struct linkinfo *link, const char *serial);
+void link_down(struct linkinfo *link);
+struct linkstats;
+void link_stats(struct linkinfo *link, struct linkstats *st);
 #endif
 
 #if !ADB_HOST
@@ -299,14 +389,18 @@ int       create_jdwp_connection_fd(int  jdwp_pid);
 void framebuffer_service(int fd, void *cookie);
 void log_service(int fd, void *cookie);
 void remount_service(int fd, void *cookie);
+void watch_service(int fd, void *cookie);
 char * get_log_file_path(const char * log_name);
 #endif
 
 /* packet allocator */
 apacket *get_apacket(void);
+void apacket_reserve(apacket *p, unsigned size);
 void put_apacket(apacket *p);
 
-int check_header(apacket *p);
+/* the payload size both sides settle on when the peer's CNXN offers peer */
+unsigned negotiated_payload(unsigned peer);
+int check_header(apacket *p, atransport *t);
 int check_data(apacket *p);
 
 /* convenience wrappers around read/write that will retry on
@@ -361,6 +455,7 @@ typedef enum {
 #endif
 
 #define ADB_PORT 5037
+#define ADB_LOCAL_SOCKET "adb-5037"   /* local socket name beside ADB_PORT */
 #define ADB_LOCAL_TRANSPORT_PORT 5555
 
 #define ADB_CLASS              0xff
@@ -402,6 +497,7 @@ extern int HOST;
 #define CHUNK_SIZE (64*1024)
 
 int sendfailmsg(int fd, const char *reason);
+unsigned unhex(unsigned char *s, int len);
 int handle_host_request(char *service, transport_type ttype, char* serial, int reply_fd, asocket *s);
 
 #endif
@@ -76,18 +76,18 @@ const char *adb_error(void)
     return __adb_error;
 }
 
-static int switch_socket_transport(int fd)
+static int switch_socket_transport(int fd, transport_type type, const char* serial)
 {
     char service[64];
     char tmp[5];
     int len;
 
-    if (__adb_serial)
-        snprintf(service, sizeof service, "host:transport:%s", __adb_serial);
+    if (serial)
+        snprintf(service, sizeof service, "host:transport:%s", serial);
     else {
         char* transport_type = "???";
 
-         switch (__adb_transport) {
+         switch (type) {
             case kTransportUsb:
                 transport_type = "transport-usb";
                 break;
@@ -160,27 +160,96 @@ int adb_status(int fd)
     return -1;
 }
 
-int _adb_connect(const char *service)
+/* adb link connects from several threads at once: the server check, the
+** mux channel and the streams opened on it are all under server_check_lock
+*/
+ADB_MUTEX_DEFINE( server_check_lock );
+static mux_channel *__adb_mux = NULL;
+static int __adb_checked = 0;
+
+static int server_socket(void)
+{
+#ifndef HAVE_WIN32_IPC
+    int fd = socket_local_client(ADB_LOCAL_SOCKET,
+                                 ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+    if(fd >= 0) {
+        return fd;
+    }
+#endif
+    return socket_loopback_client(ADB_PORT, SOCK_STREAM);
+}
+
+/* open the mux channel that later connections are streams of, and
+** return the server's version, -1 if it has no mux or -2 if there
+** is no server at all
+*/
+static int mux_connect(void)
+{
+#ifndef HAVE_WIN32_IPC
+    char buf[5];
+    int fd;
+
+    fd = server_socket();
+    if(fd < 0) {
+        strcpy(__adb_error, "cannot connect to daemon");
+        return -2;
+    }
+    if(writex(fd, "0008host:mux", 12) || adb_status(fd) || readx(fd, buf, 4)) {
+        adb_close(fd);
+        return -1;
+    }
+    buf[4] = 0;
+
+    close_on_exec(fd);
+    __adb_mux = mux_start(fd, 0);
+    if(__adb_mux == NULL) {
+        adb_close(fd);
+        return -1;
+    }
+    D("mux channel open on fd %d\n", fd);
+    return strtoul(buf, 0, 16);
+#else
+    return -1;
+#endif
+}
+
+/* a stream of the mux channel, or a connection of its own; called with
+** server_check_lock held
+*/
+static int open_stream(int direct)
+{
+    int fd = -1;
+
+    if(__adb_mux && !direct) {
+        fd = mux_open(__adb_mux);
+    }
+    if(fd < 0) {
+        fd = server_socket();
+    }
+    return fd;
+}
+
+/* ask for service on fd, as returned by open_stream() */
+static int request_service(int fd, const char *service, transport_type type, const char* serial)
 {
     char tmp[5];
     int len;
-    int fd;
 
     D("_adb_connect: %s\n", service);
     len = strlen(service);
     if((len < 1) || (len > 1024)) {
         strcpy(__adb_error, "service name too long");
+        if(fd >= 0) adb_close(fd);
         return -1;
     }
     snprintf(tmp, sizeof tmp, "%04x", len);
 
-    fd = socket_loopback_client(ADB_PORT, SOCK_STREAM);
     if(fd < 0) {
         strcpy(__adb_error, "cannot connect to daemon");
         return -2;
     }
 
-    if (memcmp(service,"host",4) != 0 && switch_socket_transport(fd)) {
+    if (memcmp(service,"host",4) != 0 && switch_socket_transport(fd, type, serial)) {
         return -1;
     }
 
@@ -198,28 +267,34 @@ int _adb_connect(const char *service)
     return fd;
 }
 
-int adb_connect(const char *service)
+static int connect_to(const char *service, transport_type type, const char* serial, int direct)
 {
-    // first query the adb server's version
-    int fd = _adb_connect("host:version");
+    int fd;
 
-    if(fd == -2) {
-        fprintf(stdout,"* daemon not running. starting it now *\n");
-    start_server:
-        if(launch_server(0)) {
-            fprintf(stderr,"* failed to start daemon *\n");
-            return -1;
-        } else {
-            fprintf(stdout,"* daemon started successfully *\n");
-        }
-        /* give the server some time to start properly and detect devices */
-        adb_sleep_ms(3000);
-        // fall through to _adb_connect
-    } else {
-        // if server was running, check its version to make sure it is not out of date
-        char buf[100];
-        int n;
-        int version = ADB_SERVER_VERSION - 1;
+    adb_mutex_lock(&server_check_lock);
+    fd = open_stream(direct);
+    adb_mutex_unlock(&server_check_lock);
+    return request_service(fd, service, type, serial);
+}
+
+int _adb_connect(const char *service)
+{
+    return connect_to(service, __adb_transport, __adb_serial, 0);
+}
+
+/* make sure a server of our version is running: once per process, and
+** again if it goes away.  Called with server_check_lock held.
+*/
+static int check_server(void)
+{
+    char buf[100];
+    int fd, n;
+    int version = mux_connect();
+
+    if(version == -1) {
+        // no mux channel: query the adb server's version on its own
+        fd = request_service(open_stream(0), "host:version",
+                             __adb_transport, __adb_serial);
 
         // if we have a file descriptor, then parse version result
         if(fd >= 0) {
@@ -231,38 +306,130 @@ int adb_connect(const char *service)
             if(readx(fd, buf, n)) goto error;
             adb_close(fd);
 
-            if (sscanf(buf, "%04x", &version) != 1) goto error;
+            if (sscanf(buf, "%04x", &version) != 1) return -1;
+        } else if(fd == -2) {
+            version = -2;
         } else {
             // if fd is -1, then check for "unknown host service",
             // which would indicate a version of adb that does not support the version command
             if (strcmp(__adb_error, "unknown host service") != 0)
                 return fd;
+            version = ADB_SERVER_VERSION - 1;
         }
+    }
 
-        if(version != ADB_SERVER_VERSION) {
-            printf("adb server is out of date.  killing...\n");
-            fd = _adb_connect("host:kill");
-            adb_close(fd);
+    if(version == -2) {
+        fprintf(stdout,"* daemon not running. starting it now *\n");
+    start_server:
+        if(launch_server(0)) {
+            fprintf(stderr,"* failed to start daemon *\n");
+            return -1;
+        } else {
+            fprintf(stdout,"* daemon started successfully *\n");
+        }
+        /* launch_server() only returns once the server has found the
+        ** devices already plugged in.  it is ours, so it has a mux; if
+        ** the channel fails anyway we get by on connections of our own
+        */
+        mux_connect();
+        return 0;
+    }
 
-            /* XXX can we better detect its death? */
-            adb_sleep_ms(2000);
-            goto start_server;
+    // if server was running, check its version to make sure it is not out of date
+    if(version != ADB_SERVER_VERSION) {
+        printf("adb server is out of date.  killing...\n");
+        fd = request_service(open_stream(0), "host:kill",
+                             __adb_transport, __adb_serial);
+        if(fd >= 0) {
+            /* the server exits right after its OKAY: our end of
+            ** the connection reads EOF once it is gone
+            */
+            for(;;) {
+                n = adb_read(fd, buf, sizeof(buf));
+                if(n > 0 || (n < 0 && errno == EINTR)) continue;
+                break;
+            }
+            adb_close(fd);
         }
+            /* a channel to the old server is dead by now, and mux_open()
+            ** knows: its pump thread closes every stream after marking it
+            */
+        __adb_mux = NULL;
+        goto start_server;
+    }
+    return 0;
+
+error:
+    adb_close(fd);
+    return -1;
+}
+
+static int connect_checked(const char *service, transport_type type, const char* serial, int direct)
+{
+    mux_channel *mux;
+    int fd, checked;
+
+    adb_mutex_lock(&server_check_lock);
+    checked = __adb_checked;
+    if(!checked) {
+        fd = check_server();
+        if(fd) goto done;
+        __adb_checked = 1;
     }
 
     // if the command is start-server, we are done.
-    if (!strcmp(service, "host:start-server"))
-        return 0;
+    if (!strcmp(service, "host:start-server")) {
+        fd = 0;
+        goto done;
+    }
 
-    fd = _adb_connect(service);
+    mux = __adb_mux;
+    fd = open_stream(direct);
+    adb_mutex_unlock(&server_check_lock);
+
+    fd = request_service(fd, service, type, serial);
+    if(fd == -2 && checked) {
+        /* the server we checked on has gone away since, killed or
+        ** crashed under a long-running client such as adb link: start
+        ** one again, as for the first connection, unless another
+        ** thread got there first.  Its mux channel went with it.
+        */
+        adb_mutex_lock(&server_check_lock);
+        if(__adb_mux == mux) {
+            D("server gone, checking again\n");
+            __adb_mux = NULL;
+            fd = check_server();
+            if(fd) goto done;
+        }
+        fd = open_stream(direct);
+        adb_mutex_unlock(&server_check_lock);
+        fd = request_service(fd, service, type, serial);
+    }
     if(fd == -2) {
         fprintf(stderr,"** daemon still not running");
     }
+    return fd;
 
+done:
+    adb_mutex_unlock(&server_check_lock);
     return fd;
-error:
-    adb_close(fd);
-    return -1;
+}
+
+int adb_connect(const char *service)
+{
+    return connect_checked(service, __adb_transport, __adb_serial, 0);
+}
+
+int adb_connect_direct(const char *service)
+{
+    return connect_checked(service, __adb_transport, __adb_serial, 1);
+}
+
+int adb_connect_serial(const char *service, const char *serial)
+{
+    if (serial == NULL)
+        return adb_connect(service);
+    return connect_checked(service, kTransportAny, serial, 0);
 }
 
 
@@ -10,6 +10,16 @@
 int adb_connect(const char *service);
 int _adb_connect(const char *service);
 
+/* adb_connect() on a connection of its own rather than a stream of the
+** process's mux channel, for an fd that has to outlive the process
+*/
+int adb_connect_direct(const char *service);
+
+/* adb_connect() to the device with the given serial number instead of the
+** one set with adb_set_transport(); NULL means that one
+*/
+int adb_connect_serial(const char *service, const char *serial);
+
 /* connect to adb, connect to the named service, return 0 if
 ** the connection succeeded AND the service returned OKAY
 */
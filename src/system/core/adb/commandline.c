@@ -39,6 +39,7 @@
 #include "adb.h"
 #include "adb_client.h"
 #include "file_sync_service.h"
+#include "ignore.h"
 
 #ifdef SH_HISTORY
 #include "shlist.h"
@@ -129,6 +130,13 @@ void help()
         "                                   dev:<character device name>\n"
         "                                   jdwp:<process pid> (remote only)\n"
         "  adb jdwp                     - list PIDs of processes hosting a JDWP transport\n"
+        "  adb link [-w <ms>] [-f <file>] [<folder> ...]\n"
+        "                               - keep each <folder> in sync with the device while it\n"
+        "                                 is plugged in ('-w' sets how long a file must be\n"
+        "                                 left alone before it is pushed, default 250ms).\n"
+        "                                 Several folders each get their own folder on the\n"
+        "                                 device; <file> lists more links, one per line as\n"
+        "                                 '<folder> <serial|-> <remote folder>'\n"
         "  adb install [-l] [-r] [-s] <file> - push this package file to the device and install it\n"
         "                                 ('-l' means forward-lock the app)\n"
         "                                 ('-r' means reinstall the app, keeping its data)\n"
@@ -152,6 +160,7 @@ void help()
         "  adb kill-server              - kill the server if it is running\n"
         "  adb get-state                - prints: offline | bootloader | device\n"
         "  adb get-serialno             - prints: <serial-number>\n"
+        "  adb packet-stats             - prints how many packets the server has in use\n"
         "  adb status-window            - continuously print device status for a specified device\n"
         "  adb remount                  - remounts the /system partition on the device read-write\n"
         "  adb reboot [bootloader|recovery] - reboots the device, optionally into the bootloader or recovery program\n"
@@ -511,7 +520,8 @@ int ppp(int argc, char **argv)
 
     adb_service_name = argv[1];
 
-    fd = adb_connect(adb_service_name);
+        /* pppd keeps the fd after we exit */
+    fd = adb_connect_direct(adb_service_name);
 
     if(fd < 0) {
         fprintf(stderr,"Error: Could not open adb service: %s. Error: %s\n",
@@ -754,6 +764,251 @@ static const char *find_product_out_path(const char *hint)
     return path_buf;
 }
 
+// ADBLink: a local folder linked with a folder on one device, or on any
+static linkinfo *link_new(linkinfo ***tail, const char *lpath,
+		const char *serial, const char *rpath, int quiet_ms)
+{
+	linkinfo *link = (linkinfo *) calloc(1, sizeof(linkinfo));
+
+	if(link == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return NULL;
+	}
+	link->lpath = lpath;
+	link->rpath = rpath;
+	link->serial = serial;
+	link->syncfd = -1;
+	link->quiet_ms = quiet_ms;
+	link->ignore = ignore_load(lpath);
+	**tail = link;
+	*tail = &link->next;
+	return link;
+}
+
+// A remote folder always ends in '/'
+static char *link_remote_path(const char *rpath, const char *name)
+{
+	int len = strlen(rpath), nlen = name ? strlen(name) : 0;
+	char *path = malloc(len + nlen + 2);
+
+	if(path == NULL) return NULL;
+	strcpy(path, rpath);
+	if(name) {
+		if(len == 0 || path[len - 1] != '/') path[len++] = '/';
+		strcpy(path + len, name);
+		len += nlen;
+	}
+	if(len == 0 || path[len - 1] != '/') path[len++] = '/';
+	path[len] = 0;
+	return path;
+}
+
+// With several folders on the command line, each gets its own folder below
+// RPATH, named after it
+static char *link_default_remote(const char *lpath)
+{
+	char abs[PATH_MAX];
+	char *base;
+
+	if(realpath(lpath, abs) == NULL) {
+		fprintf(stderr, "cannot link '%s': %s\n", lpath, strerror(errno));
+		return NULL;
+	}
+	base = strrchr(abs, '/');
+	base = base ? base + 1 : abs;
+	if(*base == 0) {
+		fprintf(stderr, "cannot link '%s': no name for it on the device\n",
+				lpath);
+		return NULL;
+	}
+	return link_remote_path(STRINGIFY(RPATH), base);
+}
+
+// One link per line: "<folder> <serial> <remote folder>", where a serial
+// of "-" means any device; '#' starts a comment
+static int link_read_file(const char *file, linkinfo ***tail, int quiet_ms)
+{
+	char line[PATH_MAX * 2 + 128];
+	char *lpath, *serial, *rpath;
+	int n = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if(f == NULL) {
+		fprintf(stderr, "cannot open '%s': %s\n", file, strerror(errno));
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		char *hash = strchr(line, '#');
+
+		n++;
+		if(hash) *hash = 0;
+		lpath = strtok(line, " \t\r\n");
+		if(lpath == NULL) continue;
+		serial = strtok(NULL, " \t\r\n");
+		rpath = strtok(NULL, " \t\r\n");
+		if(rpath == NULL || strtok(NULL, " \t\r\n")) {
+			fprintf(stderr, "%s:%d: expected <folder> <serial|-> <remote folder>\n",
+					file, n);
+			fclose(f);
+			return -1;
+		}
+		lpath = strdup(lpath);
+		serial = strcmp(serial, "-") ? strdup(serial) : NULL;
+		rpath = link_remote_path(rpath, NULL);
+		if(lpath == NULL || rpath == NULL ||
+				link_new(tail, lpath, serial, rpath, quiet_ms) == NULL) {
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+// Whether one of two folders is, or is below, the other; trailing '/'s
+// are not part of the name
+static int link_paths_nest(const char *a, const char *b)
+{
+	int la = strlen(a), lb = strlen(b), n;
+	const char *longer;
+
+	while(la > 0 && a[la - 1] == '/') la--;
+	while(lb > 0 && b[lb - 1] == '/') lb--;
+	n = (la < lb) ? la : lb;
+	if(memcmp(a, b, n)) return 0;
+	longer = (la > lb) ? a : b;
+	return longer[n] == 0 || longer[n] == '/';
+}
+
+// The watcher gives every event to the one link whose folder holds it, so
+// no two local folders may nest, and no two links may write into the same
+// remote folder on a device they can both be up with
+static int link_check_overlap(linkinfo *links)
+{
+	char abs[PATH_MAX], other[PATH_MAX];
+	linkinfo *a, *b;
+
+	for(a = links; a; a = a->next) {
+		if(realpath(a->lpath, abs) == NULL) {
+			fprintf(stderr, "cannot link '%s': %s\n", a->lpath, strerror(errno));
+			return -1;
+		}
+		for(b = a->next; b; b = b->next) {
+			if(realpath(b->lpath, other) == NULL) {
+				fprintf(stderr, "cannot link '%s': %s\n", b->lpath,
+						strerror(errno));
+				return -1;
+			}
+			if(link_paths_nest(abs, other)) {
+				fprintf(stderr, "cannot link '%s' and '%s': the folders nest\n",
+						a->lpath, b->lpath);
+				return -1;
+			}
+			if((a->serial == NULL || b->serial == NULL ||
+					!strcmp(a->serial, b->serial)) &&
+					link_paths_nest(a->rpath, b->rpath)) {
+				fprintf(stderr, "cannot link '%s' and '%s': the remote folders "
+						"'%s' and '%s' nest\n", a->lpath, b->lpath,
+						a->rpath, b->rpath);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Read one "host:track-devices" update: a hex length, then a
+// "<serial>\t<state>\n" line for each device
+static int link_read_devices(int fd, char *buf, int size)
+{
+	char tmp[5];
+	int len;
+
+	if(readx(fd, tmp, 4)) return -1;
+	tmp[4] = 0;
+	len = strtoul(tmp, 0, 16);
+	if(len >= size || readx(fd, buf, len)) return -1;
+	buf[len] = 0;
+	return len;
+}
+
+// Take the next device that is online off the list at *p
+static int link_next_device(const char **p, char *serial, int size)
+{
+	while(**p) {
+		const char *line = *p;
+		const char *end = strchr(line, '\n');
+		const char *tab;
+
+		if(end == NULL) end = line + strlen(line);
+		*p = *end ? end + 1 : end;
+		tab = memchr(line, '\t', end - line);
+		if(tab && tab - line < size && end - tab == 7 &&
+				!strncmp(tab, "\tdevice", 7)) {
+			memcpy(serial, line, tab - line);
+			serial[tab - line] = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int link_device_online(const char *devices, const char *serial)
+{
+	char dev[64];
+	const char *p = devices;
+
+	while(link_next_device(&p, dev, sizeof(dev))) {
+		if(!strcmp(dev, serial)) return 1;
+	}
+	return 0;
+}
+
+// Take down the links whose device went away, and bring up the others if
+// their device is there.  A link for any device stays with the one it got
+// for as long as that one is online.
+static void link_update(linkinfo *links, const char *devices)
+{
+	linkinfo *link;
+	linkstats st;
+	char any[64];
+	const char *p = devices;
+	int have_any = link_next_device(&p, any, sizeof(any));
+	int up = 0;
+
+	for(link = links; link; link = link->next) {
+		if(link->device && !link_device_online(devices, link->device)) {
+			printf("* %s: device %s disconnected *\n", link->lpath,
+					link->device);
+			link_stats(link, &st);
+			if(st.overflows || st.remote_overflows || st.watch_failures) {
+				printf("* %s: events lost %u times here, %u times on the "
+						"device, %u directories not watched; %u changes "
+						"recovered *\n", link->lpath, st.overflows,
+						st.remote_overflows, st.watch_failures, st.recovered);
+			}
+			link_down(link);
+		}
+	}
+	for(link = links; link; link = link->next) {
+		const char *serial = link->serial ? link->serial :
+				have_any ? any : NULL;
+
+		if(link->device == NULL && serial &&
+				link_device_online(devices, serial)) {
+			printf("* Linking %s with %s *\n", link->lpath, serial);
+			if(!link_up(link, serial)) {
+				printf("* Initial sync OK *\n");
+			} else {
+				fprintf(stderr, "Couldn't synchronise %s\n", link->lpath);
+			}
+		}
+		up += link->device != NULL;
+	}
+	if(up == 0) printf("* Waiting for device *\n");
+}
+
 int adb_commandline(int argc, char **argv)
 {
     char buf[4096];
@@ -859,6 +1114,18 @@ top:
         }
     }
 
+    if(!strcmp(argv[0], "packet-stats")) {
+        char *tmp;
+        snprintf(buf, sizeof buf, "host:%s", argv[0]);
+        tmp = adb_query(buf);
+        if(tmp) {
+            printf("%s\n", tmp);
+            return 0;
+        } else {
+            return 1;
+        }
+    }
+
     if(!strcmp(argv[0], "connect") || !strcmp(argv[0], "disconnect")) {
         char *tmp;
         if (argc != 2) {
@@ -1118,50 +1385,63 @@ top:
 
     // ADBLink option
 	if(!strcmp(argv[0], "link")) {
-		int fd, len;
-		pthread_t thread = 0;
-
-		if(argc == 2) {
-
-			fd = adb_connect("host:track-devices");
-
-			while(fd >= 0) {
-				len = adb_read(fd, buf, 4096);
-				if(len == 0) {
-					break;
-				}
-
-				if(len < 0) {
-					if(errno == EINTR) continue;
-					break;
-				}
-				if(strncmp(buf, "0014", 4) == 0) {
-					printf("* Device connected *\n");
-					printf("* Linking with %s *\n", argv[1]);
-
-					if(!do_link(argv[1], STRINGIFY(RPATH))) {
-						printf("* Initial sync OK *\n");
-						#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 13)
-						pthread_create(&thread, NULL, watcher, (void*) argv[1]);
-						#else
-						#error "The Watcher will not be available"
-						#endif
-					} else {
-						fprintf(stderr, "Couldn't synchronise\n");
-					}
-				}
-				if(strncmp(buf, "0000", 4) == 0) {
-					printf("* Waiting for device *\n");
-					if(thread) {
-						pthread_cancel(thread);
-					}
-				}
+		linkinfo *links = NULL, **tail = &links, *link;
+		const char *file = NULL;
+		int quiet_ms = LINK_DEFAULT_QUIET_MS;
+		int fd, n;
+
+		argc--;
+		argv++;
+		while(argc >= 2 && (!strcmp(argv[0], "-w") || !strcmp(argv[0], "-f"))) {
+			if(argv[0][1] == 'w') {
+				quiet_ms = atoi(argv[1]);
+			} else {
+				file = argv[1];
 			}
-			return adb_close(fd);
-
-		} else {
+			argc -= 2;
+			argv += 2;
+		}
+		if(quiet_ms < 0 || (argc == 0 && file == NULL)) {
 			return usage();
 		}
+
+		if(file && link_read_file(file, &tail, quiet_ms)) {
+			return 1;
+		}
+		// a folder named on its own goes to the device picked with -s, or
+		// to any device
+		for(n = 0; n < argc; n++) {
+			char *rpath = (argc == 1) ? STRINGIFY(RPATH)
+					: link_default_remote(argv[n]);
+
+			if(rpath == NULL || link_new(&tail, argv[n], serial, rpath,
+					quiet_ms) == NULL) {
+				return 1;
+			}
+		}
+
+		if(link_check_overlap(links)) {
+			return 1;
+		}
+
+		// one watcher for all the folders, each link is then brought up and
+		// down with its device
+		#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 13)
+		if(link_watch_start(links)) {
+			return 1;
+		}
+		#else
+		#error "The Watcher will not be available"
+		#endif
+
+		fd = adb_connect("host:track-devices");
+		while(fd >= 0 && link_read_devices(fd, buf, sizeof(buf)) >= 0) {
+			link_update(links, buf);
+		}
+		for(link = links; link; link = link->next) {
+			link_down(link);
+		}
+		return adb_close(fd);
 	}
 
     /* "adb /?" is a common idiom under Windows */
@@ -76,16 +76,22 @@ static fdevent list_pending = {
 static fdevent **fd_table = 0;
 static int fd_table_max = 0;
 
-#ifdef CRAPTASTIC
-//HAVE_EPOLL
+#ifdef HAVE_EPOLL
 
 #include <sys/epoll.h>
 
+    /* fds that epoll refuses to watch (regular files, mostly) are
+    ** flagged FDE_NOPOLL and treated as always ready, like select()
+    ** would.  nopoll_count says whether any of them are around.
+    */
+#define FDE_NOPOLL     0x0800
+
 static int epoll_fd = -1;
+static int nopoll_count = 0;
 
 static void fdevent_init()
 {
-        /* XXX: what's a good size for the passed in hint? */
+        /* the size is only a hint */
     epoll_fd = epoll_create(256);
 
     if(epoll_fd < 0) {
@@ -99,42 +105,36 @@ static void fdevent_init()
 
 static void fdevent_connect(fdevent *fde)
 {
-    struct epoll_event ev;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
-
-#if 0
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-        perror("epoll_ctl() failed\n");
-        exit(1);
-    }
-#endif
+        /* nothing to do until some events are wanted; the fd is
+        ** added to the epoll set by fdevent_update()
+        */
 }
 
 static void fdevent_disconnect(fdevent *fde)
 {
     struct epoll_event ev;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
+    if(fde->state & FDE_NOPOLL) {
+        nopoll_count--;
+        return;
+    }
 
-        /* technically we only need to delete if we
-        ** were actively monitoring events, but let's
-        ** be aggressive and do it anyway, just in case
-        ** something's out of sync
-        */
+        /* only registered while some events are wanted */
+    if((fde->state & FDE_EVENTMASK) == 0) return;
+
+    memset(&ev, 0, sizeof(ev));
     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev);
 }
 
 static void fdevent_update(fdevent *fde, unsigned events)
 {
     struct epoll_event ev;
-    int active;
+    int active, op;
 
     active = (fde->state & FDE_EVENTMASK) != 0;
+    fde->state = (fde->state & FDE_STATEMASK) | events;
+
+    if(fde->state & FDE_NOPOLL) return;
 
     memset(&ev, 0, sizeof(ev));
     ev.events = 0;
@@ -144,34 +144,24 @@ static void fdevent_update(fdevent *fde, unsigned events)
     if(events & FDE_WRITE) ev.events |= EPOLLOUT;
     if(events & FDE_ERROR) ev.events |= (EPOLLERR | EPOLLHUP);
 
-    fde->state = (fde->state & FDE_STATEMASK) | events;
-
+        /* add when we start watching, delete when we stop,
+        ** and modify in between
+        */
     if(active) {
-            /* we're already active. if we're changing to *no*
-            ** events being monitored, we need to delete, otherwise
-            ** we need to just modify
-            */
-        if(ev.events) {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
-        } else {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
-        }
+        op = ev.events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     } else {
-            /* we're not active.  if we're watching events, we need
-            ** to add, otherwise we can just do nothing
-            */
-        if(ev.events) {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
+        if(ev.events == 0) return;
+        op = EPOLL_CTL_ADD;
+    }
+
+    if(epoll_ctl(epoll_fd, op, fde->fd, &ev)) {
+        if((op == EPOLL_CTL_ADD) && (errno == EPERM)) {
+            fde->state |= FDE_NOPOLL;
+            nopoll_count++;
+            return;
         }
+        perror("epoll_ctl() failed");
+        exit(1);
     }
 }
 
@@ -179,9 +169,10 @@ static void fdevent_process()
 {
     struct epoll_event events[256];
     fdevent *fde;
+    unsigned wanted;
     int i, n;
 
-    n = epoll_wait(epoll_fd, events, 256, -1);
+    n = epoll_wait(epoll_fd, events, 256, nopoll_count ? 0 : -1);
 
     if(n < 0) {
         if(errno == EINTR) return;
@@ -192,6 +183,7 @@ static void fdevent_process()
     for(i = 0; i < n; i++) {
         struct epoll_event *ev = events + i;
         fde = ev->data.ptr;
+        wanted = fde->state & FDE_EVENTMASK;
 
         if(ev->events & EPOLLIN) {
             fde->events |= FDE_READ;
@@ -200,14 +192,31 @@ static void fdevent_process()
             fde->events |= FDE_WRITE;
         }
         if(ev->events & (EPOLLERR | EPOLLHUP)) {
-            fde->events |= FDE_ERROR;
+                /* epoll reports these whether asked or not.  select()
+                ** would have shown the fd as readable or writable, and
+                ** callers expect to notice the error on their next
+                ** read or write, so hand them that.
+                */
+            fde->events |= FDE_ERROR | (wanted & (FDE_READ | FDE_WRITE));
         }
+        fde->events &= wanted;
         if(fde->events) {
             if(fde->state & FDE_PENDING) continue;
             fde->state |= FDE_PENDING;
             fdevent_plist_enqueue(fde);
         }
     }
+
+    if(nopoll_count) {
+        for(i = 0; i < fd_table_max; i++) {
+            fde = fd_table[i];
+            if((fde == 0) || !(fde->state & FDE_NOPOLL)) continue;
+            fde->events |= fde->state & (FDE_READ | FDE_WRITE);
+            if(fde->events == 0 || (fde->state & FDE_PENDING)) continue;
+            fde->state |= FDE_PENDING;
+            fdevent_plist_enqueue(fde);
+        }
+    }
 }
 
 #else /* USE_SELECT */
@@ -240,14 +249,18 @@ static void fdevent_connect(fdevent *fde)
 
 static void fdevent_disconnect(fdevent *fde)
 {
-    int i, n;
+    int n;
 
     FD_CLR(fde->fd, &read_fds);
     FD_CLR(fde->fd, &write_fds);
     FD_CLR(fde->fd, &error_fds);
 
-    for(n = 0, i = 0; i < select_n; i++) {
-        if(fd_table[i] != 0) n = i;
+        /* only the highest fd going away lowers select_n; fd_table
+        ** still holds this fde, so search below it
+        */
+    if(fde->fd != select_n - 1) return;
+    for(n = fde->fd - 1; n >= 0; n--) {
+        if(fd_table[n] != 0) break;
     }
     select_n = n + 1;
 }
@@ -337,7 +350,7 @@ static void fdevent_register(fdevent *fde)
         if(fd_table == 0) {
             FATAL("could not expand fd_table to %d entries\n", fd_table_max);
         }
-        memset(fd_table + oldmax, 0, sizeof(int) * (fd_table_max - oldmax));
+        memset(fd_table + oldmax, 0, sizeof(fdevent*) * (fd_table_max - oldmax));
     }
 
     fd_table[fde->fd] = fde;
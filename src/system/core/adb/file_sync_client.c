@@ -23,18 +23,43 @@
 #include <time.h>
 #include <dirent.h>
 #include <limits.h>
+#include <utime.h>
 #include <sys/types.h>
+#ifndef HAVE_WINSOCK
+#include <sys/uio.h>
+#endif
 #include <zipfile/zipfile.h>
+#include <zlib.h>
 
 #include "sysdeps.h"
 #include "adb.h"
 #include "adb_client.h"
 #include "file_sync_service.h"
+#include "ignore.h"
+#include "mincrypt/sha.h"
 
 
 static unsigned total_bytes;
 static long long start_time;
 
+    /* bytes that crossed as ZDAT, before and after compression */
+static unsigned total_zin;
+static unsigned total_zout;
+
+    /* optional features the device agreed to, per session: a link may
+    ** hold sessions with several devices at once
+    */
+#define SYNC_FEAT_ZLIB 1
+#define SYNC_FEAT_RLST 2
+#define SYNC_FD_MAX 1024
+static unsigned char sync_fd_features[SYNC_FD_MAX];
+
+static unsigned sync_features(int fd)
+{
+    if(fd < 0 || fd >= SYNC_FD_MAX) return 0;
+    return sync_fd_features[fd];
+}
+
 static long long NOW()
 {
     struct timeval tv;
@@ -46,6 +71,8 @@ static long long NOW()
 static void BEGIN()
 {
     total_bytes = 0;
+    total_zin = 0;
+    total_zout = 0;
     start_time = NOW();
 }
 
@@ -57,6 +84,15 @@ static void END()
     if (t == 0)  /* prevent division by 0 :-) */
         t = 1000000;
 
+    if(total_zin) {
+        fprintf(stderr,"%lld KB/s (%d bytes in %lld.%03llds, %u compressed to %u, %u%%)\n",
+                ((((long long) total_bytes) * 1000000LL) / t) / 1024LL,
+                total_bytes, (t / 1000000LL), (t % 1000000LL) / 1000LL,
+                total_zin, total_zout,
+                (unsigned) ((total_zout * 100LL) / total_zin));
+        return;
+    }
+
     fprintf(stderr,"%lld KB/s (%d bytes in %lld.%03llds)\n",
             ((((long long) total_bytes) * 1000000LL) / t) / 1024LL,
             total_bytes, (t / 1000000LL), (t % 1000000LL) / 1000LL);
@@ -72,7 +108,80 @@ void sync_quit(int fd)
     writex(fd, &msg.req, sizeof(msg.req));
 }
 
-typedef void (*sync_ls_cb)(unsigned mode, unsigned size, unsigned time, const char *name, void *cookie);
+/* open a sync session and ask for the optional features.  An adbd that
+** does not know FEAT fails it and ends the session, so then a plain one
+** is opened.
+*/
+static int sync_connect_to(const char *serial)
+{
+    static const char wanted[] = SYNC_FEATURE_ZLIB " " SYNC_FEATURE_RLST;
+    syncmsg msg;
+    char reply[257];
+    char *name, *next;
+    unsigned features = 0;
+    int fd, len;
+
+    fd = adb_connect_serial("sync:", serial);
+    if(fd < 0) goto fail;
+
+    len = strlen(wanted);
+    msg.req.id = ID_FEAT;
+    msg.req.namelen = htoll(len);
+    if(!writex(fd, &msg.req, sizeof(msg.req)) &&
+       !writex(fd, wanted, len) &&
+       !readx(fd, &msg.status, sizeof(msg.status)) &&
+       (msg.status.id == ID_OKAY)) {
+        len = ltohl(msg.status.msglen);
+        if((len <= 256) && !readx(fd, reply, len)) {
+            reply[len] = 0;
+            for(name = reply; *name; name = next) {
+                next = strchr(name, ' ');
+                if(next) {
+                    *next++ = 0;
+                } else {
+                    next = name + strlen(name);
+                }
+                if(!strcmp(name, SYNC_FEATURE_ZLIB)) {
+                    features |= SYNC_FEAT_ZLIB;
+                } else if(!strcmp(name, SYNC_FEATURE_RLST)) {
+                    features |= SYNC_FEAT_RLST;
+                }
+            }
+            if(fd < SYNC_FD_MAX) sync_fd_features[fd] = features;
+            return fd;
+        }
+    }
+
+    adb_close(fd);
+    fd = adb_connect_serial("sync:", serial);
+    if(fd < 0) goto fail;
+    if(fd < SYNC_FD_MAX) sync_fd_features[fd] = 0;
+    return fd;
+
+fail:
+    fprintf(stderr,"error: %s\n", adb_error());
+    return -1;
+}
+
+static int sync_connect(void)
+{
+    return sync_connect_to(NULL);
+}
+
+static int sync_request(int fd, unsigned id, const char *name, int len)
+{
+    syncmsg msg;
+
+    msg.req.id = id;
+    msg.req.namelen = htoll(len);
+
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, name, len)) {
+        return -1;
+    }
+
+    return 0;
+}
 
 int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
 {
@@ -113,6 +222,44 @@ fail:
     return -1;
 }
 
+/* like sync_ls, but for the whole tree below path in one request, with
+** names relative to path.  Needs the RLST feature.
+*/
+int sync_ls_tree(int fd, const char *path, int maxdepth, const char *pattern,
+                 sync_ls_cb func, void *cookie)
+{
+    syncmsg msg;
+    char buf[SYNC_RLST_NAME_MAX + 1];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%s%c%d%c%s", path, 0, maxdepth, 0,
+                   pattern);
+    if((len < 0) || (len > 1024)) goto fail;
+
+    if(sync_request(fd, ID_RLST, buf, len)) goto fail;
+
+    for(;;) {
+        if(readx(fd, &msg.dent, sizeof(msg.dent))) break;
+        if(msg.dent.id == ID_DONE) return 0;
+        if(msg.dent.id != ID_DENT) break;
+
+        len = ltohl(msg.dent.namelen);
+        if(len > SYNC_RLST_NAME_MAX) break;
+
+        if(readx(fd, buf, len)) break;
+        buf[len] = 0;
+
+        func(ltohl(msg.dent.mode),
+             ltohl(msg.dent.size),
+             ltohl(msg.dent.time),
+             buf, cookie);
+    }
+
+fail:
+    adb_close(fd);
+    return -1;
+}
+
 typedef struct syncsendbuf syncsendbuf;
 
 struct syncsendbuf {
@@ -122,6 +269,7 @@ struct syncsendbuf {
 };
 
 static syncsendbuf send_buffer;
+static syncsendbuf zsend_buffer;
 
 int sync_readtime(int fd, const char *path, unsigned *timestamp)
 {
@@ -207,9 +355,100 @@ int sync_readmode(int fd, const char *path, unsigned *mode)
     return 0;
 }
 
+/* how many incompressible chunks a file may still have before we stop
+** trying; starting at the limit sends the whole file as plain DATA
+*/
+static int zdata_misses(int fd, const char *path)
+{
+    if((sync_features(fd) & SYNC_FEAT_ZLIB) && !sync_is_compressed(path)) {
+        return 0;
+    }
+    return SYNC_ZLIB_MAX_MISSES;
+}
+
+#ifndef HAVE_WINSOCK
+/* writex() for a message whose parts live apart */
+static int writevx(int fd, struct iovec *iov, int count)
+{
+    while(count > 0) {
+        ssize_t r = writev(fd, iov, count);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        while(count > 0 && (size_t) r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char*) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+#endif
+
+/* send len bytes of data as one DATA message, or as ZDAT when that is
+** worth it.  data is either sbuf->data or a caller's buffer, which goes
+** out behind the header in sbuf without being copied.
+*/
+static int write_data_chunk(int fd, syncsendbuf *sbuf, const char *data,
+                            int len, int *misses)
+{
+    syncsendbuf *zbuf = &zsend_buffer;
+    uLongf zlen = SYNC_DATA_MAX;
+
+    if(*misses < SYNC_ZLIB_MAX_MISSES) {
+        if(compress2((Bytef*) zbuf->data, &zlen, (const Bytef*) data, len,
+                     SYNC_ZLIB_LEVEL) == Z_OK &&
+           SYNC_ZLIB_WORTH(zlen, (uLongf) len)) {
+            *misses = 0;
+            zbuf->id = ID_ZDAT;
+            zbuf->size = htoll(zlen);
+            if(writex(fd, zbuf, sizeof(unsigned) * 2 + zlen))
+                return -1;
+            total_bytes += len;
+            total_zin += len;
+            total_zout += zlen;
+            return 0;
+        }
+        (*misses)++;
+    }
+
+    sbuf->id = ID_DATA;
+    sbuf->size = htoll(len);
+    if(data != sbuf->data) {
+#ifndef HAVE_WINSOCK
+        struct iovec iov[2];
+
+        iov[0].iov_base = sbuf;
+        iov[0].iov_len = sizeof(unsigned) * 2;
+        iov[1].iov_base = (void*) data;
+        iov[1].iov_len = len;
+        if(writevx(fd, iov, 2))
+            return -1;
+        total_bytes += len;
+        return 0;
+#else
+        memmove(sbuf->data, data, len);
+#endif
+    }
+    if(writex(fd, sbuf, sizeof(unsigned) * 2 + len))
+        return -1;
+    total_bytes += len;
+    return 0;
+}
+
 static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
 {
     int lfd, err = 0;
+    int misses = zdata_misses(fd, path);
+#ifdef SYNC_USE_SENDFILE
+    struct stat st;
+    long long left = -1;
+#endif
 
     lfd = adb_open(path, O_RDONLY);
     if(lfd < 0) {
@@ -217,10 +456,43 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
         return -1;
     }
 
-    sbuf->id = ID_DATA;
+#ifdef SYNC_USE_SENDFILE
+        /* chunks that go out uncompressed are spliced straight from the
+           file; the DATA header has to name their size up front */
+    if(fstat(lfd, &st) == 0 && S_ISREG(st.st_mode)) {
+        left = st.st_size;
+    }
+#endif
+
     for(;;) {
         int ret;
 
+#ifdef SYNC_USE_SENDFILE
+        if(left >= 0 && misses >= SYNC_ZLIB_MAX_MISSES) {
+            int len = (left < SYNC_DATA_MAX) ? left : SYNC_DATA_MAX;
+            if(len == 0) break;
+
+            sbuf->id = ID_DATA;
+            sbuf->size = htoll(len);
+            if(writex(fd, sbuf, sizeof(unsigned) * 2) ||
+               (ret = sync_sendfile(fd, lfd, sbuf->data, len)) < 0) {
+                err = -1;
+                break;
+            }
+            if(ret < len) {
+                    /* keep the stream in step with the header we sent;
+                       the caller makes the device throw the file away */
+                fprintf(stderr,"'%s' changed while being sent\n", path);
+                memset(sbuf->data, 0, len - ret);
+                writex(fd, sbuf->data, len - ret);
+                err = -1;
+                break;
+            }
+            total_bytes += len;
+            left -= len;
+            continue;
+        }
+#endif
         ret = adb_read(lfd, sbuf->data, SYNC_DATA_MAX);
         if(!ret)
             break;
@@ -229,41 +501,43 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
             if(errno == EINTR)
                 continue;
             fprintf(stderr,"cannot read '%s': %s\n", path, strerror(errno));
+            err = -1;
             break;
         }
 
-        sbuf->size = htoll(ret);
-        if(writex(fd, sbuf, sizeof(unsigned) * 2 + ret)){
+#ifdef SYNC_USE_SENDFILE
+        if(left >= 0) {
+            left = (left > ret) ? left - ret : 0;
+        }
+#endif
+
+        if(write_data_chunk(fd, sbuf, sbuf->data, ret, &misses)){
             err = -1;
             break;
         }
-        total_bytes += ret;
     }
 
     adb_close(lfd);
     return err;
 }
 
-static int write_data_buffer(int fd, char* file_buffer, int size, syncsendbuf *sbuf)
+static int write_data_buffer(int fd, const char *path, char* file_buffer, int size, syncsendbuf *sbuf)
 {
     int err = 0;
     int total = 0;
+    int misses = zdata_misses(fd, path);
 
-    sbuf->id = ID_DATA;
     while (total < size) {
         int count = size - total;
         if (count > SYNC_DATA_MAX) {
             count = SYNC_DATA_MAX;
         }
 
-        memcpy(sbuf->data, &file_buffer[total], count);
-        sbuf->size = htoll(count);
-        if(writex(fd, sbuf, sizeof(unsigned) * 2 + count)){
+        if(write_data_chunk(fd, sbuf, &file_buffer[total], count, &misses)){
             err = -1;
             break;
         }
         total += count;
-        total_bytes += count;
     }
 
     return err;
@@ -294,22 +568,98 @@ static int write_data_link(int fd, const char *path, syncsendbuf *sbuf)
 }
 #endif
 
-static int sync_send(int fd, const char *lpath, const char *rpath,
-                     unsigned mtime, mode_t mode, int verifyApk)
+/* send one file without waiting for the device to acknowledge it; every
+** sync_start_send() is answered by exactly one status, read back in order
+** by sync_finish_send(), which returns 1 if the device refused the file
+** and -1 if the session was lost.  A file that cannot be read to the end
+** is not finished: the session is dropped and -1 returned instead.
+*/
+static int sync_start_send(int fd, const char *lpath, const char *rpath,
+                           unsigned mtime, mode_t mode,
+                           char *file_buffer, int size)
 {
     syncmsg msg;
     int len, r;
     syncsendbuf *sbuf = &send_buffer;
-    char* file_buffer = NULL;
-    int size = 0;
     char tmp[64];
 
     len = strlen(rpath);
-    if(len > 1024) goto fail;
+    if(len > 1024) return -1;
 
     snprintf(tmp, sizeof(tmp), ",%d", mode);
     r = strlen(tmp);
 
+    msg.req.id = ID_SEND;
+    msg.req.namelen = htoll(len + r);
+
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, rpath, len) || writex(fd, tmp, r)) {
+        return -1;
+    }
+
+    if (file_buffer)
+        r = write_data_buffer(fd, rpath, file_buffer, size, sbuf);
+    else if (S_ISREG(mode))
+        r = write_data_file(fd, lpath, sbuf);
+#ifdef HAVE_SYMLINKS
+    else if (S_ISLNK(mode))
+        r = write_data_link(fd, lpath, sbuf);
+#endif
+    else
+        return -1;
+
+    if(r) {
+            /* anything but DATA or DONE makes the device delete what
+               it has of the file and end the session */
+        msg.data.id = ID_QUIT;
+        msg.data.size = 0;
+        writex(fd, &msg.data, sizeof(msg.data));
+        return -1;
+    }
+
+    msg.data.id = ID_DONE;
+    msg.data.size = htoll(mtime);
+    if(writex(fd, &msg.data, sizeof(msg.data)))
+        return -1;
+
+    return 0;
+}
+
+static int sync_finish_send(int fd, const char *lpath, const char *rpath)
+{
+    syncmsg msg;
+    int len;
+    syncsendbuf *sbuf = &send_buffer;
+
+    if(readx(fd, &msg.status, sizeof(msg.status)))
+        return -1;
+
+    if(msg.status.id != ID_OKAY) {
+        if(msg.status.id == ID_FAIL) {
+            len = ltohl(msg.status.msglen);
+            if(len > 256) len = 256;
+            if(readx(fd, sbuf->data, len)) {
+                return -1;
+            }
+            sbuf->data[len] = 0;
+        } else
+            strcpy(sbuf->data, "unknown reason");
+
+        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", lpath, rpath, sbuf->data);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int sync_send(int fd, const char *lpath, const char *rpath,
+                     unsigned mtime, mode_t mode, int verifyApk)
+{
+    char* file_buffer = NULL;
+    int size = 0;
+
+    if(strlen(rpath) > 1024) goto fail;
+
     if (verifyApk) {
         int lfd;
         zipfile_t zip;
@@ -367,51 +717,13 @@ static int sync_send(int fd, const char *lpath, const char *rpath,
         }
     }
 
-    msg.req.id = ID_SEND;
-    msg.req.namelen = htoll(len + r);
-
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, rpath, len) || writex(fd, tmp, r)) {
-        free(file_buffer);
-        goto fail;
-    }
-
-    if (file_buffer) {
-        write_data_buffer(fd, file_buffer, size, sbuf);
+    if(sync_start_send(fd, lpath, rpath, mtime, mode, file_buffer, size)) {
         free(file_buffer);
-    } else if (S_ISREG(mode))
-        write_data_file(fd, lpath, sbuf);
-#ifdef HAVE_SYMLINKS
-    else if (S_ISLNK(mode))
-        write_data_link(fd, lpath, sbuf);
-#endif
-    else
-        goto fail;
-
-    msg.data.id = ID_DONE;
-    msg.data.size = htoll(mtime);
-    if(writex(fd, &msg.data, sizeof(msg.data)))
         goto fail;
-
-    if(readx(fd, &msg.status, sizeof(msg.status)))
-        return -1;
-
-    if(msg.status.id != ID_OKAY) {
-        if(msg.status.id == ID_FAIL) {
-            len = ltohl(msg.status.msglen);
-            if(len > 256) len = 256;
-            if(readx(fd, sbuf->data, len)) {
-                return -1;
-            }
-            sbuf->data[len] = 0;
-        } else
-            strcpy(sbuf->data, "unknown reason");
-
-        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", lpath, rpath, sbuf->data);
-        return -1;
     }
+    free(file_buffer);
 
-    return 0;
+    return sync_finish_send(fd, lpath, rpath);
 
 fail:
     fprintf(stderr,"protocol failure\n");
@@ -438,11 +750,15 @@ static int mkdirs(char *name)
     return 0;
 }
 
+/* returns 0 once lpath is written, 1 if the device failed it part way
+** through, and -1 if the session is lost
+*/
 int sync_recv(int fd, const char *rpath, const char *lpath)
 {
     syncmsg msg;
     int len;
     int lfd = -1;
+    int started;
     char *buffer = send_buffer.data;
     unsigned id;
 
@@ -461,7 +777,7 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     }
     id = msg.data.id;
 
-    if((id == ID_DATA) || (id == ID_DONE)) {
+    if((id == ID_DATA) || (id == ID_ZDAT) || (id == ID_DONE)) {
         adb_unlink(lpath);
         mkdirs((char *)lpath);
         lfd = adb_creat(lpath, 0644);
@@ -483,14 +799,30 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     handle_data:
         len = ltohl(msg.data.size);
         if(id == ID_DONE) break;
-        if(id != ID_DATA) goto remote_error;
+        if((id != ID_DATA) && (id != ID_ZDAT)) goto remote_error;
         if(len > SYNC_DATA_MAX) {
             fprintf(stderr,"data overrun\n");
             adb_close(lfd);
             return -1;
         }
 
-        if(readx(fd, buffer, len)) {
+        if(id == ID_ZDAT) {
+            uLongf size = SYNC_DATA_MAX;
+
+            if(readx(fd, zsend_buffer.data, len)) {
+                adb_close(lfd);
+                return -1;
+            }
+            if(uncompress((Bytef*) buffer, &size,
+                          (Bytef*) zsend_buffer.data, len) != Z_OK) {
+                fprintf(stderr,"corrupt compressed data from '%s'\n", rpath);
+                adb_close(lfd);
+                return -1;
+            }
+            total_zin += size;
+            total_zout += len;
+            len = size;
+        } else if(readx(fd, buffer, len)) {
             adb_close(lfd);
             return -1;
         }
@@ -508,6 +840,7 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     return 0;
 
 remote_error:
+    started = (lfd >= 0);
     adb_close(lfd);
     adb_unlink(lpath);
 
@@ -524,44 +857,362 @@ remote_error:
 //        strcpy(buffer,"unknown reason");
     }
     fprintf(stderr,"failed to copy '%s' to '%s': %s\n", rpath, lpath, buffer);
-    return 0;
+        /* the device gave up on a file it had started to send, when it
+        ** changed under it: the session is fine, but the copy is gone
+        */
+    return started ? 1 : 0;
 }
 
 
+/* report a FAIL status whose header is in msg */
+static int sync_failure(int fd, syncmsg *msg, const char *what, const char *rpath)
+{
+    char *reason = send_buffer.data;
+    int len;
 
-/* --- */
+    if(msg->status.id != ID_FAIL)
+        return -1;
 
+    len = ltohl(msg->status.msglen);
+    if(len > 256) len = 256;
+    if(readx(fd, reason, len))
+        return -1;
+    reason[len] = 0;
 
-static void do_sync_ls_cb(unsigned mode, unsigned size, unsigned time,
-                          const char *name, void *cookie)
-{
-    printf("%08x %08x %08x %s\n", mode, size, time, name);
+    fprintf(stderr,"failed to %s '%s': %s\n", what, rpath, reason);
+
+        /* older adbd closes the session on requests it does not know */
+    if(!strcmp(reason, "unknown command"))
+        return SYNC_UNSUPPORTED;
+    return 1;
 }
 
-int do_sync_ls(const char *path)
+static int sync_status(int fd, const char *what, const char *rpath)
 {
-    int fd = adb_connect("sync:");
-    if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
-        return 1;
-    }
+    syncmsg msg;
 
-    if(sync_ls(fd, path, do_sync_ls_cb, 0)) {
-        return 1;
-    } else {
-        sync_quit(fd);
+    if(readx(fd, &msg.status, sizeof(msg.status)))
+        return -1;
+
+    if(msg.status.id == ID_OKAY)
         return 0;
-    }
+    return sync_failure(fd, &msg, what, rpath);
 }
 
-typedef struct copyinfo copyinfo;
+int sync_remove(int fd, const char *rpath)
+{
+    int len = strlen(rpath);
+    if(len > 1024) return 1;
 
-struct copyinfo
+    if(sync_request(fd, ID_ULNK, rpath, len))
+        return -1;
+    return sync_status(fd, "remove", rpath);
+}
+
+int sync_mkdir(int fd, const char *rpath)
 {
-    copyinfo *next;
-    const char *src;
-    const char *dst;
-    unsigned int time;
+    int len = strlen(rpath);
+    if(len > 1024) return 1;
+
+    if(sync_request(fd, ID_MKDR, rpath, len))
+        return -1;
+    return sync_status(fd, "create directory", rpath);
+}
+
+int sync_rename(int fd, const char *rfrom, const char *rto)
+{
+    char buf[1024];
+    int flen = strlen(rfrom);
+    int tlen = strlen(rto);
+
+    if(flen + 1 + tlen > 1024) return 1;
+    memcpy(buf, rfrom, flen + 1);
+    memcpy(buf + flen + 1, rto, tlen);
+
+    if(sync_request(fd, ID_RENM, buf, flen + 1 + tlen))
+        return -1;
+    return sync_status(fd, "rename", rfrom);
+}
+
+
+#define DELTA_HASH_SIZE 65536
+#define DELTA_HASH(weak) (((weak) ^ ((weak) >> 16)) & (DELTA_HASH_SIZE - 1))
+
+typedef struct {
+    int fd;
+    const char *path;   /* local file, to decide whether to compress */
+    unsigned offset;    /* pending COPY, merged while blocks follow each other */
+    unsigned size;
+} deltastate;
+
+static int delta_flush_copy(deltastate *ds)
+{
+    syncmsg msg;
+
+    if(ds->size == 0)
+        return 0;
+
+    msg.copy.id = ID_COPY;
+    msg.copy.size = htoll(ds->size);
+    msg.copy.offset = htoll(ds->offset);
+    ds->size = 0;
+    return writex(ds->fd, &msg.copy, sizeof(msg.copy));
+}
+
+static int delta_copy(deltastate *ds, unsigned offset, unsigned size)
+{
+    if(ds->size && ds->offset + ds->size == offset) {
+        ds->size += size;
+        return 0;
+    }
+    if(delta_flush_copy(ds))
+        return -1;
+    ds->offset = offset;
+    ds->size = size;
+    return 0;
+}
+
+static int delta_literal(deltastate *ds, unsigned char *data, int len)
+{
+    if(len == 0)
+        return 0;
+    if(delta_flush_copy(ds))
+        return -1;
+    return write_data_buffer(ds->fd, ds->path, (char*) data, len, &send_buffer);
+}
+
+/* find the block of the remote file that matches data, or -1 */
+static int delta_match(syncsig *sigs, int *hash, int *chain, unsigned weak,
+                       unsigned char *data, int len, int blocksize,
+                       unsigned count, unsigned size)
+{
+    uint8_t digest[SHA_DIGEST_SIZE];
+    int have_digest = 0;
+    int i;
+
+    for(i = hash[DELTA_HASH(weak)]; i >= 0; i = chain[i]) {
+        int blen = (i == (int) count - 1) ? (int) (size - i * blocksize) : blocksize;
+        if(sigs[i].weak != weak || blen != len)
+            continue;
+        if(!have_digest) {
+            SHA(data, len, digest);
+            have_digest = 1;
+        }
+        if(!memcmp(digest, sigs[i].strong, SHA_DIGEST_SIZE))
+            return i;
+    }
+    return -1;
+}
+
+/* send lpath as a delta against the copy the device already has.
+** Returns 0 when the file was sent, 1 when the device has nothing to diff
+** against or refused the delta (the caller should fall back to
+** sync_send()), -1 if the session was lost and SYNC_UNSUPPORTED if the
+** device does not know SIGN.
+*/
+static int sync_send_delta(int fd, const char *lpath, const char *rpath,
+                           unsigned mtime, mode_t mode)
+{
+    syncmsg msg;
+    deltastate ds;
+    syncsig *sigs = 0;
+    int *hash = 0, *chain = 0;
+    unsigned char *buf = 0;
+    unsigned blocksize, count, size, i;
+    unsigned a = 0, b = 0;
+    int lfd = -1, len, r, ret = -1;
+    int cap, start = 0, end = 0, lit = 0, eof = 0, have_sum = 0;
+    char tmp[64];
+
+    len = strlen(rpath);
+    if(len > 1024) return -1;
+
+    if(sync_request(fd, ID_SIGN, rpath, len))
+        return -1;
+
+        /* a FAIL is as long as a status; a sign header is longer */
+    if(readx(fd, &msg.status, sizeof(msg.status)))
+        return -1;
+    if(msg.sign.id != ID_SIGN)
+        return sync_failure(fd, &msg, "sign", rpath);
+    if(readx(fd, &msg.sign.count, sizeof(msg.sign) - sizeof(msg.status)))
+        return -1;
+
+    blocksize = ltohl(msg.sign.blocksize);
+    count = ltohl(msg.sign.count);
+    size = ltohl(msg.sign.size);
+    if(count == 0)
+        return 1;
+    if(blocksize < SYNC_SIGN_MIN_BLOCK || blocksize > SYNC_DATA_MAX ||
+       count != (size + blocksize - 1) / blocksize) {
+        fprintf(stderr,"invalid signature for '%s'\n", rpath);
+        return -1;
+    }
+
+    sigs = malloc(count * sizeof(syncsig));
+    chain = malloc(count * sizeof(int));
+    hash = malloc(DELTA_HASH_SIZE * sizeof(int));
+    cap = 2 * SYNC_DATA_MAX + 2 * blocksize;
+    buf = malloc(cap);
+    if(!sigs || !chain || !hash || !buf) {
+        fprintf(stderr,"out of memory\n");
+        abort();
+    }
+
+        /* always drain the signatures so the session stays usable */
+    if(readx(fd, sigs, count * sizeof(syncsig)))
+        goto done;
+
+    memset(hash, 0xff, DELTA_HASH_SIZE * sizeof(int));
+    for(i = count; i-- > 0;) {
+        sigs[i].weak = ltohl(sigs[i].weak);
+        chain[i] = hash[DELTA_HASH(sigs[i].weak)];
+        hash[DELTA_HASH(sigs[i].weak)] = i;
+    }
+
+    lfd = adb_open(lpath, O_RDONLY);
+    if(lfd < 0) {
+        fprintf(stderr,"cannot open '%s': %s\n", lpath, strerror(errno));
+        ret = 1;
+        goto done;
+    }
+
+    snprintf(tmp, sizeof(tmp), ",%d", mode);
+    r = strlen(tmp);
+    msg.req.id = ID_DLTA;
+    msg.req.namelen = htoll(len + r);
+    if(writex(fd, &msg.req, sizeof(msg.req)) ||
+       writex(fd, rpath, len) || writex(fd, tmp, r)) {
+        goto done;
+    }
+
+    ds.fd = fd;
+    ds.path = lpath;
+    ds.size = 0;
+
+    for(;;) {
+        int match;
+
+            /* keep a whole block buffered past start */
+        if(!eof && end - start <= (int) blocksize) {
+            memmove(buf, buf + lit, end - lit);
+            start -= lit;
+            end -= lit;
+            lit = 0;
+            while(!eof && end < cap) {
+                r = adb_read(lfd, buf + end, cap - end);
+                if(r < 0) {
+                    if(errno == EINTR) continue;
+                    fprintf(stderr,"cannot read '%s': %s\n", lpath, strerror(errno));
+                    goto done;
+                }
+                if(r == 0) eof = 1;
+                end += r;
+            }
+        }
+        if(end - start < (int) blocksize)
+            break;
+
+        if(!have_sum) {
+            unsigned weak = sync_weak_sum(buf + start, blocksize);
+            a = weak & 0xffff;
+            b = weak >> 16;
+            have_sum = 1;
+        }
+
+        match = delta_match(sigs, hash, chain, a | (b << 16), buf + start,
+                            blocksize, blocksize, count, size);
+        if(match >= 0) {
+            if(delta_literal(&ds, buf + lit, start - lit) ||
+               delta_copy(&ds, match * blocksize, blocksize))
+                goto done;
+            start += blocksize;
+            lit = start;
+            have_sum = 0;
+            continue;
+        }
+
+            /* literal runs go out in SYNC_DATA_MAX pieces */
+        if(start - lit >= SYNC_DATA_MAX) {
+            if(delta_literal(&ds, buf + lit, start - lit))
+                goto done;
+            lit = start;
+        }
+
+        if(end - start > (int) blocksize) {
+            unsigned out = buf[start];
+            unsigned in = buf[start + blocksize];
+            a = (a - out + in) & 0xffff;
+            b = (b - blocksize * out + a) & 0xffff;
+        } else {
+            have_sum = 0;
+        }
+        start++;
+    }
+
+        /* what is left is shorter than a block: it can only be the tail */
+    if(end > start &&
+       delta_match(sigs, hash, chain, sync_weak_sum(buf + start, end - start),
+                   buf + start, end - start, blocksize, count, size) == (int) count - 1) {
+        if(delta_literal(&ds, buf + lit, start - lit) ||
+           delta_copy(&ds, (count - 1) * blocksize, end - start))
+            goto done;
+    } else if(delta_literal(&ds, buf + lit, end - lit)) {
+        goto done;
+    }
+    if(delta_flush_copy(&ds))
+        goto done;
+
+    msg.data.id = ID_DONE;
+    msg.data.size = htoll(mtime);
+    if(writex(fd, &msg.data, sizeof(msg.data)))
+        goto done;
+
+    ret = sync_status(fd, "copy to", rpath);
+
+done:
+    if(lfd >= 0) adb_close(lfd);
+    free(buf);
+    free(hash);
+    free(chain);
+    free(sigs);
+    return ret;
+}
+
+
+/* --- */
+
+
+static void do_sync_ls_cb(unsigned mode, unsigned size, unsigned time,
+                          const char *name, void *cookie)
+{
+    printf("%08x %08x %08x %s\n", mode, size, time, name);
+}
+
+int do_sync_ls(const char *path)
+{
+    int fd = adb_connect("sync:");
+    if(fd < 0) {
+        fprintf(stderr,"error: %s\n", adb_error());
+        return 1;
+    }
+
+    if(sync_ls(fd, path, do_sync_ls_cb, 0)) {
+        return 1;
+    } else {
+        sync_quit(fd);
+        return 0;
+    }
+}
+
+typedef struct copyinfo copyinfo;
+
+struct copyinfo
+{
+    copyinfo *next;
+    const char *src;
+    const char *dst;
+    unsigned int time;
     unsigned int mode;
     unsigned int size;
     int flag;
@@ -597,6 +1248,50 @@ copyinfo *mkcopyinfo(const char *spath, const char *dpath,
     return ci;
 }
 
+/* the patterns the file lists are filtered through, and the local folder
+** they are relative to (with a trailing '/')
+*/
+static ignorelist *sync_ignore;
+static char sync_ignore_root[PATH_MAX];
+static int sync_ignore_rootlen;
+
+void sync_set_ignore(ignorelist *l, const char *lroot)
+{
+    int len = lroot ? strlen(lroot) : 0;
+
+    if(l == 0 || len == 0 || len + 2 > (int) sizeof(sync_ignore_root)) {
+        sync_ignore = 0;
+        return;
+    }
+    strcpy(sync_ignore_root, lroot);
+    if(sync_ignore_root[len - 1] != '/') {
+        strcpy(sync_ignore_root + len, "/");
+        len++;
+    }
+    sync_ignore_rootlen = len;
+    sync_ignore = l;
+}
+
+/* is name, an entry of the local folder ldir (or of its remote twin),
+** ignored?  name may have several components, whose parents are then
+** checked too if parents is set.
+*/
+static int sync_ignored(const char *ldir, const char *name, int isdir,
+                        int parents)
+{
+    char rel[PATH_MAX];
+    int len;
+
+    if(sync_ignore == 0) return 0;
+    if(strncmp(ldir, sync_ignore_root, sync_ignore_rootlen)) return 0;
+
+    len = snprintf(rel, sizeof(rel), "%s%s", ldir + sync_ignore_rootlen, name);
+    if(len <= 0 || len >= (int) sizeof(rel)) return 0;
+    if(rel[len - 1] == '/') rel[len - 1] = 0;
+
+    return parents ? ignore_path(sync_ignore, rel, isdir)
+                   : ignore_match(sync_ignore, rel, isdir);
+}
 
 static int local_build_list(copyinfo **filelist,
                             const char *lpath, const char *rpath)
@@ -634,6 +1329,8 @@ static int local_build_list(copyinfo **filelist,
         strcat(stat_path, de->d_name);
         stat(stat_path, &st);
 
+        if(sync_ignored(lpath, name, S_ISDIR(st.st_mode), 0)) continue;
+
         if (S_ISDIR(st.st_mode)) {
             ci = mkcopyinfo(lpath, rpath, name, 1);
             ci->next = dirlist;
@@ -670,10 +1367,68 @@ static int local_build_list(copyinfo **filelist,
 }
 
 
+/* files pushed before waiting for the first of them to be acknowledged */
+#define SYNC_PUSH_WINDOW 32
+
+/* push every file of the list that is not flagged as up to date, keeping
+** up to SYNC_PUSH_WINDOW of them in flight, and free the list.  After a
+** file is refused the ones already in flight are still reaped, so the
+** session stays usable.  If done is given, the files the device accepted
+** are handed back on it instead of being freed.
+*/
+static int sync_send_list(int fd, copyinfo *filelist, int *pushed, int *skipped,
+                          copyinfo **done)
+{
+    copyinfo *window[SYNC_PUSH_WINDOW];
+    copyinfo *ci;
+    int head = 0, inflight = 0, err = 0;
+
+    while(filelist != 0 || inflight > 0) {
+        if(filelist != 0 && (err || inflight < SYNC_PUSH_WINDOW)) {
+            ci = filelist;
+            filelist = ci->next;
+            if(ci->flag != 0 || err) {
+                if(!err) (*skipped)++;
+                free(ci);
+                continue;
+            }
+            fprintf(stderr,"push: %s -> %s\n", ci->src, ci->dst);
+            if(sync_start_send(fd, ci->src, ci->dst, ci->time, ci->mode, NULL, 0)) {
+                fprintf(stderr,"protocol failure\n");
+                return -1;
+            }
+            window[(head + inflight++) % SYNC_PUSH_WINDOW] = ci;
+            continue;
+        }
+
+        ci = window[head];
+        head = (head + 1) % SYNC_PUSH_WINDOW;
+        inflight--;
+        switch(sync_finish_send(fd, ci->src, ci->dst)) {
+        case 0:
+            (*pushed)++;
+            if(done != 0) {
+                ci->next = *done;
+                *done = ci;
+                continue;
+            }
+            break;
+        case 1:
+            err = 1;
+            break;
+        default:
+            return -1;
+        }
+        free(ci);
+    }
+
+    return err;
+}
+
 static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, int checktimestamps)
 {
     copyinfo *filelist = 0;
-    copyinfo *ci, *next;
+    copyinfo *ci;
     int pushed = 0;
     int skipped = 0;
 
@@ -715,18 +1470,8 @@ static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, i
             }
         }
     }
-    for(ci = filelist; ci != 0; ci = next) {
-        next = ci->next;
-        if(ci->flag == 0) {
-            fprintf(stderr,"push: %s -> %s\n", ci->src, ci->dst);
-            if(sync_send(fd, ci->src, ci->dst, ci->time, ci->mode, 0 /* no verify APK */)){
-                return 1;
-            }
-            pushed++;
-        } else {
-            skipped++;
-        }
-        free(ci);
+    if(sync_send_list(fd, filelist, &pushed, &skipped, NULL)) {
+        return 1;
     }
 
     fprintf(stderr,"%d file%s pushed. %d file%s skipped.\n",
@@ -743,9 +1488,8 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
     unsigned mode;
     int fd;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
         return 1;
     }
 
@@ -756,8 +1500,15 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
     }
 
     if(S_ISDIR(st.st_mode)) {
+        ignorelist *ignore = ignore_load(lpath);
+        int err;
+
+        sync_set_ignore(ignore, lpath);
         BEGIN();
-        if(copy_local_dir_remote(fd, lpath, rpath, 0)) {
+        err = copy_local_dir_remote(fd, lpath, rpath, 0);
+        sync_set_ignore(0, 0);
+        ignore_free(ignore);
+        if(err) {
             return 1;
         } else {
             END();
@@ -811,9 +1562,18 @@ sync_ls_build_list_cb(unsigned mode, unsigned size, unsigned time,
     sync_ls_build_list_cb_args *args = (sync_ls_build_list_cb_args *)cookie;
     copyinfo *ci;
 
+    /* A tree listing hands us whole relative paths, whose parents have
+    ** to be checked as well.
+    */
+    if (sync_ignored(args->lpath, name, S_ISDIR(mode), args->dirlist == NULL))
+        return;
+
     if (S_ISDIR(mode)) {
         copyinfo **dirlist = args->dirlist;
 
+        /* A tree listing has already descended for us. */
+        if (dirlist == NULL) return;
+
         /* Don't try recursing down "." or ".." */
         if (name[0] == '.') {
             if (name[1] == '\0') return;
@@ -848,6 +1608,13 @@ static int remote_build_list(int syncfd, copyinfo **filelist,
     args.rpath = rpath;
     args.lpath = lpath;
 
+    /* Let the device walk the whole tree if it can. */
+    if (sync_features(syncfd) & SYNC_FEAT_RLST) {
+        args.dirlist = NULL;
+        return sync_ls_tree(syncfd, rpath, 0, "", sync_ls_build_list_cb,
+                            (void *)&args) ? 1 : 0;
+    }
+
     /* Put the files/dirs in rpath on the lists. */
     if (sync_ls(syncfd, rpath, sync_ls_build_list_cb, (void *)&args)) {
         return 1;
@@ -873,6 +1640,8 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
     copyinfo *ci, *next;
     int pulled = 0;
     int skipped = 0;
+    int failed = 0;
+    int ret;
 
     /* Make sure that both directory paths end in a slash. */
     if (rpath[0] == 0 || lpath[0] == 0) return -1;
@@ -923,10 +1692,15 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
         next = ci->next;
         if (ci->flag == 0) {
             fprintf(stderr, "pull: %s -> %s\n", ci->src, ci->dst);
-            if (sync_recv(fd, ci->src, ci->dst)) {
+            ret = sync_recv(fd, ci->src, ci->dst);
+            if (ret < 0) {
                 return 1;
             }
-            pulled++;
+            if (ret) {
+                failed++;
+            } else {
+                pulled++;
+            }
         } else {
             skipped++;
         }
@@ -937,7 +1711,7 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
             pulled, (pulled == 1) ? "" : "s",
             skipped, (skipped == 1) ? "" : "s");
 
-    return 0;
+    return failed ? 1 : 0;
 }
 
 int do_sync_pull(const char *rpath, const char *lpath)
@@ -947,9 +1721,8 @@ int do_sync_pull(const char *rpath, const char *lpath)
 
     int fd;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
         return 1;
     }
 
@@ -1007,14 +1780,20 @@ int do_sync_sync(const char *lpath, const char *rpath)
 {
     fprintf(stderr,"syncing %s...\n",rpath);
 
-    int fd = adb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
         return 1;
     }
 
+    ignorelist *ignore = ignore_load(lpath);
+    int err;
+
+    sync_set_ignore(ignore, lpath);
     BEGIN();
-    if(copy_local_dir_remote(fd, lpath, rpath, 1)){
+    err = copy_local_dir_remote(fd, lpath, rpath, 1);
+    sync_set_ignore(0, 0);
+    ignore_free(ignore);
+    if(err){
         return 1;
     } else {
         END();
@@ -1024,160 +1803,570 @@ int do_sync_sync(const char *lpath, const char *rpath)
 }
 
 //////////////////// My chunk
-static int copy_remote_dir_local2(int fd, const char *rpath, const char *lpath,
-                                 int checktimestamps)
+
+/* Link journal:
+**
+** What both sides looked like after the last link, kept per linked folder
+** and device in ~/.android/adblink.  After a magic line there is one line
+** per file that was the same on both sides:
+**
+**     <size> <mtime> <remote size> <remote mtime> <path>
+**
+** with the path relative to the linked folders.  A side whose copy still
+** matches its line has not touched the file since, so the other side's
+** change wins, deletions included.  Only when both sides moved on is it a
+** conflict, settled by mtime as before.  Files the journal does not know
+** are settled by mtime alone; copies that differ with the same mtime are
+** reported as a conflict that the local copy wins.
+*/
+#define LINK_JOURNAL_MAGIC "adblink journal 1\n"
+#define LINK_HASH_SIZE 65536
+
+typedef struct linkent linkent;
+
+struct linkent
 {
-    copyinfo *filelist = 0;
-    copyinfo *ci, *next;
-    int pulled = 0;
-    int skipped = 0;
+    linkent *next;
+    copyinfo *local;            /* the file as it is now, if it exists */
+    copyinfo *remote;
+    int known;                  /* the journal had a line for it */
+    int action;                 /* LINK_NONE, LINK_PUSH, ... */
+    int result;                 /* LINK_KEEP, LINK_SET or LINK_DROP */
+    unsigned size, time;        /* local side as of the last link */
+    unsigned rsize, rtime;      /* remote side */
+    char path[1];
+};
 
-    /* Make sure that both directory paths end in a slash. */
-    if (rpath[0] == 0 || lpath[0] == 0) return -1;
-    if (rpath[strlen(rpath) - 1] != '/') {
-        int  tmplen = strlen(rpath) + 2;
-        char *tmp = malloc(tmplen);
-        if (tmp == 0) return -1;
-        snprintf(tmp, tmplen, "%s/", rpath);
-        rpath = tmp;
+    /* what goes back into the journal for an entry */
+#define LINK_KEEP 0             /* the line that was read, if any */
+#define LINK_SET  1             /* the values now in the entry */
+#define LINK_DROP 2             /* nothing, the file is gone */
+
+typedef struct {
+    linkent **hash;
+    int loaded;
+    char file[PATH_MAX];        /* "" when there is nowhere to keep it */
+} linkjournal;
+
+static unsigned link_hash(const char *path)
+{
+    unsigned h = 5381;
+    while(*path)
+        h = h * 33 + (unsigned char) *path++;
+    return h % LINK_HASH_SIZE;
+}
+
+static linkent *link_entry(linkjournal *j, const char *path)
+{
+    unsigned h = link_hash(path);
+    int len = strlen(path);
+    linkent *e;
+
+    for(e = j->hash[h]; e != 0; e = e->next) {
+        if(!strcmp(e->path, path))
+            return e;
     }
-    if (lpath[strlen(lpath) - 1] != '/') {
-        int  tmplen = strlen(lpath) + 2;
-        char *tmp = malloc(tmplen);
-        if (tmp == 0) return -1;
-        snprintf(tmp, tmplen, "%s/", lpath);
-        lpath = tmp;
+
+    e = calloc(1, sizeof(linkent) + len);
+    if(e == 0) {
+        fprintf(stderr,"out of memory\n");
+        abort();
     }
+    memcpy(e->path, path, len + 1);
+    e->next = j->hash[h];
+    j->hash[h] = e;
+    return e;
+}
 
-    fprintf(stderr, "pull: building file list...\n");
-    /* Recursively build the list of files to copy. */
-    if (remote_build_list(fd, &filelist, rpath, lpath)) {
-        return -1;
+/* ~/.android/adblink/<serial>-<hash of both folders> */
+static void link_journal_name(linkjournal *j, const char *lpath,
+                              const char *rpath, const char *serial)
+{
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    char key[PATH_MAX * 2];
+    unsigned hash = 5381;
+    char *p;
+
+    j->file[0] = 0;
+    if(home == 0 || serial == 0 || serial[0] == 0)
+        return;
+    if(realpath(lpath, dir) == 0)
+        return;
+    snprintf(key, sizeof(key), "%s:%s", dir, rpath);
+    for(p = key; *p; p++)
+        hash = hash * 33 + (unsigned char) *p;
+
+    snprintf(dir, sizeof(dir), "%s/.android", home);
+    adb_mkdir(dir, 0750);
+    snprintf(dir, sizeof(dir), "%s/.android/adblink", home);
+    adb_mkdir(dir, 0750);
+    if(snprintf(j->file, sizeof(j->file), "%s/%s-%08x", dir, serial, hash) >=
+       (int) sizeof(j->file)) {
+        j->file[0] = 0;
+        return;
+    }
+    for(p = j->file + strlen(dir) + 1; *p; p++) {
+        if(*p == '/') *p = '_';
     }
+}
 
-    if (checktimestamps) {
-    	struct stat st;
-        for (ci = filelist; ci != 0; ci = ci->next) {
-        	if(lstat(ci->dst, &st)) {
-				st.st_mtime = 0;
-			}
-        	if (ci->time <= st.st_mtime) {
-					ci->flag = 1;
-			}
+static void link_journal_load(linkjournal *j)
+{
+    char line[PATH_MAX + 64];
+    FILE *f;
+
+    if(j->file[0] == 0)
+        return;
+    f = fopen(j->file, "r");
+    if(f == 0) {
+            /* a journal we cannot read must not be written over either */
+        if(errno != ENOENT) {
+            fprintf(stderr,"cannot read '%s': %s\n", j->file, strerror(errno));
+            j->file[0] = 0;
         }
+        return;
     }
 
-    for (ci = filelist; ci != 0; ci = next) {
-        next = ci->next;
-        if (ci->flag == 0) {
-            fprintf(stderr, "pull: %s -> %s\n", ci->src, ci->dst);
-            if (sync_recv(fd, ci->src, ci->dst)) {
-                return 1;
-            }
-            pulled++;
-        } else {
-            skipped++;
+    if(fgets(line, sizeof(line), f) && !strcmp(line, LINK_JOURNAL_MAGIC)) {
+        j->loaded = 1;
+        while(fgets(line, sizeof(line), f)) {
+            unsigned size, time, rsize, rtime;
+            int len, n = 0;
+            linkent *e;
+
+            len = strlen(line);
+            if(len == 0 || line[len - 1] != '\n')
+                continue;
+            line[len - 1] = 0;
+            if(sscanf(line, "%u %u %u %u %n", &size, &time, &rsize, &rtime,
+                      &n) != 4 || n == 0 || line[n] == 0)
+                continue;
+
+            e = link_entry(j, line + n);
+            e->known = 1;
+            e->size = size;
+            e->time = time;
+            e->rsize = rsize;
+            e->rtime = rtime;
         }
-        free(ci);
     }
+    fclose(f);
+}
 
-    fprintf(stderr, "%d file%s pulled. %d file%s skipped.\n",
-            pulled, (pulled == 1) ? "" : "s",
-            skipped, (skipped == 1) ? "" : "s");
+static void link_journal_save(linkjournal *j)
+{
+    char tmp[PATH_MAX + 8];
+    linkent *e;
+    FILE *f;
+    int h, err;
+
+    if(j->file[0] == 0)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.new", j->file);
+    f = fopen(tmp, "w");
+    if(f == 0) {
+        fprintf(stderr,"cannot write '%s': %s\n", tmp, strerror(errno));
+        return;
+    }
 
-    return 0;
+    fputs(LINK_JOURNAL_MAGIC, f);
+    for(h = 0; h < LINK_HASH_SIZE; h++) {
+        for(e = j->hash[h]; e != 0; e = e->next) {
+            if((e->result == LINK_DROP) ||
+               (e->result == LINK_KEEP && !e->known) ||
+               strchr(e->path, '\n'))
+                continue;
+            fprintf(f, "%u %u %u %u %s\n", e->size, e->time,
+                    e->rsize, e->rtime, e->path);
+        }
+    }
+
+    err = ferror(f);
+    if(fclose(f) || err || rename(tmp, j->file)) {
+        fprintf(stderr,"cannot write '%s'\n", j->file);
+        adb_unlink(tmp);
+    }
 }
-static int copy_local_dir_remote2(int fd, const char *lpath, const char *rpath, int checktimestamps)
+
+static void link_journal_free(linkjournal *j)
 {
-    copyinfo *filelist = 0;
-    copyinfo *ci, *next;
-    int pushed = 0;
-    int skipped = 0;
+    linkent *e, *next;
+    int h;
+
+    for(h = 0; h < LINK_HASH_SIZE; h++) {
+        for(e = j->hash[h]; e != 0; e = next) {
+            next = e->next;
+            free(e->local);
+            free(e->remote);
+            free(e);
+        }
+    }
+    free(j->hash);
+}
 
-    if((lpath[0] == 0) || (rpath[0] == 0)) return -1;
+/* record that both sides now hold the same file */
+static void link_set(linkent *e, unsigned size, unsigned time,
+                     unsigned rsize, unsigned rtime)
+{
+    e->size = size;
+    e->time = time;
+    e->rsize = rsize;
+    e->rtime = rtime;
+    e->result = LINK_SET;
+}
+
+    /* what to do about an entry */
+#define LINK_NONE      0
+#define LINK_PUSH      1
+#define LINK_PULL      2
+#define LINK_RM_REMOTE 3
+#define LINK_RM_LOCAL  4
+
+static int link_decide(linkent *e)
+{
+    copyinfo *l = e->local;
+    copyinfo *r = e->remote;
+    int lchanged, rchanged;
+
+    if(l && r && l->size == r->size) {
+        /* a push carries the mtime along, except for links */
+        if(l->time == r->time || (S_ISLNK(l->mode) && S_ISLNK(r->mode))) {
+            link_set(e, l->size, l->time, r->size, r->time);
+            return LINK_NONE;
+        }
+    }
+
+    if(!e->known) {
+        if(l && r) {
+            if(r->time < l->time) return LINK_PUSH;
+            if(r->time > l->time) return LINK_PULL;
+                /* same mtime, yet they differ (same sizes returned above) */
+            fprintf(stderr,"conflict: '%s' differs with the same timestamp, "
+                    "keeping the local file\n", e->path);
+            return LINK_PUSH;
+        }
+        return l ? LINK_PUSH : LINK_PULL;
+    }
+
+    lchanged = !(l && l->size == e->size && l->time == e->time);
+    rchanged = !(r && r->size == e->rsize &&
+                 (r->time == e->rtime || S_ISLNK(r->mode)));
+
+    if(!lchanged && !rchanged) {
+        link_set(e, l->size, l->time, r->size, r->time);
+        return LINK_NONE;
+    }
+    if(!rchanged)
+        return l ? LINK_PUSH : LINK_RM_REMOTE;
+    if(!lchanged)
+        return r ? LINK_PULL : LINK_RM_LOCAL;
+
+    if(!l && !r) {
+        e->result = LINK_DROP;
+        return LINK_NONE;
+    }
+    fprintf(stderr,"conflict: '%s' changed on both sides, keeping the %s\n",
+            e->path, !r ? "local file" : !l ? "remote file" :
+            (l->time >= r->time) ? "newer local file" : "newer remote file");
+    if(l && (!r || l->time >= r->time))
+        return LINK_PUSH;
+    return LINK_PULL;
+}
+
+int do_link(linkinfo *link, const char *serial, sync_synced_cb synced,
+            void *cookie)
+{
+    linkjournal j;
+    linkent *e;
+    copyinfo *list, *ci, *next;
+    copyinfo *pushlist = 0, *done = 0;
+    const char *lpath = link->lpath;
+    const char *rpath = link->rpath;
+    unsigned mode;
+    int llen, rlen, h, got, ret = 1, walked = 0;
+    int pushed = 0, pulled = 0, removed = 0, skipped = 0;
+
+    fprintf(stderr,"syncing %s -> %s...\n",lpath, rpath);
+
+    /* Make sure that both directory paths end in a slash. */
+    if((lpath[0] == 0) || (rpath[0] == 0)) return 1;
     if(lpath[strlen(lpath) - 1] != '/') {
         int  tmplen = strlen(lpath)+2;
         char *tmp = malloc(tmplen);
-        if(tmp == 0) return -1;
+        if(tmp == 0) return 1;
         snprintf(tmp, tmplen, "%s/",lpath);
         lpath = tmp;
     }
     if(rpath[strlen(rpath) - 1] != '/') {
         int tmplen = strlen(rpath)+2;
         char *tmp = malloc(tmplen);
-        if(tmp == 0) return -1;
+        if(tmp == 0) return 1;
         snprintf(tmp, tmplen, "%s/",rpath);
         rpath = tmp;
     }
+    llen = strlen(lpath);
+    rlen = strlen(rpath);
+
+    /* Stays in place for the pulls the device's change feed asks for. */
+    sync_set_ignore(link->ignore, lpath);
+
+    memset(&j, 0, sizeof(j));
+    j.hash = calloc(LINK_HASH_SIZE, sizeof(linkent*));
+    if(j.hash == 0) return 1;
+    link_journal_name(&j, lpath, rpath, serial);
+
+    /* A missing remote folder (storage not mounted, device wiped) must not
+    ** read as every file having been deleted there.
+    */
+    if(sync_readmode(link->syncfd, rpath, &mode)) goto done;
+    if(mode != 0) {
+        link_journal_load(&j);
+    }
 
-    if(local_build_list(&filelist, lpath, rpath)) {
-        return -1;
+    /* One walk of each side, matched up by relative path. */
+    list = 0;
+    if(local_build_list(&list, lpath, rpath)) goto done;
+    for(ci = list; ci != 0; ci = next) {
+        next = ci->next;
+        e = link_entry(&j, ci->src + llen);
+        ci->next = 0;
+        e->local = ci;
     }
 
-    if(checktimestamps){
-        for(ci = filelist; ci != 0; ci = ci->next) {
-            if(sync_start_readtime(fd, ci->dst)) {
-                return 1;
-            }
-        }
-        for(ci = filelist; ci != 0; ci = ci->next) {
-            unsigned int timestamp, mode, size;
-            if(sync_finish_readtime(fd, &timestamp, &mode, &size))
-                return 1;
-            if(size == ci->size) {
-                /* for links, we cannot update the atime/mtime */
-                if((S_ISREG(ci->mode & mode) && timestamp == ci->time) ||
-                    (S_ISLNK(ci->mode & mode) && timestamp >= ci->time))
-                    ci->flag = 1;
-            }
-            if(timestamp >= ci->time) {
-            	ci->flag = 1;
+    fprintf(stderr, "pull: building file list...\n");
+    list = 0;
+    if(mode != 0 && remote_build_list(link->syncfd, &list, rpath, lpath))
+        goto done;
+    for(ci = list; ci != 0; ci = next) {
+        next = ci->next;
+        e = link_entry(&j, ci->src + rlen);
+        ci->next = 0;
+        e->remote = ci;
+    }
+    if(!j.loaded && mode != 0) {
+        fprintf(stderr, "no link journal, comparing timestamps only\n");
+    }
+    walked = 1;
+
+    BEGIN();
+    for(h = 0; h < LINK_HASH_SIZE; h++) {
+        for(e = j.hash[h]; e != 0; e = e->next) {
+            e->action = link_decide(e);
+            if(e->action == LINK_PUSH) {
+                e->local->next = pushlist;
+                pushlist = e->local;
+                e->local = 0;
+            } else if(e->action == LINK_NONE && (e->local || e->remote)) {
+                skipped++;
             }
         }
     }
-    for(ci = filelist; ci != 0; ci = next) {
+
+    if(sync_send_list(link->syncfd, pushlist, &pushed, &skipped, &done) < 0)
+        goto done;
+    for(ci = done; ci != 0; ci = next) {
         next = ci->next;
-        if(ci->flag == 0) {
-            fprintf(stderr,"push: %s -> %s\n", ci->src, ci->dst);
-            if(sync_send(fd, ci->src, ci->dst, ci->time, ci->mode, 0 /* no verify APK */)){
-                return 1;
+        e = link_entry(&j, ci->src + llen);
+        link_set(e, ci->size, ci->time, ci->size, ci->time);
+        free(ci);
+    }
+    END();
+
+    /* Pulls and deletions, now that the device is up to date. */
+    BEGIN();
+    for(h = 0; h < LINK_HASH_SIZE; h++) {
+        for(e = j.hash[h]; e != 0; e = e->next) {
+            copyinfo *l = e->local;
+            copyinfo *r = e->remote;
+            struct utimbuf times;
+            struct stat st;
+
+            switch(e->action) {
+            case LINK_PULL:
+                fprintf(stderr, "pull: %s -> %s\n", r->src, r->dst);
+                got = sync_recv(link->syncfd, r->src, r->dst);
+                if(got < 0)
+                    goto done;
+                    /* changed while it was read: the journal keeps the
+                    ** old line, so the next run looks at it again
+                    */
+                if(got)
+                    break;
+                pulled++;
+                    /* so that the copies match without the journal too */
+                if(!S_ISLNK(r->mode)) {
+                    times.actime = r->time;
+                    times.modtime = r->time;
+                    utime(r->dst, &times);
+                }
+                if(lstat(r->dst, &st) == 0)
+                    link_set(e, st.st_size, st.st_mtime, r->size, r->time);
+                break;
+            case LINK_RM_REMOTE:
+                fprintf(stderr, "remove: %s\n", r->src);
+                switch(sync_remove(link->syncfd, r->src)) {
+                case 0:
+                    removed++;
+                    e->result = LINK_DROP;
+                    break;
+                case 1:
+                    break;
+                default:
+                    goto done;
+                }
+                break;
+            case LINK_RM_LOCAL:
+                fprintf(stderr, "remove: %s\n", l->src);
+                if(adb_unlink(l->src) == 0) {
+                    removed++;
+                    e->result = LINK_DROP;
+                } else {
+                    fprintf(stderr,"cannot remove '%s': %s\n",
+                            l->src, strerror(errno));
+                }
+                break;
             }
-            pushed++;
-        } else {
-            skipped++;
         }
-        free(ci);
     }
+    END();
 
-    fprintf(stderr,"%d file%s pushed. %d file%s skipped.\n",
+    fprintf(stderr,"%d file%s pushed. %d file%s pulled. %d file%s removed. "
+            "%d file%s skipped.\n",
             pushed, (pushed == 1) ? "" : "s",
+            pulled, (pulled == 1) ? "" : "s",
+            removed, (removed == 1) ? "" : "s",
             skipped, (skipped == 1) ? "" : "s");
 
-    return 0;
+    if(synced) {
+        for(h = 0; h < LINK_HASH_SIZE; h++) {
+            for(e = j.hash[h]; e != 0; e = e->next) {
+                if(e->result == LINK_SET)
+                    synced(e->path, e->rsize, e->rtime, cookie);
+            }
+        }
+    }
+    ret = 0;
+
+done:
+        /* without both walks the table holds only part of the journal,
+        ** which is worse than keeping the old one
+        */
+    if(walked)
+        link_journal_save(&j);
+    link_journal_free(&j);
+    return ret;
 }
 
-int do_link(const char *lpath, const char *rpath)
+int sync_link_connect(const char *serial)
 {
-    fprintf(stderr,"syncing %s -> %s...\n",lpath, rpath);
+    return sync_connect_to(serial);
+}
 
-    int fd = adb_connect("sync:");
-    if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
+void sync_link_disconnect(int fd)
+{
+    if(fd < 0) return;
+    sync_quit(fd);
+    adb_close(fd);
+    if(fd < SYNC_FD_MAX) sync_fd_features[fd] = 0;
+}
+
+/* push a file, or a whole directory tree, over an already open sync
+** session; unlike do_sync_push() the remote path is final, so no STAT
+** is needed
+*/
+int sync_link_push(int fd, const char *lpath, const char *rpath, int delta)
+{
+    struct stat st;
+
+    if(lstat(lpath, &st)) {
+        fprintf(stderr,"cannot stat '%s': %s\n", lpath, strerror(errno));
         return 1;
     }
+    if(S_ISDIR(st.st_mode)) {
+        BEGIN();
+        if(copy_local_dir_remote(fd, lpath, rpath, 0)) {
+            return 1;
+        }
+        END();
+        return 0;
+    }
+    if(!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
+        fprintf(stderr, "skipping special file '%s'\n", lpath);
+        return 0;
+    }
 
+    if(delta && S_ISREG(st.st_mode) && st.st_size >= SYNC_DELTA_MIN &&
+       (unsigned long long) st.st_size <= SYNC_DELTA_MAX) {
+        int ret;
+
+        BEGIN();
+        ret = sync_send_delta(fd, lpath, rpath, st.st_mtime, st.st_mode);
+        if(ret == 0) {
+            fprintf(stderr,"push: %s -> %s (delta, %u of %u bytes sent)\n",
+                    lpath, rpath, total_bytes, (unsigned) st.st_size);
+            END();
+            return 0;
+        }
+        if(ret != 1)
+            return ret;
+    }
+
+    fprintf(stderr,"push: %s -> %s\n", lpath, rpath);
     BEGIN();
-    if(copy_local_dir_remote2(fd, lpath, rpath, 1)){
+    if(sync_send(fd, lpath, rpath, st.st_mtime, st.st_mode, 0 /* no verify APK */)) {
         return 1;
-    } else {
-        END();
-        BEGIN();
-		if(copy_remote_dir_local2(fd, rpath, lpath, 1)){
-			return 1;
-		} else {
-			END();
-			sync_quit(fd);
-			return 0;
-		}
     }
+    END();
+    return 0;
+}
+
+/* pull one file over an already open sync session and give it the remote
+** mtime, so that both copies compare equal afterwards
+*/
+int sync_link_pull(int fd, const char *rpath, const char *lpath, unsigned mtime)
+{
+    struct utimbuf times;
+
+    int ret;
+
+    fprintf(stderr,"pull: %s -> %s\n", rpath, lpath);
+    BEGIN();
+    ret = sync_recv(fd, rpath, lpath);
+    if(ret) {
+        return ret;
+    }
+    END();
+    times.actime = mtime;
+    times.modtime = mtime;
+    utime(lpath, &times);
+    return 0;
+}
+
+/* pull every file below the remote folder rpath into lpath (both ending
+** in '/') that filter accepts
+*/
+int sync_link_pull_tree(int fd, const char *rpath, const char *lpath,
+                        sync_pull_cb filter, void *cookie)
+{
+    copyinfo *filelist = 0;
+    copyinfo *ci, *next;
+    int ret = 0;
+
+    if(remote_build_list(fd, &filelist, rpath, lpath)) {
+        return 1;
+    }
+    for(ci = filelist; ci != 0; ci = next) {
+        next = ci->next;
+        if(ret == 0 && !S_ISLNK(ci->mode) &&
+           filter(ci->dst, ci->mode, ci->size, ci->time, 0, cookie)) {
+            ret = sync_link_pull(fd, ci->src, ci->dst, ci->time);
+            if(ret == 0)
+                filter(ci->dst, ci->mode, ci->size, ci->time, 1, cookie);
+            else if(ret > 0)
+                ret = 0;
+        }
+        free(ci);
+    }
+    return ret;
 }
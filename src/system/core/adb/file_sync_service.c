@@ -21,15 +21,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <utime.h>
 
 #include <errno.h>
 
+#include <zlib.h>
+
 #include "sysdeps.h"
 
 #define TRACE_TAG  TRACE_SYNC
 #include "adb.h"
 #include "file_sync_service.h"
+#include "mincrypt/sha.h"
 
 static int mkdirs(char *name)
 {
@@ -53,7 +58,49 @@ static int mkdirs(char *name)
     return 0;
 }
 
-static int do_stat(int s, const char *path)
+/* STAT and DENT replies are small; collect them and hand them to the
+** socket in large writes instead of one or two tiny packets each.
+*/
+#define REPLY_MAX SYNC_DATA_MAX
+
+typedef struct {
+    int fd;
+    unsigned len;
+    char *data;
+} replybuf;
+
+static int reply_flush(replybuf *out)
+{
+    unsigned len = out->len;
+
+    out->len = 0;
+    if(len == 0) return 0;
+    return writex(out->fd, out->data, len);
+}
+
+static int reply_write(replybuf *out, const void *data, unsigned len)
+{
+    if(out->len + len > REPLY_MAX) {
+        if(reply_flush(out)) return -1;
+        if(len > REPLY_MAX) return writex(out->fd, data, len);
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+/* whether the host has already sent us more requests */
+static int request_pending(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+static int do_stat(replybuf *out, const char *path)
 {
     syncmsg msg;
     struct stat st;
@@ -70,10 +117,10 @@ static int do_stat(int s, const char *path)
         msg.stat.time = htoll(st.st_mtime);
     }
 
-    return writex(s, &msg.stat, sizeof(msg.stat));
+    return reply_write(out, &msg.stat, sizeof(msg.stat));
 }
 
-static int do_list(int s, const char *path)
+static int do_list(replybuf *out, const char *path)
 {
     DIR *d;
     struct dirent *de;
@@ -108,8 +155,9 @@ static int do_list(int s, const char *path)
             msg.dent.time = htoll(st.st_mtime);
             msg.dent.namelen = htoll(len);
 
-            if(writex(s, &msg.dent, sizeof(msg.dent)) ||
-               writex(s, de->d_name, len)) {
+            if(reply_write(out, &msg.dent, sizeof(msg.dent)) ||
+               reply_write(out, de->d_name, len)) {
+                closedir(d);
                 return -1;
             }
         }
@@ -123,7 +171,102 @@ done:
     msg.dent.size = 0;
     msg.dent.time = 0;
     msg.dent.namelen = 0;
-    return writex(s, &msg.dent, sizeof(msg.dent));
+    if(reply_write(out, &msg.dent, sizeof(msg.dent))) {
+        return -1;
+    }
+    return reply_flush(out);
+}
+
+/* send a DENT for everything below the len byte directory path, named
+** from path + rel on; depth counts the levels below the RLST root
+*/
+static int list_tree(replybuf *out, char *path, int len, int rel, int depth,
+                     int maxdepth, const char *pattern)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    syncmsg msg;
+    int ret = 0;
+
+    d = opendir(path);
+    if(d == 0) return 0;
+
+    msg.dent.id = ID_DENT;
+
+    while((de = readdir(d))) {
+        int nlen = strlen(de->d_name);
+        int isdir;
+
+        if(de->d_name[0] == '.') {
+            if(de->d_name[1] == 0) continue;
+            if((de->d_name[1] == '.') && (de->d_name[2] == 0)) continue;
+        }
+        if((len + 1 + nlen >= PATH_MAX) ||
+           (len + 1 + nlen - rel > SYNC_RLST_NAME_MAX)) {
+            continue;
+        }
+
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, nlen + 1);
+        if(lstat(path, &st)) {
+            path[len] = 0;
+            continue;
+        }
+
+        isdir = S_ISDIR(st.st_mode);
+        if(isdir || (pattern[0] == 0) ||
+           (fnmatch(pattern, de->d_name, 0) == 0)) {
+            msg.dent.mode = htoll(st.st_mode);
+            msg.dent.size = htoll(st.st_size);
+            msg.dent.time = htoll(st.st_mtime);
+            msg.dent.namelen = htoll(len + 1 + nlen - rel);
+
+            if(reply_write(out, &msg.dent, sizeof(msg.dent)) ||
+               reply_write(out, path + rel, len + 1 + nlen - rel)) {
+                ret = -1;
+                break;
+            }
+        }
+
+        if(isdir && ((maxdepth == 0) || (depth < maxdepth))) {
+            ret = list_tree(out, path, len + 1 + nlen, rel, depth + 1,
+                            maxdepth, pattern);
+            if(ret) break;
+        }
+        path[len] = 0;
+    }
+
+    path[len] = 0;
+    closedir(d);
+    return ret;
+}
+
+static int do_list_tree(replybuf *out, const char *root, int maxdepth,
+                        const char *pattern)
+{
+    syncmsg msg;
+    char path[PATH_MAX];
+    int len = strlen(root);
+
+    while((len > 1) && (root[len - 1] == '/')) len--;
+    if(len < PATH_MAX) {
+        memcpy(path, root, len);
+        path[len] = 0;
+        if(list_tree(out, path, len, len + 1, 1, maxdepth, pattern)) {
+            return -1;
+        }
+    }
+
+    msg.dent.id = ID_DONE;
+    msg.dent.mode = 0;
+    msg.dent.size = 0;
+    msg.dent.time = 0;
+    msg.dent.namelen = 0;
+    if(reply_write(out, &msg.dent, sizeof(msg.dent))) {
+        return -1;
+    }
+    return reply_flush(out);
 }
 
 static int fail_message(int s, const char *reason)
@@ -148,6 +291,160 @@ static int fail_errno(int s)
     return fail_message(s, strerror(errno));
 }
 
+static int okay_message(int s)
+{
+    syncmsg msg;
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return writex(s, &msg.status, sizeof(msg.status));
+}
+
+/* enable the requested features we know about and name them back */
+static int do_feat(int s, char *names, int *compress)
+{
+    syncmsg msg;
+    char *name, *next;
+    char enabled[64];
+    int len = 0;
+
+    for(name = names; *name; name = next) {
+        next = strchr(name, ' ');
+        if(next) {
+            *next++ = 0;
+        } else {
+            next = name + strlen(name);
+        }
+        if(!strcmp(name, SYNC_FEATURE_ZLIB)) {
+            *compress = 1;
+        } else if(strcmp(name, SYNC_FEATURE_RLST)) {
+            continue;
+        }
+        if(len + 1 + strlen(name) >= sizeof(enabled)) continue;
+        if(len) enabled[len++] = ' ';
+        strcpy(enabled + len, name);
+        len += strlen(name);
+    }
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = htoll(len);
+    if(writex(s, &msg.status, sizeof(msg.status)) ||
+       writex(s, enabled, len)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* read the len byte payload of a ZDAT message and inflate it into buffer;
+** the compressed bytes go to the scratch half of the buffer
+*/
+static int read_zdata(int s, char *buffer, unsigned len, unsigned *outlen)
+{
+    char *zbuf = buffer + SYNC_DATA_MAX;
+    uLongf size = SYNC_DATA_MAX;
+
+    if(len > SYNC_DATA_MAX) {
+        fail_message(s, "oversize data message");
+        return -1;
+    }
+    if(readx(s, zbuf, len))
+        return -1;
+    if(uncompress((Bytef*) buffer, &size, (Bytef*) zbuf, len) != Z_OK) {
+        fail_message(s, "corrupt compressed data");
+        return -1;
+    }
+    *outlen = size;
+    return 0;
+}
+
+/* remove a file, or a directory and everything below it */
+static int remove_tree(char *path, int len)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    int ret = 0;
+
+    if(lstat(path, &st)) return -1;
+    if(!S_ISDIR(st.st_mode)) return adb_unlink(path);
+
+    d = opendir(path);
+    if(d == 0) return -1;
+
+    while((de = readdir(d))) {
+        int nlen = strlen(de->d_name);
+
+        if(de->d_name[0] == '.') {
+            if(de->d_name[1] == 0) continue;
+            if((de->d_name[1] == '.') && (de->d_name[2] == 0)) continue;
+        }
+        if(len + 1 + nlen >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            ret = -1;
+            break;
+        }
+
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, nlen + 1);
+        ret = remove_tree(path, len + 1 + nlen);
+        path[len] = 0;
+        if(ret) break;
+    }
+
+    closedir(d);
+    if(ret) return ret;
+    return rmdir(path);
+}
+
+static int do_unlink(int s, const char *path)
+{
+    char tmp[PATH_MAX];
+    int len = strlen(path);
+
+    memcpy(tmp, path, len + 1);
+    if(remove_tree(tmp, len) && errno != ENOENT)
+        return fail_errno(s);
+
+    return okay_message(s);
+}
+
+static int do_mkdir(int s, const char *path)
+{
+    char tmp[1024 + 2];
+    struct stat st;
+    int len = strlen(path);
+
+        /* mkdirs() creates every component followed by a '/' */
+    memcpy(tmp, path, len);
+    tmp[len] = '/';
+    tmp[len + 1] = 0;
+    if(mkdirs(tmp) || stat(path, &st))
+        return fail_errno(s);
+    if(!S_ISDIR(st.st_mode))
+        return fail_message(s, "not a directory");
+
+    return okay_message(s);
+}
+
+static int do_rename(int s, char *from, char *to)
+{
+    struct stat st;
+    int ret;
+
+    ret = rename(from, to);
+        /* only a missing parent of to is ours to create: from may
+        ** just have gone away in the meantime
+        */
+    if(ret && errno == ENOENT && lstat(from, &st) == 0) {
+        mkdirs(to);
+        ret = rename(from, to);
+    }
+    if(ret)
+        return fail_errno(s);
+
+    return okay_message(s);
+}
+
 static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
 {
     syncmsg msg;
@@ -174,21 +471,25 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
         if(readx(s, &msg.data, sizeof(msg.data)))
             goto fail;
 
-        if(msg.data.id != ID_DATA) {
+        if(msg.data.id == ID_ZDAT) {
+            if(read_zdata(s, buffer, ltohl(msg.data.size), &len))
+                goto fail;
+        } else if(msg.data.id != ID_DATA) {
             if(msg.data.id == ID_DONE) {
                 timestamp = ltohl(msg.data.size);
                 break;
             }
             fail_message(s, "invalid data message");
             goto fail;
+        } else {
+            len = ltohl(msg.data.size);
+            if(len > SYNC_DATA_MAX) {
+                fail_message(s, "oversize data message");
+                goto fail;
+            }
+            if(readx(s, buffer, len))
+                goto fail;
         }
-        len = ltohl(msg.data.size);
-        if(len > SYNC_DATA_MAX) {
-            fail_message(s, "oversize data message");
-            goto fail;
-        }
-        if(readx(s, buffer, len))
-            goto fail;
 
         if(fd < 0)
             continue;
@@ -314,10 +615,235 @@ static int do_send(int s, char *path, char *buffer)
     return ret;
 }
 
-static int do_recv(int s, const char *path, char *buffer)
+/* read up to len bytes, stopping short only at end of file */
+static int read_block(int fd, char *buffer, int len)
+{
+    int total = 0;
+
+    while(total < len) {
+        int r = adb_read(fd, buffer + total, len - total);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(r == 0) break;
+        total += r;
+    }
+    return total;
+}
+
+static int do_sign(int s, const char *path, char *buffer)
+{
+    syncmsg msg;
+    struct stat st;
+    syncsig sigs[256];
+    unsigned blocksize, count, i;
+    int fd, n = 0;
+
+    msg.sign.id = ID_SIGN;
+    msg.sign.blocksize = 0;
+    msg.sign.count = 0;
+    msg.sign.size = 0;
+
+    fd = adb_open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+       (unsigned long long) st.st_size > SYNC_DELTA_MAX) {
+        if(fd >= 0) adb_close(fd);
+        return writex(s, &msg.sign, sizeof(msg.sign));
+    }
+
+    blocksize = SYNC_SIGN_MIN_BLOCK;
+    while(blocksize < SYNC_DATA_MAX &&
+          st.st_size / blocksize > SYNC_SIGN_MAX_BLOCKS) {
+        blocksize *= 2;
+    }
+    count = (st.st_size + blocksize - 1) / blocksize;
+
+    msg.sign.blocksize = htoll(blocksize);
+    msg.sign.count = htoll(count);
+    msg.sign.size = htoll(st.st_size);
+    if(writex(s, &msg.sign, sizeof(msg.sign))) {
+        adb_close(fd);
+        return -1;
+    }
+
+    for(i = 0; i < count; i++) {
+        int len = read_block(fd, buffer, blocksize);
+
+            /* the file shrank under us: send signatures that never match,
+               the host still expects count of them */
+        if(len <= 0) {
+            memset(&sigs[n], 0, sizeof(syncsig));
+        } else {
+            sigs[n].weak = htoll(sync_weak_sum((unsigned char*) buffer, len));
+            SHA(buffer, len, sigs[n].strong);
+        }
+
+        if(++n == 256 || i == count - 1) {
+            if(writex(s, sigs, n * sizeof(syncsig))) {
+                adb_close(fd);
+                return -1;
+            }
+            n = 0;
+        }
+    }
+
+    adb_close(fd);
+    return 0;
+}
+
+/* copy len bytes at offset of base into fd */
+static int copy_range(int fd, int base, unsigned offset, unsigned len, char *buffer)
+{
+    if(adb_lseek(base, offset, SEEK_SET) != (off_t) offset)
+        return -1;
+
+    while(len > 0) {
+        int n = len > SYNC_DATA_MAX ? SYNC_DATA_MAX : len;
+        if(read_block(base, buffer, n) != n)
+            return -1;
+        if(writex(fd, buffer, n))
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int do_delta(int s, char *path, char *buffer)
+{
+    syncmsg msg;
+    struct stat st;
+    char tmp[1024 + 16];
+    char *x;
+    mode_t mode = 0644;
+    unsigned int timestamp = 0;
+    int fd = -1, base;
+
+    x = strrchr(path, ',');
+    if(x) {
+        *x = 0;
+        mode = strtoul(x + 1, NULL, 0) & 0777;
+    }
+        /* copy user permission bits to "group" and "other" permissions */
+    mode |= ((mode >> 3) & 0070);
+    mode |= ((mode >> 3) & 0007);
+
+        /* the new file is built beside the old one, then renamed over it */
+    snprintf(tmp, sizeof(tmp), "%s.adbdelta", path);
+    adb_unlink(tmp);
+
+    base = adb_open(path, O_RDONLY);
+    if(base >= 0 && fstat(base, &st) == 0)
+        fd = adb_open_mode(tmp, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if(fd < 0) {
+        if(base >= 0)
+            adb_close(base);
+        base = -1;
+        if(fail_errno(s))
+            return -1;
+    }
+
+    for(;;) {
+        unsigned int len;
+
+        if(readx(s, &msg.data, sizeof(msg.data)))
+            goto fail;
+
+        if(msg.data.id == ID_DONE) {
+            timestamp = ltohl(msg.data.size);
+            break;
+        }
+
+        len = ltohl(msg.data.size);
+        if(msg.data.id == ID_COPY) {
+            unsigned offset;
+
+            if(readx(s, &offset, sizeof(offset)))
+                goto fail;
+            offset = ltohl(offset);
+
+            if(fd < 0)
+                continue;
+            if(offset > st.st_size || len > st.st_size - offset) {
+                fail_message(s, "invalid block reference");
+                goto fail;
+            }
+            if(copy_range(fd, base, offset, len, buffer)) {
+                adb_close(fd);
+                adb_close(base);
+                adb_unlink(tmp);
+                fd = base = -1;
+                if(fail_errno(s)) return -1;
+            }
+            continue;
+        }
+
+        if(msg.data.id == ID_ZDAT) {
+            if(read_zdata(s, buffer, len, &len))
+                goto fail;
+        } else if(msg.data.id != ID_DATA) {
+            fail_message(s, "invalid data message");
+            goto fail;
+        } else {
+            if(len > SYNC_DATA_MAX) {
+                fail_message(s, "oversize data message");
+                goto fail;
+            }
+            if(readx(s, buffer, len))
+                goto fail;
+        }
+
+        if(fd < 0)
+            continue;
+        if(writex(fd, buffer, len)) {
+            adb_close(fd);
+            adb_close(base);
+            adb_unlink(tmp);
+            fd = base = -1;
+            if(fail_errno(s)) return -1;
+        }
+    }
+
+    if(fd >= 0) {
+        struct utimbuf u;
+        adb_close(fd);
+        adb_close(base);
+        u.actime = timestamp;
+        u.modtime = timestamp;
+        utime(tmp, &u);
+
+        if(rename(tmp, path)) {
+            adb_unlink(tmp);
+            return fail_errno(s);
+        }
+
+        msg.status.id = ID_OKAY;
+        msg.status.msglen = 0;
+        if(writex(s, &msg.status, sizeof(msg.status)))
+            return -1;
+    }
+    return 0;
+
+fail:
+    if(fd >= 0) {
+        adb_close(fd);
+        adb_close(base);
+    }
+    adb_unlink(tmp);
+    return -1;
+}
+
+static int do_recv(int s, const char *path, char *buffer, int compress)
 {
     syncmsg msg;
     int fd, r;
+    int misses = 0;
+    char *out;
+    uLongf zlen;
+#ifdef SYNC_USE_SENDFILE
+    struct stat st;
+    long long left = -1;
+#endif
 
     fd = adb_open(path, O_RDONLY);
     if(fd < 0) {
@@ -325,8 +851,43 @@ static int do_recv(int s, const char *path, char *buffer)
         return 0;
     }
 
-    msg.data.id = ID_DATA;
+    if(compress && sync_is_compressed(path)) {
+        compress = 0;
+    }
+
+#ifdef SYNC_USE_SENDFILE
+        /* chunks that go out uncompressed are spliced straight from the
+           file; the DATA header has to name their size up front */
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        left = st.st_size;
+    }
+#endif
+
     for(;;) {
+#ifdef SYNC_USE_SENDFILE
+        if(left >= 0 && !(compress && misses < SYNC_ZLIB_MAX_MISSES)) {
+            unsigned len = (left < SYNC_DATA_MAX) ? left : SYNC_DATA_MAX;
+            if(len == 0) break;
+
+            msg.data.id = ID_DATA;
+            msg.data.size = htoll(len);
+            if(writex(s, &msg.data, sizeof(msg.data)) ||
+               (r = sync_sendfile(s, fd, buffer, len)) < 0) {
+                adb_close(fd);
+                return -1;
+            }
+            if((unsigned) r < len) {
+                    /* the file shrank under us; fill in the chunk we
+                       promised, then report it instead of DONE */
+                memset(buffer, 0, len - r);
+                adb_close(fd);
+                if(writex(s, buffer, len - r)) return -1;
+                return fail_message(s, "file changed while being read");
+            }
+            left -= len;
+            continue;
+        }
+#endif
         r = adb_read(fd, buffer, SYNC_DATA_MAX);
         if(r <= 0) {
             if(r == 0) break;
@@ -335,9 +896,31 @@ static int do_recv(int s, const char *path, char *buffer)
             adb_close(fd);
             return r;
         }
+#ifdef SYNC_USE_SENDFILE
+        if(left >= 0) {
+            left = (left > r) ? left - r : 0;
+        }
+#endif
+
+        msg.data.id = ID_DATA;
+        out = buffer;
+        if(compress && misses < SYNC_ZLIB_MAX_MISSES) {
+            zlen = SYNC_DATA_MAX;
+            if(compress2((Bytef*) buffer + SYNC_DATA_MAX, &zlen,
+                         (Bytef*) buffer, r, SYNC_ZLIB_LEVEL) == Z_OK &&
+               SYNC_ZLIB_WORTH(zlen, (uLongf) r)) {
+                msg.data.id = ID_ZDAT;
+                out = buffer + SYNC_DATA_MAX;
+                r = zlen;
+                misses = 0;
+            } else {
+                misses++;
+            }
+        }
+
         msg.data.size = htoll(r);
         if(writex(s, &msg.data, sizeof(msg.data)) ||
-           writex(s, buffer, r)) {
+           writex(s, out, r)) {
             adb_close(fd);
             return -1;
         }
@@ -359,23 +942,36 @@ void file_sync_service(int fd, void *cookie)
     syncmsg msg;
     char name[1025];
     unsigned namelen;
+    int compress = 0;
+    replybuf out;
 
-    char *buffer = malloc(SYNC_DATA_MAX);
-    if(buffer == 0) goto fail;
+        /* the second half holds compressed chunks */
+    char *buffer = malloc(SYNC_DATA_MAX * 2);
+    out.fd = fd;
+    out.len = 0;
+    out.data = malloc(REPLY_MAX);
+    if((buffer == 0) || (out.data == 0)) goto fail;
 
     for(;;) {
+            /* replies to pipelined requests go out together, once the
+               host has nothing more queued for us */
+        if(!request_pending(fd) && reply_flush(&out)) goto fail;
+
         D("sync: waiting for command\n");
 
         if(readx(fd, &msg.req, sizeof(msg.req))) {
+            reply_flush(&out);
             fail_message(fd, "command read failure");
             break;
         }
         namelen = ltohl(msg.req.namelen);
         if(namelen > 1024) {
+            reply_flush(&out);
             fail_message(fd, "invalid namelen");
             break;
         }
         if(readx(fd, name, namelen)) {
+            reply_flush(&out);
             fail_message(fd, "filename read failure");
             break;
         }
@@ -384,19 +980,66 @@ void file_sync_service(int fd, void *cookie)
         msg.req.namelen = 0;
         D("sync: '%s' '%s'\n", (char*) &msg.req, name);
 
+            /* the other commands reply directly, so nothing may be
+               left behind when one of them runs */
+        if(msg.req.id != ID_STAT && msg.req.id != ID_LIST &&
+           reply_flush(&out)) goto fail;
+
         switch(msg.req.id) {
         case ID_STAT:
-            if(do_stat(fd, name)) goto fail;
+            if(do_stat(&out, name)) goto fail;
             break;
         case ID_LIST:
-            if(do_list(fd, name)) goto fail;
+            if(do_list(&out, name)) goto fail;
             break;
         case ID_SEND:
             if(do_send(fd, name, buffer)) goto fail;
             break;
         case ID_RECV:
-            if(do_recv(fd, name, buffer)) goto fail;
+            if(do_recv(fd, name, buffer, compress)) goto fail;
+            break;
+        case ID_FEAT:
+            if(do_feat(fd, name, &compress)) goto fail;
+            break;
+        case ID_ULNK:
+            if(do_unlink(fd, name)) goto fail;
+            break;
+        case ID_MKDR:
+            if(do_mkdir(fd, name)) goto fail;
+            break;
+        case ID_SIGN:
+            if(do_sign(fd, name, buffer)) goto fail;
             break;
+        case ID_DLTA:
+            if(do_delta(fd, name, buffer)) goto fail;
+            break;
+        case ID_RENM: {
+                /* "from\0to" */
+            unsigned fromlen = strlen(name);
+            if(fromlen + 1 >= namelen) {
+                fail_message(fd, "invalid rename request");
+                goto fail;
+            }
+            if(do_rename(fd, name, name + fromlen + 1)) goto fail;
+            break;
+        }
+        case ID_RLST: {
+                /* "path\0depth\0pattern" */
+            unsigned pathlen = strlen(name);
+            unsigned depthlen;
+            if(pathlen + 1 >= namelen) {
+                fail_message(fd, "invalid list request");
+                goto fail;
+            }
+            depthlen = strlen(name + pathlen + 1);
+            if(pathlen + 1 + depthlen + 1 > namelen) {
+                fail_message(fd, "invalid list request");
+                goto fail;
+            }
+            if(do_list_tree(&out, name, atoi(name + pathlen + 1),
+                            name + pathlen + 1 + depthlen + 1)) goto fail;
+            break;
+        }
         case ID_QUIT:
             goto fail;
         default:
@@ -407,6 +1050,7 @@ void file_sync_service(int fd, void *cookie)
 
 fail:
     if(buffer != 0) free(buffer);
+    if(out.data != 0) free(out.data);
     D("sync: done\n");
     adb_close(fd);
 }
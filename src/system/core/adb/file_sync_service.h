@@ -45,6 +45,14 @@ static inline unsigned __swap_uint32(unsigned x)
 #define ID_OKAY MKID('O','K','A','Y')
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
+#define ID_MKDR MKID('M','K','D','R')
+#define ID_RENM MKID('R','E','N','M')
+#define ID_SIGN MKID('S','I','G','N')
+#define ID_DLTA MKID('D','L','T','A')
+#define ID_COPY MKID('C','O','P','Y')
+#define ID_FEAT MKID('F','E','A','T')
+#define ID_ZDAT MKID('Z','D','A','T')
+#define ID_RLST MKID('R','L','S','T')
 
 typedef union {
     unsigned id;
@@ -73,16 +81,263 @@ typedef union {
         unsigned id;
         unsigned msglen;
     } status;    
+    struct {
+        unsigned id;
+        unsigned blocksize;
+        unsigned count;
+        unsigned size;
+    } sign;
+    struct {
+        unsigned id;
+        unsigned size;
+        unsigned offset;
+    } copy;
 } syncmsg;
 
+/* Delta pushes (rsync style):
+**
+** SIGN <path> is answered with a sign header giving the block size, the
+** number of blocks and the size of the remote file (all 0 if there is no
+** regular file at <path>), followed by one syncsig per block.
+**
+** DLTA <path>,<mode> is sent like SEND, but the file is rebuilt from a
+** stream of DATA (literal bytes) and COPY (a byte range of the current
+** remote file) messages ended by DONE <mtime>.  The device writes the new
+** file next to the old one and renames it into place before answering.
+**
+** Sizes and offsets are 32 bits, so files larger than SYNC_DELTA_MAX
+** are never diffed: the device signs them as if it had no file, and the
+** host sends them with SEND.
+*/
+typedef struct {
+    unsigned weak;
+    unsigned char strong[20];   /* SHA-1 */
+} syncsig;
+
+#define SYNC_SIGN_MIN_BLOCK 2048
+#define SYNC_SIGN_MAX_BLOCKS 16384
+
+/* rolling checksum of a block: a = sum(x[i]), b = sum((len - i) * x[i]) */
+static inline unsigned sync_weak_sum(const unsigned char *p, int len)
+{
+    unsigned a = 0, b = 0;
+    int i;
+
+    for(i = 0; i < len; i++) {
+        a += p[i];
+        b += (len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+
+/* Optional features:
+**
+** FEAT <features> asks for optional protocol features, named in a space
+** separated list, and is answered with an OKAY status whose message lists
+** the ones the device enabled for the rest of the session.  An adbd that
+** predates FEAT fails it and ends the session.
+**
+** "zlib": either side may send a ZDAT message wherever a DATA message is
+** allowed in SEND, RECV and DLTA.  ZDAT carries one chunk compressed with
+** zlib's compress2(); it inflates to at most SYNC_DATA_MAX bytes.
+**
+** "rlst": RLST <path>\0<depth>\0<pattern> lists the whole tree below
+** <path> in one go, as DENT records named relative to <path> and ended by
+** DONE.  Directories come before their contents and are always listed;
+** other entries only if their name matches the fnmatch() <pattern> (all
+** of them if it is empty).  Nothing deeper than <depth> levels is listed,
+** 0 meaning no limit.  Names can be up to SYNC_RLST_NAME_MAX long.
+*/
+#define SYNC_FEATURE_ZLIB "zlib"
+#define SYNC_FEATURE_RLST "rlst"
+#define SYNC_RLST_NAME_MAX 1280
+#define SYNC_ZLIB_LEVEL 1
+
+/* a chunk only goes out compressed if that saves at least 1/16 of it;
+** after SYNC_ZLIB_MAX_MISSES chunks in a row that did not, the rest of
+** the file is sent as plain DATA
+*/
+#define SYNC_ZLIB_WORTH(zlen, len) ((zlen) < (len) - (len) / 16)
+#define SYNC_ZLIB_MAX_MISSES 4
+
+/* files whose contents are already compressed are sent as plain DATA */
+static inline int sync_is_compressed(const char *path)
+{
+    static const char *exts[] = {
+        ".apk", ".jar", ".zip", ".gz", ".tgz", ".bz2", ".xz", ".7z",
+        ".jpg", ".jpeg", ".png", ".gif", ".webp",
+        ".mp3", ".ogg", ".mp4", ".m4a", ".3gp", ".webm", 0
+    };
+    const char *ext = strrchr(path, '.');
+    int i;
+
+    if(ext == 0 || strchr(ext, '/')) return 0;
+    for(i = 0; exts[i]; i++) {
+        const char *a = ext, *b = exts[i];
+            /* case-insensitive; '|0x20' leaves '.' and digits alone */
+        while(*a && (*a | 0x20) == *b) {
+            a++;
+            b++;
+        }
+        if(*a == 0 && *b == 0) return 1;
+    }
+    return 0;
+}
 
 void file_sync_service(int fd, void *cookie);
 int do_sync_ls(const char *path);
 int do_sync_push(const char *lpath, const char *rpath, int verifyApk);
 int do_sync_sync(const char *lpath, const char *rpath);
 int do_sync_pull(const char *rpath, const char *lpath);
-int do_link(const char *lpath, const char *rpath);
+
+/* ADBLink: a single "sync:" session is kept open for as long as the
+** device stays connected and every change seen by the watcher is
+** replayed over it.  One process can serve several links, each a local
+** folder paired with a folder on one device; the folders must not nest.
+*/
+typedef struct linkinfo linkinfo;
+struct ignorelist;
+struct linkstate;
+
+struct linkinfo {
+    const char *lpath;      /* local folder being watched */
+    const char *rpath;      /* remote folder it is linked to */
+    const char *serial;     /* device it is linked with, NULL for any */
+    char *device;           /* serial of the device it is up with, NULL
+                               while offline */
+    int syncfd;             /* long-lived sync session, -1 when offline */
+    int quiet_ms;           /* events on a path are coalesced until it has
+                               been quiet for this long */
+    struct ignorelist *ignore;  /* entries neither side syncs, or NULL */
+    struct linkstate *state;    /* the watcher's, see watcher.c */
+    linkinfo *next;
+};
+
+#define LINK_DEFAULT_QUIET_MS 250
+
+/* what the watcher had to recover from on a link, see link_stats() */
+typedef struct linkstats {
+    unsigned overflows;         /* times the kernel dropped local events */
+    unsigned remote_overflows;  /* times the device dropped its own */
+    unsigned watch_failures;    /* directories that could not be watched */
+    unsigned rescans;           /* directories compared with the device */
+    unsigned recovered;         /* changes those comparisons turned up */
+} linkstats;
+
+/* called by do_link() for each file both sides hold once it is done, by its
+** path relative to the folders, with the device's size and mtime for it
+*/
+typedef void (*sync_synced_cb)(const char *rel, unsigned size, unsigned time,
+                               void *cookie);
+
+/* bring both folders up to date with each other over link->syncfd; serial
+** names the device's journal (see file_sync_client.c), none if it is NULL
+*/
+int do_link(linkinfo *link, const char *serial, sync_synced_cb synced,
+            void *cookie);
+
+/* a sync session with the device named serial, or with the default one */
+int sync_link_connect(const char *serial);
+void sync_link_disconnect(int fd);
+/* with delta set, a regular file of SYNC_DELTA_MIN to SYNC_DELTA_MAX bytes
+** that the device already has is sent as a delta; SYNC_UNSUPPORTED is returned
+** if the device does not know SIGN/DLTA
+*/
+#define SYNC_DELTA_MIN (1024*1024)
+#define SYNC_DELTA_MAX 0xffffffffULL
+
+int sync_link_push(int fd, const char *lpath, const char *rpath, int delta);
+/* 1 if the device gave up on the file part way through, as it does when
+** the file changes under it, -1 if the session is lost
+*/
+int sync_link_pull(int fd, const char *rpath, const char *lpath, unsigned mtime);
+
+/* called with pulled 0 for each remote file, which is only pulled if it
+** returns non-zero, then with pulled 1 once it has been
+*/
+typedef int (*sync_pull_cb)(const char *lpath, unsigned mode, unsigned size,
+                            unsigned time, int pulled, void *cookie);
+
+int sync_link_pull_tree(int fd, const char *rpath, const char *lpath,
+                        sync_pull_cb filter, void *cookie);
+
+/* list the directory path on the device, "." and ".." included; the
+** session is closed if it fails
+*/
+typedef void (*sync_ls_cb)(unsigned mode, unsigned size, unsigned time, const char *name, void *cookie);
+int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie);
+
+/* leave the entries l ignores (see ignore.h) out of the file lists built
+** below the local folder lroot, or of its remote twin; NULL for none
+*/
+void sync_set_ignore(struct ignorelist *l, const char *lroot);
+
+/* structural changes over a sync session (ULNK, MKDR and RENM requests).
+** ULNK removes a file or a whole directory tree, MKDR creates a directory
+** and any missing parents, RENM takes "from\0to" as its name.
+** They return 0 on success, 1 if the device refused the operation, -1 if
+** the session was lost and SYNC_UNSUPPORTED if the adbd on the device does
+** not know the request (which also ends the session).
+*/
+#define SYNC_UNSUPPORTED (-2)
+
+int sync_remove(int fd, const char *rpath);
+int sync_mkdir(int fd, const char *rpath);
+int sync_rename(int fd, const char *rfrom, const char *rto);
+
+/* Change feed ("watch:<path>" service):
+**
+** The device reports every change below <path> as a record shaped like a
+** DENT message, named relative to <path>:
+**
+**   DENT <name>       <name> was created or changed; mode, size and time
+**                     are what it looks like now.  A directory that appears
+**                     is followed by a DENT for everything already in it.
+**   ULNK <name>       <name> is gone, with everything below it
+**   RENM <from\0to>   <from> was renamed to <to> inside <path>
+**   OVFL              changes were lost; the host has to rescan <path>
+**   DONE              <path> itself went away, or could not be watched
+**
+** A change is only reported once its path has been quiet for
+** WATCH_QUIET_MS, so a file that is being written goes out once.
+*/
+#define ID_OVFL MKID('O','V','F','L')
+#define WATCH_NAME_MAX 1024
+#define WATCH_QUIET_MS 100
 
 #define SYNC_DATA_MAX (64*1024)
 
+#if defined(HAVE_SYS_SENDFILE_H) && !defined(HAVE_WINSOCK)
+#include <errno.h>
+#include <sys/sendfile.h>
+#define SYNC_USE_SENDFILE 1
+
+/* copy the next len bytes of the file fd to the socket s without taking
+** them through user space.  Where the file system cannot do that they
+** are read into buffer (SYNC_DATA_MAX bytes) instead.  Returns the number
+** of bytes sent, short only if the file ended early, or -1 on error.
+*/
+static inline int sync_sendfile(int s, int fd, char *buffer, unsigned len)
+{
+    unsigned done = 0;
+    int r;
+
+    while(done < len) {
+        r = sendfile(s, fd, NULL, len - done);
+        if(r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            r = adb_read(fd, buffer, len - done);
+            if(r > 0 && writex(s, buffer, r)) return -1;
+        }
+        if(r < 0) {
+            if(errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        if(r == 0) break;
+        done += r;
+    }
+    return done;
+}
+#endif
+
 #endif
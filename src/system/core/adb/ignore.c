@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ignore.h"
+
+#define IGN_NEGATE    0x01      /* "!pattern" */
+#define IGN_DIRONLY   0x02      /* "pattern/" */
+#define IGN_ANCHORED  0x04      /* matched against the whole relative path */
+
+    /* how a compiled pattern is matched */
+#define IGN_LITERAL   0         /* the whole name */
+#define IGN_PREFIX    1         /* "name*": the start of the name */
+#define IGN_SUFFIX    2         /* "*name": the end of the name */
+#define IGN_GLOB      3         /* anything else */
+
+typedef struct {
+    int flags;
+    int kind;
+    int len;                    /* of the literal part */
+    char *text;                 /* the literal part, or the whole glob */
+} ignorepat;
+
+struct ignorelist {
+    ignorepat *pats;
+    int count;
+    int max;
+};
+
+/* match one [...] class at p against c; returns the end of the class, or
+** NULL if c is not in it
+*/
+static const char *glob_class(const char *p, char c)
+{
+    int negate = 0, found = 0;
+
+    p++;
+    if(*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    if(*p == ']') {
+        found = (c == ']');
+        p++;
+    }
+    while(*p && *p != ']') {
+        if(p[1] == '-' && p[2] && p[2] != ']') {
+            if(c >= p[0] && c <= p[2]) found = 1;
+            p += 3;
+        } else {
+            if(c == *p) found = 1;
+            p++;
+        }
+    }
+    if(*p == 0) return 0;
+    return (found != negate) ? p + 1 : 0;
+}
+
+static int glob_match(const char *p, const char *s)
+{
+    for(;;) {
+        switch(*p) {
+        case 0:
+            return *s == 0;
+        case '*':
+            if(p[1] == '*') {
+                p += 2;
+                    /* a "**" component may also match no directory at all */
+                if(*p == '/' && glob_match(p + 1, s)) return 1;
+                for(;; s++) {
+                    if(glob_match(p, s)) return 1;
+                    if(*s == 0) return 0;
+                }
+            }
+            p++;
+            for(;; s++) {
+                if(glob_match(p, s)) return 1;
+                if(*s == 0 || *s == '/') return 0;
+            }
+        case '?':
+            if(*s == 0 || *s == '/') return 0;
+            p++;
+            s++;
+            break;
+        case '[':
+            if(*s == 0 || *s == '/') return 0;
+            p = glob_class(p, *s);
+            if(p == 0) return 0;
+            s++;
+            break;
+        case '\\':
+            if(p[1]) p++;
+            /* fall through */
+        default:
+            if(*p != *s) return 0;
+            p++;
+            s++;
+            break;
+        }
+    }
+}
+
+static int has_wildcards(const char *p, int len)
+{
+    while(len-- > 0) {
+        if(*p == '*' || *p == '?' || *p == '[' || *p == '\\') return 1;
+        p++;
+    }
+    return 0;
+}
+
+ignorelist *ignore_new(void)
+{
+    return calloc(1, sizeof(ignorelist));
+}
+
+int ignore_add(ignorelist *l, const char *pattern)
+{
+    ignorepat pat;
+    int len;
+
+    memset(&pat, 0, sizeof(pat));
+    len = strlen(pattern);
+    while(len > 0 && (pattern[len - 1] == '\n' || pattern[len - 1] == '\r'))
+        len--;
+    while(len > 0 && pattern[len - 1] == ' ' &&
+          (len < 2 || pattern[len - 2] != '\\'))
+        len--;
+    if(len == 0 || pattern[0] == '#') return 0;
+
+    if(pattern[0] == '!') {
+        pat.flags |= IGN_NEGATE;
+        pattern++;
+        len--;
+    } else if(pattern[0] == '\\' && (pattern[1] == '!' || pattern[1] == '#')) {
+        pattern++;
+        len--;
+    }
+    if(len > 0 && pattern[len - 1] == '/') {
+        pat.flags |= IGN_DIRONLY;
+        len--;
+    }
+    if(memchr(pattern, '/', len)) {
+        pat.flags |= IGN_ANCHORED;
+        if(pattern[0] == '/') {
+            pattern++;
+            len--;
+        }
+    }
+    if(len <= 0) return 0;
+
+        /* boil the common shapes down to a string compare */
+    if(!has_wildcards(pattern, len)) {
+        pat.kind = IGN_LITERAL;
+    } else if(pattern[0] == '*' && pattern[1] != '*' &&
+              !has_wildcards(pattern + 1, len - 1) &&
+              !memchr(pattern, '/', len)) {
+        pat.kind = IGN_SUFFIX;
+        pattern++;
+        len--;
+    } else if(pattern[len - 1] == '*' && (len < 2 || pattern[len - 2] != '*') &&
+              !has_wildcards(pattern, len - 1)) {
+        pat.kind = IGN_PREFIX;
+        len--;
+    } else {
+        pat.kind = IGN_GLOB;
+    }
+
+    pat.len = len;
+    pat.text = malloc(len + 1);
+    if(pat.text == 0) return -1;
+    memcpy(pat.text, pattern, len);
+    pat.text[len] = 0;
+
+    if(l->count == l->max) {
+        int max = l->max ? l->max * 2 : 16;
+        ignorepat *pats = realloc(l->pats, max * sizeof(ignorepat));
+        if(pats == 0) {
+            free(pat.text);
+            return -1;
+        }
+        l->pats = pats;
+        l->max = max;
+    }
+    l->pats[l->count++] = pat;
+    return 0;
+}
+
+ignorelist *ignore_load(const char *dir)
+{
+    char path[PATH_MAX];
+    char line[1024];
+    ignorelist *l;
+    FILE *f;
+    int len;
+
+    len = strlen(dir);
+    if(snprintf(path, sizeof(path), "%s%s%s", dir,
+                (len && dir[len - 1] == '/') ? "" : "/", IGNORE_FILE) >=
+       (int) sizeof(path)) {
+        return 0;
+    }
+    f = fopen(path, "r");
+    if(f == 0) return 0;
+
+    l = ignore_new();
+    while(l && fgets(line, sizeof(line), f)) {
+        if(ignore_add(l, line)) {
+            ignore_free(l);
+            l = 0;
+        }
+    }
+    fclose(f);
+
+    if(l && l->count == 0) {
+        ignore_free(l);
+        l = 0;
+    }
+    return l;
+}
+
+void ignore_free(ignorelist *l)
+{
+    int i;
+
+    if(l == 0) return;
+    for(i = 0; i < l->count; i++)
+        free(l->pats[i].text);
+    free(l->pats);
+    free(l);
+}
+
+static int pat_match(ignorepat *pat, const char *name, int len)
+{
+    switch(pat->kind) {
+    case IGN_LITERAL:
+        return len == pat->len && !memcmp(name, pat->text, len);
+    case IGN_SUFFIX:
+            /* anchored patterns see the whole path, where the leading
+            ** '*' still may not take in a '/'
+            */
+        return len >= pat->len &&
+            !memcmp(name + len - pat->len, pat->text, pat->len) &&
+            !memchr(name, '/', len - pat->len);
+    case IGN_PREFIX:
+            /* the '*' may not take in a '/' */
+        return len >= pat->len && !memcmp(name, pat->text, pat->len) &&
+            !memchr(name + pat->len, '/', len - pat->len);
+    default:
+        return glob_match(pat->text, name);
+    }
+}
+
+int ignore_match(ignorelist *l, const char *rel, int isdir)
+{
+    const char *base;
+    int i, len, baselen;
+
+    if(l == 0) return 0;
+    len = strlen(rel);
+    base = strrchr(rel, '/');
+    base = base ? base + 1 : rel;
+    baselen = len - (base - rel);
+
+    for(i = l->count - 1; i >= 0; i--) {
+        ignorepat *pat = &l->pats[i];
+
+        if((pat->flags & IGN_DIRONLY) && !isdir) continue;
+        if((pat->flags & IGN_ANCHORED) ? pat_match(pat, rel, len)
+                                       : pat_match(pat, base, baselen)) {
+            return !(pat->flags & IGN_NEGATE);
+        }
+    }
+    return 0;
+}
+
+int ignore_path(ignorelist *l, const char *rel, int isdir)
+{
+    char dir[PATH_MAX];
+    const char *x;
+
+    if(l == 0) return 0;
+    for(x = strchr(rel, '/'); x != 0; x = strchr(x + 1, '/')) {
+        if(x - rel >= (int) sizeof(dir)) break;
+        memcpy(dir, rel, x - rel);
+        dir[x - rel] = 0;
+        if(ignore_match(l, dir, 1)) return 1;
+    }
+    return ignore_match(l, rel, isdir);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ADB_IGNORE_H
+#define _ADB_IGNORE_H
+
+/* Ignore patterns for link, push and sync, in the style of .gitignore:
+**
+**   # comment           blank lines and comments are skipped
+**   *.o                 a pattern without a '/' matches the name of an
+**                       entry at any depth
+**   build/              a trailing '/' only matches directories
+**   /out  lib/x86       any other '/' anchors the pattern at the top folder
+**   **                  as a whole path component, "**" matches any number
+**                       of directories, at the start, end or middle
+**                       of a pattern
+**   !keep.o             a leading '!' takes an entry back in
+**
+** '*', '?' and [a-z] classes never match a '/'.  The last pattern that
+** matches an entry decides, and nothing below an ignored directory is
+** looked at (so it cannot be taken back in either).
+**
+** Patterns are compiled once: most of them end up as plain string, prefix
+** or suffix compares, and only the others go through the glob matcher.
+*/
+
+#define IGNORE_FILE ".adbignore"
+
+typedef struct ignorelist ignorelist;
+
+/* the patterns in dir/.adbignore, or NULL if there are none */
+ignorelist *ignore_load(const char *dir);
+
+ignorelist *ignore_new(void);
+int ignore_add(ignorelist *l, const char *pattern);
+void ignore_free(ignorelist *l);
+
+/* rel is a path relative to the top folder, without a trailing '/';
+** ignore_match() only looks at rel itself, its parents are assumed to
+** have been checked, while ignore_path() checks them as well
+*/
+int ignore_match(ignorelist *l, const char *rel, int isdir);
+int ignore_path(ignorelist *l, const char *rel, int isdir);
+
+#endif
@@ -8,7 +8,9 @@ ADB_MUTEX(socket_list_lock)
 ADB_MUTEX(transport_lock)
 #if ADB_HOST
 ADB_MUTEX(local_transports_lock)
+ADB_MUTEX(server_check_lock)
 #endif
 ADB_MUTEX(usb_lock)
+ADB_MUTEX(packet_pool_lock)
 
 #undef ADB_MUTEX
@@ -0,0 +1,600 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sysdeps.h"
+
+#define  TRACE_TAG  TRACE_SOCKETS
+#include "adb.h"
+
+/* A mux channel carries any number of streams over one connection to the
+** server, so a client that opens many services pays for connecting and
+** for the version check once instead of once per service.
+**
+** "host:mux" answers OKAY followed by the server's version in four hex
+** digits.  From then on both sides only send frames:
+**
+**   OPEN<id>0000          from the client: a new stream
+**   WRTE<id><len><data>   len bytes for the stream
+**   CRED<id><len>         the sender may send len more bytes on the stream
+**   CLSE<id>0000          the stream is gone, sent by either side
+**
+** with id and len in four hex digits, like every length on the smart
+** socket.  A side may send up to MUX_WINDOW bytes on a stream that the
+** other has not handed on yet, and gets CRED for them as they go.  So a
+** stream whose reader is slow only ever stops itself: the channel is
+** always read, and the other streams keep going.
+**
+** Each stream is a socketpair.  On the client the caller gets
+** the other end, and on the server a local socket behind a smart socket
+** does, just as if it had been accept()ed.  So a stream starts with the
+** usual service request, gets OKAY or FAIL, and then carries the service,
+** without either end knowing it is not a connection of its own.
+**
+** Each channel is pumped by a thread of its own.
+*/
+
+#ifndef HAVE_WIN32_IPC
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#define MUX_HEADER       12
+#define MUX_CHUNK        4096
+#define MUX_MAX_STREAMS  64
+
+    /* bytes a stream may have in flight, and how many of them the
+    ** receiver hands on before it gives credit for them
+    */
+#define MUX_WINDOW       (64*1024)
+#define MUX_CREDIT_MIN   MUX_CHUNK
+
+    /* frames queued for the channel past which streams are not read */
+#define MUX_BACKLOG      (64*1024)
+
+typedef struct mux_buf mux_buf;
+typedef struct mux_queue mux_queue;
+typedef struct mux_stream mux_stream;
+
+struct mux_buf
+{
+    mux_buf *next;
+    int len;
+    int off;
+    char data[MUX_HEADER + MUX_CHUNK];
+};
+
+struct mux_queue
+{
+    mux_buf *first;
+    mux_buf *last;
+    int bytes;
+};
+
+struct mux_stream
+{
+    unsigned id;
+    int fd;
+    int closing;            /* CLSE seen: close once out is written */
+    mux_queue out;          /* data for fd */
+    int credit;             /* bytes the peer will still take */
+    int consumed;           /* bytes fd took that the peer has no credit for */
+};
+
+struct mux_channel
+{
+    int fd;
+    int server;
+
+        /* shared with mux_open(), under lock */
+    adb_mutex_t lock;
+    int wake[2];
+    int pending[MUX_MAX_STREAMS];
+    int npending;
+    int count;
+    int dead;
+
+        /* the pump thread's own */
+    mux_stream *streams[MUX_MAX_STREAMS];
+    int nstreams;
+    unsigned next_id;
+    mux_queue out;          /* frames for fd */
+    char in[MUX_HEADER + MUX_CHUNK];
+    int inlen;
+};
+
+static int mux_accept_send = -1;
+static int mux_accept_recv = -1;
+static fdevent mux_accept_fde;
+
+static void mux_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int mux_put(mux_queue *q, const char *hdr, const void *data, int len)
+{
+    mux_buf *b = malloc(sizeof(mux_buf));
+    int n = 0;
+
+    if(b == 0) return -1;
+    if(hdr) {
+        memcpy(b->data, hdr, MUX_HEADER);
+        n = MUX_HEADER;
+    }
+    memcpy(b->data + n, data, len);
+    b->len = n + len;
+    b->off = 0;
+    b->next = 0;
+
+    if(q->last) {
+        q->last->next = b;
+    } else {
+        q->first = b;
+    }
+    q->last = b;
+    q->bytes += b->len;
+    return 0;
+}
+
+/* only WRTE carries data, CRED's len is the credit */
+static int mux_frame_len(mux_channel *c, const char *cmd, unsigned id,
+                         unsigned len, const void *data, int datalen)
+{
+    char hdr[MUX_HEADER + 1];
+
+    snprintf(hdr, sizeof hdr, "%.4s%04x%04x", cmd, id & 0xffff, len & 0xffff);
+    return mux_put(&c->out, hdr, data, datalen);
+}
+
+static int mux_frame(mux_channel *c, const char *cmd, unsigned id,
+                     const void *data, int len)
+{
+    return mux_frame_len(c, cmd, id, len, data, len);
+}
+
+/* 0 once q is written or would block, -1 if fd is gone */
+static int mux_flush(int fd, mux_queue *q)
+{
+    mux_buf *b;
+    int r;
+
+    while((b = q->first) != 0) {
+            /* no SIGPIPE for a caller who closed its end */
+        r = send(fd, b->data + b->off, b->len - b->off, MSG_NOSIGNAL);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN) return 0;
+            return -1;
+        }
+        b->off += r;
+        q->bytes -= r;
+        if(b->off == b->len) {
+            q->first = b->next;
+            if(q->first == 0) q->last = 0;
+            free(b);
+        }
+    }
+    return 0;
+}
+
+static void mux_drop(mux_queue *q)
+{
+    mux_buf *b;
+
+    while((b = q->first) != 0) {
+        q->first = b->next;
+        free(b);
+    }
+    q->last = 0;
+    q->bytes = 0;
+}
+
+static mux_stream *mux_find(mux_channel *c, unsigned id)
+{
+    int i;
+
+    for(i = 0; i < c->nstreams; i++) {
+        if(c->streams[i]->id == id) return c->streams[i];
+    }
+    return 0;
+}
+
+static mux_stream *mux_add(mux_channel *c, unsigned id, int fd)
+{
+    mux_stream *st;
+
+    if(c->nstreams == MUX_MAX_STREAMS) return 0;
+    st = calloc(1, sizeof(mux_stream));
+    if(st == 0) return 0;
+    st->id = id;
+    st->fd = fd;
+    st->credit = MUX_WINDOW;
+    mux_nonblock(fd);
+    close_on_exec(fd);
+    c->streams[c->nstreams++] = st;
+    return st;
+}
+
+static void mux_remove(mux_channel *c, mux_stream *st, int tell_peer)
+{
+    int i;
+
+    D("mux %p: stream %x closed%s\n", c, st->id, tell_peer ? ", telling peer" : "");
+    if(tell_peer) {
+        mux_frame(c, "CLSE", st->id, 0, 0);
+    }
+    for(i = 0; i < c->nstreams; i++) {
+        if(c->streams[i] == st) {
+            c->streams[i] = c->streams[--c->nstreams];
+            break;
+        }
+    }
+    adb_close(st->fd);
+    mux_drop(&st->out);
+    free(st);
+
+    adb_mutex_lock(&c->lock);
+    c->count--;
+    adb_mutex_unlock(&c->lock);
+}
+
+/* give the peer credit for what fd took, once there is enough to be
+** worth a frame
+*/
+static void mux_credit(mux_channel *c, mux_stream *st, int taken)
+{
+    int n;
+
+    st->consumed += taken;
+    while(st->consumed >= MUX_CREDIT_MIN) {
+        n = (st->consumed > 0xffff) ? 0xffff : st->consumed;
+        mux_frame_len(c, "CRED", st->id, n, 0, 0);
+        st->consumed -= n;
+    }
+}
+
+/* the server's end of a new stream goes to the main loop, which is
+** the only one allowed to create sockets
+*/
+static void mux_accept_event(int fd, unsigned ev, void *unused)
+{
+    asocket *s;
+    int sfd;
+
+    if(!(ev & FDE_READ)) return;
+    if(readx(fd, &sfd, sizeof(sfd))) {
+        fatal_errno("cannot read mux accept socket");
+    }
+
+    s = create_local_socket(sfd);
+    if(s) {
+        connect_to_smartsocket(s);
+        return;
+    }
+    adb_close(sfd);
+}
+
+static int mux_open_frame(mux_channel *c, unsigned id)
+{
+    int s[2];
+
+    if(!c->server || mux_find(c, id)) return -1;
+
+    adb_mutex_lock(&c->lock);
+    c->count++;
+    adb_mutex_unlock(&c->lock);
+
+    if(adb_socketpair(s) == 0) {
+        if(mux_add(c, id, s[0])) {
+            if(writex(mux_accept_send, &s[1], sizeof(s[1]))) {
+                fatal_errno("cannot write mux accept socket");
+            }
+            return 0;
+        }
+        adb_close(s[0]);
+        adb_close(s[1]);
+    }
+
+    adb_mutex_lock(&c->lock);
+    c->count--;
+    adb_mutex_unlock(&c->lock);
+    return mux_frame(c, "CLSE", id, 0, 0);
+}
+
+/* -1 on a protocol error, which ends the channel */
+static int mux_dispatch(mux_channel *c, const char *cmd, unsigned id,
+                        const char *data, int len)
+{
+    mux_stream *st;
+
+    if(!memcmp(cmd, "OPEN", 4)) {
+        return mux_open_frame(c, id);
+    }
+
+    st = mux_find(c, id);
+    if(!memcmp(cmd, "WRTE", 4)) {
+            /* a stream we closed may still get data in flight */
+        if(st == 0 || st->closing) return 0;
+        if(st->out.bytes + len > MUX_WINDOW) {
+            D("mux %p: stream %x overran its window\n", c, id);
+            mux_remove(c, st, 1);
+            return 0;
+        }
+        return mux_put(&st->out, 0, data, len);
+    }
+    if(!memcmp(cmd, "CRED", 4)) {
+        if(st) st->credit += len;
+        return 0;
+    }
+    if(!memcmp(cmd, "CLSE", 4)) {
+        if(st == 0) return 0;
+        if(st->out.first) {
+            st->closing = 1;
+        } else {
+            mux_remove(c, st, 0);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static int mux_read(mux_channel *c)
+{
+    unsigned id, len, datalen;
+    int r;
+
+    r = adb_read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+    if(r < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    if(r <= 0) return -1;
+    c->inlen += r;
+
+    while(c->inlen >= MUX_HEADER) {
+        id = unhex((unsigned char*) c->in + 4, 4);
+        len = unhex((unsigned char*) c->in + 8, 4);
+        datalen = memcmp(c->in, "WRTE", 4) ? 0 : len;
+        if(id > 0xffff || len > 0xffff || datalen > MUX_CHUNK) {
+            D("mux %p: bad frame\n", c);
+            return -1;
+        }
+        if(c->inlen < (int) (MUX_HEADER + datalen)) break;
+
+        if(mux_dispatch(c, c->in, id, c->in + MUX_HEADER, len)) return -1;
+
+        c->inlen -= MUX_HEADER + datalen;
+        memmove(c->in, c->in + MUX_HEADER + datalen, c->inlen);
+    }
+    return 0;
+}
+
+/* streams mux_open() handed out since we last looked */
+static void mux_take_pending(mux_channel *c)
+{
+    int fds[MUX_MAX_STREAMS];
+    int i, n;
+
+    adb_mutex_lock(&c->lock);
+    n = c->npending;
+    memcpy(fds, c->pending, n * sizeof(int));
+    c->npending = 0;
+    adb_mutex_unlock(&c->lock);
+
+    for(i = 0; i < n; i++) {
+        do {
+            c->next_id = (c->next_id + 1) & 0xffff;
+        } while(c->next_id == 0 || mux_find(c, c->next_id));
+
+        if(mux_add(c, c->next_id, fds[i]) == 0) {
+            adb_close(fds[i]);
+            adb_mutex_lock(&c->lock);
+            c->count--;
+            adb_mutex_unlock(&c->lock);
+            continue;
+        }
+        D("mux %p: stream %x opened\n", c, c->next_id);
+        mux_frame(c, "OPEN", c->next_id, 0, 0);
+    }
+}
+
+static void *mux_thread(void *_c)
+{
+    mux_channel *c = _c;
+    struct pollfd fds[2 + MUX_MAX_STREAMS];
+    mux_stream *polled[MUX_MAX_STREAMS];
+    mux_stream *st;
+    char buf[MUX_CHUNK];
+    int i, n, r, bytes;
+
+    D("mux %p: starting on fd %d\n", c, c->fd);
+    for(;;) {
+        mux_take_pending(c);
+
+        n = c->nstreams;
+        for(i = 0; i < n; i++) {
+            st = c->streams[i];
+            polled[i] = st;
+            fds[2 + i].fd = st->fd;
+            fds[2 + i].events = 0;
+            fds[2 + i].revents = 0;
+            if(!st->closing && st->credit > 0 && c->out.bytes < MUX_BACKLOG) {
+                fds[2 + i].events |= POLLIN;
+            }
+            if(st->out.first) {
+                fds[2 + i].events |= POLLOUT;
+            }
+                /* a hangup is reported regardless, and must wait
+                ** for credit like any data
+                */
+            if(fds[2 + i].events == 0) fds[2 + i].fd = -1;
+        }
+        fds[0].fd = c->wake[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = c->fd;
+        fds[1].events = POLLIN | (c->out.first ? POLLOUT : 0);
+        fds[1].revents = 0;
+
+        r = poll(fds, 2 + n, -1);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            D("mux %p: poll error %d\n", c, errno);
+            break;
+        }
+
+        if(fds[0].revents & POLLIN) {
+            adb_read(c->wake[0], buf, sizeof(buf));
+        }
+
+            /* only ever removes the stream at hand, so the ones
+            ** left in polled[] stay valid
+            */
+        for(i = 0; i < n; i++) {
+            st = polled[i];
+            if(fds[2 + i].revents & (POLLOUT | POLLHUP | POLLERR)) {
+                bytes = st->out.bytes;
+                if(mux_flush(st->fd, &st->out)) {
+                    mux_remove(c, st, !st->closing);
+                    continue;
+                }
+                if(st->closing && st->out.first == 0) {
+                    mux_remove(c, st, 0);
+                    continue;
+                }
+                mux_credit(c, st, bytes - st->out.bytes);
+            }
+            if(st->closing || !(fds[2 + i].events & POLLIN)) continue;
+            if(fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                r = adb_read(st->fd, buf,
+                             (st->credit < (int) sizeof(buf)) ? st->credit
+                                                              : (int) sizeof(buf));
+                if(r > 0) {
+                    st->credit -= r;
+                    mux_frame(c, "WRTE", st->id, buf, r);
+                } else if(r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    mux_remove(c, st, 1);
+                }
+            }
+        }
+
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if(mux_read(c)) break;
+        }
+        if(c->out.first && mux_flush(c->fd, &c->out)) break;
+    }
+
+    D("mux %p: closing\n", c);
+    adb_mutex_lock(&c->lock);
+    c->dead = 1;
+    for(i = 0; i < c->npending; i++) {
+        adb_close(c->pending[i]);
+    }
+    c->npending = 0;
+    adb_mutex_unlock(&c->lock);
+
+    while(c->nstreams > 0) {
+        mux_remove(c, c->streams[0], 0);
+    }
+    mux_drop(&c->out);
+    adb_close(c->fd);
+
+        /* a client's channel may still be asked for streams, which
+        ** dead turns down, so only the server's goes away entirely
+        */
+    if(c->server) {
+        adb_close(c->wake[0]);
+        adb_close(c->wake[1]);
+        free(c);
+    }
+    return 0;
+}
+
+mux_channel *mux_start(int fd, int server)
+{
+    mux_channel *c;
+    adb_thread_t tid;
+    int s[2];
+
+    if(server && mux_accept_send < 0) {
+        if(adb_socketpair(s)) return 0;
+        mux_accept_send = s[0];
+        mux_accept_recv = s[1];
+        close_on_exec(mux_accept_send);
+        close_on_exec(mux_accept_recv);
+        fdevent_install(&mux_accept_fde, mux_accept_recv, mux_accept_event, 0);
+        fdevent_set(&mux_accept_fde, FDE_READ);
+    }
+
+    c = calloc(1, sizeof(mux_channel));
+    if(c == 0) return 0;
+    if(adb_socketpair(c->wake)) {
+        free(c);
+        return 0;
+    }
+    c->fd = fd;
+    c->server = server;
+    adb_mutex_init(&c->lock, 0);
+    mux_nonblock(fd);
+    mux_nonblock(c->wake[0]);
+    close_on_exec(c->wake[0]);
+    close_on_exec(c->wake[1]);
+
+    if(adb_thread_create(&tid, mux_thread, c)) {
+        adb_close(c->wake[0]);
+        adb_close(c->wake[1]);
+        free(c);
+        return 0;
+    }
+    return c;
+}
+
+int mux_open(mux_channel *c)
+{
+    int s[2];
+
+    adb_mutex_lock(&c->lock);
+    if(c->dead || c->count == MUX_MAX_STREAMS || adb_socketpair(s)) {
+        adb_mutex_unlock(&c->lock);
+        return -1;
+    }
+    c->pending[c->npending++] = s[0];
+    c->count++;
+    adb_write(c->wake[1], "", 1);
+    adb_mutex_unlock(&c->lock);
+
+    return s[1];
+}
+
+#else /* HAVE_WIN32_IPC */
+
+/* no poll() over emulated sockets on Win32: clients fall back to a
+** connection per service
+*/
+mux_channel *mux_start(int fd, int server)
+{
+    return 0;
+}
+
+int mux_open(mux_channel *c)
+{
+    return -1;
+}
+
+#endif /* HAVE_WIN32_IPC */
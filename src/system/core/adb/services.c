@@ -399,6 +399,10 @@ int service_to_fd(const char *name)
 #if !ADB_HOST
     } else if(!strncmp(name, "sync:", 5)) {
         ret = create_service_thread(file_sync_service, NULL);
+    } else if(!strncmp(name, "watch:", 6)) {
+        void* arg = strdup(name + 6);
+        if(arg == 0) return -1;
+        ret = create_service_thread(watch_service, arg);
     } else if(!strncmp(name, "remount:", 8)) {
         ret = create_service_thread(remount_service, NULL);
     } else if(!strncmp(name, "reboot:", 7)) {
@@ -29,6 +29,23 @@
 ADB_MUTEX_DEFINE( socket_list_lock );
 
 static void local_socket_close_locked(asocket *s);
+static int remote_socket_enqueue(asocket *s, apacket *p);
+
+/* a Remote socket is used to send/receive data to/from a given transport object
+** it needs to be closed when the transport is forcibly destroyed by the user
+*/
+typedef struct aremotesocket {
+    asocket      socket;
+    adisconnect  disconnect;
+
+        /* writes we sent that the far side has not acknowledged */
+    unsigned     unacked;
+
+        /* writes we received that our local peer had to queue;
+        ** they are acknowledged once it has drained them
+        */
+    unsigned     deferred;
+} aremotesocket;
 
 int sendfailmsg(int fd, const char *reason)
 {
@@ -171,6 +188,13 @@ enqueue:
     }
     s->pkt_last = p;
 
+        /* a write from the far side is acknowledged when we
+        ** drain the queue and call ready on our remote peer
+        */
+    if(s->peer && s->peer->enqueue == remote_socket_enqueue) {
+        ((aremotesocket*) s->peer)->deferred++;
+    }
+
         /* make sure we are notified when we can drain the queue */
     fdevent_add(&s->fde, FDE_WRITE);
 
@@ -243,6 +267,17 @@ static void local_socket_close_locked(asocket *s)
     insert_local_socket(s, &local_socket_closing_list);
 }
 
+/* how much to read from a local socket at once: as much as the
+** transport behind a remote peer will carry in one packet
+*/
+static size_t local_socket_payload(asocket *s)
+{
+    if(s->peer && s->peer->enqueue == remote_socket_enqueue) {
+        return s->peer->transport->max_payload;
+    }
+    return MAX_PAYLOAD_V1;
+}
+
 static void local_socket_event_func(int fd, unsigned ev, void *_s)
 {
     asocket *s = _s;
@@ -298,11 +333,15 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
 
     if(ev & FDE_READ){
         apacket *p = get_apacket();
-        unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
+        unsigned char *x;
+        size_t max = local_socket_payload(s);
+        size_t avail = max;
         int r;
         int is_eof = 0;
 
+        apacket_reserve(p, max);
+        x = p->data;
+
         while(avail > 0) {
             r = adb_read(fd, x, avail);
             if(r > 0) {
@@ -320,10 +359,10 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
             break;
         }
 
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if((avail == max) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = max - avail;
 
             r = s->peer->enqueue(s->peer, p);
 
@@ -417,33 +456,46 @@ static asocket *create_host_service_socket(const char *name, const char* serial)
 }
 #endif /* ADB_HOST */
 
-/* a Remote socket is used to send/receive data to/from a given transport object
-** it needs to be closed when the transport is forcibly destroyed by the user
-*/
-typedef struct aremotesocket {
-    asocket      socket;
-    adisconnect  disconnect;
-} aremotesocket;
-
 static int remote_socket_enqueue(asocket *s, apacket *p)
 {
+    aremotesocket *rs = (aremotesocket*) s;
+
     D("Calling remote_socket_enqueue\n");
     p->msg.command = A_WRTE;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
     p->msg.data_length = p->len;
     send_packet(p, s->transport);
-    return 1;
+
+        /* keep the peer sending until the window is full */
+    return (++rs->unacked >= s->transport->window) ? 1 : 0;
+}
+
+/* called for every READY after the first: the far side has taken
+** one of our writes off its hands
+*/
+void remote_socket_acked(asocket *s)
+{
+    aremotesocket *rs = (aremotesocket*) s;
+
+    if(s->enqueue != remote_socket_enqueue) return;
+    if(rs->unacked > 0) rs->unacked--;
 }
 
 static void remote_socket_ready(asocket *s)
 {
+    aremotesocket *rs = (aremotesocket*) s;
+    unsigned n = rs->deferred ? rs->deferred : 1;
+
     D("Calling remote_socket_ready\n");
-    apacket *p = get_apacket();
-    p->msg.command = A_OKAY;
-    p->msg.arg0 = s->peer->id;
-    p->msg.arg1 = s->id;
-    send_packet(p, s->transport);
+    rs->deferred = 0;
+    while(n-- > 0) {
+        apacket *p = get_apacket();
+        p->msg.command = A_OKAY;
+        p->msg.arg0 = s->peer->id;
+        p->msg.arg1 = s->id;
+        send_packet(p, s->transport);
+    }
 }
 
 static void remote_socket_close(asocket *s)
@@ -502,7 +554,7 @@ void connect_to_remote(asocket *s, const char *destination)
     apacket *p = get_apacket();
     int len = strlen(destination) + 1;
 
-    if(len > (MAX_PAYLOAD-1)) {
+    if(len > (int) (p->size-1)) {
         fatal("destination oversized");
     }
 
@@ -581,7 +633,7 @@ static int smart_socket_enqueue(asocket *s, apacket *p)
         s->pkt_first = p;
         s->pkt_last = p;
     } else {
-        if((s->pkt_first->len + p->len) > MAX_PAYLOAD) {
+        if((s->pkt_first->len + p->len) > s->pkt_first->size) {
             D("SS(%d): overflow\n", s->id);
             put_apacket(p);
             goto fail;
@@ -59,6 +59,9 @@ static __inline__ void  adb_mutex_unlock( adb_mutex_t*  lock )
     LeaveCriticalSection( lock );
 }
 
+/* full memory barrier, for the few structures shared without a lock */
+#define  adb_memory_barrier()     MemoryBarrier()
+
 typedef struct { unsigned  tid; }  adb_thread_t;
 
 typedef  void*  (*adb_thread_func_t)(void*  arg);
@@ -289,6 +292,9 @@ typedef  pthread_mutex_t          adb_mutex_t;
 #define  adb_cond_signal          pthread_cond_signal
 #define  adb_cond_destroy         pthread_cond_destroy
 
+/* full memory barrier, for the few structures shared without a lock */
+#define  adb_memory_barrier()     __sync_synchronize()
+
 static __inline__ void  close_on_exec(int  fd)
 {
     fcntl( fd, F_SETFD, FD_CLOEXEC );
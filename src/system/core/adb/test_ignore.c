@@ -0,0 +1,87 @@
+/* a simple test program for the .adbignore matcher, build it with
+**   cc -o test_ignore test_ignore.c ignore.c
+** and it prints the cases that fail, exiting non-zero if there are any
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ignore.h"
+
+typedef struct {
+    const char *pattern;
+    const char *path;
+    int isdir;
+    int ignored;
+} testcase;
+
+static const testcase cases[] = {
+        /* without a '/', a pattern matches the name at any depth */
+    { "*.o",      "top.o",          0, 1 },
+    { "*.o",      "a/b/c.o",        0, 1 },
+    { "*.o",      "a/b/c.c",        0, 0 },
+    { "core",     "a/core",         0, 1 },
+    { "lib*",     "a/libfoo",       0, 1 },
+
+        /* a leading '/' anchors it at the top folder */
+    { "/*.o",     "top.o",          0, 1 },
+    { "/*.o",     "a/b/c.o",        0, 0 },
+    { "/*.o",     "a/c.o",          0, 0 },
+    { "/core",    "core",           0, 1 },
+    { "/core",    "a/core",         0, 0 },
+    { "/lib*",    "libfoo",         0, 1 },
+    { "/lib*",    "a/libfoo",       0, 0 },
+    { "/lib*",    "lib/foo",        0, 0 },
+
+        /* so does any other '/' */
+    { "lib/*.so", "lib/x.so",       0, 1 },
+    { "lib/*.so", "lib/x/y.so",     0, 0 },
+    { "lib/*.so", "a/lib/x.so",     0, 0 },
+    { "a/**/x",   "a/x",            0, 1 },
+    { "a/**/x",   "a/b/c/x",        0, 1 },
+    { "**/x",     "b/x",            0, 1 },
+
+        /* a trailing '/' only matches directories */
+    { "build/",   "build",          1, 1 },
+    { "build/",   "build",          0, 0 },
+    { "build/",   "a/build",        1, 1 },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned n;
+    int failed = 0;
+
+    for(n = 0; n < sizeof(cases) / sizeof(cases[0]); n++) {
+        const testcase *t = &cases[n];
+        ignorelist *l = ignore_new();
+        int r;
+
+        if(l == 0 || ignore_add(l, t->pattern)) {
+            fprintf(stderr, "cannot add pattern '%s'\n", t->pattern);
+            return 1;
+        }
+        r = ignore_match(l, t->path, t->isdir);
+        if(r != t->ignored) {
+            printf("FAIL: '%s' %s '%s'%s\n", t->pattern,
+                   t->ignored ? "should match" : "should not match",
+                   t->path, t->isdir ? " (dir)" : "");
+            failed++;
+        }
+        ignore_free(l);
+    }
+
+    {
+            /* the last pattern that matches decides */
+        ignorelist *l = ignore_new();
+        ignore_add(l, "*.o");
+        ignore_add(l, "!/keep.o");
+        if(ignore_match(l, "keep.o", 0) || !ignore_match(l, "a/keep.o", 0)) {
+            printf("FAIL: '!/keep.o' after '*.o'\n");
+            failed++;
+        }
+        ignore_free(l);
+    }
+
+    printf("%u cases, %d failed\n", n + 1, failed);
+    return failed ? 1 : 0;
+}
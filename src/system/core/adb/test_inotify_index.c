@@ -0,0 +1,208 @@
+/* a simple test program for the watch index of libinotifytools, build it with
+**   cc -I../include -I../libinotifytools -o test_inotify_index \
+**       test_inotify_index.c ../libinotifytools/redblack.c -lpthread
+**
+** "test_inotify_index" checks the hash tables and the path tree against a
+** plain table of names while watches are created, removed and renamed at
+** random, and exits non-zero on the first difference.
+** "test_inotify_index bench" times lookups and renames on 100k watches:
+** the root, two directories and 49999 subdirectories in each.
+**
+** No watches are added with the kernel: the index is filled directly.
+*/
+#define _GNU_SOURCE
+#include "../libinotifytools/inotifytools.c"
+
+#include <sys/time.h>
+
+#define MODEL_WDS   3000
+#define MODEL_OPS   20000
+
+static char *model[MODEL_WDS];     /* the name of each wd, or NULL */
+
+static double
+now( void )
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* short names from a small set, so that renames often hit other watches */
+static void
+random_path( char *out, int dir )
+{
+    static const char *comps[] = { "a", "ab", "b", "abc", "c" };
+    int depth = 1 + rand() % 4, i;
+
+    out[0] = 0;
+    if (rand() % 4) strcat(out, "/");
+    for (i = 0; i < depth; i++) {
+        strcat(out, comps[rand() % 5]);
+        if (i < depth - 1 || dir) strcat(out, "/");
+    }
+}
+
+static int
+model_check( inotifytools_ctx *c, int op )
+{
+    int wd, count = 0;
+
+    for (wd = 0; wd < MODEL_WDS; wd++) {
+        char *name = inotifytools_filename_from_wd_r(c, wd);
+        watch *w;
+
+        if ((name == 0) != (model[wd] == 0) ||
+            (name && strcmp(name, model[wd]))) {
+            printf("FAIL: op %d: wd %d is '%s', expected '%s'\n", op, wd,
+                   name ? name : "(none)", model[wd] ? model[wd] : "(none)");
+            return -1;
+        }
+        if (model[wd] == 0) continue;
+        count++;
+
+        w = watch_from_filename(c, model[wd]);
+        if (w == 0 || strcmp(w->filename, model[wd])) {
+            printf("FAIL: op %d: '%s' not found by name\n", op, model[wd]);
+            return -1;
+        }
+        if (w->node != node_lookup(c, model[wd], 0)) {
+            printf("FAIL: op %d: '%s' not on its path node\n", op, model[wd]);
+            return -1;
+        }
+    }
+    if (count != inotifytools_get_num_watches_r(c)) {
+        printf("FAIL: op %d: %d watches, expected %d\n", op,
+               inotifytools_get_num_watches_r(c), count);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+model_test( void )
+{
+    inotifytools_ctx *c = inotifytools_ctx_new();
+    char from[256], to[256];
+    int op, i;
+
+    srand(1);
+    for (op = 0; op < MODEL_OPS; op++) {
+        int kind = rand() % 10, wd = 1 + rand() % (MODEL_WDS - 1);
+
+        if (kind < 4) {
+                /* a wd handed out again is renamed in place */
+            random_path(from, rand() % 2);
+            create_watch(c, wd, from);
+            free(model[wd]);
+            model[wd] = strdup(from);
+        } else if (kind < 6) {
+            watch *w = watch_from_wd(c, wd);
+            if (w) {
+                unindex_watch(c, w);
+                destroy_watch(w);
+            }
+            free(model[wd]);
+            model[wd] = 0;
+        } else if (kind < 9) {
+            int len;
+
+            random_path(from, rand() % 2);
+            random_path(to, rand() % 2);
+                /* now and then a prefix that is not a whole component */
+            if (rand() % 3 == 0 && strlen(from) > 2)
+                from[strlen(from) - 2] = 0;
+            inotifytools_replace_filename_r(c, from, to);
+
+            len = strlen(from);
+            for (i = 0; i < MODEL_WDS; i++) {
+                char *name;
+                if (model[i] == 0 || strncmp(model[i], from, len)) continue;
+                if (asprintf(&name, "%s%s", to, model[i] + len) < 0) abort();
+                free(model[i]);
+                model[i] = name;
+            }
+        } else if (model[wd]) {
+            random_path(from, 1);
+            inotifytools_set_filename_by_wd_r(c, wd, from);
+            free(model[wd]);
+            model[wd] = strdup(from);
+        }
+
+        if (op % 1000 == 0 && model_check(c, op)) return 1;
+    }
+    if (model_check(c, op)) return 1;
+
+    ctx_close(c);
+    if (c->num_nodes) {
+        printf("FAIL: %u path nodes left after cleanup\n", c->num_nodes);
+        return 1;
+    }
+    inotifytools_ctx_free(c);
+    printf("%d operations, index matches\n", MODEL_OPS);
+    return 0;
+}
+
+static int
+bench( void )
+{
+    inotifytools_ctx *c = inotifytools_ctx_new();
+    char name[256], from[64], to[64];
+    double t0, t1;
+    long sum = 0;
+    int wd = 1, i, j, k;
+
+    t0 = now();
+    create_watch(c, wd++, "/w/");
+    for (i = 0; i < 2; i++) {
+        sprintf(name, "/w/d%d/", i);
+        create_watch(c, wd++, name);
+        for (j = 0; j < 49999; j++) {
+            sprintf(name, "/w/d%d/s%d/", i, j);
+            create_watch(c, wd++, name);
+        }
+    }
+    t1 = now();
+    printf("add %d watches       %.3fs\n", inotifytools_get_num_watches_r(c),
+           t1 - t0);
+
+    t0 = now();
+    for (k = 0; k < 1000000; k++)
+        sum += strlen(inotifytools_filename_from_wd_r(c, 1 + k % (wd - 1)));
+    printf("1M wd lookups          %.3fs\n", now() - t0);
+
+    t0 = now();
+    for (k = 0; k < 1000000; k++) {
+        sprintf(name, "/w/d1/s%d/", k % 49999);
+        sum += inotifytools_wd_from_filename_r(c, name);
+    }
+    printf("1M filename lookups    %.3fs\n", now() - t0);
+
+    t0 = now();
+    for (k = 0; k < 1000; k++) {
+        sprintf(from, "/w/d0/s%d/", k);
+        sprintf(to, "/w/d0/r%d/", k);
+        inotifytools_replace_filename_r(c, from, to);
+    }
+    printf("1000 leaf dir renames  %.3fs\n", now() - t0);
+
+    t0 = now();
+    inotifytools_replace_filename_r(c, "/w/d1/", "/w/moved/");
+    printf("rename 50k subtree     %.3fs\n", now() - t0);
+
+    if (inotifytools_wd_from_filename_r(c, "/w/moved/s77/") < 0 ||
+        inotifytools_wd_from_filename_r(c, "/w/d1/s77/") >= 0 ||
+        inotifytools_wd_from_filename_r(c, "/w/d0/r5/") < 0) {
+        printf("FAIL: renamed watches not where expected\n");
+        return 1;
+    }
+    inotifytools_ctx_free(c);
+    return sum < 0;
+}
+
+int main( int argc, char **argv )
+{
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench();
+    return model_test();
+}
@@ -0,0 +1,159 @@
+/* a simple test program that measures the CPU time the sync protocol takes
+** to push and pull a file, build it with
+**   cc -fcommon -DADB_HOST=1 -D_GNU_SOURCE -I../include \
+**       -include ../include/arch/linux-x86/AndroidConfig.h \
+**       -o test_sync_cpu test_sync_cpu.c file_sync_client.c \
+**       file_sync_service.c ignore.c ../libmincrypt/sha.c -lz -lpthread
+**
+**   test_sync_cpu <file> [runs]
+**
+** pushes <file> to <file>.pushed and pulls that back to <file>.pulled,
+** with the client and the device's sync service talking over a socket
+** pair in this process, and prints the CPU time of each per GB, the best
+** of runs (6 by default).  Use a large incompressible file, such as
+**   head -c 1G /dev/urandom > big
+** so that sync compression stays out of the way.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <zipfile/zipfile.h>
+
+#include "sysdeps.h"
+#include "adb.h"
+#include "adb_client.h"
+#include "file_sync_service.h"
+
+/* what the sync code needs from the rest of adb */
+int readx(int fd, void *ptr, size_t len)
+{
+    char *p = ptr;
+    int r;
+
+    while (len > 0) {
+        r = adb_read(fd, p, len);
+        if (r > 0) {
+            len -= r;
+            p += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int writex(int fd, const void *ptr, size_t len)
+{
+    const char *p = ptr;
+    int r;
+
+    while (len > 0) {
+        r = adb_write(fd, p, len);
+        if (r > 0) {
+            len -= r;
+            p += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+zipfile_t init_zipfile(const void *data, size_t size) { return 0; }
+zipentry_t lookup_zipentry(zipfile_t file, const char *name) { return 0; }
+void release_zipfile(zipfile_t file) { }
+
+static void *
+service_thread( void *fd )
+{
+    file_sync_service((int)(long) fd, 0);
+    return 0;
+}
+
+/* each "sync:" gets a service of its own on the far end of a socket pair */
+int adb_connect(const char *service)
+{
+    adb_thread_t t;
+    int s[2];
+
+    if (adb_socketpair(s))
+        return -1;
+    if (adb_thread_create(&t, service_thread, (void *)(long) s[1])) {
+        adb_close(s[0]);
+        adb_close(s[1]);
+        return -1;
+    }
+    return s[0];
+}
+
+int adb_connect_serial(const char *service, const char *serial)
+{
+    return adb_connect(service);
+}
+
+const char *adb_error(void)
+{
+    return strerror(errno);
+}
+
+static double
+cpu( void )
+{
+    struct rusage u;
+
+    getrusage(RUSAGE_SELF, &u);
+    return u.ru_utime.tv_sec + u.ru_stime.tv_sec +
+           (u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e6;
+}
+
+int main( int argc, char **argv )
+{
+    char pushed[PATH_MAX], pulled[PATH_MAX];
+    double push = 0, pull = 0, t, gb;
+    struct stat st;
+    int runs = 6, i;
+
+    if (argc < 2 || (argc > 2 && (runs = atoi(argv[2])) < 1)) {
+        fprintf(stderr, "usage: test_sync_cpu <file> [runs]\n");
+        return 2;
+    }
+    if (stat(argv[1], &st) || st.st_size == 0) {
+        fprintf(stderr, "cannot use '%s'\n", argv[1]);
+        return 1;
+    }
+    gb = st.st_size / 1073741824.0;
+    snprintf(pushed, sizeof pushed, "%s.pushed", argv[1]);
+    snprintf(pulled, sizeof pulled, "%s.pulled", argv[1]);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < runs; i++) {
+        t = cpu();
+        if (do_sync_push(argv[1], pushed, 0))
+            return 1;
+        t = cpu() - t;
+        if (i == 0 || t < push) push = t;
+
+        t = cpu();
+        if (do_sync_pull(pushed, pulled))
+            return 1;
+        t = cpu() - t;
+        if (i == 0 || t < pull) pull = t;
+
+        adb_unlink(pushed);
+        adb_unlink(pulled);
+    }
+    printf("cpu per GB, best of %d: push %.2fs, pull %.2fs\n", runs,
+           push / gb, pull / gb);
+    return 0;
+}
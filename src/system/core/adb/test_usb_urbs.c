@@ -0,0 +1,289 @@
+/* a simple test program that measures bulk throughput of usb_linux.c
+** against a stand-in for usbfs, build it with
+**   cc -DADB_HOST=1 -DHAVE_PTHREADS=1 -D_GNU_SOURCE -I../include \
+**       -o test_usb_urbs test_usb_urbs.c -lpthread
+**
+**   test_usb_urbs [-c cost_us] [megabytes]
+**
+** moves 24-byte headers and 64K payloads, the way remote_write() sends
+** packets, out of one handle and back in through it at the same time,
+** and prints the rate each way.
+**
+** ioctl() and poll() are swapped for ones that model a single bus: the
+** transfers queued are served in order at BUS_RATE bytes/s, each with a
+** fixed cost on top (125us by default), and the bus only idles when
+** nothing is queued.  To compare with another revision, build with
+** -DUSB_SRC='"old_usb_linux.c"' after
+**   git show <rev>:./usb_linux.c > old_usb_linux.c
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#define BUS_RATE    40e6
+#define BUS_FD      -1      /* the fd of the fake device */
+#define QMAX        64
+
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bus_reaped = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bus_queued = PTHREAD_COND_INITIALIZER;
+static struct usbdevfs_urb *pending[QMAX], *completed[QMAX];
+static int npending, ncompleted;
+static int level[2];        /* readable while completed is not empty */
+static double bus_free, bus_cost = 125e-6;
+
+static double
+now( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bus_complete( struct usbdevfs_urb *urb, int status )
+{
+    urb->status = status;
+    urb->actual_length = status ? 0 : urb->buffer_length;
+    completed[ncompleted++] = urb;
+    if (ncompleted == 1 && write(level[1], "x", 1) != 1)
+        abort();
+    pthread_cond_broadcast(&bus_reaped);
+}
+
+static struct usbdevfs_urb *
+bus_reap( void )
+{
+    struct usbdevfs_urb *urb = completed[0];
+    char c;
+
+    memmove(completed, completed + 1, --ncompleted * sizeof(*completed));
+    if (ncompleted == 0 && read(level[0], &c, 1) != 1)
+        abort();
+    return urb;
+}
+
+/* serves the first transfer queued, then the next */
+static void *
+bus_thread( void *unused )
+{
+    pthread_mutex_lock(&bus_lock);
+    for (;;) {
+        struct usbdevfs_urb *urb;
+        double start, end, wait;
+
+        while (npending == 0)
+            pthread_cond_wait(&bus_queued, &bus_lock);
+        urb = pending[0];
+        start = now();
+        if (bus_free > start) start = bus_free;
+        end = start + bus_cost + urb->buffer_length / BUS_RATE;
+        bus_free = end;
+
+        pthread_mutex_unlock(&bus_lock);
+        wait = end - now();
+        if (wait > 0) {
+            struct timespec ts;
+            ts.tv_sec = (time_t) wait;
+            ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+            nanosleep(&ts, 0);
+        }
+        pthread_mutex_lock(&bus_lock);
+
+            /* unless it was discarded in the meantime */
+        if (npending && pending[0] == urb) {
+            memmove(pending, pending + 1, --npending * sizeof(*pending));
+            bus_complete(urb, 0);
+        }
+    }
+    return 0;
+}
+
+static int
+fake_ioctl( int fd, unsigned long req, void *arg )
+{
+    int i, res = 0;
+
+    pthread_mutex_lock(&bus_lock);
+    switch (req) {
+    case USBDEVFS_SUBMITURB:
+        if (npending == QMAX) {
+            errno = ENOMEM;
+            res = -1;
+            break;
+        }
+        pending[npending++] = arg;
+        pthread_cond_signal(&bus_queued);
+        break;
+    case USBDEVFS_REAPURB:
+        while (ncompleted == 0)
+            pthread_cond_wait(&bus_reaped, &bus_lock);
+        *(struct usbdevfs_urb **) arg = bus_reap();
+        break;
+    case USBDEVFS_REAPURBNDELAY:
+        if (ncompleted) {
+            *(struct usbdevfs_urb **) arg = bus_reap();
+        } else {
+            errno = EAGAIN;
+            res = -1;
+        }
+        break;
+    case USBDEVFS_DISCARDURB:
+        for (i = 0; i < npending; i++) {
+            if (pending[i] == arg) break;
+        }
+        if (i == npending) {
+            errno = EINVAL;
+            res = -1;
+            break;
+        }
+        memmove(pending + i, pending + i + 1,
+                (npending - i - 1) * sizeof(*pending));
+        npending--;
+        bus_complete(arg, -ENOENT);
+        break;
+    default:
+        errno = ENOTTY;
+        res = -1;
+    }
+    pthread_mutex_unlock(&bus_lock);
+    return res;
+}
+
+/* usbfs reports POLLOUT while there are completed transfers to reap */
+static int
+fake_poll( struct pollfd *fds, nfds_t nfds, int timeout )
+{
+    struct pollfd real[8];
+    nfds_t i;
+    int res;
+
+    if (nfds > 8) abort();
+    for (i = 0; i < nfds; i++) {
+        real[i] = fds[i];
+        if (fds[i].fd == BUS_FD) {
+            real[i].fd = level[0];
+            real[i].events = POLLIN;
+        }
+    }
+    res = poll(real, nfds, timeout);
+    for (i = 0; i < nfds; i++) {
+        fds[i].revents = real[i].revents;
+        if (fds[i].fd == BUS_FD)
+            fds[i].revents = (real[i].revents & POLLIN) ? POLLOUT : 0;
+    }
+    return res;
+}
+
+#define ioctl(fd, req, arg)     fake_ioctl(fd, req, arg)
+#define poll(fds, nfds, t)      fake_poll(fds, nfds, t)
+#ifdef USB_SRC
+#include USB_SRC
+#else
+#include "usb_linux.c"
+#endif
+#undef ioctl
+#undef poll
+
+/* what usb_linux.c needs from the rest of adb */
+int adb_trace_mask;
+void fatal_errno(const char *fmt, ...) { abort(); }
+int is_adb_interface(int vid, int pid, int usb_class, int usb_subclass,
+                     int usb_protocol) { return 0; }
+void register_usb_transport(usb_handle *usb, const char *serial,
+                            unsigned writeable) { }
+void unregister_usb_transport(usb_handle *usb) { }
+void forget_usb_transport(usb_handle *usb) { }
+void usb_scan_complete(void) { }
+
+#define HEADER      24
+#define PAYLOAD     65536
+
+static usb_handle *handle;
+static long packets;
+static volatile double read_time;
+
+static void *
+reader( void *unused )
+{
+    static char buf[PAYLOAD];
+    double t0 = now();
+    long i;
+
+    for (i = 0; i < packets; i++) {
+        if (usb_read(handle, buf, HEADER) || usb_read(handle, buf, PAYLOAD)) {
+            fprintf(stderr, "read %ld failed\n", i);
+            exit(1);
+        }
+    }
+    read_time = now() - t0;
+
+        /* before the transfers were queued, a write only completed while
+        ** some reader was waiting in USBDEVFS_REAPURB, so keep one there
+        */
+    for (;;)
+        usb_read(handle, buf, HEADER);
+    return 0;
+}
+
+int main( int argc, char **argv )
+{
+    static char buf[PAYLOAD];
+    pthread_t bus, rd;
+    double t0, write_time;
+    long megs = 64, i;
+
+    argc--;
+    argv++;
+    if (argc > 1 && !strcmp(argv[0], "-c")) {
+        bus_cost = atof(argv[1]) / 1e6;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 0)
+        megs = atol(argv[0]);
+    if (megs < 1 || bus_cost < 0) {
+        fprintf(stderr, "usage: test_usb_urbs [-c cost_us] [megabytes]\n");
+        return 2;
+    }
+    packets = megs * 1048576 / PAYLOAD;
+
+    if (pipe(level) || pthread_create(&bus, 0, bus_thread, 0)) {
+        fprintf(stderr, "cannot start the bus: %s\n", strerror(errno));
+        return 1;
+    }
+
+    handle = calloc(1, sizeof(*handle));
+    strcpy(handle->fname, "fake");
+    handle->desc = BUS_FD;
+    handle->ep_in = 0x81;
+    handle->ep_out = 0x02;
+    handle->writeable = 1;
+    adb_cond_init(&handle->notify, 0);
+    adb_mutex_init(&handle->lock, 0);
+
+    pthread_create(&rd, 0, reader, 0);
+    t0 = now();
+    for (i = 0; i < packets; i++) {
+        if (usb_write(handle, buf, HEADER) || usb_write(handle, buf, PAYLOAD)) {
+            fprintf(stderr, "write %ld failed\n", i);
+            return 1;
+        }
+    }
+    write_time = now() - t0;
+    while (read_time == 0)
+        usleep(1000);
+
+    printf("%ldMB, %.0fus per transfer: write %.1f MB/s, read %.1f MB/s "
+           "(bus %.0f MB/s, shared)\n", megs, bus_cost * 1e6,
+           megs * 1048576 / write_time / 1e6,
+           megs * 1048576 / read_time / 1e6, BUS_RATE / 1e6);
+    return 0;
+}
@@ -87,29 +87,13 @@ run_transport_disconnects(atransport*  t)
     }
 }
 
-static int
-read_packet(int  fd, apacket** ppacket)
-{
-    char *p = (char*)ppacket;  /* really read a packet address */
-    int   r;
-    int   len = sizeof(*ppacket);
-    while(len > 0) {
-        r = adb_read(fd, p, len);
-        if(r > 0) {
-            len -= r;
-            p   += r;
-        } else {
-            D("read_packet: %d error %d %d\n", fd, r, errno);
-            if((r < 0) && (errno == EINTR)) continue;
-            return -1;
-        }
-    }
-
 #if ADB_TRACE
+static void trace_packet(const char *label, packet_ring *r, apacket *p)
+{
     if (ADB_TRACING)
     {
-        unsigned  command = (*ppacket)->msg.command;
-        int       len     = (*ppacket)->msg.data_length;
+        unsigned  command = p->msg.command;
+        int       len     = p->msg.data_length;
         char      cmd[5];
         int       n;
 
@@ -122,65 +106,172 @@ read_packet(int  fd, apacket** ppacket)
         }
         cmd[4] = 0;
 
-        D("read_packet: %d ok: [%08x %s] %08x %08x (%d) ",
-          fd, command, cmd, (*ppacket)->msg.arg0, (*ppacket)->msg.arg1, len);
-        dump_hex((*ppacket)->data, len);
+        D("%s: %p [%08x %s] %08x %08x (%d) ",
+          label, r, command, cmd, p->msg.arg0, p->msg.arg1, len);
+        dump_hex(p->data, len);
     }
+}
+#else
+#define trace_packet(label, r, p) do { } while(0)
 #endif
+
+/* Packets go between the transport threads and the main loop through
+** packet rings rather than by writing their addresses down a socketpair,
+** so a busy transport costs no system calls per packet: the socketpair is
+** only written to when the other side has said it is going to sleep, and
+** it is drained a whole burst at a time.  Both sides set their flag before
+** looking at the ring one last time, and the other side moves head or tail
+** before looking at the flag, with a full barrier in between, so one of
+** the two always sees the other.
+*/
+static int ring_init(packet_ring *r)
+{
+    int s[2];
+
+    if(adb_socketpair(s)) {
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->producer_fd = s[1];
+    r->consumer_fd = s[0];
+    r->consumer_sleeping = 1;
     return 0;
 }
 
-static int
-write_packet(int  fd, apacket** ppacket)
+static void ring_kick(int fd)
 {
-    char *p = (char*) ppacket;  /* we really write the packet address */
-    int r, len = sizeof(ppacket);
-
-#if ADB_TRACE
-    if (ADB_TRACING)
-    {
-        unsigned  command = (*ppacket)->msg.command;
-        int       len     = (*ppacket)->msg.data_length;
-        char      cmd[5];
-        int       n;
+    char c = 1;
 
-        for (n = 0; n < 4; n++) {
-            int  b = (command >> (n*8)) & 255;
-            if (b >= 32 && b < 127)
-                cmd[n] = (char)b;
-            else
-                cmd[n] = '.';
+    while(adb_write(fd, &c, 1) < 0) {
+        if(errno != EINTR) {
+            D("ring_kick: %d error %d\n", fd, errno);
+            return;
         }
-        cmd[4] = 0;
+    }
+}
 
-        D("write_packet: %d [%08x %s] %08x %08x (%d) ",
-          fd, command, cmd, (*ppacket)->msg.arg0, (*ppacket)->msg.arg1, len);
-        dump_hex((*ppacket)->data, len);
+/* blocks until the other side kicks us, and swallows any wakeups that
+** piled up meanwhile: they are only ever a hint to look at the ring again
+*/
+static int ring_wait(int fd)
+{
+    char buf[64];
+    int r;
+
+    for(;;) {
+        r = adb_read(fd, buf, sizeof(buf));
+        if(r > 0) return 0;
+        if((r < 0) && (errno == EINTR)) continue;
+        D("ring_wait: %d error %d %d\n", fd, r, errno);
+        return -1;
     }
-#endif
-    len = sizeof(ppacket);
-    while(len > 0) {
-        r = adb_write(fd, p, len);
-        if(r > 0) {
-            len -= r;
-            p += r;
-        } else {
-            D("write_packet: %d error %d %d\n", fd, r, errno);
-            if((r < 0) && (errno == EINTR)) continue;
-            return -1;
+}
+
+static int ring_full(packet_ring *r)
+{
+    return r->head - r->tail >= PACKET_RING_SIZE;
+}
+
+static int ring_empty(packet_ring *r)
+{
+    return r->head == r->tail;
+}
+
+static int ring_put(packet_ring *r, apacket *p)
+{
+    while(ring_full(r)) {
+        if(r->closed) return -1;
+        r->producer_waiting = 1;
+        adb_memory_barrier();
+        if(!ring_full(r)) {
+            r->producer_waiting = 0;
+            break;
         }
+        if(r->closed || ring_wait(r->producer_fd)) return -1;
+    }
+    if(r->closed) return -1;
+
+    trace_packet("ring_put", r, p);
+    r->slot[r->head % PACKET_RING_SIZE] = p;
+    adb_memory_barrier();
+    r->head++;
+
+    adb_memory_barrier();
+    if(r->consumer_sleeping) {
+        r->consumer_sleeping = 0;
+        ring_kick(r->producer_fd);
     }
     return 0;
 }
 
+static apacket *ring_get(packet_ring *r)
+{
+    apacket *p;
+
+    if(ring_empty(r)) return NULL;
+
+    adb_memory_barrier();
+    p = r->slot[r->tail % PACKET_RING_SIZE];
+    adb_memory_barrier();
+    r->tail++;
+
+    adb_memory_barrier();
+    if(r->producer_waiting) {
+        r->producer_waiting = 0;
+        ring_kick(r->consumer_fd);
+    }
+    trace_packet("ring_get", r, p);
+    return p;
+}
+
+/* returns 0 if the consumer may go to sleep, -1 if packets came in */
+static int ring_sleep(packet_ring *r)
+{
+    r->consumer_sleeping = 1;
+    adb_memory_barrier();
+    if(!ring_empty(r)) {
+        r->consumer_sleeping = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* frees whatever is left once both threads are gone */
+static void ring_drain(packet_ring *r)
+{
+    while(!ring_empty(r)) {
+        put_apacket(r->slot[r->tail % PACKET_RING_SIZE]);
+        r->tail++;
+    }
+}
+
 static void transport_socket_events(int fd, unsigned events, void *_t)
 {
+    atransport *t = _t;
+    packet_ring *r = &t->from_remote;
+    apacket *p;
+    char buf[64];
+    int n;
+
     if(events & FDE_READ){
-        apacket *p = 0;
-        if(read_packet(fd, &p)){
-            D("failed to read packet from transport socket on fd %d\n", fd);
-        } else {
-            handle_packet(p, (atransport *) _t);
+        if(adb_read(fd, buf, sizeof(buf)) <= 0) {
+            D("failed to read wakeup from transport socket on fd %d\n", fd);
+            return;
+        }
+        for(;;) {
+                /* don't starve the other fds: after a full ring's worth,
+                ** come back through the event loop
+                */
+            for(n = 0; n < PACKET_RING_SIZE; n++) {
+                p = ring_get(r);
+                if(p == NULL) break;
+                handle_packet(p, t);
+            }
+            if(n == PACKET_RING_SIZE) {
+                ring_kick(r->producer_fd);
+                return;
+            }
+            if(ring_sleep(r) == 0) return;
         }
     }
 }
@@ -208,8 +299,9 @@ void send_packet(apacket *p, atransport *t)
         D("Transport is null \n");
     }
 
-    if(write_packet(t->transport_socket, &p)){
-        fatal_errno("cannot enqueue packet on transport socket");
+    if(ring_put(&t->to_remote, p)){
+        D("send_packet: transport %p is going away, dropping packet\n", t);
+        put_apacket(p);
     }
 }
 
@@ -231,7 +323,7 @@ static void *output_thread(void *_t)
     atransport *t = _t;
     apacket *p;
 
-    D("from_remote: starting thread for transport %p, on fd %d\n", t, t->fd );
+    D("from_remote: starting thread for transport %p\n", t);
 
     D("from_remote: transport %p SYNC online (%d)\n", t, t->sync_token + 1);
     p = get_apacket();
@@ -239,7 +331,7 @@ static void *output_thread(void *_t)
     p->msg.arg0 = 1;
     p->msg.arg1 = ++(t->sync_token);
     p->msg.magic = A_SYNC ^ 0xffffffff;
-    if(write_packet(t->fd, &p)) {
+    if(ring_put(&t->from_remote, p)) {
         put_apacket(p);
         D("from_remote: failed to write SYNC apacket to transport %p", t);
         goto oops;
@@ -252,7 +344,7 @@ static void *output_thread(void *_t)
         if(t->read_from_remote(p, t) == 0){
             D("from_remote: received remote packet, sending to transport %p\n",
               t);
-            if(write_packet(t->fd, &p)){
+            if(ring_put(&t->from_remote, p)){
                 put_apacket(p);
                 D("from_remote: failed to write apacket to transport %p", t);
                 goto oops;
@@ -270,7 +362,7 @@ static void *output_thread(void *_t)
     p->msg.arg0 = 0;
     p->msg.arg1 = 0;
     p->msg.magic = A_SYNC ^ 0xffffffff;
-    if(write_packet(t->fd, &p)) {
+    if(ring_put(&t->from_remote, p)) {
         put_apacket(p);
         D("from_remote: failed to write SYNC apacket to transport %p", t);
     }
@@ -288,14 +380,17 @@ static void *input_thread(void *_t)
     apacket *p;
     int active = 0;
 
-    D("to_remote: starting input_thread for %p, reading from fd %d\n",
-       t, t->fd);
+    D("to_remote: starting input_thread for %p\n", t);
 
     for(;;){
-        if(read_packet(t->fd, &p)) {
-            D("to_remote: failed to read apacket from transport %p on fd %d\n", 
-               t, t->fd );
-            break;
+        p = ring_get(&t->to_remote);
+        if(p == NULL) {
+            if(ring_sleep(&t->to_remote)) continue;
+            if(ring_wait(t->to_remote.consumer_fd)) {
+                D("to_remote: failed to wait for apacket on transport %p\n", t);
+                break;
+            }
+            continue;
         }
         if(p->msg.command == A_SYNC){
             if(p->msg.arg0 == 0) {
@@ -327,7 +422,12 @@ static void *input_thread(void *_t)
     // while a client socket is still active.
     close_all_sockets(t);
 
-    D("to_remote: thread is exiting for transport %p, fd %d\n", t, t->fd);
+        /* a main loop blocked on a full ring has to find out as well */
+    t->to_remote.closed = 1;
+    adb_memory_barrier();
+    ring_kick(t->to_remote.consumer_fd);
+
+    D("to_remote: thread is exiting for transport %p\n", t);
     kick_transport(t);
     transport_unref(t);
     return 0;
@@ -417,6 +517,7 @@ device_tracker_send( device_tracker*  tracker,
     apacket*  p = get_apacket();
     asocket*  peer = tracker->socket.peer;
 
+    apacket_reserve(p, len);
     memcpy(p->data, buffer, len);
     p->len = len;
     return peer->enqueue( peer, p );
@@ -463,6 +564,8 @@ create_device_tracker(void)
 }
 
 
+static void check_ready(void);
+
 /* call this function each time the transport list has changed */
 void  update_transports(void)
 {
@@ -470,6 +573,8 @@ void  update_transports(void)
     int              len;
     device_tracker*  tracker;
 
+    check_ready();
+
     len = list_transports_msg(buffer, sizeof(buffer));
 
     tracker = device_tracker_list;
@@ -492,8 +597,43 @@ struct tmsg
 {
     atransport *transport;
     int         action;
+    usb_handle *usb;        /* for FORGET_USB */
 };
 
+/* actions of a tmsg without a transport */
+#define READY_USB_SCANNED  1
+#define READY_TIMED_OUT    2
+#define FORGET_USB         3
+
+static void (*ready_func)(void);
+static int usb_scanned;
+static int ready_timed_out;
+
+/* runs in the main loop, whenever the transports change */
+static void check_ready(void)
+{
+    void (*func)(void) = ready_func;
+    atransport *t;
+    int connecting = 0;
+
+    if(func == NULL) return;
+
+    if(!ready_timed_out) {
+        if(!usb_scanned) return;
+
+        adb_mutex_lock(&transport_lock);
+        for(t = transport_list.next; t != &transport_list; t = t->next) {
+            if(t->connection_state == CS_OFFLINE) connecting++;
+        }
+        adb_mutex_unlock(&transport_lock);
+        if(connecting) return;
+    }
+
+    D("transport: server ready%s\n", ready_timed_out ? " (timed out)" : "");
+    ready_func = NULL;
+    func();
+}
+
 static int
 transport_read_action(int  fd, struct tmsg*  m)
 {
@@ -538,12 +678,42 @@ transport_write_action(int  fd, struct tmsg*  m)
     return 0;
 }
 
+/* runs in the main loop, so after the registration of usb's transport,
+** if that was still on its way when the device was forgotten
+*/
+static void forget_usb(usb_handle *usb)
+{
+    atransport *t;
+
+    adb_mutex_lock(&transport_lock);
+    for(t = transport_list.next; t != &transport_list; t = t->next) {
+        if (t->usb == usb && t->connection_state == CS_NOPERM) {
+            t->next->prev = t->prev;
+            t->prev->next = t->next;
+            break;
+        }
+    }
+    adb_mutex_unlock(&transport_lock);
+
+    if(t != &transport_list) {
+        D("transport: %p forgetting usb_handle %p\n", t, usb);
+            /* no threads were started for it, nor fds opened */
+        run_transport_disconnects(t);
+        if (t->product)
+            free(t->product);
+        if (t->serial)
+            free(t->serial);
+        free(t);
+        update_transports();
+    }
+    usb_close(usb);
+}
+
 static void transport_registration_func(int _fd, unsigned ev, void *data)
 {
     tmsg m;
     adb_thread_t output_thread_ptr;
     adb_thread_t input_thread_ptr;
-    int s[2];
     atransport *t;
 
     if(!(ev & FDE_READ)) {
@@ -556,6 +726,17 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
 
     t = m.transport;
 
+    if(t == NULL) {
+        if(m.action == FORGET_USB) {
+            forget_usb(m.usb);
+            return;
+        }
+        if(m.action == READY_USB_SCANNED) usb_scanned = 1;
+        if(m.action == READY_TIMED_OUT) ready_timed_out = 1;
+        check_ready();
+        return;
+    }
+
     if(m.action == 0){
         D("transport: %p removing and free'ing %d\n", t, t->transport_socket);
 
@@ -565,6 +746,12 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
         fdevent_remove(&(t->transport_fde));
         adb_close(t->fd);
 
+            /* both threads are gone, so nobody else touches the rings */
+        ring_drain(&t->from_remote);
+        ring_drain(&t->to_remote);
+        adb_close(t->to_remote.producer_fd);
+        adb_close(t->to_remote.consumer_fd);
+
         adb_mutex_lock(&transport_lock);
         t->next->prev = t->prev;
         t->prev->next = t->next;
@@ -589,14 +776,14 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
         /* initial references are the two threads */
         t->ref_count = 2;
 
-        if(adb_socketpair(s)) {
+        if(ring_init(&t->from_remote) || ring_init(&t->to_remote)) {
             fatal_errno("cannot open transport socketpair");
         }
 
-        D("transport: %p (%d,%d) starting\n", t, s[0], s[1]);
+        t->transport_socket = t->from_remote.consumer_fd;
+        t->fd = t->from_remote.producer_fd;
 
-        t->transport_socket = s[0];
-        t->fd = s[1];
+        D("transport: %p (%d,%d) starting\n", t, t->transport_socket, t->fd);
 
         D("transport: %p install %d\n", t, t->transport_socket );
         fdevent_install(&(t->transport_fde),
@@ -653,6 +840,7 @@ static void register_transport(atransport *transport)
     tmsg m;
     m.transport = transport;
     m.action = 1;
+    m.usb = NULL;
     D("transport: %p registered\n", transport);
     if(transport_write_action(transport_registration_send, &m)) {
         fatal_errno("cannot write transport registration socket\n");
@@ -664,12 +852,52 @@ static void remove_transport(atransport *transport)
     tmsg m;
     m.transport = transport;
     m.action = 0;
+    m.usb = NULL;
     D("transport: %p removed\n", transport);
     if(transport_write_action(transport_registration_send, &m)) {
         fatal_errno("cannot write transport registration socket\n");
     }
 }
 
+/* Readiness goes through the registration socket as well, as a message
+** without a transport: the usb scan's own registrations are then always
+** handled before its completion is.
+*/
+static void post_ready_action(int action)
+{
+    tmsg m;
+    m.transport = NULL;
+    m.action = action;
+    m.usb = NULL;
+    if(transport_write_action(transport_registration_send, &m)) {
+        fatal_errno("cannot write transport registration socket\n");
+    }
+}
+
+void usb_scan_complete(void)
+{
+    D("transport: usb scan complete\n");
+    post_ready_action(READY_USB_SCANNED);
+}
+
+static void *ready_timeout_thread(void *unused)
+{
+    adb_sleep_ms(ADB_READY_TIMEOUT);
+    post_ready_action(READY_TIMED_OUT);
+    return 0;
+}
+
+void notify_when_ready(void (*func)(void))
+{
+    adb_thread_t tid;
+
+    ready_func = func;
+    if(adb_thread_create(&tid, ready_timeout_thread, NULL)) {
+        ready_timed_out = 1;
+    }
+    check_ready();
+}
+
 
 static void transport_unref(atransport *t)
 {
@@ -923,6 +1151,22 @@ void unregister_usb_transport(usb_handle *usb)
     adb_mutex_unlock(&transport_lock);
 }
 
+/* Like unregister_usb_transport(), but ordered after the registration of
+** usb's transport like any other registration message, and usb is then
+** closed with usb_close().
+*/
+void forget_usb_transport(usb_handle *usb)
+{
+    tmsg m;
+    m.transport = NULL;
+    m.action = FORGET_USB;
+    m.usb = usb;
+    D("transport: forgetting usb_handle %p\n", usb);
+    if(transport_write_action(transport_registration_send, &m)) {
+        fatal_errno("cannot write transport registration socket\n");
+    }
+}
+
 #undef TRACE_TAG
 #define TRACE_TAG  TRACE_RWX
 
@@ -978,18 +1222,41 @@ int writex(int fd, const void *ptr, size_t len)
     return 0;
 }
 
-int check_header(apacket *p)
+/* both sides settle on the smaller of the two sizes, so a 1.0 peer keeps
+** getting MAX_PAYLOAD_V1 packets.  every peer takes those, so nothing
+** smaller is believed
+*/
+unsigned negotiated_payload(unsigned peer)
 {
+    if(peer > MAX_PAYLOAD) return MAX_PAYLOAD;
+    if(peer < MAX_PAYLOAD_V1) return MAX_PAYLOAD_V1;
+    return peer;
+}
+
+/* called by the input thread.  A CNXN may carry up to MAX_PAYLOAD and
+** settles the size of what follows; before the first one the size is
+** not known yet, so MAX_PAYLOAD is let through as well
+*/
+int check_header(apacket *p, atransport *t)
+{
+    unsigned max = t->read_max_payload ? t->read_max_payload : MAX_PAYLOAD;
+
     if(p->msg.magic != (p->msg.command ^ 0xffffffff)) {
         D("check_header(): invalid magic\n");
         return -1;
     }
 
-    if(p->msg.data_length > MAX_PAYLOAD) {
-        D("check_header(): %d > MAX_PAYLOAD\n", p->msg.data_length);
+    if(p->msg.command == A_CNXN) {
+        max = MAX_PAYLOAD;
+    }
+    if(p->msg.data_length > max) {
+        D("check_header(): %d > %d\n", p->msg.data_length, max);
         return -1;
     }
 
+    if(p->msg.command == A_CNXN) {
+        t->read_max_payload = negotiated_payload(p->msg.arg1);
+    }
     return 0;
 }
 
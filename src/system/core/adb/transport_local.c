@@ -65,11 +65,12 @@ static int remote_read(apacket *p, atransport *t)
     D("read remote packet: %04x arg0=%0x arg1=%0x data_length=%0x data_check=%0x magic=%0x\n",
       p->msg.command, p->msg.arg0, p->msg.arg1, p->msg.data_length, p->msg.data_check, p->msg.magic);
 #endif
-    if(check_header(p)) {
+    if(check_header(p, t)) {
         D("bad header: terminated (data)\n");
         return -1;
     }
 
+    apacket_reserve(p, p->msg.data_length);
     if(readx(t->sfd, p->data, p->msg.data_length)){
         D("remote local: terminated (data)\n");
         return -1;
@@ -86,14 +87,22 @@ static int remote_read(apacket *p, atransport *t)
 static int remote_write(apacket *p, atransport *t)
 {
     int   length = p->msg.data_length;
+    amessage *hdr = (amessage*) (p->data - sizeof(amessage));
 
     fix_endians(p);
 
+        /* send header and payload in one go; for the inline
+        ** payload the header already sits right in front of it
+        */
+    if(hdr != &p->msg) {
+        memcpy(hdr, &p->msg, sizeof(amessage));
+    }
+
 #if 0 && defined __ppc__
     D("write remote packet: %04x arg0=%0x arg1=%0x data_length=%0x data_check=%0x magic=%0x\n",
       p->msg.command, p->msg.arg0, p->msg.arg1, p->msg.data_length, p->msg.data_check, p->msg.magic);
 #endif
-    if(writex(t->sfd, &p->msg, sizeof(amessage) + length)) {
+    if(writex(t->sfd, hdr, sizeof(amessage) + length)) {
         D("remote local: write terminated\n");
         return -1;
     }
@@ -239,6 +248,8 @@ int init_socket_transport(atransport *t, int s, int port, int local)
     t->sync_token = 1;
     t->connection_state = CS_OFFLINE;
     t->type = kTransportLocal;
+    t->max_payload = MAX_PAYLOAD_V1;
+    t->window = 1;
 
 #if ADB_HOST
     if (HOST && local) {
@@ -60,12 +60,13 @@ static int remote_read(apacket *p, atransport *t)
 
     fix_endians(p);
 
-    if(check_header(p)) {
+    if(check_header(p, t)) {
         D("remote usb: check_header failed\n");
         return -1;
     }
 
     if(p->msg.data_length) {
+        apacket_reserve(p, p->msg.data_length);
         if(usb_read(t->usb, p->data, p->msg.data_length)){
             D("remote usb: terminated (data)\n");
             return -1;
@@ -91,7 +92,7 @@ static int remote_write(apacket *p, atransport *t)
         return -1;
     }
     if(p->msg.data_length == 0) return 0;
-    if(usb_write(t->usb, &p->data, size)) {
+    if(usb_write(t->usb, p->data, size)) {
         D("remote usb: 2 - write terminated\n");
         return -1;
     }
@@ -120,6 +121,8 @@ void init_usb_transport(atransport *t, usb_handle *h, int state)
     t->sync_token = 1;
     t->connection_state = state;
     t->type = kTransportUsb;
+    t->max_payload = MAX_PAYLOAD_V1;
+    t->window = 1;
     t->usb = h;
 
 #if ADB_HOST
@@ -646,6 +646,7 @@ usb_init()
 
 	/* initial device scan */
 	scan_usb_devices();
+	usb_scan_complete();
 	
 	/* starting USB event polling thread */
     if (adb_thread_create(&tid, device_poll_thread, NULL)) {
@@ -26,6 +26,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <poll.h>
+#include <sys/inotify.h>
 
 #include <linux/usbdevice_fs.h>
 #include <linux/version.h>
@@ -47,6 +49,23 @@
 
 static adb_mutex_t usb_lock = ADB_MUTEX_INITIALIZER;
 
+/* Bulk transfers are queued: each handle keeps USB_READ_URBS reads and up
+** to USB_WRITE_URBS writes in flight, so the bus never idles between one
+** transfer and the next, and a single reaper thread per handle collects
+** all of them.
+*/
+#define USB_URB_SIZE    (16*1024)
+#define USB_READ_URBS   4
+#define USB_WRITE_URBS  4
+
+struct usb_xfer
+{
+    struct usbdevfs_urb urb;    /* must come first, the reaper casts back */
+    int busy;                   /* submitted and not reaped yet */
+    int offset;                 /* bytes of a read already handed out */
+    unsigned char buf[USB_URB_SIZE];
+};
+
 struct usb_handle
 {
     usb_handle *prev;
@@ -60,11 +79,18 @@ struct usb_handle
     unsigned zero_mask;
     unsigned writeable;
 
-    struct usbdevfs_urb urb_in;
-    struct usbdevfs_urb urb_out;
-
-    int urb_in_busy;
-    int urb_out_busy;
+        /* both rings are used in submission order, which is also the
+        ** order the kernel completes transfers on one endpoint in
+        */
+    struct usb_xfer xfer_in[USB_READ_URBS];
+    struct usb_xfer xfer_out[USB_WRITE_URBS];
+    unsigned in_next;
+    unsigned out_next;
+    int out_error;
+
+    int started;
+    int reaper_done;
+    int wake[2];
     int dead;
 
     adb_cond_t notify;
@@ -72,9 +98,6 @@ struct usb_handle
 
     // for garbage collecting disconnected devices
     int mark;
-
-    // ID of thread currently in REAPURB
-    pthread_t reaper_thread;
 };
 
 static usb_handle handle_list = {
@@ -127,156 +150,176 @@ static inline int badname(const char *name)
     return 0;
 }
 
-static void find_usb_device(const char *base,
+static void find_usb_interface(const char *devname,
         void (*register_device_callback)
                 (const char *, unsigned char, unsigned char, int, int, unsigned))
 {
-    char busname[32], devname[32];
     unsigned char local_ep_in, local_ep_out;
-    DIR *busdir , *devdir ;
-    struct dirent *de;
     int fd ;
+    unsigned char devdesc[256];
+    unsigned char* bufptr = devdesc;
+    unsigned char* bufend;
+    struct usb_device_descriptor* device;
+    struct usb_config_descriptor* config;
+    struct usb_interface_descriptor* interface;
+    struct usb_endpoint_descriptor *ep1, *ep2;
+    unsigned zero_mask = 0;
+    unsigned vid, pid;
+    size_t desclength;
+
+//    DBGX("[ scanning %s ]\n", devname);
+    if((fd = unix_open(devname, O_RDONLY)) < 0) {
+        return;
+    }
 
-    busdir = opendir(base);
-    if(busdir == 0) return;
+    desclength = adb_read(fd, devdesc, sizeof(devdesc));
+    bufend = bufptr + desclength;
 
-    while((de = readdir(busdir)) != 0) {
-        if(badname(de->d_name)) continue;
+        // should have device and configuration descriptors, and atleast two endpoints
+    if (desclength < USB_DT_DEVICE_SIZE + USB_DT_CONFIG_SIZE) {
+        D("desclength %d is too small\n", desclength);
+        adb_close(fd);
+        return;
+    }
 
-        snprintf(busname, sizeof busname, "%s/%s", base, de->d_name);
-        devdir = opendir(busname);
-        if(devdir == 0) continue;
-
-//        DBGX("[ scanning %s ]\n", busname);
-        while((de = readdir(devdir))) {
-            unsigned char devdesc[256];
-            unsigned char* bufptr = devdesc;
-            unsigned char* bufend;
-            struct usb_device_descriptor* device;
-            struct usb_config_descriptor* config;
-            struct usb_interface_descriptor* interface;
-            struct usb_endpoint_descriptor *ep1, *ep2;
-            unsigned zero_mask = 0;
-            unsigned vid, pid;
-            size_t desclength;
+    device = (struct usb_device_descriptor*)bufptr;
+    bufptr += USB_DT_DEVICE_SIZE;
 
-            if(badname(de->d_name)) continue;
-            snprintf(devname, sizeof devname, "%s/%s", busname, de->d_name);
+    if((device->bLength != USB_DT_DEVICE_SIZE) || (device->bDescriptorType != USB_DT_DEVICE)) {
+        adb_close(fd);
+        return;
+    }
 
-            if(known_device(devname)) {
-                DBGX("skipping %s\n", devname);
-                continue;
-            }
+    vid = __le16_to_cpu(device->idVendor);
+    pid = __le16_to_cpu(device->idProduct);
+    pid = devdesc[10] | (devdesc[11] << 8);
+    DBGX("[ %s is V:%04x P:%04x ]\n", devname, vid, pid);
+
+        // should have config descriptor next
+    config = (struct usb_config_descriptor *)bufptr;
+    bufptr += USB_DT_CONFIG_SIZE;
+    if (config->bLength != USB_DT_CONFIG_SIZE || config->bDescriptorType != USB_DT_CONFIG) {
+        D("usb_config_descriptor not found\n");
+        adb_close(fd);
+        return;
+    }
 
-//            DBGX("[ scanning %s ]\n", devname);
-            if((fd = unix_open(devname, O_RDONLY)) < 0) {
-                continue;
-            }
+        // loop through all the descriptors and look for the ADB interface
+    while (bufptr < bufend) {
+        unsigned char length = bufptr[0];
+        unsigned char type = bufptr[1];
 
-            desclength = adb_read(fd, devdesc, sizeof(devdesc));
-            bufend = bufptr + desclength;
+        if (type == USB_DT_INTERFACE) {
+            interface = (struct usb_interface_descriptor *)bufptr;
+            bufptr += length;
 
-                // should have device and configuration descriptors, and atleast two endpoints
-            if (desclength < USB_DT_DEVICE_SIZE + USB_DT_CONFIG_SIZE) {
-                D("desclength %d is too small\n", desclength);
-                adb_close(fd);
-                continue;
+            if (length != USB_DT_INTERFACE_SIZE) {
+                D("interface descriptor has wrong size\n");
+                break;
             }
 
-            device = (struct usb_device_descriptor*)bufptr;
-            bufptr += USB_DT_DEVICE_SIZE;
-
-            if((device->bLength != USB_DT_DEVICE_SIZE) || (device->bDescriptorType != USB_DT_DEVICE)) {
-                adb_close(fd);
-                continue;
-            }
+            DBGX("bInterfaceClass: %d,  bInterfaceSubClass: %d,"
+                 "bInterfaceProtocol: %d, bNumEndpoints: %d\n",
+                 interface->bInterfaceClass, interface->bInterfaceSubClass,
+                 interface->bInterfaceProtocol, interface->bNumEndpoints);
+
+            if (interface->bNumEndpoints == 2 &&
+                    is_adb_interface(vid, pid, interface->bInterfaceClass,
+                    interface->bInterfaceSubClass, interface->bInterfaceProtocol))  {
+
+                DBGX("looking for bulk endpoints\n");
+                    // looks like ADB...
+                ep1 = (struct usb_endpoint_descriptor *)bufptr;
+                bufptr += USB_DT_ENDPOINT_SIZE;
+                ep2 = (struct usb_endpoint_descriptor *)bufptr;
+                bufptr += USB_DT_ENDPOINT_SIZE;
+
+                if (bufptr > devdesc + desclength ||
+                    ep1->bLength != USB_DT_ENDPOINT_SIZE ||
+                    ep1->bDescriptorType != USB_DT_ENDPOINT ||
+                    ep2->bLength != USB_DT_ENDPOINT_SIZE ||
+                    ep2->bDescriptorType != USB_DT_ENDPOINT) {
+                    D("endpoints not found\n");
+                    break;
+                }
 
-            vid = __le16_to_cpu(device->idVendor);
-            pid = __le16_to_cpu(device->idProduct);
-            pid = devdesc[10] | (devdesc[11] << 8);
-            DBGX("[ %s is V:%04x P:%04x ]\n", devname, vid, pid);
-
-                // should have config descriptor next
-            config = (struct usb_config_descriptor *)bufptr;
-            bufptr += USB_DT_CONFIG_SIZE;
-            if (config->bLength != USB_DT_CONFIG_SIZE || config->bDescriptorType != USB_DT_CONFIG) {
-                D("usb_config_descriptor not found\n");
-                adb_close(fd);
-                continue;
-            }
+                    // both endpoints should be bulk
+                if (ep1->bmAttributes != USB_ENDPOINT_XFER_BULK ||
+                    ep2->bmAttributes != USB_ENDPOINT_XFER_BULK) {
+                    D("bulk endpoints not found\n");
+                    continue;
+                }
+                    /* aproto 01 needs 0 termination */
+                if(interface->bInterfaceProtocol == 0x01) {
+                    zero_mask = ep1->wMaxPacketSize - 1;
+                }
 
-                // loop through all the descriptors and look for the ADB interface
-            while (bufptr < bufend) {
-                unsigned char length = bufptr[0];
-                unsigned char type = bufptr[1];
-
-                if (type == USB_DT_INTERFACE) {
-                    interface = (struct usb_interface_descriptor *)bufptr;
-                    bufptr += length;
-
-                    if (length != USB_DT_INTERFACE_SIZE) {
-                        D("interface descriptor has wrong size\n");
-                        break;
-                    }
-
-                    DBGX("bInterfaceClass: %d,  bInterfaceSubClass: %d,"
-                         "bInterfaceProtocol: %d, bNumEndpoints: %d\n",
-                         interface->bInterfaceClass, interface->bInterfaceSubClass,
-                         interface->bInterfaceProtocol, interface->bNumEndpoints);
-
-                    if (interface->bNumEndpoints == 2 &&
-                            is_adb_interface(vid, pid, interface->bInterfaceClass,
-                            interface->bInterfaceSubClass, interface->bInterfaceProtocol))  {
-
-                        DBGX("looking for bulk endpoints\n");
-                            // looks like ADB...
-                        ep1 = (struct usb_endpoint_descriptor *)bufptr;
-                        bufptr += USB_DT_ENDPOINT_SIZE;
-                        ep2 = (struct usb_endpoint_descriptor *)bufptr;
-                        bufptr += USB_DT_ENDPOINT_SIZE;
-
-                        if (bufptr > devdesc + desclength ||
-                            ep1->bLength != USB_DT_ENDPOINT_SIZE ||
-                            ep1->bDescriptorType != USB_DT_ENDPOINT ||
-                            ep2->bLength != USB_DT_ENDPOINT_SIZE ||
-                            ep2->bDescriptorType != USB_DT_ENDPOINT) {
-                            D("endpoints not found\n");
-                            break;
-                        }
-
-                            // both endpoints should be bulk
-                        if (ep1->bmAttributes != USB_ENDPOINT_XFER_BULK ||
-                            ep2->bmAttributes != USB_ENDPOINT_XFER_BULK) {
-                            D("bulk endpoints not found\n");
-                            continue;
-                        }
-                            /* aproto 01 needs 0 termination */
-                        if(interface->bInterfaceProtocol == 0x01) {
-                            zero_mask = ep1->wMaxPacketSize - 1;
-                        }
-
-                            // we have a match.  now we just need to figure out which is in and which is out.
-                        if (ep1->bEndpointAddress & USB_ENDPOINT_DIR_MASK) {
-                            local_ep_in = ep1->bEndpointAddress;
-                            local_ep_out = ep2->bEndpointAddress;
-                        } else {
-                            local_ep_in = ep2->bEndpointAddress;
-                            local_ep_out = ep1->bEndpointAddress;
-                        }
-
-                        register_device_callback(devname, local_ep_in, local_ep_out,
-                                interface->bInterfaceNumber, device->iSerialNumber, zero_mask);
-                        break;
-                    }
+                    // we have a match.  now we just need to figure out which is in and which is out.
+                if (ep1->bEndpointAddress & USB_ENDPOINT_DIR_MASK) {
+                    local_ep_in = ep1->bEndpointAddress;
+                    local_ep_out = ep2->bEndpointAddress;
                 } else {
-                    bufptr += length;
+                    local_ep_in = ep2->bEndpointAddress;
+                    local_ep_out = ep1->bEndpointAddress;
                 }
-            } // end of while
 
-            adb_close(fd);
-        } // end of devdir while
-        closedir(devdir);
-    } //end of busdir while
+                register_device_callback(devname, local_ep_in, local_ep_out,
+                        interface->bInterfaceNumber, device->iSerialNumber, zero_mask);
+                break;
+            }
+        } else {
+            bufptr += length;
+        }
+    } // end of while
+
+    adb_close(fd);
+}
+
+static void find_usb_bus(const char *busname,
+        void (*register_device_callback)
+                (const char *, unsigned char, unsigned char, int, int, unsigned))
+{
+    char devname[32];
+    DIR *devdir ;
+    struct dirent *de;
+
+    devdir = opendir(busname);
+    if(devdir == 0) return;
+
+//    DBGX("[ scanning %s ]\n", busname);
+    while((de = readdir(devdir))) {
+        if(badname(de->d_name)) continue;
+        if(snprintf(devname, sizeof devname, "%s/%s", busname, de->d_name) >=
+           (int) sizeof devname) continue;
+
+        if(known_device(devname)) {
+            DBGX("skipping %s\n", devname);
+            continue;
+        }
+
+        find_usb_interface(devname, register_device_callback);
+    }
+    closedir(devdir);
+}
+
+static void find_usb_device(const char *base,
+        void (*register_device_callback)
+                (const char *, unsigned char, unsigned char, int, int, unsigned))
+{
+    char busname[32];
+    DIR *busdir ;
+    struct dirent *de;
+
+    busdir = opendir(base);
+    if(busdir == 0) return;
+
+    while((de = readdir(busdir)) != 0) {
+        if(badname(de->d_name)) continue;
+
+        if(snprintf(busname, sizeof busname, "%s/%s", base, de->d_name) >=
+           (int) sizeof busname) continue;
+        find_usb_bus(busname, register_device_callback);
+    }
     closedir(busdir);
 }
 
@@ -284,134 +327,219 @@ void usb_cleanup()
 {
 }
 
-static int usb_bulk_write(usb_handle *h, const void *data, int len)
+/* All of the functions below are called with h->lock held. */
+
+static int usb_submit(usb_handle *h, struct usb_xfer *x, unsigned char ep, int len)
 {
-    struct usbdevfs_urb *urb = &h->urb_out;
+    struct usbdevfs_urb *urb = &x->urb;
     int res;
-    struct timeval tv;
-    struct timespec ts;
 
     memset(urb, 0, sizeof(*urb));
     urb->type = USBDEVFS_URB_TYPE_BULK;
-    urb->endpoint = h->ep_out;
+    urb->endpoint = ep;
     urb->status = -1;
-    urb->buffer = (void*) data;
+    urb->buffer = x->buf;
     urb->buffer_length = len;
+    x->offset = 0;
 
-    D("++ write ++\n");
-
-    adb_mutex_lock(&h->lock);
-    if(h->dead) {
-        res = -1;
-        goto fail;
-    }
     do {
         res = ioctl(h->desc, USBDEVFS_SUBMITURB, urb);
     } while((res < 0) && (errno == EINTR));
 
     if(res < 0) {
-        goto fail;
+        D("[ submit urb ep %02x - error %d ]\n", ep, errno);
+        urb->status = -errno;
+        urb->actual_length = 0;
+        return -1;
     }
-
-    res = -1;
-    h->urb_out_busy = 1;
-    for(;;) {
-        /* time out after five seconds */
-        gettimeofday(&tv, NULL);
-        ts.tv_sec = tv.tv_sec + 5;
-        ts.tv_nsec = tv.tv_usec * 1000L;
-        res = pthread_cond_timedwait(&h->notify, &h->lock, &ts);
-        if(res < 0 || h->dead) {
-            break;
-        }
-        if(h->urb_out_busy == 0) {
-            if(urb->status == 0) {
-                res = urb->actual_length;
-            }
-            break;
-        }
-    }
-fail:
-    adb_mutex_unlock(&h->lock);
-    D("-- write --\n");
-    return res;
+    x->busy = 1;
+    return 0;
 }
 
-static int usb_bulk_read(usb_handle *h, void *data, int len)
+static int usb_busy(usb_handle *h)
 {
-    struct usbdevfs_urb *urb = &h->urb_in;
-    struct usbdevfs_urb *out = NULL;
-    int res;
+    int i;
 
-    memset(urb, 0, sizeof(*urb));
-    urb->type = USBDEVFS_URB_TYPE_BULK;
-    urb->endpoint = h->ep_in;
-    urb->status = -1;
-    urb->buffer = data;
-    urb->buffer_length = len;
+    for(i = 0; i < USB_READ_URBS; i++) {
+        if(h->xfer_in[i].busy) return 1;
+    }
+    for(i = 0; i < USB_WRITE_URBS; i++) {
+        if(h->xfer_out[i].busy) return 1;
+    }
+    return 0;
+}
 
+static void usb_discard(usb_handle *h)
+{
+    int i;
 
-    adb_mutex_lock(&h->lock);
-    if(h->dead) {
-        res = -1;
-        goto fail;
+    for(i = 0; i < USB_READ_URBS; i++) {
+        if(h->xfer_in[i].busy) {
+            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->xfer_in[i].urb);
+        }
     }
-    do {
-        res = ioctl(h->desc, USBDEVFS_SUBMITURB, urb);
-    } while((res < 0) && (errno == EINTR));
+    for(i = 0; i < USB_WRITE_URBS; i++) {
+        if(h->xfer_out[i].busy) {
+            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->xfer_out[i].urb);
+        }
+    }
+}
 
-    if(res < 0) {
-        goto fail;
+static void usb_wake(usb_handle *h)
+{
+    char c = 1;
+
+    if(h->started) {
+        adb_write(h->wake[1], &c, 1);
     }
+}
 
-    h->urb_in_busy = 1;
+/* The reaper sleeps in poll(), which usbfs reports writable when there
+** are completed transfers to reap, rather than in USBDEVFS_REAPURB, so
+** a kick only has to write to the wake socket to get its attention.
+** It goes away once the handle is dead and nothing is in flight.
+*/
+static void *usb_reaper_thread(void *_h)
+{
+    usb_handle *h = _h;
+    struct usbdevfs_urb *urb;
+    struct usb_xfer *x;
+    struct pollfd fds[2];
+    char buf[16];
+    int res, gone;
+
+    D("[ reaper for %s starting ]\n", h->fname);
     for(;;) {
-        D("[ reap urb - wait ]\n");
-        h->reaper_thread = pthread_self();
-        adb_mutex_unlock(&h->lock);
-        res = ioctl(h->desc, USBDEVFS_REAPURB, &out);
-        adb_mutex_lock(&h->lock);
-        h->reaper_thread = 0;
-        if(h->dead) {
-            res = -1;
-            break;
+        fds[0].fd = h->desc;
+        fds[0].events = POLLOUT;
+        fds[0].revents = 0;
+        fds[1].fd = h->wake[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        res = poll(fds, 2, -1);
+        if(res < 0 && errno != EINTR) {
+            D("[ reaper poll - error %d ]\n", errno);
+        }
+        if(fds[1].revents & POLLIN) {
+            adb_read(h->wake[0], buf, sizeof(buf));
         }
-        if(res < 0) {
-            if(errno == EINTR) {
-                continue;
+
+        adb_mutex_lock(&h->lock);
+        gone = 0;
+        for(;;) {
+            res = ioctl(h->desc, USBDEVFS_REAPURBNDELAY, &urb);
+            if(res < 0) {
+                if(errno != EAGAIN && errno != EINTR) {
+                    D("[ reap urb - error %d ]\n", errno);
+                    gone = 1;
+                }
+                break;
+            }
+            D("[ urb @%p ep %02x status = %d, actual = %d ]\n",
+                urb, urb->endpoint, urb->status, urb->actual_length);
+            x = (struct usb_xfer *) urb;
+            x->busy = 0;
+            if(urb->endpoint == h->ep_out && urb->status != 0) {
+                h->out_error = 1;
             }
-            D("[ reap urb - error ]\n");
+        }
+        if(gone) {
+            h->dead = 1;
+        }
+        adb_cond_broadcast(&h->notify);
+        if(h->dead && (gone || !usb_busy(h))) {
             break;
         }
-        D("[ urb @%p status = %d, actual = %d ]\n",
-            out, out->status, out->actual_length);
+        adb_mutex_unlock(&h->lock);
+    }
 
-        if(out == &h->urb_in) {
-            D("[ reap urb - IN complete ]\n");
-            h->urb_in_busy = 0;
-            if(urb->status == 0) {
-                res = urb->actual_length;
-            } else {
-                res = -1;
-            }
+    D("[ reaper for %s exiting ]\n", h->fname);
+    h->reaper_done = 1;
+    adb_cond_broadcast(&h->notify);
+    adb_mutex_unlock(&h->lock);
+    return 0;
+}
+
+/* the first read or write queues up the reads and starts the reaper */
+static int usb_start(usb_handle *h)
+{
+    adb_thread_t tid;
+    int i;
+
+    if(h->started) return 0;
+
+    if(adb_socketpair(h->wake)) {
+        D("[ cannot create wake socket for %s ]\n", h->fname);
+        return -1;
+    }
+    for(i = 0; i < USB_READ_URBS; i++) {
+        if(usb_submit(h, &h->xfer_in[i], h->ep_in, USB_URB_SIZE)) {
             break;
         }
-        if(out == &h->urb_out) {
-            D("[ reap urb - OUT compelete ]\n");
-            h->urb_out_busy = 0;
-            adb_cond_broadcast(&h->notify);
+    }
+    h->started = 1;
+    if(adb_thread_create(&tid, usb_reaper_thread, h)) {
+        D("[ cannot create reaper for %s ]\n", h->fname);
+        h->dead = 1;
+        h->reaper_done = 1;
+        usb_discard(h);
+        return -1;
+    }
+    return 0;
+}
+
+/* a device that stops taking OUT transfers gets USB_WRITE_TIMEOUT seconds
+** to free a slot, then the handle is given up on as a kick would
+*/
+#define USB_WRITE_TIMEOUT   5
+
+static int usb_queue_write(usb_handle *h, const void *data, int len)
+{
+    struct usb_xfer *x = &h->xfer_out[h->out_next];
+    struct timeval tv;
+    struct timespec ts;
+
+    if(x->busy && !h->dead) {
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + USB_WRITE_TIMEOUT;
+        ts.tv_nsec = tv.tv_usec * 1000L;
+        while(x->busy && !h->dead) {
+            if(pthread_cond_timedwait(&h->notify, &h->lock, &ts) == ETIMEDOUT) {
+                D("[ write to %s timed out ]\n", h->fname);
+                h->dead = 1;
+                usb_discard(h);
+                usb_wake(h);
+                adb_cond_broadcast(&h->notify);
+                return -1;
+            }
         }
     }
-fail:
+    if(h->dead || h->out_error) {
+        return -1;
+    }
+
+        /* nobody else touches an idle slot, so copy without the lock */
     adb_mutex_unlock(&h->lock);
-    return res;
-}
+    memcpy(x->buf, data, len);
+    adb_mutex_lock(&h->lock);
+    if(h->dead) {
+        return -1;
+    }
 
+    if(usb_submit(h, x, h->ep_out, len)) {
+        return -1;
+    }
+    h->out_next = (h->out_next + 1) % USB_WRITE_URBS;
+    return 0;
+}
 
+/* Writes only wait for a free slot, not for the transfer itself: a
+** transfer that fails is reported by the next usb_write().
+*/
 int usb_write(usb_handle *h, const void *_data, int len)
 {
     unsigned char *data = (unsigned char*) _data;
-    int n;
+    int res = -1;
     int need_zero = 0;
 
     if(h->zero_mask) {
@@ -424,60 +552,89 @@ int usb_write(usb_handle *h, const void *_data, int len)
         }
     }
 
+    D("++ write ++\n");
+    adb_mutex_lock(&h->lock);
+    if(h->dead || usb_start(h)) {
+        goto fail;
+    }
+
     while(len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
+        int xfer = (len > USB_URB_SIZE) ? USB_URB_SIZE : len;
 
-        n = usb_bulk_write(h, data, xfer);
-        if(n != xfer) {
-            D("ERROR: n = %d, errno = %d (%s)\n",
-                n, errno, strerror(errno));
-            return -1;
+        if(usb_queue_write(h, data, xfer)) {
+            D("ERROR: write of %d failed, errno = %d (%s)\n",
+                xfer, errno, strerror(errno));
+            goto fail;
         }
 
         len -= xfer;
         data += xfer;
     }
 
-    if(need_zero){
-        n = usb_bulk_write(h, _data, 0);
-        return n;
+    if(need_zero && usb_queue_write(h, _data, 0)) {
+        goto fail;
     }
+    res = 0;
 
-    return 0;
+fail:
+    adb_mutex_unlock(&h->lock);
+    D("-- write --\n");
+    return res;
 }
 
+/* The reads in flight turn the endpoint into a byte stream: each one is
+** handed out in order, in as many pieces as the callers ask for, and
+** queued again once it is used up.
+*/
 int usb_read(usb_handle *h, void *_data, int len)
 {
     unsigned char *data = (unsigned char*) _data;
+    struct usb_xfer *x;
+    int res = -1;
     int n;
 
     D("++ usb_read ++\n");
+    adb_mutex_lock(&h->lock);
+    if(h->dead || usb_start(h)) {
+        goto fail;
+    }
+
     while(len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
-
-        D("[ usb read %d fd = %d], fname=%s\n", xfer, h->desc, h->fname);
-        n = usb_bulk_read(h, data, xfer);
-        D("[ usb read %d ] = %d, fname=%s\n", xfer, n, h->fname);
-        if(n != xfer) {
-            if((errno == ETIMEDOUT) && (h->desc != -1)) {
-                D("[ timeout ]\n");
-                if(n > 0){
-                    data += n;
-                    len -= n;
-                }
-                continue;
-            }
-            D("ERROR: n = %d, errno = %d (%s)\n",
-                n, errno, strerror(errno));
-            return -1;
+        x = &h->xfer_in[h->in_next];
+        while(x->busy && !h->dead) {
+            D("[ usb read - wait ], fname=%s\n", h->fname);
+            adb_cond_wait(&h->notify, &h->lock);
+        }
+        if(h->dead) {
+            goto fail;
+        }
+        if(x->urb.status != 0) {
+            D("ERROR: urb status = %d, fname=%s\n", x->urb.status, h->fname);
+            goto fail;
         }
 
-        len -= xfer;
-        data += xfer;
+        n = x->urb.actual_length - x->offset;
+        if(n > len) n = len;
+        adb_mutex_unlock(&h->lock);
+        memcpy(data, x->buf + x->offset, n);
+        adb_mutex_lock(&h->lock);
+        x->offset += n;
+        data += n;
+        len -= n;
+
+        if(x->offset == x->urb.actual_length) {
+            if(h->dead || usb_submit(h, x, h->ep_in, USB_URB_SIZE)) {
+                goto fail;
+            }
+            h->in_next = (h->in_next + 1) % USB_READ_URBS;
+        }
     }
+    res = 0;
 
+fail:
+    adb_mutex_unlock(&h->lock);
     D("-- usb_read --\n");
-    return 0;
+    return res;
 }
 
 void usb_kick(usb_handle *h)
@@ -488,25 +645,12 @@ void usb_kick(usb_handle *h)
         h->dead = 1;
 
         if (h->writeable) {
-            /* HACK ALERT!
-            ** Sometimes we get stuck in ioctl(USBDEVFS_REAPURB).
-            ** This is a workaround for that problem.
+            /* cancel whatever is in flight: the reaper collects the
+            ** cancelled transfers, and readers and writers waiting
+            ** on them are woken up right away
             */
-            if (h->reaper_thread) {
-                pthread_kill(h->reaper_thread, SIGALRM);
-            }
-
-            /* cancel any pending transactions
-            ** these will quietly fail if the txns are not active,
-            ** but this ensures that a reader blocked on REAPURB
-            ** will get unblocked
-            */
-            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_in);
-            ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urb_out);
-            h->urb_in.status = -ENODEV;
-            h->urb_out.status = -ENODEV;
-            h->urb_in_busy = 0;
-            h->urb_out_busy = 0;
+            usb_discard(h);
+            usb_wake(h);
             adb_cond_broadcast(&h->notify);
         } else {
             unregister_usb_transport(h);
@@ -519,14 +663,35 @@ int usb_close(usb_handle *h)
 {
     D("[ usb close ... ]\n");
     adb_mutex_lock(&usb_lock);
-    h->next->prev = h->prev;
-    h->prev->next = h->next;
-    h->prev = 0;
-    h->next = 0;
+        /* forget_device() has taken it off the list already */
+    if(h->next) {
+        h->next->prev = h->prev;
+        h->prev->next = h->next;
+        h->prev = 0;
+        h->next = 0;
+    }
+    adb_mutex_unlock(&usb_lock);
+
+        /* the transfers in flight point into h, so wait for the
+        ** reaper to have collected them all
+        */
+    adb_mutex_lock(&h->lock);
+    if(h->started) {
+        if(!h->dead) {
+            h->dead = 1;
+            usb_discard(h);
+            usb_wake(h);
+        }
+        while(!h->reaper_done) {
+            adb_cond_wait(&h->notify, &h->lock);
+        }
+        adb_close(h->wake[0]);
+        adb_close(h->wake[1]);
+    }
+    adb_mutex_unlock(&h->lock);
 
     adb_close(h->desc);
     D("[ usb closed %p (fd = %d) ]\n", h, h->desc);
-    adb_mutex_unlock(&usb_lock);
 
     free(h);
     return 0;
@@ -570,7 +735,6 @@ static void register_device(const char *dev_name,
     adb_mutex_init(&usb->lock, 0);
     /* initialize mark to 1 so we don't get garbage collected after the device scan */
     usb->mark = 1;
-    usb->reaper_thread = 0;
 
     usb->desc = unix_open(usb->fname, O_RDWR);
     if(usb->desc < 0) {
@@ -654,33 +818,239 @@ fail:
     free(usb);
 }
 
+/* Drops a handle that never got a transport going: one we could only
+** open read-only, once it is unplugged or its permissions change.  It
+** leaves the list at once, so that the device can be registered again,
+** but its transport may still be on its way to the main loop, which
+** closes the handle only after that.
+*/
+static void forget_device(usb_handle *h)
+{
+    D("[ usb forgetting %s ]\n", h->fname);
+    adb_mutex_lock(&usb_lock);
+    h->next->prev = h->prev;
+    h->prev->next = h->next;
+    h->prev = 0;
+    h->next = 0;
+    adb_mutex_unlock(&usb_lock);
+
+    forget_usb_transport(h);
+}
+
+static usb_handle *find_handle(const char *dev_name)
+{
+    usb_handle *usb;
+
+    adb_mutex_lock(&usb_lock);
+    for(usb = handle_list.next; usb != &handle_list; usb = usb->next){
+        if(!strcmp(usb->fname, dev_name)) {
+            adb_mutex_unlock(&usb_lock);
+            return usb;
+        }
+    }
+    adb_mutex_unlock(&usb_lock);
+    return 0;
+}
+
+static void usb_device_added(const char *dev_name)
+{
+    usb_handle *usb = find_handle(dev_name);
+
+    if(usb) {
+            /* udev usually fixes up the permissions right after the
+            ** node shows up, so give a read-only device another go
+            */
+        if(usb->writeable || access(dev_name, R_OK | W_OK)) return;
+        forget_device(usb);
+    }
+    find_usb_interface(dev_name, register_device);
+}
+
+static void usb_device_removed(const char *dev_name)
+{
+    usb_handle *usb = find_handle(dev_name);
+
+    if(usb == 0) return;
+    if(usb->writeable) {
+        usb_kick(usb);
+    } else {
+        forget_device(usb);
+    }
+}
+
+#define USB_BUS_BASE    "/dev/bus/usb"
+#define USB_MAX_BUSES   64
+
+/* Hotplug: one inotify watch on /dev/bus/usb for buses coming and going,
+** and one on each bus for its device nodes.  Only startup and a queue
+** overflow need the full scan.  Once a watch is missing, events can no
+** longer be trusted to cover every device, and device_poll_thread()
+** falls back to scanning every second.
+*/
+static struct {
+    int wd;
+    char name[32];
+} usb_buses[USB_MAX_BUSES];
+
+/* returns -1 if the bus is there but cannot be watched */
+static int usb_watch_bus(int ifd, const char *busname)
+{
+    int i, wd;
+
+    wd = inotify_add_watch(ifd, busname, IN_CREATE | IN_ATTRIB | IN_DELETE);
+    if(wd < 0) {
+        D("[ cannot watch %s: %s ]\n", busname, strerror(errno));
+            /* gone again already */
+        if(errno == ENOENT || errno == ENOTDIR) return 0;
+        return -1;
+    }
+    for(i = 0; i < USB_MAX_BUSES; i++) {
+        if(usb_buses[i].wd == wd) return 0;
+    }
+    for(i = 0; i < USB_MAX_BUSES; i++) {
+        if(usb_buses[i].wd <= 0) {
+            usb_buses[i].wd = wd;
+            snprintf(usb_buses[i].name, sizeof usb_buses[i].name, "%s", busname);
+            return 0;
+        }
+    }
+    D("[ too many usb buses, not watching %s ]\n", busname);
+    inotify_rm_watch(ifd, wd);
+    return -1;
+}
+
+static const char *usb_bus_name(int wd)
+{
+    int i;
+
+    for(i = 0; i < USB_MAX_BUSES; i++) {
+        if(usb_buses[i].wd == wd) return usb_buses[i].name;
+    }
+    return 0;
+}
+
+/* returns -1 if a bus could not be watched */
+static int usb_scan_all(int ifd)
+{
+    char busname[32];
+    DIR *busdir;
+    struct dirent *de;
+    int res = 0;
+
+    if((busdir = opendir(USB_BUS_BASE)) != 0) {
+        while((de = readdir(busdir)) != 0) {
+            if(badname(de->d_name)) continue;
+            if(snprintf(busname, sizeof busname, "%s/%s", USB_BUS_BASE,
+                        de->d_name) >= (int) sizeof busname) continue;
+            if(usb_watch_bus(ifd, busname)) res = -1;
+        }
+        closedir(busdir);
+    }
+    find_usb_device(USB_BUS_BASE, register_device);
+    kick_disconnected_devices();
+    return res;
+}
+
+/* returns -1 once the watches no longer cover every bus */
+static int usb_hotplug_event(int ifd, int root, struct inotify_event *ev)
+{
+    char path[64];
+    const char *bus;
+    int i, res;
+
+    if(ev->mask & IN_Q_OVERFLOW) {
+        D("[ usb hotplug events lost, rescanning ]\n");
+        return usb_scan_all(ifd);
+    }
+    if(ev->mask & IN_IGNORED) {
+        if(ev->wd == root) {
+            D("[ %s is no longer watched ]\n", USB_BUS_BASE);
+            return -1;
+        }
+        for(i = 0; i < USB_MAX_BUSES; i++) {
+            if(usb_buses[i].wd == ev->wd) usb_buses[i].wd = 0;
+        }
+        return 0;
+    }
+    if(ev->len == 0 || badname(ev->name)) return 0;
+
+    if(ev->wd == root) {
+        if((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR)) {
+            snprintf(path, sizeof path, "%s/%s", USB_BUS_BASE, ev->name);
+            res = usb_watch_bus(ifd, path);
+                /* devices may have shown up before the watch did */
+            find_usb_bus(path, register_device);
+            return res;
+        }
+        return 0;
+    }
+
+    bus = usb_bus_name(ev->wd);
+    if(bus == 0) return 0;
+    snprintf(path, sizeof path, "%s/%s", bus, ev->name);
+
+    if(ev->mask & IN_DELETE) {
+        D("[ usb hotplug: %s removed ]\n", path);
+        usb_device_removed(path);
+    } else if(ev->mask & (IN_CREATE | IN_ATTRIB)) {
+        D("[ usb hotplug: %s added ]\n", path);
+        usb_device_added(path);
+    }
+    return 0;
+}
+
 void* device_poll_thread(void* unused)
 {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    int ifd, root = -1;
+    int n, i;
+
     D("Created device thread\n");
+
+    ifd = inotify_init();
+    if(ifd >= 0) {
+        root = inotify_add_watch(ifd, USB_BUS_BASE, IN_CREATE | IN_DELETE);
+    }
+    if(root < 0) {
+            /* no inotify, or no /dev/bus/usb yet */
+        D("[ usb hotplug unavailable (%s) ]\n", strerror(errno));
+        find_usb_device(USB_BUS_BASE, register_device);
+        usb_scan_complete();
+        goto polling;
+    }
+
+    if(usb_scan_all(ifd)) {
+        usb_scan_complete();
+        goto polling;
+    }
+    usb_scan_complete();
+    for(;;) {
+        n = adb_read(ifd, buf, sizeof(buf));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            fatal_errno("cannot read usb hotplug events");
+        }
+        for(i = 0; i < n; i += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) (buf + i);
+            if(usb_hotplug_event(ifd, root, ev)) goto polling;
+        }
+    }
+
+polling:
+    D("[ usb hotplug: polling ]\n");
+    if(ifd >= 0) adb_close(ifd);
     for(;;) {
-            /* XXX use inotify */
-        find_usb_device("/dev/bus/usb", register_device);
-        kick_disconnected_devices();
         sleep(1);
+        find_usb_device(USB_BUS_BASE, register_device);
+        kick_disconnected_devices();
     }
     return NULL;
 }
 
-static void sigalrm_handler(int signo)
-{
-    // don't need to do anything here
-}
-
 void usb_init()
 {
     adb_thread_t tid;
-    struct sigaction    actions;
-
-    memset(&actions, 0, sizeof(actions));
-    sigemptyset(&actions.sa_mask);
-    actions.sa_flags = 0;
-    actions.sa_handler = sigalrm_handler;
-    sigaction(SIGALRM,& actions, NULL);
 
     if(adb_thread_create(&tid, device_poll_thread, NULL)){
         fatal_errno("cannot create input thread");
@@ -94,16 +94,27 @@ int usb_write(usb_handle *h, const void *data, int len)
     return 0;
 }
 
-int usb_read(usb_handle *h, void *data, int len)
+int usb_read(usb_handle *h, void *_data, int len)
 {
+    unsigned char *data = (unsigned char*) _data;
     int n;
 
     D("[ read %d ]\n", len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: n = %d, errno = %d (%s)\n",
-            n, errno, strerror(errno));
-        return -1;
+        /* the gadget driver will not take reads larger than its
+        ** bulk buffer, so payloads bigger than MAX_PAYLOAD_V1
+        ** are collected in pieces
+        */
+    while(len > 0) {
+        int xfer = (len > MAX_PAYLOAD_V1) ? MAX_PAYLOAD_V1 : len;
+
+        n = adb_read(h->fd, data, xfer);
+        if(n != xfer) {
+            D("ERROR: n = %d, errno = %d (%s)\n",
+                n, errno, strerror(errno));
+            return -1;
+        }
+        len -= xfer;
+        data += xfer;
     }
     return 0;
 }
@@ -379,6 +379,7 @@ void* RunLoopThread(void* unused)
     unsigned i;
 
     InitUSB();
+    usb_scan_complete();
 
     currentRunLoop = CFRunLoopGetCurrent();
 
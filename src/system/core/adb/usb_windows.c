@@ -168,9 +168,11 @@ int register_new_device(usb_handle* handle) {
 void* device_poll_thread(void* unused) {
   D("Created device thread\n");
 
+  find_devices();
+  usb_scan_complete();
   while(1) {
-    find_devices();
     adb_sleep_ms(1000);
+    find_devices();
   }
 
   return NULL;
@@ -0,0 +1,459 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+
+#include <errno.h>
+
+#include "sysdeps.h"
+
+#define TRACE_TAG  TRACE_SYNC
+#include "adb.h"
+#include "file_sync_service.h"
+
+/* The change feed behind "watch:<path>", see file_sync_service.h.  One
+** inotify watch per directory below <path>; events are folded into a
+** pending change per path, and a change is only reported, from a fresh
+** lstat(), once its path has been quiet for WATCH_QUIET_MS.
+*/
+
+#define WATCH_EVENTS (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_HASH_SIZE 256
+
+typedef struct pending pending;
+
+struct pending {
+    pending *next;          /* in order of last activity */
+    pending *prev;
+    pending *hnext;
+    long long last;         /* ms */
+    int tree;               /* a directory that came in with its contents */
+    char path[1];           /* relative to the root */
+};
+
+typedef struct {
+    int s;                  /* to the host */
+    int ifd;                /* inotify */
+    int rootwd;
+    char root[PATH_MAX];
+
+    char **dirs;            /* relative path of each watched directory, */
+    int dircount;           /* indexed by watch descriptor */
+
+    pending list;
+    pending *hash[WATCH_HASH_SIZE];
+} watch;
+
+static long long now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((long long) tv.tv_usec) / 1000LL +
+        1000LL * ((long long) tv.tv_sec);
+}
+
+static unsigned hash_path(const char *path)
+{
+    unsigned h = 5381;
+    while(*path)
+        h = h * 33 + (unsigned char) *path++;
+    return h % WATCH_HASH_SIZE;
+}
+
+/* "name" below the directory "dir", both relative to the root */
+static int join(char *out, const char *dir, const char *name)
+{
+    int len = snprintf(out, PATH_MAX, "%s%s%s", dir, dir[0] ? "/" : "", name);
+    return (len < PATH_MAX) ? 0 : -1;
+}
+
+static int full_path(watch *w, char *out, const char *rel)
+{
+    int len = snprintf(out, PATH_MAX, "%s%s%s", w->root, rel[0] ? "/" : "", rel);
+    return (len < PATH_MAX) ? 0 : -1;
+}
+
+static int send_record(watch *w, unsigned id, struct stat *st,
+                       const char *name, int len)
+{
+    syncmsg msg;
+
+    msg.dent.id = id;
+    msg.dent.mode = st ? htoll(st->st_mode) : 0;
+    msg.dent.size = st ? htoll(st->st_size) : 0;
+    msg.dent.time = st ? htoll(st->st_mtime) : 0;
+    msg.dent.namelen = htoll(len);
+    if(writex(w->s, &msg.dent, sizeof(msg.dent)) ||
+       (len > 0 && writex(w->s, name, len))) {
+        return -1;
+    }
+    return 0;
+}
+
+/* report what is at rel now, and everything below it if tree is set */
+static int send_entry(watch *w, const char *rel, int tree)
+{
+    char path[PATH_MAX];
+    char sub[PATH_MAX];
+    struct stat st;
+    struct dirent *de;
+    DIR *d;
+    int ret = 0;
+
+    if(strlen(rel) > WATCH_NAME_MAX || full_path(w, path, rel))
+        return 0;
+    if(lstat(path, &st))
+        return send_record(w, ID_ULNK, 0, rel, strlen(rel));
+    if(send_record(w, ID_DENT, &st, rel, strlen(rel)))
+        return -1;
+    if(!tree || !S_ISDIR(st.st_mode))
+        return 0;
+
+    d = opendir(path);
+    if(d == 0)
+        return 0;
+    while((de = readdir(d))) {
+        if(de->d_name[0] == '.') {
+            if(de->d_name[1] == 0) continue;
+            if((de->d_name[1] == '.') && (de->d_name[2] == 0)) continue;
+        }
+        if(join(sub, rel, de->d_name) == 0 && send_entry(w, sub, 1)) {
+            ret = -1;
+            break;
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+/* watch rel and every directory below it; returns the watch on rel */
+static int watch_tree(watch *w, const char *rel)
+{
+    char path[PATH_MAX];
+    char sub[PATH_MAX];
+    struct dirent *de;
+    DIR *d;
+    int wd;
+
+    if(full_path(w, path, rel))
+        return -1;
+    wd = inotify_add_watch(w->ifd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if(wd < 0) {
+        D("watch: cannot watch '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    if(wd >= w->dircount) {
+        int count = wd + 64;
+        char **dirs = realloc(w->dirs, count * sizeof(char*));
+        if(dirs == 0) {
+            inotify_rm_watch(w->ifd, wd);
+            return -1;
+        }
+        memset(dirs + w->dircount, 0, (count - w->dircount) * sizeof(char*));
+        w->dirs = dirs;
+        w->dircount = count;
+    }
+    free(w->dirs[wd]);
+    w->dirs[wd] = strdup(rel);
+
+    d = opendir(path);
+    if(d == 0)
+        return wd;
+    while((de = readdir(d))) {
+        struct stat st;
+
+        if(de->d_name[0] == '.') {
+            if(de->d_name[1] == 0) continue;
+            if((de->d_name[1] == '.') && (de->d_name[2] == 0)) continue;
+        }
+        if(join(sub, rel, de->d_name) || full_path(w, path, sub))
+            continue;
+        if(lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            watch_tree(w, sub);
+    }
+    closedir(d);
+    return wd;
+}
+
+static int in_subtree(const char *path, const char *dir, int len)
+{
+    return !strncmp(path, dir, len) && (path[len] == 0 || path[len] == '/');
+}
+
+/* a directory left the tree: stop watching it and what is below it */
+static void unwatch_tree(watch *w, const char *rel)
+{
+    int len = strlen(rel);
+    int wd;
+
+    for(wd = 0; wd < w->dircount; wd++) {
+        if(w->dirs[wd] && wd != w->rootwd && in_subtree(w->dirs[wd], rel, len)) {
+            inotify_rm_watch(w->ifd, wd);
+            free(w->dirs[wd]);
+            w->dirs[wd] = 0;
+        }
+    }
+}
+
+/* a directory was renamed inside the tree */
+static void rename_tree(watch *w, const char *from, const char *to)
+{
+    int len = strlen(from);
+    char path[PATH_MAX];
+    int wd;
+
+    for(wd = 0; wd < w->dircount; wd++) {
+        if(w->dirs[wd] && wd != w->rootwd && in_subtree(w->dirs[wd], from, len)) {
+            if(snprintf(path, sizeof(path), "%s%s", to, w->dirs[wd] + len) <
+               (int) sizeof(path)) {
+                free(w->dirs[wd]);
+                w->dirs[wd] = strdup(path);
+            }
+        }
+    }
+}
+
+static void pending_unlink(watch *w, pending *p)
+{
+    pending **pp = &w->hash[hash_path(p->path)];
+
+    while(*pp != p)
+        pp = &(*pp)->hnext;
+    *pp = p->hnext;
+    p->prev->next = p->next;
+    p->next->prev = p->prev;
+}
+
+/* note activity on rel */
+static void pending_touch(watch *w, const char *rel, int tree)
+{
+    unsigned h = hash_path(rel);
+    pending *p;
+
+    for(p = w->hash[h]; p != 0; p = p->hnext) {
+        if(!strcmp(p->path, rel))
+            break;
+    }
+    if(p != 0) {
+        p->prev->next = p->next;
+        p->next->prev = p->prev;
+    } else {
+        int len = strlen(rel);
+        p = calloc(1, sizeof(pending) + len);
+        if(p == 0)
+            return;
+        memcpy(p->path, rel, len + 1);
+        p->hnext = w->hash[h];
+        w->hash[h] = p;
+    }
+    p->tree |= tree;
+    p->last = now_ms();
+    p->next = &w->list;
+    p->prev = w->list.prev;
+    p->prev->next = p;
+    w->list.prev = p;
+}
+
+/* report every change that has been quiet long enough, or all of them;
+** returns how long until the next one is due (-1 for none), or -2 if
+** the host went away
+*/
+static int pending_flush(watch *w, int all)
+{
+    long long now = now_ms();
+    pending *p;
+    int ret;
+
+    while((p = w->list.next) != &w->list) {
+        if(!all && p->last + WATCH_QUIET_MS > now)
+            return (int) (p->last + WATCH_QUIET_MS - now);
+        pending_unlink(w, p);
+        ret = send_entry(w, p->path, p->tree);
+        free(p);
+        if(ret)
+            return -2;
+    }
+    return -1;
+}
+
+static void watch_free(watch *w)
+{
+    pending *p;
+    int wd;
+
+    while((p = w->list.next) != &w->list) {
+        pending_unlink(w, p);
+        free(p);
+    }
+    for(wd = 0; wd < w->dircount; wd++)
+        free(w->dirs[wd]);
+    free(w->dirs);
+    if(w->ifd >= 0)
+        adb_close(w->ifd);
+}
+
+/* an unpaired MOVED_FROM: the path left the tree */
+static void moved_out(watch *w, char *from, int isdir)
+{
+    pending_touch(w, from, 0);
+    if(isdir) unwatch_tree(w, from);
+    from[0] = 0;
+}
+
+void watch_service(int fd, void *cookie)
+{
+    char *root = cookie;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char names[PATH_MAX * 2];
+    char from[PATH_MAX];
+    char rel[PATH_MAX];
+    struct pollfd fds[2];
+    unsigned moved_cookie = 0;
+    int moved_dir = 0;
+    int timeout = -1;
+    int len, off;
+    watch w;
+
+    memset(&w, 0, sizeof(w));
+    w.s = fd;
+    w.ifd = -1;
+    w.list.next = w.list.prev = &w.list;
+    from[0] = 0;
+
+    len = strlen(root);
+    while(len > 1 && root[len - 1] == '/')
+        len--;
+    if(len >= PATH_MAX) goto done;
+    memcpy(w.root, root, len);
+    w.root[len] = 0;
+
+    w.ifd = inotify_init();
+    if(w.ifd < 0) goto done;
+    w.rootwd = watch_tree(&w, "");
+    if(w.rootwd < 0) {
+        send_record(&w, ID_DONE, 0, 0, 0);
+        goto done;
+    }
+    D("watch: watching '%s'\n", w.root);
+
+    fds[0].fd = w.ifd;
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = POLLIN;
+
+    for(;;) {
+        fds[0].revents = fds[1].revents = 0;
+            /* MOVED_FROM and its MOVED_TO are queued together, so an
+               unpaired MOVED_FROM only needs a short look */
+        if(poll(fds, 2, from[0] ? 10 : timeout) < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+
+            /* the host sends nothing; readable means it is gone */
+        if(fds[1].revents) break;
+
+        len = 0;
+        if(fds[0].revents & POLLIN) {
+            len = adb_read(w.ifd, buf, sizeof(buf));
+            if(len < 0 && errno != EINTR && errno != EAGAIN) break;
+            if(len < 0) len = 0;
+        }
+        if(len == 0 && from[0]) {
+            moved_out(&w, from, moved_dir);
+        }
+
+        for(off = 0; off < len;) {
+            struct inotify_event *ev = (struct inotify_event*) (buf + off);
+            int isdir = (ev->mask & IN_ISDIR) != 0;
+
+            off += sizeof(struct inotify_event) + ev->len;
+
+            if(from[0] && !((ev->mask & IN_MOVED_TO) &&
+                            ev->cookie == moved_cookie)) {
+                moved_out(&w, from, moved_dir);
+            }
+
+            if(ev->mask & IN_Q_OVERFLOW) {
+                    /* the host rescans, which covers what is pending */
+                pending_flush(&w, 1);
+                if(send_record(&w, ID_OVFL, 0, 0, 0)) goto done;
+                continue;
+            }
+            if(ev->wd == w.rootwd &&
+               (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+                pending_flush(&w, 1);
+                send_record(&w, ID_DONE, 0, 0, 0);
+                goto done;
+            }
+            if(ev->mask & IN_IGNORED) {
+                if(ev->wd >= 0 && ev->wd < w.dircount) {
+                    free(w.dirs[ev->wd]);
+                    w.dirs[ev->wd] = 0;
+                }
+                continue;
+            }
+            if(ev->wd < 0 || ev->wd >= w.dircount || w.dirs[ev->wd] == 0 ||
+               ev->len == 0 || join(rel, w.dirs[ev->wd], ev->name)) {
+                continue;
+            }
+
+            if(ev->mask & IN_MOVED_FROM) {
+                strcpy(from, rel);
+                moved_cookie = ev->cookie;
+                moved_dir = isdir;
+            } else if((ev->mask & IN_MOVED_TO) && from[0]) {
+                    /* everything else goes out first, so the rename
+                       finds the host's copy as it was */
+                int nlen = strlen(from) + 1 + strlen(rel);
+
+                if(pending_flush(&w, 1) == -2) goto done;
+                memcpy(names, from, strlen(from) + 1);
+                strcpy(names + strlen(from) + 1, rel);
+                if(send_record(&w, ID_RENM, 0, names, nlen)) goto done;
+                if(moved_dir) rename_tree(&w, from, rel);
+                from[0] = 0;
+            } else if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    /* a directory comes with whatever it already holds */
+                if(isdir) watch_tree(&w, rel);
+                pending_touch(&w, rel, isdir);
+            } else {
+                pending_touch(&w, rel, 0);
+            }
+        }
+
+        timeout = pending_flush(&w, 0);
+        if(timeout == -2) break;
+    }
+
+done:
+    watch_free(&w);
+    free(root);
+    D("watch: done\n");
+    adb_close(fd);
+}
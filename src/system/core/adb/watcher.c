@@ -1,160 +1,1610 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/inotify.h>
 #include <inotifytools/inotifytools.h>
-#include "file_sync_service.h"
 #include "sysdeps.h"
+#include "adb_client.h"
+#include "file_sync_service.h"
+#include "ignore.h"
 
 #define nasprintf(...) niceassert( -1 != asprintf(__VA_ARGS__), "out of memory")
 #define niceassert(cond,mesg) _niceassert((long)cond, __LINE__, __FILE__, \
                                           #cond, mesg)
 
-char* fdir(char* dir, int len) {
-	char* mydir;
-	mydir = (char *)malloc((strlen(dir) + strlen(STRINGIFY(RPATH))) * sizeof(char));
+void _niceassert( long cond, int line, char const * file, char const * condstr,
+                  char const * mesg );
+int isdir( char const * path );
+
+// A path that keeps changing is still flushed after this many quiet windows
+#define MAX_DELAY_WINDOWS 8
+
+// Threads reading the linked folder while the watches are set up
+#define LINK_WALK_THREADS 4
+
+#define LINK_EVENTS (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | \
+		IN_MODIFY)
+
+/*
+ * Coalescing stage.
+ *
+ * Events are not replayed on the device as they arrive: each one is folded
+ * into a pending change for its path, and a change is only flushed once its
+ * path has been quiet for link->quiet_ms.  Pending changes are kept in order
+ * of last activity, so the head of the list is always the next one due.
+ */
+
+// The watcher and the remote_watcher() of each link take turns: they change
+// the local folders, the echo tables and the devices, and the sync client's
+// buffers are shared by all of them.  None is cancelled half way through.
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void link_enter(int *cancel_state) {
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, cancel_state);
+	pthread_mutex_lock(&link_lock);
+}
+
+static void link_leave(int cancel_state) {
+	pthread_mutex_unlock(&link_lock);
+	pthread_setcancelstate(cancel_state, NULL);
+}
+
+// Flags of a pending change, applied in this order when it is flushed
+#define CH_REMOVE  0x01   // remove whatever the device has at this path
+#define CH_MKDIR   0x02   // create the directory
+#define CH_PUSH    0x04   // push the file, or the whole tree for a directory
+#define CH_NEW     0x08   // created in this window: a delete cancels it
+
+#define CHANGE_HASH_SIZE 1024
+
+typedef struct change change;
+
+struct change {
+	change *next;
+	change *prev;
+	change *hnext;
+
+	char *path;          // local path
+	int flags;
+	long long first;     // ms, first event folded in
+	long long last;      // ms, last event folded in
+};
+
+typedef struct echo echo;
+typedef struct synced synced;
+typedef struct dirtydir dirtydir;
+
+// What the watcher keeps for each link
+struct linkstate {
+	change changes;      // pending changes, oldest activity first
+	change *change_hash[CHANGE_HASH_SIZE];
+	echo *echo_hash[CHANGE_HASH_SIZE];
+	synced **synced_hash;   // SYNCED_HASH_SIZE of them
+
+	// Structural changes go through the sync session too, unless the adbd on
+	// the device predates the ULNK/MKDR/RENM requests: then it is one shell
+	// per change.  Likewise large files are pushed as deltas unless it
+	// predates SIGN/DLTA.
+	int native_verbs;
+	int delta_push;
+
+	dirtydir *dirty;     // subtrees to compare with the device, in order
+	dirtydir **dirty_tail;
+	linkstats stats;
+
+	int online;          // between link_up() and link_down()
+	int watching;        // the folder is watched; only the watcher looks
+	int feed_running;
+	pthread_t feed;      // remote_watcher()
+};
+
+typedef struct linkstate linkstate;
+
+static long long now_ms() {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((long long) tv.tv_usec) / 1000LL +
+		1000LL * ((long long) tv.tv_sec);
+}
+
+static unsigned hash_path(char const *path) {
+	unsigned h = 5381;
+	while (*path)
+		h = h * 33 + (unsigned char) *path++;
+	return h % CHANGE_HASH_SIZE;
+}
+
+// Is path equal to, or below, the directory dir (given without a trailing /)
+static int in_subtree(char const *path, char const *dir, int len) {
+	return !strncmp(path, dir, len) && (path[len] == 0 || path[len] == '/');
+}
+
+static change *change_find(linkstate *ls, char const *path) {
+	change *c;
+
+	for (c = ls->change_hash[hash_path(path)]; c; c = c->hnext) {
+		if (!strcmp(c->path, path))
+			return c;
+	}
+	return NULL;
+}
+
+static void change_unhash(linkstate *ls, change *c) {
+	change **pc = &ls->change_hash[hash_path(c->path)];
+
+	while (*pc != c)
+		pc = &(*pc)->hnext;
+	*pc = c->hnext;
+}
+
+static void change_hash_in(linkstate *ls, change *c) {
+	unsigned h = hash_path(c->path);
+
+	c->hnext = ls->change_hash[h];
+	ls->change_hash[h] = c;
+}
+
+static void change_unlink(change *c) {
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+}
+
+static void change_append(linkstate *ls, change *c) {
+	c->next = &ls->changes;
+	c->prev = ls->changes.prev;
+	c->prev->next = c;
+	ls->changes.prev = c;
+}
+
+static void change_free(linkstate *ls, change *c) {
+	change_unlink(c);
+	change_unhash(ls, c);
+	free(c->path);
+	free(c);
+}
+
+// Record new activity on c, moving it to the tail of the list
+static void change_touch(linkstate *ls, change *c, int quiet_ms) {
+	long long now = now_ms();
+
+	if (now - c->first >= (long long) quiet_ms * MAX_DELAY_WINDOWS)
+		return;
+	c->last = now;
+	change_unlink(c);
+	change_append(ls, c);
+}
+
+// Find the pending change for path, creating an empty one if there is none
+static change *change_get(linkstate *ls, char const *path, int quiet_ms) {
+	change *c = change_find(ls, path);
+
+	if (c) {
+		change_touch(ls, c, quiet_ms);
+		return c;
+	}
+
+	c = (change *) calloc(1, sizeof(change));
+	niceassert(c, "out of memory");
+	c->path = strdup(path);
+	niceassert(c->path, "out of memory");
+	c->first = c->last = now_ms();
+	change_append(ls, c);
+	change_hash_in(ls, c);
+	return c;
+}
+
+// Forget every pending change below (and including) dir
+static void change_drop_subtree(linkstate *ls, char const *dir) {
+	change *c, *next;
+	int len = strlen(dir);
+
+	for (c = ls->changes.next; c != &ls->changes; c = next) {
+		next = c->next;
+		if (in_subtree(c->path, dir, len))
+			change_free(ls, c);
+	}
+}
+
+static void change_reset(linkstate *ls) {
+	while (ls->changes.next != &ls->changes)
+		change_free(ls, ls->changes.next);
+}
+
+/*
+ * Echo table.
+ *
+ * Whatever remote_watcher() applies to the local folder shows up in the
+ * watcher's events like any local edit.  The feed notes how it left each
+ * path, and a pending change whose path still looks exactly like that is
+ * dropped instead of being sent back to the device.
+ */
+
+struct echo {
+	echo *next;
+	char *path;
+	int gone;
+	struct stat st;
+};
+
+static echo *echo_find(linkstate *ls, char const *path) {
+	echo *e;
+
+	for (e = ls->echo_hash[hash_path(path)]; e; e = e->next) {
+		if (!strcmp(e->path, path))
+			return e;
+	}
+	return NULL;
+}
+
+static void echo_forget(linkstate *ls, echo *e) {
+	echo **pe = &ls->echo_hash[hash_path(e->path)];
+
+	while (*pe != e)
+		pe = &(*pe)->next;
+	*pe = e->next;
+	free(e->path);
+	free(e);
+}
+
+// Remember how the feed left path
+static void echo_note(linkstate *ls, char const *path) {
+	echo *e = echo_find(ls, path);
+
+	if (!e) {
+		unsigned h = hash_path(path);
+
+		e = (echo *) calloc(1, sizeof(echo));
+		niceassert(e, "out of memory");
+		e->path = strdup(path);
+		niceassert(e->path, "out of memory");
+		e->next = ls->echo_hash[h];
+		ls->echo_hash[h] = e;
+	}
+	e->gone = lstat(path, &e->st) != 0;
+}
+
+static int echo_same(echo *e, struct stat *st) {
+	if (e->gone || !st)
+		return e->gone && !st;
+	if (st->st_ino != e->st.st_ino ||
+			(st->st_mode & S_IFMT) != (e->st.st_mode & S_IFMT))
+		return 0;
+	// a directory's times move with whatever the feed puts in it
+	if (S_ISDIR(st->st_mode))
+		return 1;
+	return st->st_size == e->st.st_size && st->st_mtime == e->st.st_mtime &&
+		st->st_ctime == e->st.st_ctime;
+}
+
+// Is path, as it is now, only what the feed made of it
+static int echo_match(linkstate *ls, char const *path) {
+	struct stat st;
+	int exists = lstat(path, &st) == 0;
+	echo *e = echo_find(ls, path);
+	char *dir, *slash;
+	int ret = 0;
+
+	if (e) {
+		if (echo_same(e, exists ? &st : NULL))
+			return 1;
+		echo_forget(ls, e);
+		return 0;
+	}
+	if (exists)
+		return 0;
+
+	// gone along with a directory the feed removed
+	dir = strdup(path);
+	niceassert(dir, "out of memory");
+	while (!ret && (slash = strrchr(dir, '/')) != NULL) {
+		*slash = 0;
+		e = echo_find(ls, dir);
+		ret = e && e->gone && lstat(dir, &st) != 0;
+	}
+	free(dir);
+	return ret;
+}
+
+static void echo_reset(linkstate *ls) {
+	int h;
+
+	for (h = 0; h < CHANGE_HASH_SIZE; h++) {
+		while (ls->echo_hash[h])
+			echo_forget(ls, ls->echo_hash[h]);
+	}
+}
+
+// A local path below link->lpath, relative to it
+static char const *link_rel(linkinfo *link, char const *path) {
+	char const *rel = path + strlen(link->lpath);
+
+	while (*rel == '/') rel++;
+	return rel;
+}
+
+// Map a local path below link->lpath to the matching path on the device.
+// link->rpath must end in '/'.
+static char* remote_path(linkinfo *link, char const *path) {
+	char *rpath;
+
+	nasprintf(&rpath, "%s%s", link->rpath, link_rel(link, path));
+	return rpath;
+}
+
+/*
+ * Synced table.
+ *
+ * What both sides held the last time they agreed, by path relative to the
+ * folders, with the device's size and mtime for files.  do_link() fills it
+ * in, and the watcher's pushes and removals and the feed's pulls keep it
+ * up.  When events were lost, an entry that only the device has is a local
+ * deletion if the table has it just as the device does; anything else is
+ * the device's own, and left to the feed.
+ */
+
+#define SYNCED_HASH_SIZE 65536
+
+struct synced {
+	synced *next;
+	char *path;
+	int is_dir;
+	unsigned size;
+	unsigned time;
+};
+
+static unsigned synced_hash(char const *rel) {
+	unsigned h = 5381;
+	while (*rel)
+		h = h * 33 + (unsigned char) *rel++;
+	return h % SYNCED_HASH_SIZE;
+}
+
+static synced *synced_find(linkstate *ls, char const *rel) {
+	synced *e;
 
-	strcpy(mydir, STRINGIFY(RPATH));
-	strcat(mydir, &dir[len]);
+	for (e = ls->synced_hash[synced_hash(rel)]; e; e = e->next) {
+		if (!strcmp(e->path, rel))
+			return e;
+	}
+	return NULL;
+}
+
+static void synced_note(linkstate *ls, char const *rel, int is_dir,
+		unsigned size, unsigned time) {
+	synced *e = synced_find(ls, rel);
+
+	if (!e) {
+		unsigned h = synced_hash(rel);
+
+		e = (synced *) calloc(1, sizeof(synced));
+		niceassert(e, "out of memory");
+		e->path = strdup(rel);
+		niceassert(e->path, "out of memory");
+		e->next = ls->synced_hash[h];
+		ls->synced_hash[h] = e;
+	}
+	e->is_dir = is_dir;
+	e->size = size;
+	e->time = time;
+}
+
+static void synced_forget(linkstate *ls, char const *rel) {
+	synced **pe = &ls->synced_hash[synced_hash(rel)];
+	synced *e;
+
+	while ((e = *pe) != NULL) {
+		if (!strcmp(e->path, rel)) {
+			*pe = e->next;
+			free(e->path);
+			free(e);
+			return;
+		}
+		pe = &e->next;
+	}
+}
+
+static void synced_reset(linkstate *ls) {
+	synced *e;
+	int h;
+
+	for (h = 0; h < SYNCED_HASH_SIZE; h++) {
+		while ((e = ls->synced_hash[h]) != NULL) {
+			ls->synced_hash[h] = e->next;
+			free(e->path);
+			free(e);
+		}
+	}
+}
+
+// do_link()'s report; the directories on the way to a file are synced too
+static void synced_from_link(char const *rel, unsigned size, unsigned time,
+		void *cookie) {
+	linkstate *ls = (linkstate *) cookie;
+	char *dir, *slash;
+
+	synced_note(ls, rel, 0, size, time);
+	dir = strdup(rel);
+	niceassert(dir, "out of memory");
+	while ((slash = strrchr(dir, '/')) != NULL) {
+		*slash = 0;
+		if (synced_find(ls, dir))
+			break;
+		synced_note(ls, dir, 1, 0, 0);
+	}
+	free(dir);
+}
+
+static int link_ignored(linkinfo *link, char const *path, int is_dir);
+
+// path was just pushed: a push carries the mtime along, and a directory
+// brings whatever it holds
+static void synced_pushed(linkinfo *link, char const *path) {
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	if (lstat(path, &st) || link_ignored(link, path, S_ISDIR(st.st_mode)))
+		return;
+	if (!S_ISDIR(st.st_mode)) {
+		if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+			synced_note(link->state, link_rel(link, path), 0, st.st_size,
+					st.st_mtime);
+		return;
+	}
+
+	synced_note(link->state, link_rel(link, path), 1, 0, 0);
+	dir = opendir(path);
+	if (!dir)
+		return;
+	while ((de = readdir(dir))) {
+		char *sub;
 
-	return mydir;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		nasprintf(&sub, "%s/%s", path, de->d_name);
+		synced_pushed(link, sub);
+		free(sub);
+	}
+	closedir(dir);
 }
 
-// Watcher
-void *watcher(void *path) {
-	char * moved_from = 0;
-	int events = IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_MODIFY;
+// Is the device's entry at path, which the local folder no longer has,
+// what both sides last agreed on; a link's mtime is not carried over
+static int synced_match(linkinfo *link, char const *path, unsigned mode,
+		unsigned size, unsigned time) {
+	synced *e = synced_find(link->state, link_rel(link, path));
 
-	int plen = strlen((char *) path);
+	if (!e || e->is_dir != S_ISDIR(mode))
+		return 0;
+	return e->is_dir || (e->size == size &&
+			(e->time == time || S_ISLNK(mode)));
+}
+
+// Run a one-shot shell command on the device and wait for it to finish
+static int link_shell(linkinfo *link, char const *cmd) {
+	char buf[4096];
+	int fd;
 
-	// initialize and watch the entire directory tree from the current working
-	// directory downwards for all events
-	if (!inotifytools_initialize() || !inotifytools_watch_recursively(path,
-			events)) {
-		fprintf(stderr, "%s\n", strerror(inotifytools_error()));
+	snprintf(buf, sizeof buf, "shell:%s", cmd);
+	fd = adb_connect_serial(buf, link->device);
+	if (fd < 0) {
+		fprintf(stderr, "error: %s\n", adb_error());
 		return -1;
-	} else {
-		fprintf(stderr, "Watching %s\n", (char *) path);
 	}
+	while (adb_read(fd, buf, sizeof buf) > 0)
+		;
+	adb_close(fd);
+	return 0;
+}
 
-	// set time format to 24 hour time, HH:MM:SS
-	inotifytools_set_printf_timefmt("%T");
+// The device closes the session when it sees a request it does not know
+static void link_reconnect(linkinfo *link) {
+	adb_close(link->syncfd);
+	link->syncfd = sync_link_connect(link->device);
+}
 
-	// Output all events as "<timestamp> <path> <events>"
-	struct inotify_event * event = inotifytools_next_event(-1);
-	while (event) {
-		inotifytools_printf(event, "%T %w%f %e\n");
-
-		// For recursivity
-		if ((event->mask & IN_CREATE) || (!moved_from && (event->mask
-				& IN_MOVED_TO))) {
-			// New file - if it is a directory, watch it
-			static char * new_file;
-
-			nasprintf(&new_file, "%s%s", inotifytools_filename_from_wd(
-							event->wd), event->name);
-			//ACTION
-			if(isdir(new_file)) {
-				int fd;
-				char buf[4096];
-				snprintf(buf, sizeof buf, "shell:mkdir \"%s\%s\"", fdir(
-					inotifytools_filename_from_wd(event->wd), plen), event->name);
-				fd = adb_connect(buf);
-				adb_read(fd, buf, 4096);
-				if (fd < 0) {
-					fprintf(stderr,"error: %s\n", adb_error());
-					return -1;
-				}
-				adb_close(fd);
-			} else {
-				do_sync_push(new_file, fdir(inotifytools_filename_from_wd(
-					event->wd), plen), 0);
-			}
+static void link_unsupported(linkinfo *link) {
+	fprintf(stderr, "* Device does not support sync mkdir/rename, "
+			"falling back to shell commands *\n");
+	link->state->native_verbs = 0;
+	link_reconnect(link);
+}
 
-			if (isdir(new_file) && !inotifytools_watch_recursively(new_file,
-					events)) {
-				fprintf(stderr, "Couldn't watch new directory %s: %s\n",
-						new_file, strerror(inotifytools_error()));
-			}
-			free(new_file);
-		} // IN_CREATE
-		else if (event->mask & IN_MOVED_FROM) {
-			nasprintf(&moved_from, "%s%s/", inotifytools_filename_from_wd(
-							event->wd), event->name);
-			//ACTION
-			int fd;
-			char buf[4096];
-			snprintf(buf, sizeof buf, "shell:rm -r \"%s\%s\"", fdir(
-				inotifytools_filename_from_wd(event->wd), plen), event->name);
-			fd = adb_connect(buf);
-			adb_read(fd, buf, 4096);
-			if (fd < 0) {
-				fprintf(stderr,"error: %s\n", adb_error());
-				return -1;
+static void link_push(linkinfo *link, char const *path, char const *rpath) {
+	// the ignore patterns are the sync client's, and so shared by all links
+	sync_set_ignore(link->ignore, link->lpath);
+	if (sync_link_push(link->syncfd, path, rpath, link->state->delta_push)
+			== SYNC_UNSUPPORTED) {
+		fprintf(stderr, "* Device does not support delta pushes *\n");
+		link->state->delta_push = 0;
+		link_reconnect(link);
+		sync_link_push(link->syncfd, path, rpath, 0);
+	}
+}
+
+// Actions, all of them replayed on the device from the coalescing stage
+static void link_remove(linkinfo *link, char const *rpath) {
+	char *cmd;
+
+	if (link->state->native_verbs) {
+		if (sync_remove(link->syncfd, rpath) != SYNC_UNSUPPORTED)
+			return;
+		link_unsupported(link);
+	}
+	nasprintf(&cmd, "rm -r \"%s\"", rpath);
+	link_shell(link, cmd);
+	free(cmd);
+}
+
+static void link_mkdir(linkinfo *link, char const *rpath) {
+	char *cmd;
+
+	if (link->state->native_verbs) {
+		if (sync_mkdir(link->syncfd, rpath) != SYNC_UNSUPPORTED)
+			return;
+		link_unsupported(link);
+	}
+	nasprintf(&cmd, "mkdir \"%s\"", rpath);
+	link_shell(link, cmd);
+	free(cmd);
+}
+
+static void link_rename(linkinfo *link, char const *rfrom, char const *rto) {
+	char *cmd;
+
+	if (link->state->native_verbs) {
+		if (sync_rename(link->syncfd, rfrom, rto) != SYNC_UNSUPPORTED)
+			return;
+		link_unsupported(link);
+	}
+	nasprintf(&cmd, "mv \"%s\" \"%s\"", rfrom, rto);
+	link_shell(link, cmd);
+	free(cmd);
+}
+
+static void change_flush(linkinfo *link, change *c) {
+	char *rpath;
+
+	if (echo_match(link->state, c->path)) {
+		change_free(link->state, c);
+		return;
+	}
+
+	rpath = remote_path(link, c->path);
+	if (c->flags & CH_REMOVE) {
+		link_remove(link, rpath);
+		synced_forget(link->state, link_rel(link, c->path));
+	}
+	if (c->flags & CH_MKDIR) {
+		link_mkdir(link, rpath);
+		synced_note(link->state, link_rel(link, c->path), 1, 0, 0);
+	}
+	if (c->flags & CH_PUSH) {
+		link_push(link, c->path, rpath);
+		synced_pushed(link, c->path);
+	}
+
+	free(rpath);
+	change_free(link->state, c);
+}
+
+// Flush every change that has been quiet long enough, and return how long
+// to wait for the next one to be due (-1 when nothing is pending)
+static int change_flush_ready(linkinfo *link) {
+	long long now = now_ms();
+	change *c;
+
+	while ((c = link->state->changes.next) != &link->state->changes) {
+		if (c->last + link->quiet_ms > now)
+			return (int) (c->last + link->quiet_ms - now);
+		change_flush(link, c);
+	}
+	return -1;
+}
+
+// A file or directory appeared at path
+static void queue_create(linkinfo *link, char const *path, int is_dir) {
+	change *c = change_get(link->state, path, link->quiet_ms);
+
+	c->flags |= CH_NEW | (is_dir ? CH_MKDIR : CH_PUSH);
+}
+
+// Something was moved into the tree at path; unlike a create, the device may
+// already have an older copy, and a directory brings its whole contents.
+static void queue_moved_in(linkinfo *link, char const *path, int is_dir) {
+	change *c = change_get(link->state, path, link->quiet_ms);
+
+	c->flags |= is_dir ? (CH_MKDIR | CH_PUSH) : CH_PUSH;
+}
+
+static void queue_modify(linkinfo *link, char const *path) {
+	change *c = change_get(link->state, path, link->quiet_ms);
+
+	c->flags |= CH_PUSH;
+}
+
+// path was deleted, or moved out of the tree
+static void queue_delete(linkinfo *link, char const *path, int is_dir) {
+	linkstate *ls = link->state;
+	change *c = change_find(ls, path);
+	int flags = c ? c->flags : 0;
+
+	if (c)
+		change_free(ls, c);
+	if (is_dir)
+		change_drop_subtree(ls, path);
+
+	// something created in this window never reached the device, only an
+	// older copy it replaced may need removing
+	if ((flags & CH_NEW) && !(flags & CH_REMOVE))
+		return;
+
+	c = change_get(ls, path, link->quiet_ms);
+	c->flags = CH_REMOVE;
+}
+
+// from was renamed to to, both inside the tree
+static void queue_rename(linkinfo *link, char const *from, char const *to,
+		int is_dir) {
+	linkstate *ls = link->state;
+	change *c, *next;
+	int len = strlen(from);
+	char *rfrom, *rto;
+
+	c = change_find(ls, from);
+	if (c && (c->flags & CH_NEW)) {
+		// the device has no up to date copy of from: create to instead
+		queue_delete(link, from, is_dir);
+		queue_moved_in(link, to, is_dir);
+		return;
+	}
+
+	// everything else goes out first, so the rename finds the device as
+	// the tree was when it happened
+	for (c = ls->changes.next; c != &ls->changes; c = next) {
+		next = c->next;
+		if (!in_subtree(c->path, from, len))
+			change_flush(link, c);
+	}
+
+	// a rename made by the feed is already on the device
+	if (!echo_match(ls, from) || !echo_match(ls, to)) {
+		rfrom = remote_path(link, from);
+		rto = remote_path(link, to);
+		link_rename(link, rfrom, rto);
+		free(rfrom);
+		free(rto);
+	}
+
+	// what is left pending now lives below to
+	for (c = ls->changes.next; c != &ls->changes; c = c->next) {
+		char *path;
+
+		nasprintf(&path, "%s%s", to, c->path + len);
+		change_unhash(ls, c);
+		free(c->path);
+		c->path = path;
+		change_hash_in(ls, c);
+	}
+}
+
+// Is path, below the linked folder, one of the entries it ignores
+static int link_ignored(linkinfo *link, char const *path, int is_dir) {
+	int len = strlen(link->lpath);
+
+	if (!link->ignore || strncmp(path, link->lpath, len))
+		return 0;
+	while (path[len] == '/')
+		len++;
+	return ignore_path(link->ignore, path + len, is_dir);
+}
+
+// Ignored directories are neither watched nor read; the walk has already
+// checked the parents of the ones it is given
+static int link_walk_filter(char const *path, void *arg) {
+	linkinfo *link = (linkinfo *) arg;
+	char rel[PATH_MAX];
+	int len = strlen(link->lpath);
+	int n;
+
+	if (strncmp(path, link->lpath, len))
+		return 0;
+	while (path[len] == '/')
+		len++;
+	n = snprintf(rel, sizeof(rel), "%s", path + len);
+	if (n <= 0 || n >= (int) sizeof(rel))
+		return 0;
+	if (rel[n - 1] == '/')
+		rel[n - 1] = 0;
+	return ignore_match(link->ignore, rel, 1);
+}
+
+/*
+ * Watcher.
+ *
+ * The folders of all links are watched on one inotify instance, by one
+ * thread: it alone uses link_ctx.  Events are handed to the link whose
+ * folder they are in, and dropped while that link is offline.  link_up()
+ * and link_down() only flag the link and wake the watcher, which then
+ * watches or unwatches the folder itself.
+ */
+
+static inotifytools_ctx *link_ctx;
+static int wake_fds[2] = { -1, -1 };
+
+static void link_wake() {
+	char c = 0;
+
+	// a wakeup that is already pending will do just as well
+	adb_write(wake_fds[1], &c, 1);
+}
+
+// The link whose folder path is in, online or not
+static linkinfo *link_find(linkinfo *links, char const *path) {
+	linkinfo *link;
+
+	for (link = links; link; link = link->next) {
+		int len = strlen(link->lpath);
+
+		while (len > 1 && link->lpath[len - 1] == '/')
+			len--;
+		if (in_subtree(path, link->lpath, len))
+			return link;
+	}
+	return NULL;
+}
+
+// Watch path and the directories below it, leaving out what link ignores
+static int link_watch(linkinfo *link, char const *path) {
+	inotifytools_set_walk_filter_r(link_ctx,
+			link->ignore ? link_walk_filter : 0, link);
+	if (!inotifytools_watch_recursively_r(link_ctx, path, LINK_EVENTS)) {
+		fprintf(stderr, "Couldn't watch %s: %s\n", path,
+				strerror(inotifytools_error_r(link_ctx)));
+		return -1;
+	}
+	return 0;
+}
+
+// Bring the watches in line with which links are online
+static void link_update_watches(linkinfo *links) {
+	linkinfo *link;
+	long long start;
+	int state, online, num;
+
+	for (link = links; link; link = link->next) {
+		linkstate *ls = link->state;
+
+		link_enter(&state);
+		online = ls->online;
+		link_leave(state);
+
+		if (online && !ls->watching) {
+			// reading a large tree is mostly waiting on the disk, which a
+			// few threads can do at once
+			start = now_ms();
+			num = inotifytools_get_num_watches_r(link_ctx);
+			if (!link_watch(link, link->lpath)) {
+				fprintf(stderr, "Watching %s (%d directories in %lld ms)\n",
+						link->lpath,
+						inotifytools_get_num_watches_r(link_ctx) - num,
+						now_ms() - start);
 			}
-			adb_close(fd);
+			ls->watching = 1;
+		} else if (!online && ls->watching) {
+			inotifytools_remove_watches_below_r(link_ctx, link->lpath);
+			ls->watching = 0;
+		}
+	}
+}
+
+/*
+ * Recovery.
+ *
+ * When the kernel drops events (IN_Q_OVERFLOW) or a new directory cannot be
+ * watched, the folder may have changed without the watcher seeing it.  The
+ * subtree is marked dirty and compared with the device one directory at a
+ * time, between batches of live events, and whatever differs is queued as
+ * if its events had been seen.
+ */
+
+struct dirtydir {
+	dirtydir *next;
+	char *path;          // local directory, without a trailing /
+};
+
+static void dirty_free(dirtydir *d) {
+	free(d->path);
+	free(d);
+}
+
+static void dirty_reset(linkstate *ls) {
+	dirtydir *d;
+
+	while ((d = ls->dirty) != NULL) {
+		ls->dirty = d->next;
+		dirty_free(d);
+	}
+	ls->dirty_tail = &ls->dirty;
+}
+
+// Queue the subtree at path for a rescan, unless it is part of one already
+static void dirty_add(linkstate *ls, char const *path) {
+	dirtydir *d, **pd;
+	int len = strlen(path);
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	for (d = ls->dirty; d; d = d->next) {
+		if (in_subtree(path, d->path, strlen(d->path)))
+			return;
+	}
+
+	// and it takes in the ones below it
+	for (pd = &ls->dirty; (d = *pd) != NULL; ) {
+		if (!strncmp(d->path, path, len) &&
+				(d->path[len] == 0 || d->path[len] == '/')) {
+			*pd = d->next;
+			dirty_free(d);
+		} else {
+			pd = &d->next;
+		}
+	}
+	ls->dirty_tail = pd;
+
+	d = (dirtydir *) calloc(1, sizeof(dirtydir));
+	niceassert(d, "out of memory");
+	d->path = strndup(path, len);
+	niceassert(d->path, "out of memory");
+	*ls->dirty_tail = d;
+	ls->dirty_tail = &d->next;
+}
+
+// The kernel dropped events: nothing that is watched can be trusted
+static void link_overflow(linkinfo *links) {
+	linkinfo *link;
+
+	fprintf(stderr, "* Events were lost, rescanning *\n");
+	for (link = links; link; link = link->next) {
+		if (!link->state->online)
+			continue;
+		link->state->stats.overflows++;
+		dirty_add(link->state, link->lpath);
+	}
+}
+
+static void link_watch_failed(linkinfo *link, char const *path) {
+	link->state->stats.watch_failures++;
+	dirty_add(link->state, path);
+}
+
+typedef struct {
+	char *name;
+	unsigned mode;
+	unsigned size;
+	unsigned time;
+	int seen;
+} rentry;
+
+typedef struct {
+	rentry *e;
+	int count;
+	int max;
+} rlist;
+
+static void rlist_add(unsigned mode, unsigned size, unsigned time,
+		char const *name, void *cookie) {
+	rlist *l = (rlist *) cookie;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return;
+	if (l->count == l->max) {
+		l->max = l->max ? l->max * 2 : 64;
+		l->e = (rentry *) realloc(l->e, l->max * sizeof(rentry));
+		niceassert(l->e, "out of memory");
+	}
+	l->e[l->count].name = strdup(name);
+	niceassert(l->e[l->count].name, "out of memory");
+	l->e[l->count].mode = mode;
+	l->e[l->count].size = size;
+	l->e[l->count].time = time;
+	l->e[l->count].seen = 0;
+	l->count++;
+}
+
+static int rentry_cmp(const void *a, const void *b) {
+	return strcmp(((rentry *) a)->name, ((rentry *) b)->name);
+}
+
+// Compare one dirty directory with the device and queue what differs; its
+// subdirectories that the device has too are rescanned in turn
+static void link_rescan(linkinfo *link, dirtydir *d) {
+	linkstate *ls = link->state;
+	rlist remote = { 0, 0, 0 };
+	rentry key, *r;
+	change *c;
+	struct dirent *de;
+	struct stat st;
+	char *rdir, *path;
+	DIR *dir;
+	int i;
+
+	ls->stats.rescans++;
+
+	// a directory whose watch failed gets another chance
+	nasprintf(&path, "%s/", d->path);
+	if (inotifytools_wd_from_filename_r(link_ctx, path) < 0)
+		link_watch(link, d->path);
+	free(path);
 
-			// if not watched...
-			if (inotifytools_wd_from_filename(moved_from) == -1) {
-				free(moved_from);
-				moved_from = 0;
+	rdir = remote_path(link, d->path);
+	if (sync_ls(link->syncfd, rdir, rlist_add, &remote)) {
+		fprintf(stderr, "Couldn't list %s\n", rdir);
+		link->syncfd = sync_link_connect(link->device);
+		goto done;
+	}
+	qsort(remote.e, remote.count, sizeof(rentry), rentry_cmp);
+
+	dir = opendir(d->path);
+	if (!dir)
+		goto done;
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		nasprintf(&path, "%s/%s", d->path, de->d_name);
+		key.name = de->d_name;
+		r = (rentry *) bsearch(&key, remote.e, remote.count, sizeof(rentry),
+				rentry_cmp);
+		if (r)
+			r->seen = 1;
+
+		if (lstat(path, &st) || link_ignored(link, path, S_ISDIR(st.st_mode))) {
+			// gone again, or never synced
+		} else if ((c = change_find(ls, path)) != NULL) {
+			// already on its way, but a new directory only brings itself
+			if (S_ISDIR(st.st_mode) && !(c->flags & CH_PUSH))
+				dirty_add(ls, path);
+		} else if (r && (r->mode & S_IFMT) == (st.st_mode & S_IFMT)) {
+			if (S_ISDIR(st.st_mode)) {
+				dirty_add(ls, path);
+			} else if (S_ISREG(st.st_mode) && (r->size != st.st_size ||
+					r->time != st.st_mtime)) {
+				queue_modify(link, path);
+				ls->stats.recovered++;
 			}
-		} // IN_MOVED_FROM
-		else if (event->mask & IN_MOVED_TO) {
-			static char * new_name;
-			nasprintf(&new_name, "%s%s/", inotifytools_filename_from_wd(
-							event->wd), event->name);
-			//ACTION
-			if(isdir(new_name)) {
-				int fd;
-				char buf[4096];
-				snprintf(buf, sizeof buf, "shell:mkdir \"%s\%s\"", fdir(
-					inotifytools_filename_from_wd(event->wd), plen), event->name);
-				fd = adb_connect(buf);
-				adb_read(fd, buf, 4096);
-				if (fd < 0) {
-					fprintf(stderr,"error: %s\n", adb_error());
-					return -1;
-				}
-				adb_close(fd);
+		} else if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode) ||
+				S_ISLNK(st.st_mode)) {
+			if (r)
+				queue_delete(link, path, S_ISDIR(r->mode));
+			queue_moved_in(link, path, S_ISDIR(st.st_mode));
+			ls->stats.recovered++;
+		}
+		free(path);
+	}
+	closedir(dir);
+
+	// what only the device has was removed here while events were lost, if
+	// the device still has it as both sides last did; anything else turned
+	// up on the device and the feed brings it over
+	for (i = 0; i < remote.count; i++) {
+		r = &remote.e[i];
+		if (r->seen)
+			continue;
+		nasprintf(&path, "%s/%s", d->path, r->name);
+		if (lstat(path, &st) && !change_find(ls, path) &&
+				!link_ignored(link, path, S_ISDIR(r->mode)) &&
+				synced_match(link, path, r->mode, r->size, r->time)) {
+			queue_delete(link, path, S_ISDIR(r->mode));
+			ls->stats.recovered++;
+		}
+		free(path);
+	}
+
+done:
+	for (i = 0; i < remote.count; i++)
+		free(remote.e[i].name);
+	free(remote.e);
+	free(rdir);
+}
+
+// Rescan the next dirty directory of each link; returns whether any are left
+static int link_recover_step(linkinfo *links) {
+	linkinfo *link;
+	int more = 0;
+
+	for (link = links; link; link = link->next) {
+		linkstate *ls = link->state;
+		dirtydir *d = ls->dirty;
+
+		if (!d || !ls->online)
+			continue;
+		ls->dirty = d->next;
+		if (!ls->dirty)
+			ls->dirty_tail = &ls->dirty;
+		link_rescan(link, d);
+		dirty_free(d);
+
+		if (ls->dirty)
+			more = 1;
+		else
+			fprintf(stderr, "* Rescanned %s, %u changes recovered so far *\n",
+					link->lpath, ls->stats.recovered);
+	}
+	return more;
+}
+
+void link_stats(linkinfo *link, linkstats *st) {
+	int state;
+
+	link_enter(&state);
+	*st = link->state->stats;
+	link_leave(state);
+}
+
+// A MOVED_FROM waiting for its MOVED_TO
+typedef struct {
+	char *path;
+	linkinfo *link;      // NULL unless the path is synced
+	unsigned cookie;
+	int is_dir;
+} pending_move;
+
+// The file left the tree
+static void moved_out(pending_move *moved) {
+	if (moved->link)
+		queue_delete(moved->link, moved->path, moved->is_dir);
+	free(moved->path);
+	moved->path = 0;
+}
+
+static void link_event(linkinfo *links, struct inotify_event *event,
+		pending_move *moved) {
+	char *dir = inotifytools_filename_from_wd_r(link_ctx, event->wd);
+	int is_dir = (event->mask & IN_ISDIR) != 0;
+	linkinfo *link;
+	char *path;
+	int synced;
+
+	// Resolve a pending MOVED_FROM: either this is its MOVED_TO, or the
+	// file left the tree
+	if (moved->path && (!(event->mask & IN_MOVED_TO) ||
+			event->cookie != moved->cookie))
+		moved_out(moved);
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		link_overflow(links);
+		return;
+	}
+
+	// the watch itself is already gone
+	if (!dir)
+		return;
+
+	// Output all events as "<timestamp> <path> <events>"
+	inotifytools_printf_r(link_ctx, event, "%T %w%f %e\n");
+
+	nasprintf(&path, "%s%s", dir, event->name);
+	link = link_find(links, path);
+	synced = link && link->state->online && !link_ignored(link, path, is_dir);
+
+	if (event->mask & IN_MOVED_FROM) {
+		moved->path = path;
+		moved->link = synced ? link : NULL;
+		moved->cookie = event->cookie;
+		moved->is_dir = is_dir;
+		return;
+	}
+
+	if (event->mask & IN_MOVED_TO) {
+		if (moved->path) {
+			// a rename across links or across the ignore patterns is a
+			// plain delete and create as far as the devices are concerned
+			if (moved->link && moved->link == link && synced) {
+				queue_rename(link, moved->path, path, is_dir);
 			} else {
-				do_sync_push(new_name, fdir(inotifytools_filename_from_wd(
-					event->wd), plen), 0);
+				if (moved->link)
+					queue_delete(moved->link, moved->path, is_dir);
+				if (synced)
+					queue_moved_in(link, path, is_dir);
+			}
+
+			if (is_dir && moved->link) {
+				// keep the watches below the directory under its new name
+				char *old_dir, *new_dir;
+
+				nasprintf(&old_dir, "%s/", moved->path);
+				nasprintf(&new_dir, "%s/", path);
+				inotifytools_replace_filename_r(link_ctx, old_dir, new_dir);
+				free(old_dir);
+				free(new_dir);
+			} else if (is_dir && synced && link_watch(link, path)) {
+				link_watch_failed(link, path);
 			}
+			free(moved->path);
+			moved->path = 0;
+		} else if (synced) {
+			queue_moved_in(link, path, is_dir);
+			if (is_dir && link_watch(link, path))
+				link_watch_failed(link, path);
+		}
+	} // IN_MOVED_TO
+	else if (!synced) {
+		// never synced, and an ignored directory is not watched
+	}
+	else if (event->mask & IN_CREATE) {
+		// New file - if it is a directory, watch it
+		is_dir = isdir(path);
+		queue_create(link, path, is_dir);
+		if (is_dir && link_watch(link, path))
+			link_watch_failed(link, path);
+	} // IN_CREATE
+	else if (event->mask & IN_MODIFY) {
+		queue_modify(link, path);
+	}
+	else if (event->mask & IN_DELETE) {
+		queue_delete(link, path, is_dir);
+	}
+
+	free(path);
+}
 
-			if (moved_from) {
-				inotifytools_replace_filename(moved_from, new_name);
-				free(moved_from);
-				moved_from = 0;
-			} // moved_from
+static linkinfo *watched_links;
+static pending_move moved;   // under link_lock, like the rest
+
+// Fold every event the kernel has queued into the pending changes.  The
+// feed does this too before it touches the local folder, so that an edit
+// already made there is a pending change it leaves alone, however far
+// behind the watcher thread is.
+static void link_drain_events() {
+	struct inotify_event *event;
+
+	// MOVED_FROM and its MOVED_TO are queued together by the kernel, so a
+	// MOVED_FROM still unpaired once the queue is drained left the tree
+	while ((event = inotifytools_next_events_ms_r(link_ctx, 0, 1)))
+		link_event(watched_links, event, &moved);
+	if (moved.path)
+		moved_out(&moved);
+}
+
+// Flush what is due on every online link, and return how long to wait for
+// the next change to be (-1 when nothing is pending)
+static int link_flush_ready(linkinfo *links) {
+	linkinfo *link;
+	int timeout = -1, t;
+
+	for (link = links; link; link = link->next) {
+		if (!link->state->online)
+			continue;
+		t = change_flush_ready(link);
+		if (t >= 0 && (timeout < 0 || t < timeout))
+			timeout = t;
+	}
+	return timeout;
+}
+
+static void *watcher(void *arg) {
+	linkinfo *links = (linkinfo *) arg;
+	struct pollfd pfd[2];
+	char buf[64];
+	int timeout = -1;
+	int state;
+
+	pfd[0].fd = inotifytools_ctx_fd(link_ctx);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wake_fds[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		pfd[0].revents = pfd[1].revents = 0;
+		if (poll(pfd, 2, timeout) < 0 && errno != EINTR) {
+			fprintf(stderr, "watcher: %s\n", strerror(errno));
+			break;
 		}
-		else if (event->mask & IN_MODIFY) {
-			static char * new_name;
-			nasprintf(&new_name, "%s%s", inotifytools_filename_from_wd(
-							event->wd), event->name);
-			//ACTION
-			do_sync_push(new_name, fdir(inotifytools_filename_from_wd(
-					event->wd), plen), 0);
+
+		if (pfd[1].revents & POLLIN) {
+			while (adb_read(wake_fds[0], buf, sizeof buf) > 0)
+				;
+			link_update_watches(links);
 		}
-		else if (event->mask & IN_DELETE) {
-			//ACTION
-			int fd;
-			char buf[4096];
-			snprintf(buf, sizeof buf, "shell:rm -r \"%s\%s\"", fdir(
-					inotifytools_filename_from_wd(event->wd), plen), event->name);
-			fd = adb_connect(buf);
-			adb_read(fd, buf, 4096);
-			if (fd < 0) {
-				fprintf(stderr,"error: %s\n", adb_error());
-				return -1;
-			}
-			adb_close(fd);
+
+		link_enter(&state);
+		if (pfd[0].revents & POLLIN)
+			link_drain_events();
+		timeout = link_flush_ready(links);
+		// dirty directories are rescanned one at a time, between events
+		if (link_recover_step(links))
+			timeout = 0;
+		link_leave(state);
+	}
+	return NULL;
+}
+
+int link_watch_start(linkinfo *links) {
+	linkinfo *link;
+	pthread_t thread;
+	int i;
+
+	link_ctx = inotifytools_ctx_new();
+	if (!link_ctx) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+	inotifytools_set_walk_threads_r(link_ctx, LINK_WALK_THREADS);
+	// set time format to 24 hour time, HH:MM:SS
+	inotifytools_set_printf_timefmt_r(link_ctx, "%T");
+
+	if (pipe(wake_fds)) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		close_on_exec(wake_fds[i]);
+		fcntl(wake_fds[i], F_SETFL, O_NONBLOCK);
+	}
+
+	for (link = links; link; link = link->next) {
+		linkstate *ls = (linkstate *) calloc(1, sizeof(linkstate));
+
+		niceassert(ls, "out of memory");
+		ls->synced_hash = (synced **) calloc(SYNCED_HASH_SIZE,
+				sizeof(synced *));
+		niceassert(ls->synced_hash, "out of memory");
+		ls->changes.next = ls->changes.prev = &ls->changes;
+		ls->dirty_tail = &ls->dirty;
+		link->state = ls;
+	}
+
+	watched_links = links;
+	if (pthread_create(&thread, NULL, watcher, links)) {
+		fprintf(stderr, "Couldn't start the watcher\n");
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+static void *remote_watcher(void *arg);
+
+// Sync the link with the device serial, then keep it in sync.  Other links
+// wait for the initial sync, which holds link_lock for the sync client.
+int link_up(linkinfo *link, char const *serial) {
+	linkstate *ls = link->state;
+	int state, ret;
+
+	link->device = strdup(serial);
+	niceassert(link->device, "out of memory");
+
+	// one sync session per connection, shared with the watcher
+	link->syncfd = sync_link_connect(serial);
+	ret = link->syncfd < 0;
+	if (!ret) {
+		link_enter(&state);
+		synced_reset(ls);
+		ret = do_link(link, serial, synced_from_link, ls);
+		if (!ret) {
+			// anything left over from a previous connection was covered
+			// by do_link()
+			change_reset(ls);
+			dirty_reset(ls);
+			ls->native_verbs = 1;
+			ls->delta_push = 1;
+			ls->online = 1;
+		}
+		link_leave(state);
+	}
+	if (ret) {
+		sync_link_disconnect(link->syncfd);
+		link->syncfd = -1;
+		free(link->device);
+		link->device = NULL;
+		return -1;
+	}
+
+	link_wake();
+	// and remote edits come back as they happen
+	ls->feed_running = !pthread_create(&ls->feed, NULL, remote_watcher, link);
+	return 0;
+}
+
+void link_down(linkinfo *link) {
+	linkstate *ls = link->state;
+	int state;
+
+	if (!link->device)
+		return;
+	if (ls->feed_running) {
+		pthread_cancel(ls->feed);
+		pthread_join(ls->feed, NULL);
+		ls->feed_running = 0;
+	}
+
+	link_enter(&state);
+	ls->online = 0;
+	change_reset(ls);
+	dirty_reset(ls);
+	echo_reset(ls);
+	synced_reset(ls);
+	sync_link_disconnect(link->syncfd);
+	link->syncfd = -1;
+	free(link->device);
+	link->device = NULL;
+	link_leave(state);
+	link_wake();
+}
+
+/*
+ * Change feed.
+ *
+ * remote_watcher() follows the device's "watch:" service (see
+ * file_sync_service.h) and brings each change it reports over to the local
+ * folder, pulling files over a sync session of its own.  Local edits that
+ * are still pending win over the device's: they are on their way there.
+ * Edits the watcher thread has not read yet count as pending too, as the
+ * feed drains the kernel's queue before each change it applies.
+ */
+
+// A name from the device must stay below the local folder
+static int feed_name_ok(char const *rel) {
+	char const *p = rel;
+
+	if (rel[0] == 0 || rel[0] == '/')
+		return 0;
+	while (p) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == 0 || p[2] == '/'))
+			return 0;
+		p = strchr(p, '/');
+		if (p)
+			p++;
+	}
+	return 1;
+}
+
+static char* local_path(linkinfo *link, char const *rel) {
+	char *path;
+	int len = strlen(link->lpath);
+
+	nasprintf(&path, "%s%s%s", link->lpath,
+			(len && link->lpath[len - 1] == '/') ? "" : "/", rel);
+	return path;
+}
+
+// rm -r
+static int remove_local(char const *path) {
+	struct stat st;
+	struct dirent *de;
+	DIR *d;
+
+	if (lstat(path, &st))
+		return 0;
+	if (!S_ISDIR(st.st_mode))
+		return adb_unlink(path);
+
+	d = opendir(path);
+	if (d) {
+		while ((de = readdir(d))) {
+			char *sub;
+
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			nasprintf(&sub, "%s/%s", path, de->d_name);
+			remove_local(sub);
+			free(sub);
+		}
+		closedir(d);
+	}
+	return rmdir(path);
+}
+
+// Does the local copy need the device's, as described by the feed.  A
+// pending change means the local copy is newer and on its way there.
+static int feed_wanted(linkinfo *link, char const *path, unsigned size,
+		unsigned time) {
+	struct stat st;
+
+	if (change_find(link->state, path))
+		return 0;
+	return lstat(path, &st) || !S_ISREG(st.st_mode) ||
+		st.st_size != size || st.st_mtime != time;
+}
+
+static int feed_filter(char const *path, unsigned mode, unsigned size,
+		unsigned time, int pulled, void *cookie) {
+	linkinfo *link = (linkinfo *) cookie;
+
+	if (pulled) {
+		echo_note(link->state, path);
+		synced_note(link->state, link_rel(link, path), 0, size, time);
+		return 0;
+	}
+	// a rescan is long: catch up with the local folder as it goes
+	link_drain_events();
+	if (feed_wanted(link, path, size, time))
+		return 1;
+	if (!change_find(link->state, path))
+		synced_note(link->state, link_rel(link, path), 0, size, time);
+	return 0;
+}
+
+// DENT: rel was created or changed on the device
+static int feed_dent(linkinfo *link, int fd, char const *rel, unsigned mode,
+		unsigned size, unsigned time) {
+	char *path = local_path(link, rel);
+	struct stat st;
+	int ret = 0;
+
+	if (S_ISDIR(mode)) {
+		if (!change_find(link->state, path) &&
+				(lstat(path, &st) || !S_ISDIR(st.st_mode))) {
+			remove_local(path);
+			if (adb_mkdir(path, 0775))
+				fprintf(stderr, "cannot create '%s': %s\n", path,
+						strerror(errno));
+			echo_note(link->state, path);
 		}
+		if (!change_find(link->state, path))
+			synced_note(link->state, rel, 1, 0, 0);
+	} else if (S_ISREG(mode) && feed_wanted(link, path, size, time)) {
+		char *rpath;
+
+		nasprintf(&rpath, "%s%s", link->rpath, rel);
+		ret = sync_link_pull(fd, rpath, path, time);
+		echo_note(link->state, path);
+		if (!ret)
+			synced_note(link->state, rel, 0, size, time);
+		else if (ret > 0)
+			// changed while it was read: its next DENT pulls it
+			ret = 0;
+		free(rpath);
+	} else if (S_ISREG(mode) && !change_find(link->state, path)) {
+		// the same here already
+		synced_note(link->state, rel, 0, size, time);
+	}
+	free(path);
+	return ret;
+}
+
+// ULNK: rel is gone from the device
+static void feed_unlink(linkinfo *link, char const *rel) {
+	char *path = local_path(link, rel);
+	struct stat st;
+
+	if (!change_find(link->state, path) && lstat(path, &st) == 0) {
+		fprintf(stderr, "remove: %s\n", path);
+		if (remove_local(path))
+			fprintf(stderr, "cannot remove '%s': %s\n", path,
+					strerror(errno));
+		echo_note(link->state, path);
+	}
+	synced_forget(link->state, rel);
+	free(path);
+}
+
+// RENM: from was renamed to to on the device
+static void feed_rename(linkinfo *link, char const *from, char const *to) {
+	char *lfrom = local_path(link, from);
+	char *lto = local_path(link, to);
+	struct stat st;
+
+	// nothing to do when it is the device catching up with a local rename
+	if (lstat(lfrom, &st) == 0) {
+		fprintf(stderr, "rename: %s -> %s\n", lfrom, lto);
+		if (rename(lfrom, lto))
+			fprintf(stderr, "cannot rename '%s': %s\n", lfrom,
+					strerror(errno));
+		echo_note(link->state, lfrom);
+		echo_note(link->state, lto);
+	}
+	synced_forget(link->state, from);
+	free(lfrom);
+	free(lto);
+}
+
+// ULNK and RENM do not say whether the entry is a directory, so it is
+// ignored if it would be either way
+static int feed_ignored(linkinfo *link, char const *rel) {
+	return ignore_path(link->ignore, rel, 0) ||
+		ignore_path(link->ignore, rel, 1);
+}
+
+static void feed_cleanup(void *arg) {
+	int *fds = (int *) arg;
 
-		event = inotifytools_next_event(-1);
+	if (fds[0] >= 0)
+		adb_close(fds[0]);
+	sync_link_disconnect(fds[1]);
+}
+
+// Change feed
+static void *remote_watcher(void *arg) {
+	linkinfo *link = (linkinfo *) arg;
+	int fds[2] = { -1, -1 };   // the feed, and a sync session for pulls
+	char name[WATCH_NAME_MAX * 2 + 2];
+	syncmsg msg;
+	char *cmd, *lpath;
+	int len, state, stop = 0;
+
+	pthread_cleanup_push(feed_cleanup, fds);
+
+	link_enter(&state);
+	echo_reset(link->state);
+	nasprintf(&cmd, "watch:%s", link->rpath);
+	fds[0] = adb_connect_serial(cmd, link->device);
+	free(cmd);
+	if (fds[0] < 0) {
+		fprintf(stderr, "* Device has no change feed, remote edits are "
+				"picked up on the next connection *\n");
+		stop = 1;
+	} else {
+		fds[1] = sync_link_connect(link->device);
+		stop = fds[1] < 0;
+	}
+	link_leave(state);
+
+	while (!stop) {
+		if (readx(fds[0], &msg.dent, sizeof(msg.dent)))
+			break;
+		len = ltohl(msg.dent.namelen);
+		if (len >= (int) sizeof(name) || readx(fds[0], name, len))
+			break;
+		name[len] = 0;
+
+		link_enter(&state);
+		link_drain_events();
+		switch (msg.dent.id) {
+		case ID_DENT:
+			if (feed_name_ok(name) && !ignore_path(link->ignore, name,
+					S_ISDIR(ltohl(msg.dent.mode))))
+				stop = feed_dent(link, fds[1], name, ltohl(msg.dent.mode),
+						ltohl(msg.dent.size), ltohl(msg.dent.time));
+			break;
+		case ID_ULNK:
+			if (feed_name_ok(name) && !feed_ignored(link, name))
+				feed_unlink(link, name);
+			break;
+		case ID_RENM: {
+			char *to = name + strlen(name) + 1;
+
+			if (to >= name + len || !feed_name_ok(name) || !feed_name_ok(to) ||
+					feed_ignored(link, name))
+				break;
+			// whatever is renamed to an ignored name is gone as far as the
+			// link is concerned; the other way round it is picked up on the
+			// next connection
+			if (feed_ignored(link, to))
+				feed_unlink(link, name);
+			else
+				feed_rename(link, name, to);
+			break;
+		}
+		case ID_OVFL:
+			// changes were lost on the device, compare with all of it
+			fprintf(stderr, "* Device dropped changes, rescanning *\n");
+			link->state->stats.remote_overflows++;
+			lpath = local_path(link, "");
+			sync_set_ignore(link->ignore, link->lpath);
+			stop = sync_link_pull_tree(fds[1], link->rpath, lpath,
+					feed_filter, link);
+			free(lpath);
+			break;
+		default:
+			// DONE: the linked folder itself went away
+			stop = 1;
+			break;
+		}
+		link_leave(state);
 	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
 }
@@ -28,9 +28,14 @@ int inotifytools_watch_recursively_with_exclude( char const * path,
                                                  int events,
                                                  char const ** exclude_list );
                                                  // [UH]
+void inotifytools_set_walk_threads( int threads );
+void inotifytools_set_walk_filter( int (*filter)( char const * path, void * arg ),
+                                   void * arg );
 int inotifytools_ignore_events_by_regex( char const *pattern, int flags );
 struct inotify_event * inotifytools_next_event( int timeout );
 struct inotify_event * inotifytools_next_events( int timeout, int num_events );
+struct inotify_event * inotifytools_next_events_ms( int timeout_ms,
+                                                    int num_events );
 int inotifytools_error();
 int inotifytools_get_stat_by_wd( int wd, int event );
 int inotifytools_get_stat_total( int event );
@@ -52,6 +57,75 @@ int inotifytools_get_max_user_watches();
 int inotifytools_get_max_user_instances();
 int inotifytools_get_max_queued_events();
 
+/* Reentrant interface: each context is an inotify instance of its own, and
+ * the _r functions are the ones above working on it instead of on the
+ * default context.
+ */
+typedef struct inotifytools_ctx inotifytools_ctx;
+
+inotifytools_ctx * inotifytools_ctx_new();
+void inotifytools_ctx_free( inotifytools_ctx * ctx );
+int inotifytools_ctx_fd( inotifytools_ctx * ctx );
+
+void inotifytools_set_filename_by_wd_r( inotifytools_ctx * ctx, int wd,
+                                        char const * filename );
+void inotifytools_set_filename_by_filename_r( inotifytools_ctx * ctx,
+                                              char const * oldname,
+                                              char const * newname );
+void inotifytools_replace_filename_r( inotifytools_ctx * ctx,
+                                      char const * oldname,
+                                      char const * newname );
+char * inotifytools_filename_from_wd_r( inotifytools_ctx * ctx, int wd );
+int inotifytools_wd_from_filename_r( inotifytools_ctx * ctx,
+                                     char const * filename );
+int inotifytools_remove_watch_by_filename_r( inotifytools_ctx * ctx,
+                                             char const * filename );
+int inotifytools_remove_watch_by_wd_r( inotifytools_ctx * ctx, int wd );
+int inotifytools_remove_watches_below_r( inotifytools_ctx * ctx,
+                                         char const * path );
+int inotifytools_watch_file_r( inotifytools_ctx * ctx, char const * filename,
+                               int events );
+int inotifytools_watch_files_r( inotifytools_ctx * ctx,
+                                char const * filenames[], int events );
+int inotifytools_watch_recursively_r( inotifytools_ctx * ctx,
+                                      char const * path, int events );
+int inotifytools_watch_recursively_with_exclude_r( inotifytools_ctx * ctx,
+                                                   char const * path,
+                                                   int events,
+                                                   char const **
+                                                   exclude_list );
+void inotifytools_set_walk_threads_r( inotifytools_ctx * ctx, int threads );
+void inotifytools_set_walk_filter_r( inotifytools_ctx * ctx,
+                                     int (*filter)( char const * path,
+                                                    void * arg ),
+                                     void * arg );
+int inotifytools_ignore_events_by_regex_r( inotifytools_ctx * ctx,
+                                           char const *pattern, int flags );
+struct inotify_event * inotifytools_next_event_r( inotifytools_ctx * ctx,
+                                                  int timeout );
+struct inotify_event * inotifytools_next_events_r( inotifytools_ctx * ctx,
+                                                   int timeout,
+                                                   int num_events );
+struct inotify_event * inotifytools_next_events_ms_r( inotifytools_ctx * ctx,
+                                                      int timeout_ms,
+                                                      int num_events );
+int inotifytools_error_r( inotifytools_ctx * ctx );
+int inotifytools_get_stat_by_wd_r( inotifytools_ctx * ctx, int wd,
+                                   int event );
+int inotifytools_get_stat_total_r( inotifytools_ctx * ctx, int event );
+int inotifytools_get_stat_by_filename_r( inotifytools_ctx * ctx,
+                                         char const * filename, int event );
+void inotifytools_initialize_stats_r( inotifytools_ctx * ctx );
+int inotifytools_get_num_watches_r( inotifytools_ctx * ctx );
+
+int inotifytools_printf_r( inotifytools_ctx * ctx,
+                           struct inotify_event* event, char* fmt );
+int inotifytools_fprintf_r( inotifytools_ctx * ctx, FILE* file,
+                            struct inotify_event* event, char* fmt );
+int inotifytools_snprintf_r( inotifytools_ctx * ctx, char * out, int size,
+                             struct inotify_event* event, char* fmt );
+void inotifytools_set_printf_timefmt_r( inotifytools_ctx * ctx, char * fmt );
+
 #ifdef __cplusplus
 }
 #endif
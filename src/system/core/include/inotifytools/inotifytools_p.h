@@ -4,10 +4,16 @@
 #include "redblack.h"
 
 struct rbtree *inotifytools_wd_sorted_by_event(int sort_event);
+struct rbtree *inotifytools_wd_sorted_by_event_r(inotifytools_ctx * ctx,
+                                                 int sort_event);
 
 typedef struct watch {
 	char *filename;
 	int wd;
+	struct watch *wd_next;      // in the wd index
+	struct watch *name_next;    // in the filename index
+	struct watch *node_next;    // other watches on the same path
+	struct pathnode *node;      // where filename is in the path tree
 	unsigned hit_access;
 	unsigned hit_modify;
 	unsigned hit_attrib;
@@ -28,7 +28,8 @@
 #include <dirent.h>
 #include <time.h>
 #include <regex.h>
-#include <setjmp.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <sys/inotify.h>
 
@@ -120,38 +121,104 @@
 
 #define MAX_EVENTS 4096
 #define MAX_STRLEN 4096
+#define EVENT_STR_MAX 1024
 #define INOTIFY_PROCDIR "/proc/sys/fs/inotify/"
 #define WATCHES_SIZE_PATH INOTIFY_PROCDIR "max_user_watches"
 #define QUEUE_SIZE_PATH   INOTIFY_PROCDIR "max_queued_watches"
 #define INSTANCES_PATH    INOTIFY_PROCDIR "max_user_instances"
 
-static int inotify_fd;
-static unsigned  num_access;
-static unsigned  num_modify;
-static unsigned  num_attrib;
-static unsigned  num_close_nowrite;
-static unsigned  num_close_write;
-static unsigned  num_open;
-static unsigned  num_move_self;
-static unsigned  num_moved_to;
-static unsigned  num_moved_from;
-static unsigned  num_create;
-static unsigned  num_delete;
-static unsigned  num_delete_self;
-static unsigned  num_unmount;
-static unsigned  num_total;
-static int collect_stats = 0;
-
-struct rbtree *tree_wd = 0;
-struct rbtree *tree_filename = 0;
-static int error = 0;
-static int init = 0;
-static char* timefmt = 0;
-static regex_t* regex = 0;
+/**
+ * @internal
+ * Watch indexes.
+ *
+ * Every watch is in two hash tables, one keyed by watch descriptor and one
+ * by filename, which always hold the same watches and so grow together.
+ * Every watch also hangs off the node of the path tree matching its
+ * filename.  The tree has one node per path component, so the watches below
+ * a directory are found without looking at any other watch.
+ */
+typedef struct pathnode pathnode;
+
+struct pathnode {
+	pathnode *parent;
+	pathnode *child;            // first child
+	pathnode *next;             // siblings
+	pathnode *prev;
+	pathnode *hnext;            // in node_table
+	watch *watches;             // watches on exactly this path
+	int refs;                   // watches and children
+	char name[1];
+};
+
+#define INDEX_MIN_SIZE 1024
+
+/**
+ * @internal
+ * Everything an inotify instance needs.
+ *
+ * Each context has its own inotify file descriptor, watches, event buffer,
+ * statistics and settings, so several of them can be used at once, from
+ * different threads if need be (one thread per context at a time).  The
+ * functions without a context argument work on a default one.
+ */
+struct inotifytools_ctx {
+	int init;
+	int fd;
+	int error;
+
+	watch **wd_table;
+	watch **name_table;
+	unsigned table_size;
+	unsigned num_watches;
+
+	pathnode **node_table;
+	unsigned node_table_size;
+	unsigned num_nodes;
+	pathnode path_root;         // parent of the first component
+
+	char * timefmt;
+	regex_t * regex;
+
+	int walk_threads;           // see inotifytools_set_walk_threads()
+	int (*walk_filter)( char const * path, void * arg );
+	void * walk_filter_arg;
+
+	// events read but not returned yet
+	struct inotify_event event[MAX_EVENTS];
+	int first_byte;
+	ssize_t bytes;
+
+	int collect_stats;
+	unsigned num_access;
+	unsigned num_modify;
+	unsigned num_attrib;
+	unsigned num_close_nowrite;
+	unsigned num_close_write;
+	unsigned num_open;
+	unsigned num_move_self;
+	unsigned num_moved_to;
+	unsigned num_moved_from;
+	unsigned num_create;
+	unsigned num_delete;
+	unsigned num_delete_self;
+	unsigned num_unmount;
+	unsigned num_total;
+};
+
+static inotifytools_ctx default_ctx;
 
 int isdir( char const * path );
-void record_stats( struct inotify_event const * event );
+void record_stats( inotifytools_ctx * c, struct inotify_event const * event );
 int onestr_to_event(char const * event);
+static struct inotify_event * next_events( inotifytools_ctx * c,
+                                           struct timeval * timeout,
+                                           int num_events );
+static struct inotify_event * read_event( inotifytools_ctx * c,
+                                          struct timeval * timeout,
+                                          int num_events );
+static int ctx_open( inotifytools_ctx * c );
+static char * event_to_str( int events, char sep, char * ret );
+static void ctx_close( inotifytools_ctx * c );
 
 /**
  * @internal
@@ -226,12 +293,13 @@ char * chrtostr(char ch) {
 int read_num_from_file( char * filename, int * num ) {
 	FILE * file = fopen( filename, "r" );
 	if ( !file ) {
-		error = errno;
+		default_ctx.error = errno;
 		return 0;
 	}
 
 	if ( EOF == fscanf( file, "%d", num ) ) {
-		error = errno;
+		default_ctx.error = errno;
+		fclose( file );
 		return 0;
 	}
 
@@ -240,32 +308,243 @@ int read_num_from_file( char * filename, int * num ) {
 	return 1;
 }
 
-int wd_compare(const void *d1, const void *d2, const void *config) {
-	if (!d1 || !d2) return d1 - d2;
-	return ((watch*)d1)->wd - ((watch*)d2)->wd;
+static unsigned hash_wd( int wd ) {
+	return (unsigned)wd * 2654435761u;
+}
+
+static unsigned hash_name( char const * name, int len, unsigned h ) {
+	while ( len-- > 0 )
+		h = h * 33 + (unsigned char)*name++;
+	return h;
+}
+
+static unsigned hash_filename( char const * filename ) {
+	return hash_name( filename, strlen(filename), 5381 );
+}
+
+static unsigned hash_node( pathnode * parent, char const * name, int len ) {
+	return hash_name( name, len, (unsigned)(unsigned long)parent * 2654435761u );
+}
+
+/**
+ * @internal
+ * Find the child of @a parent named by the @a len bytes at @a name, creating
+ * it if @a create is set.
+ */
+static pathnode *node_child( inotifytools_ctx * c, pathnode * parent,
+                             char const * name, int len, int create ) {
+	pathnode *n;
+
+	if ( c->node_table_size ) {
+		n = c->node_table[hash_node(parent, name, len) &
+		                  (c->node_table_size - 1)];
+		for ( ; n; n = n->hnext ) {
+			if ( n->parent == parent && !strncmp(n->name, name, len)
+			     && n->name[len] == 0 )
+				return n;
+		}
+	}
+	if ( !create ) return 0;
+
+	if ( c->num_nodes >= c->node_table_size ) {
+		unsigned size = c->node_table_size ? c->node_table_size * 2
+		                                   : INDEX_MIN_SIZE;
+		pathnode **table = (pathnode**)calloc(size, sizeof(pathnode*));
+		unsigned i;
+
+		niceassert( table, "out of memory" );
+		for ( i = 0; i < c->node_table_size; ++i ) {
+			while ( (n = c->node_table[i]) ) {
+				unsigned h = hash_node(n->parent, n->name, strlen(n->name));
+				c->node_table[i] = n->hnext;
+				n->hnext = table[h & (size - 1)];
+				table[h & (size - 1)] = n;
+			}
+		}
+		free( c->node_table );
+		c->node_table = table;
+		c->node_table_size = size;
+	}
+
+	n = (pathnode*)calloc(1, sizeof(pathnode) + len);
+	niceassert( n, "out of memory" );
+	memcpy( n->name, name, len );
+	n->parent = parent;
+	n->next = parent->child;
+	if ( n->next ) n->next->prev = n;
+	parent->child = n;
+	++parent->refs;
+
+	unsigned h = hash_node(parent, name, len) & (c->node_table_size - 1);
+	n->hnext = c->node_table[h];
+	c->node_table[h] = n;
+	++c->num_nodes;
+	return n;
+}
+
+/**
+ * @internal
+ * Find the node for @a path, creating it and its parents if @a create is set.
+ * A leading '/' is a component of its own, repeated or trailing '/'s are
+ * ignored.
+ */
+static pathnode *node_lookup( inotifytools_ctx * c, char const * path,
+                              int create ) {
+	pathnode *n = &c->path_root;
+	char const *end;
+
+	if ( *path == '/' ) {
+		n = node_child( c, n, "", 0, create );
+	}
+	while ( n && *path ) {
+		while ( *path == '/' ) ++path;
+		if ( !*path ) break;
+		end = strchr( path, '/' );
+		if ( !end ) end = path + strlen(path);
+		n = node_child( c, n, path, end - path, create );
+		path = end;
+	}
+	return n;
+}
+
+/**
+ * @internal
+ * Drop a reference to @a n, freeing it and any parent left unused.
+ */
+static void node_release( inotifytools_ctx * c, pathnode * n ) {
+	while ( n != &c->path_root && --n->refs == 0 ) {
+		pathnode *parent = n->parent;
+		pathnode **pn = &c->node_table[hash_node(parent, n->name,
+		                  strlen(n->name)) & (c->node_table_size - 1)];
+
+		while ( *pn != n ) pn = &(*pn)->hnext;
+		*pn = n->hnext;
+		if ( n->prev ) n->prev->next = n->next;
+		else parent->child = n->next;
+		if ( n->next ) n->next->prev = n->prev;
+		--c->num_nodes;
+		free( n );
+		n = parent;
+	}
+}
+
+/**
+ * @internal
+ * Add @a w to the filename index and the path tree.
+ */
+static void index_filename( inotifytools_ctx * c, watch * w ) {
+	unsigned h = hash_filename(w->filename) & (c->table_size - 1);
+
+	w->name_next = c->name_table[h];
+	c->name_table[h] = w;
+
+	w->node = node_lookup( c, w->filename, 1 );
+	w->node_next = w->node->watches;
+	w->node->watches = w;
+	++w->node->refs;
+}
+
+static void unindex_filename( inotifytools_ctx * c, watch * w ) {
+	watch **pw = &c->name_table[hash_filename(w->filename) &
+	                            (c->table_size - 1)];
+
+	while ( *pw != w ) pw = &(*pw)->name_next;
+	*pw = w->name_next;
+
+	pw = &w->node->watches;
+	while ( *pw != w ) pw = &(*pw)->node_next;
+	*pw = w->node_next;
+	node_release( c, w->node );
+	w->node = 0;
+}
+
+/**
+ * @internal
+ * Add @a w to every index.
+ */
+static void index_watch( inotifytools_ctx * c, watch * w ) {
+	unsigned h;
+
+	if ( c->num_watches >= c->table_size ) {
+		unsigned size = c->table_size ? c->table_size * 2 : INDEX_MIN_SIZE;
+		watch **wds = (watch**)calloc(size, sizeof(watch*));
+		watch **names = (watch**)calloc(size, sizeof(watch*));
+		watch *v;
+		unsigned i;
+
+		niceassert( wds && names, "out of memory" );
+		for ( i = 0; i < c->table_size; ++i ) {
+			while ( (v = c->wd_table[i]) ) {
+				c->wd_table[i] = v->wd_next;
+				h = hash_wd(v->wd) & (size - 1);
+				v->wd_next = wds[h];
+				wds[h] = v;
+				h = hash_filename(v->filename) & (size - 1);
+				v->name_next = names[h];
+				names[h] = v;
+			}
+		}
+		free( c->wd_table );
+		free( c->name_table );
+		c->wd_table = wds;
+		c->name_table = names;
+		c->table_size = size;
+	}
+
+	h = hash_wd(w->wd) & (c->table_size - 1);
+	w->wd_next = c->wd_table[h];
+	c->wd_table[h] = w;
+	index_filename( c, w );
+	++c->num_watches;
+}
+
+static void unindex_watch( inotifytools_ctx * c, watch * w ) {
+	watch **pw = &c->wd_table[hash_wd(w->wd) & (c->table_size - 1)];
+
+	while ( *pw != w ) pw = &(*pw)->wd_next;
+	*pw = w->wd_next;
+	unindex_filename( c, w );
+	--c->num_watches;
 }
 
-int filename_compare(const void *d1, const void *d2, const void *config) {
-	if (!d1 || !d2) return d1 - d2;
-	return strcmp(((watch*)d1)->filename, ((watch*)d2)->filename);
+/**
+ * @internal
+ * Give @a w a new filename, which it takes ownership of.
+ */
+static void set_watch_filename( inotifytools_ctx * c, watch * w,
+                                char * filename ) {
+	unindex_filename( c, w );
+	free( w->filename );
+	w->filename = filename;
+	index_filename( c, w );
 }
 
 /**
  * @internal
  */
-watch *watch_from_wd( int wd ) {
-	watch w;
-	w.wd = wd;
-	return (watch*)rbfind(&w, tree_wd);
+watch *watch_from_wd( inotifytools_ctx * c, int wd ) {
+	watch *w;
+
+	if ( !c->table_size ) return 0;
+	w = c->wd_table[hash_wd(wd) & (c->table_size - 1)];
+	for ( ; w; w = w->wd_next ) {
+		if ( w->wd == wd ) return w;
+	}
+	return 0;
 }
 
 /**
  * @internal
  */
-watch *watch_from_filename( char const *filename ) {
-	watch w;
-	w.filename = (char*)filename;
-	return (watch*)rbfind(&w, tree_filename);
+watch *watch_from_filename( inotifytools_ctx * c, char const *filename ) {
+	watch *w;
+
+	if ( !c->table_size ) return 0;
+	w = c->name_table[hash_filename(filename) & (c->table_size - 1)];
+	for ( ; w; w = w->name_next ) {
+		if ( !strcmp(w->filename, filename) ) return w;
+	}
+	return 0;
 }
 
 /**
@@ -278,42 +557,80 @@ watch *watch_from_filename( char const *filename ) {
  *         obtained from inotifytools_error().
  */
 int inotifytools_initialize() {
-	if (init) return 1;
+	if (default_ctx.init) return 1;
+	return ctx_open( &default_ctx );
+}
 
-	error = 0;
+/**
+ * @internal
+ * Open inotify for @a c, which is all zeroes.
+ */
+static int ctx_open( inotifytools_ctx * c ) {
+	c->error = 0;
 	// Try to initialise inotify
-	inotify_fd = inotify_init();
-	if (inotify_fd < 0)	{
-		error = inotify_fd;
+	c->fd = inotify_init();
+	if (c->fd < 0)	{
+		c->error = errno;
 		return 0;
 	}
 
-	collect_stats = 0;
-	init = 1;
-	tree_wd = rbinit(wd_compare, 0);
-	tree_filename = rbinit(filename_compare, 0);
-	timefmt = 0;
+	c->collect_stats = 0;
+	c->init = 1;
+	c->timefmt = 0;
+	c->walk_threads = 1;
 
 	return 1;
 }
 
 /**
- * @internal
+ * Create a new inotifytools context.
+ *
+ * A context is an inotify instance of its own: the @a _r functions called
+ * with it only ever see its watches and events, whatever happens to other
+ * contexts or to the default one used by the other functions.  A context
+ * must not be used by two threads at once.
+ *
+ * @return the new context, or NULL on failure, in which case errno says why.
  */
-void destroy_watch(watch *w) {
-	if (w->filename) free(w->filename);
-	free(w);
+inotifytools_ctx * inotifytools_ctx_new() {
+	inotifytools_ctx * c = (inotifytools_ctx*)calloc( 1, sizeof(*c) );
+
+	if ( !c ) return 0;
+	if ( !ctx_open( c ) ) {
+		errno = c->error;
+		free( c );
+		return 0;
+	}
+	return c;
+}
+
+/**
+ * Close the inotify instance of @a c and free it.
+ */
+void inotifytools_ctx_free( inotifytools_ctx * c ) {
+	if ( !c ) return;
+	ctx_close( c );
+	free( c );
+}
+
+/**
+ * Get the inotify file descriptor of a context.
+ *
+ * It becomes readable when there are events to read, so a program can wait
+ * for several contexts, or other file descriptors, at once with select() or
+ * poll() before calling inotifytools_next_events_r().  Do not read from it
+ * directly.
+ */
+int inotifytools_ctx_fd( inotifytools_ctx * c ) {
+	return c->fd;
 }
 
 /**
  * @internal
  */
-void cleanup_tree(const void *nodep,
-                 const VISIT which,
-                 const int depth, void* arg) {
-	if (which != endorder && which != leaf) return;
-	watch *w = (watch*)nodep;
-	destroy_watch(w);
+void destroy_watch(watch *w) {
+	if (w->filename) free(w->filename);
+	free(w);
 }
 
 /**
@@ -323,33 +640,46 @@ void cleanup_tree(const void *nodep,
  * again before any other functions can be used.
  */
 void inotifytools_cleanup() {
-	if (!init) return;
-
-	init = 0;
-	close(inotify_fd);
-	collect_stats = 0;
-	error = 0;
-	timefmt = 0;
+	if (!default_ctx.init) return;
+	ctx_close( &default_ctx );
+	memset( &default_ctx, 0, sizeof(default_ctx) );
+}
 
-	if (regex) {
-		regfree(regex);
-		free(regex);
-		regex = 0;
+/**
+ * @internal
+ */
+static void ctx_close( inotifytools_ctx * c ) {
+	c->init = 0;
+	close(c->fd);
+	c->collect_stats = 0;
+	c->error = 0;
+	c->timefmt = 0;
+
+	if (c->regex) {
+		regfree(c->regex);
+		free(c->regex);
+		c->regex = 0;
+	}
+
+	unsigned i;
+	watch *w;
+	for ( i = 0; i < c->table_size; ++i ) {
+		while ( (w = c->wd_table[i]) ) {
+			unindex_watch(c, w);
+			destroy_watch(w);
+		}
 	}
-
-	rbwalk(tree_wd, cleanup_tree, 0);
-	rbdestroy(tree_wd); tree_wd = 0;
-	rbdestroy(tree_filename); tree_filename = 0;
+	free(c->wd_table); c->wd_table = 0;
+	free(c->name_table); c->name_table = 0;
+	c->table_size = 0;
+	free(c->node_table); c->node_table = 0;
+	c->node_table_size = 0;
 }
 
 /**
  * @internal
  */
-void empty_stats(const void *nodep,
-                 const VISIT which,
-                 const int depth, void *arg) {
-    if (which != endorder && which != leaf) return;
-	watch *w = (watch*)nodep;
+void empty_stats(watch *w) {
 	w->hit_access = 0;
 	w->hit_modify = 0;
 	w->hit_attrib = 0;
@@ -366,42 +696,6 @@ void empty_stats(const void *nodep,
 	w->hit_total = 0;
 }
 
-/**
- * @internal
- */
-void replace_filename(const void *nodep,
-                      const VISIT which,
-                      const int depth, void *arg) {
-    if (which != endorder && which != leaf) return;
-	watch *w = (watch*)nodep;
-	char *old_name = ((char**)arg)[0];
-	char *new_name = ((char**)arg)[1];
-	int old_len = *((int*)&((char**)arg)[2]);
-	char *name;
-	if ( 0 == strncmp( old_name, w->filename, old_len ) ) {
-		nasprintf( &name, "%s%s", new_name, &(w->filename[old_len]) );
-		if (!strcmp( w->filename, new_name )) {
-			free(name);
-		} else {
-			rbdelete(w, tree_filename);
-			free( w->filename );
-			w->filename = name;
-			rbsearch(w, tree_filename);
-		}
-	}
-}
-
-/**
- * @internal
- */
-void get_num(const void *nodep,
-             const VISIT which,
-             const int depth, void *arg) {
-    if (which != endorder && which != leaf) return;
-	++(*((int*)arg));
-}
-
-
 /**
  * Initialize or reset statistics.
  *
@@ -415,29 +709,41 @@ void get_num(const void *nodep,
  * event tallies to 0.
  */
 void inotifytools_initialize_stats() {
-	niceassert( init, "inotifytools_initialize not called yet" );
+	inotifytools_initialize_stats_r( &default_ctx );
+}
+
+/**
+ * inotifytools_initialize_stats() for the context @a c.
+ */
+void inotifytools_initialize_stats_r( inotifytools_ctx * c ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
 
 	// if already collecting stats, reset stats
-	if (collect_stats) {
-		rbwalk(tree_wd, empty_stats, 0);
+	if (c->collect_stats) {
+		unsigned i;
+		watch *w;
+		for ( i = 0; i < c->table_size; ++i ) {
+			for ( w = c->wd_table[i]; w; w = w->wd_next )
+				empty_stats(w);
+		}
 	}
 
-	num_access = 0;
-	num_modify = 0;
-	num_attrib = 0;
-	num_close_nowrite = 0;
-	num_close_write = 0;
-	num_open = 0;
-	num_move_self = 0;
-	num_moved_from = 0;
-	num_moved_to = 0;
-	num_create = 0;
-	num_delete = 0;
-	num_delete_self = 0;
-	num_unmount = 0;
-	num_total = 0;
-
-	collect_stats = 1;
+	c->num_access = 0;
+	c->num_modify = 0;
+	c->num_attrib = 0;
+	c->num_close_nowrite = 0;
+	c->num_close_write = 0;
+	c->num_open = 0;
+	c->num_move_self = 0;
+	c->num_moved_from = 0;
+	c->num_moved_to = 0;
+	c->num_create = 0;
+	c->num_delete = 0;
+	c->num_delete_self = 0;
+	c->num_unmount = 0;
+	c->num_total = 0;
+
+	c->collect_stats = 1;
 }
 
 /**
@@ -654,80 +960,91 @@ char * inotifytools_event_to_str(int events) {
  */
 char * inotifytools_event_to_str_sep(int events, char sep)
 {
-	static char ret[1024];
+	static char ret[EVENT_STR_MAX];
+	return event_to_str( events, sep, ret );
+}
+
+/**
+ * @internal
+ * inotifytools_event_to_str_sep() into @a ret, which has room for
+ * EVENT_STR_MAX characters.
+ */
+static char * event_to_str( int events, char sep, char * ret )
+{
+	char const sepstr[2] = { sep, 0 };
 	ret[0] = '\0';
 	ret[1] = '\0';
 
 	if ( IN_ACCESS & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "ACCESS" );
 	}
 	if ( IN_MODIFY & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "MODIFY" );
 	}
 	if ( IN_ATTRIB & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "ATTRIB" );
 	}
 	if ( IN_CLOSE_WRITE & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "CLOSE_WRITE" );
 	}
 	if ( IN_CLOSE_NOWRITE & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "CLOSE_NOWRITE" );
 	}
 	if ( IN_OPEN & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "OPEN" );
 	}
 	if ( IN_MOVED_FROM & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "MOVED_FROM" );
 	}
 	if ( IN_MOVED_TO & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "MOVED_TO" );
 	}
 	if ( IN_CREATE & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "CREATE" );
 	}
 	if ( IN_DELETE & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "DELETE" );
 	}
 	if ( IN_DELETE_SELF & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "DELETE_SELF" );
 	}
 	if ( IN_UNMOUNT & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "UNMOUNT" );
 	}
 	if ( IN_Q_OVERFLOW & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "Q_OVERFLOW" );
 	}
 	if ( IN_IGNORED & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "IGNORED" );
 	}
 	if ( IN_CLOSE & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "CLOSE" );
 	}
 	if ( IN_MOVE_SELF & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "MOVE_SELF" );
 	}
 	if ( IN_ISDIR & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "ISDIR" );
 	}
 	if ( IN_ONESHOT & events ) {
-		strcat( ret, chrtostr(sep) );
+		strcat( ret, sepstr );
 		strcat( ret, "ONESHOT" );
 	}
 
@@ -760,8 +1077,15 @@ char * inotifytools_event_to_str_sep(int events, char sep)
  *       filename returned will still be the original name.
  */
 char * inotifytools_filename_from_wd( int wd ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_wd(wd);
+	return inotifytools_filename_from_wd_r( &default_ctx, wd );
+}
+
+/**
+ * inotifytools_filename_from_wd() for the context @a c.
+ */
+char * inotifytools_filename_from_wd_r( inotifytools_ctx * c, int wd ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_wd(c, wd);
 	if (!w)
         return NULL;
 
@@ -783,8 +1107,16 @@ char * inotifytools_filename_from_wd( int wd ) {
  *       establish the watch.
  */
 int inotifytools_wd_from_filename( char const * filename ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_filename(filename);
+	return inotifytools_wd_from_filename_r( &default_ctx, filename );
+}
+
+/**
+ * inotifytools_wd_from_filename() for the context @a c.
+ */
+int inotifytools_wd_from_filename_r( inotifytools_ctx * c,
+                                     char const * filename ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_filename(c, filename);
 	if (!w) return -1;
 	return w->wd;
 }
@@ -804,11 +1136,20 @@ int inotifytools_wd_from_filename( char const * filename ) {
  * @param filename New filename.
  */
 void inotifytools_set_filename_by_wd( int wd, char const * filename ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_wd(wd);
+	inotifytools_set_filename_by_wd_r( &default_ctx, wd, filename );
+}
+
+/**
+ * inotifytools_set_filename_by_wd() for the context @a c.
+ */
+void inotifytools_set_filename_by_wd_r( inotifytools_ctx * c, int wd,
+                                        char const * filename ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_wd(c, wd);
 	if (!w) return;
-	if (w->filename) free(w->filename);
-	w->filename = strdup(filename);
+	char *name = strdup(filename);
+	niceassert( name, "out of memory" );
+	set_watch_filename(c, w, name);
 }
 
 /**
@@ -827,10 +1168,20 @@ void inotifytools_set_filename_by_wd( int wd, char const * filename ) {
  */
 void inotifytools_set_filename_by_filename( char const * oldname,
                                             char const * newname ) {
-	watch *w = watch_from_filename(oldname);
+	inotifytools_set_filename_by_filename_r( &default_ctx, oldname, newname );
+}
+
+/**
+ * inotifytools_set_filename_by_filename() for the context @a c.
+ */
+void inotifytools_set_filename_by_filename_r( inotifytools_ctx * c,
+                                              char const * oldname,
+                                              char const * newname ) {
+	watch *w = watch_from_filename(c, oldname);
 	if (!w) return;
-	if (w->filename) free(w->filename);
-	w->filename = strdup(newname);
+	char *name = strdup(newname);
+	niceassert( name, "out of memory" );
+	set_watch_filename(c, w, name);
 }
 
 /**
@@ -857,24 +1208,95 @@ void inotifytools_set_filename_by_filename( char const * oldname,
  */
 void inotifytools_replace_filename( char const * oldname,
                                     char const * newname ) {
+	inotifytools_replace_filename_r( &default_ctx, oldname, newname );
+}
+
+/**
+ * inotifytools_replace_filename() for the context @a c.
+ */
+void inotifytools_replace_filename_r( inotifytools_ctx * c,
+                                      char const * oldname,
+                                      char const * newname ) {
 	if ( !oldname || !newname ) return;
-	char *names[2+sizeof(int)/sizeof(char*)];
-	names[0] = (char*)oldname;
-	names[1] = (char*)newname;
-	*((int*)&names[2]) = strlen(oldname);
-	rbwalk(tree_filename, replace_filename, (void*)names);
+	int old_len = strlen(oldname);
+	char *base, *last, *slash;
+	pathnode *parent, *n;
+	watch **found = 0, *w;
+	int num_found = 0, max_found = 0, last_len, i;
+	int exact = old_len && oldname[old_len-1] == '/';
+
+	// Only the node named by the last component of oldname (or the ones
+	// starting with it, when oldname does not end in '/') and everything
+	// below it can hold matching watches.
+	base = strdup(oldname);
+	niceassert( base, "out of memory" );
+	if ( exact ) base[old_len-1] = 0;
+	slash = strrchr(base, '/');
+	if ( slash == base ) {
+		parent = node_lookup(c, "/", 0);
+		last = base + 1;
+	} else if ( slash ) {
+		*slash = 0;
+		parent = node_lookup(c, base, 0);
+		last = slash + 1;
+	} else {
+		parent = &c->path_root;
+		last = base;
+	}
+	last_len = strlen(last);
+
+	n = 0;
+	if ( parent )
+		n = exact ? node_child(c, parent, last, last_len, 0) : parent->child;
+	for ( ; n; n = exact ? 0 : n->next ) {
+		if ( strncmp(n->name, last, last_len) ) continue;
+
+		// walk the subtree of n, collecting the watches to rename first,
+		// as renaming them reshapes the tree
+		pathnode *top = n, *m = n;
+		while ( m ) {
+			for ( w = m->watches; w; w = w->node_next ) {
+				if ( strncmp(w->filename, oldname, old_len) ) continue;
+				if ( num_found == max_found ) {
+					max_found = max_found ? max_found * 2 : 64;
+					found = (watch**)realloc(found, max_found * sizeof(watch*));
+					niceassert( found, "out of memory" );
+				}
+				found[num_found++] = w;
+			}
+			if ( m->child ) {
+				m = m->child;
+				continue;
+			}
+			while ( m != top && !m->next ) m = m->parent;
+			m = (m == top) ? 0 : m->next;
+		}
+	}
+
+	for ( i = 0; i < num_found; ++i ) {
+		char *name;
+		w = found[i];
+		nasprintf( &name, "%s%s", newname, &(w->filename[old_len]) );
+		if ( !strcmp( w->filename, name ) ) {
+			free(name);
+		} else {
+			set_watch_filename(c, w, name);
+		}
+	}
+	free(found);
+	free(base);
 }
 
 /**
  * @internal
  */
-int remove_inotify_watch(watch *w) {
-	error = 0;
-	int status = inotify_rm_watch( inotify_fd, w->wd );
+int remove_inotify_watch(inotifytools_ctx * c, watch *w) {
+	c->error = 0;
+	int status = inotify_rm_watch( c->fd, w->wd );
 	if ( status < 0 ) {
 		fprintf(stderr, "Failed to remove watch on %s: %s\n", w->filename,
-		        strerror(status) );
-		error = status;
+		        strerror(errno) );
+		c->error = errno;
 		return 0;
 	}
 	return 1;
@@ -883,14 +1305,27 @@ int remove_inotify_watch(watch *w) {
 /**
  * @internal
  */
-watch *create_watch(int wd, char *filename) {
+watch *create_watch(inotifytools_ctx * c, int wd, char *filename) {
 	if ( wd <= 0 || !filename) return 0;
 
-	watch *w = (watch*)calloc(1, sizeof(watch));
+	// the kernel hands out the same wd again for an inode already watched
+	watch *w = watch_from_wd(c, wd);
+	if (w) {
+		if (strcmp(w->filename, filename)) {
+			char *name = strdup(filename);
+			niceassert( name, "out of memory" );
+			set_watch_filename(c, w, name);
+		}
+		return w;
+	}
+
+	w = (watch*)calloc(1, sizeof(watch));
+	niceassert( w, "out of memory" );
 	w->wd = wd;
 	w->filename = strdup(filename);
-	rbsearch(w, tree_wd);
-	rbsearch(w, tree_filename);
+	niceassert( w->filename, "out of memory" );
+	index_watch(c, w);
+	return w;
 }
 
 /**
@@ -906,13 +1341,19 @@ watch *create_watch(int wd, char *filename) {
  *         obtained from inotifytools_error().
  */
 int inotifytools_remove_watch_by_wd( int wd ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_wd(wd);
+	return inotifytools_remove_watch_by_wd_r( &default_ctx, wd );
+}
+
+/**
+ * inotifytools_remove_watch_by_wd() for the context @a c.
+ */
+int inotifytools_remove_watch_by_wd_r( inotifytools_ctx * c, int wd ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_wd(c, wd);
 	if (!w) return 1;
 
-	if (!remove_inotify_watch(w)) return 0;
-	rbdelete(w, tree_wd);
-	rbdelete(w, tree_filename);
+	if (!remove_inotify_watch(c, w)) return 0;
+	unindex_watch(c, w);
 	destroy_watch(w);
 	return 1;
 }
@@ -929,17 +1370,75 @@ int inotifytools_remove_watch_by_wd( int wd ) {
  *       establish the watch.
  */
 int inotifytools_remove_watch_by_filename( char const * filename ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_filename(filename);
+	return inotifytools_remove_watch_by_filename_r( &default_ctx, filename );
+}
+
+/**
+ * inotifytools_remove_watch_by_filename() for the context @a c.
+ */
+int inotifytools_remove_watch_by_filename_r( inotifytools_ctx * c,
+                                             char const * filename ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_filename(c, filename);
 	if (!w) return 1;
 
-	if (!remove_inotify_watch(w)) return 0;
-	rbdelete(w, tree_wd);
-	rbdelete(w, tree_filename);
+	if (!remove_inotify_watch(c, w)) return 0;
+	unindex_watch(c, w);
 	destroy_watch(w);
 	return 1;
 }
 
+/**
+ * Remove the watches on a directory and on everything below it.
+ *
+ * @param c    context the watches are in.
+ *
+ * @param path directory, as named when it was watched (with or without the
+ *             trailing '/').
+ *
+ * @return 1 on success, 0 if some watch could not be removed, in which case
+ *         the error can be obtained from inotifytools_error_r().  The watches
+ *         which could be removed are gone either way.
+ */
+int inotifytools_remove_watches_below_r( inotifytools_ctx * c,
+                                         char const * path ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+	pathnode *top = node_lookup( c, path, 0 ), *n;
+	watch **found = 0, *w;
+	int num_found = 0, max_found = 0, i, ok = 1;
+
+	// collect them first, as removing them reshapes the tree
+	for ( n = top; n; ) {
+		for ( w = n->watches; w; w = w->node_next ) {
+			if ( num_found == max_found ) {
+				max_found = max_found ? max_found * 2 : 64;
+				found = (watch**)realloc(found, max_found * sizeof(watch*));
+				niceassert( found, "out of memory" );
+			}
+			found[num_found++] = w;
+		}
+		if ( n->child ) {
+			n = n->child;
+			continue;
+		}
+		while ( n != top && !n->next ) n = n->parent;
+		n = (n == top) ? 0 : n->next;
+	}
+
+	for ( i = 0; i < num_found; ++i ) {
+		w = found[i];
+		// the kernel may have dropped it already, with the directory
+		if ( inotify_rm_watch( c->fd, w->wd ) < 0 && errno != EINVAL ) {
+			c->error = errno;
+			ok = 0;
+		}
+		unindex_watch(c, w);
+		destroy_watch(w);
+	}
+	free(found);
+	return ok;
+}
+
 /**
  * Set up a watch on a file.
  *
@@ -952,10 +1451,18 @@ int inotifytools_remove_watch_by_filename( char const * filename ) {
  *         obtained from inotifytools_error().
  */
 int inotifytools_watch_file( char const * filename, int events ) {
-	static char const * filenames[2];
+	return inotifytools_watch_file_r( &default_ctx, filename, events );
+}
+
+/**
+ * inotifytools_watch_file() for the context @a c.
+ */
+int inotifytools_watch_file_r( inotifytools_ctx * c, char const * filename,
+                               int events ) {
+	char const * filenames[2];
 	filenames[0] = filename;
 	filenames[1] = NULL;
-	return inotifytools_watch_files( filenames, events );
+	return inotifytools_watch_files_r( c, filenames, events );
 }
 
 /**
@@ -974,16 +1481,24 @@ int inotifytools_watch_file( char const * filename, int events ) {
  *         obtained from inotifytools_error().
  */
 int inotifytools_watch_files( char const * filenames[], int events ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	error = 0;
+	return inotifytools_watch_files_r( &default_ctx, filenames, events );
+}
+
+/**
+ * inotifytools_watch_files() for the context @a c.
+ */
+int inotifytools_watch_files_r( inotifytools_ctx * c,
+                                char const * filenames[], int events ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+	c->error = 0;
 
-	static int i;
+	int i;
 	for ( i = 0; filenames[i]; ++i ) {
-		static int wd;
-		wd = inotify_add_watch( inotify_fd, filenames[i], events );
+		int wd;
+		wd = inotify_add_watch( c->fd, filenames[i], events );
 		if ( wd < 0 ) {
 			if ( wd == -1 ) {
-				error = errno;
+				c->error = errno;
 				return 0;
 			} // if ( wd == -1 )
 			else {
@@ -1003,7 +1518,7 @@ int inotifytools_watch_files( char const * filenames[], int events ) {
 		else {
 			nasprintf( &filename, "%s/", filenames[i] );
 		}
-		create_watch(wd, filename);
+		create_watch(c, wd, filename);
 		free(filename);
 	} // for
 
@@ -1040,6 +1555,15 @@ struct inotify_event * inotifytools_next_event( int timeout ) {
 	return inotifytools_next_events( timeout, 1 );
 }
 
+/**
+ * inotifytools_next_event() for the context @a c.  The event is stored in
+ * @a c, and may be overwritten by the next call with it.
+ */
+struct inotify_event * inotifytools_next_event_r( inotifytools_ctx * c,
+                                                  int timeout ) {
+	return inotifytools_next_events_r( c, timeout, 1 );
+}
+
 
 /**
  * Get the next inotify events to occur.
@@ -1091,90 +1615,157 @@ struct inotify_event * inotifytools_next_event( int timeout ) {
  *       the @a timeout period begins again each time a matching event occurs.
  */
 struct inotify_event * inotifytools_next_events( int timeout, int num_events ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
+	return inotifytools_next_events_r( &default_ctx, timeout, num_events );
+}
+
+/**
+ * inotifytools_next_events() for the context @a c.  The event is stored in
+ * @a c, and may be overwritten by the next call with it.
+ */
+struct inotify_event * inotifytools_next_events_r( inotifytools_ctx * c,
+                                                   int timeout,
+                                                   int num_events ) {
+	struct timeval read_timeout;
+
+	read_timeout.tv_sec = timeout;
+	read_timeout.tv_usec = 0;
+	return next_events( c, timeout <= 0 ? NULL : &read_timeout, num_events );
+}
+
+/**
+ * Get the next inotify events to occur, with a timeout in milliseconds.
+ *
+ * Behaves exactly like inotifytools_next_events(), except that @a timeout_ms
+ * is expressed in milliseconds.  If @a timeout_ms is 0, the function is
+ * non-blocking; if it is negative, the function will block until an event
+ * occurs.
+ *
+ * @param timeout_ms maximum amount of time, in milliseconds, to wait for an
+ *                   event.
+ *
+ * @param num_events approximate number of inotify events to wait for until
+ *                   this function returns.  See inotifytools_next_events().
+ *
+ * @return pointer to an inotify event, or NULL if function timed out before
+ *         an event occurred or @a num_events < 1.  See
+ *         inotifytools_next_events().
+ */
+struct inotify_event * inotifytools_next_events_ms( int timeout_ms,
+                                                    int num_events ) {
+	return inotifytools_next_events_ms_r( &default_ctx, timeout_ms,
+	                                      num_events );
+}
+
+/**
+ * inotifytools_next_events_ms() for the context @a c.  The event is stored in
+ * @a c, and may be overwritten by the next call with it.
+ */
+struct inotify_event * inotifytools_next_events_ms_r( inotifytools_ctx * c,
+                                                      int timeout_ms,
+                                                      int num_events ) {
+	struct timeval read_timeout;
+
+	read_timeout.tv_sec = timeout_ms / 1000;
+	read_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	return next_events( c, timeout_ms < 0 ? NULL : &read_timeout,
+	                    num_events );
+}
+
+/**
+ * @internal
+ * Implementation of inotifytools_next_events(); a NULL @a timeout blocks
+ * until an event occurs.
+ */
+static struct inotify_event * next_events( inotifytools_ctx * c,
+                                           struct timeval * timeout,
+                                           int num_events ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
 	niceassert( num_events <= MAX_EVENTS, "too many events requested" );
 
 	if ( num_events < 1 ) return NULL;
 
-	static struct inotify_event event[MAX_EVENTS];
-	static struct inotify_event * ret;
-	static int first_byte = 0;
-	static ssize_t bytes;
-	static jmp_buf jmp;
-	static char match_name[MAX_STRLEN];
+	struct inotify_event * ret;
+	char match_name[MAX_STRLEN];
+
+	// events the regex matches are skipped, and the wait starts over
+	for (;;) {
+		ret = read_event( c, timeout, num_events );
+		if ( !ret ) return NULL;
 
-#define RETURN(A) {\
-	if (regex) {\
-		inotifytools_snprintf(match_name, MAX_STRLEN, A, "%w%f");\
-		if (0 == regexec(regex, match_name, 0, 0, 0)) {\
-			longjmp(jmp,0);\
-		}\
-	}\
-	if ( collect_stats ) {\
-		record_stats( A );\
-	}\
-	return A;\
+		if (c->regex) {
+			inotifytools_snprintf_r(c, match_name, MAX_STRLEN, ret, "%w%f");
+			if (0 == regexec(c->regex, match_name, 0, 0, 0)) {
+				continue;
+			}
+		}
+		if ( c->collect_stats ) {
+			record_stats( c, ret );
+		}
+		return ret;
+	}
 }
 
-	setjmp(jmp);
+/**
+ * @internal
+ * The next event in @a c's buffer, reading more from inotify if there are none
+ * left.
+ */
+static struct inotify_event * read_event( inotifytools_ctx * c,
+                                          struct timeval * timeout,
+                                          int num_events ) {
+	struct inotify_event * ret;
 
-	error = 0;
+	c->error = 0;
 
 	// first_byte is index into event buffer
-	if ( first_byte != 0
-	  && first_byte <= (int)(bytes - sizeof(struct inotify_event)) ) {
+	if ( c->first_byte != 0
+	  && c->first_byte <= (int)(c->bytes - sizeof(struct inotify_event)) ) {
 
-		ret = (struct inotify_event *)((char *)&event[0] + first_byte);
-		first_byte += sizeof(struct inotify_event) + ret->len;
+		ret = (struct inotify_event *)((char *)&c->event[0] + c->first_byte);
+		c->first_byte += sizeof(struct inotify_event) + ret->len;
 
 		// if the pointer to the next event exactly hits end of bytes read,
 		// that's good.  next time we're called, we'll read.
-		if ( first_byte == bytes ) {
-			first_byte = 0;
+		if ( c->first_byte == c->bytes ) {
+			c->first_byte = 0;
 		}
-		else if ( first_byte > bytes ) {
+		else if ( c->first_byte > c->bytes ) {
 			// oh... no.  this can't be happening.  An incomplete event.
 			// Copy what we currently have into first element, call self to
 			// read remainder.
 			// oh, and they BETTER NOT overlap.
 			// Boy I hope this code works.
 			// But I think this can never happen due to how inotify is written.
-			niceassert( (long)((char *)&event[0] +
+			niceassert( (long)((char *)&c->event[0] +
 			            sizeof(struct inotify_event) +
-			            event[0].len) <= (long)ret,
+			            c->event[0].len) <= (long)ret,
 			            "extremely unlucky user, death imminent" );
 			// how much of the event do we have?
-			bytes = (char *)&event[0] + bytes - (char *)ret;
-			memcpy( &event[0], ret, bytes );
-			return inotifytools_next_events( timeout, num_events );
+			c->bytes = (char *)&c->event[0] + c->bytes - (char *)ret;
+			memcpy( &c->event[0], ret, c->bytes );
+			return read_event( c, timeout, num_events );
 		}
-		RETURN(ret);
+		return ret;
 
 	}
 
-	else if ( first_byte == 0 ) {
-		bytes = 0;
+	else if ( c->first_byte == 0 ) {
+		c->bytes = 0;
 	}
 
 
-	static ssize_t this_bytes;
-	static unsigned int bytes_to_read;
-	static int rc;
-	static fd_set read_fds;
-
-	static struct timeval read_timeout;
-	read_timeout.tv_sec = timeout;
-	read_timeout.tv_usec = 0;
-	static struct timeval * read_timeout_ptr;
-	read_timeout_ptr = ( timeout <= 0 ? NULL : &read_timeout );
+	ssize_t this_bytes;
+	unsigned int bytes_to_read;
+	int rc;
+	fd_set read_fds;
 
 	FD_ZERO(&read_fds);
-	FD_SET(inotify_fd, &read_fds);
-	rc = select(inotify_fd + 1, &read_fds,
-	            NULL, NULL, read_timeout_ptr);
+	FD_SET(c->fd, &read_fds);
+	rc = select(c->fd + 1, &read_fds,
+	            NULL, NULL, timeout);
 	if ( rc < 0 ) {
 		// error
-		error = errno;
+		c->error = errno;
 		return NULL;
 	}
 	else if ( rc == 0 ) {
@@ -1184,19 +1775,19 @@ struct inotify_event * inotifytools_next_events( int timeout, int num_events ) {
 
 	// wait until we have enough bytes to read
 	do {
-		rc = ioctl( inotify_fd, FIONREAD, &bytes_to_read );
+		rc = ioctl( c->fd, FIONREAD, &bytes_to_read );
 	} while ( !rc &&
 	          bytes_to_read < sizeof(struct inotify_event)*num_events );
 
 	if ( rc == -1 ) {
-		error = errno;
+		c->error = errno;
 		return NULL;
 	}
 
-	this_bytes = read(inotify_fd, &event[0] + bytes,
-	                  sizeof(struct inotify_event)*MAX_EVENTS - bytes);
+	this_bytes = read(c->fd, (char *)&c->event[0] + c->bytes,
+	                  sizeof(struct inotify_event)*MAX_EVENTS - c->bytes);
 	if ( this_bytes < 0 ) {
-		error = errno;
+		c->error = errno;
 		return NULL;
 	}
 	if ( this_bytes == 0 ) {
@@ -1204,19 +1795,244 @@ struct inotify_event * inotifytools_next_events( int timeout, int num_events ) {
 		                "events occurred at once.\n");
 		return NULL;
 	}
-	bytes += this_bytes;
+	c->bytes += this_bytes;
+
+	ret = &c->event[0];
+	c->first_byte = sizeof(struct inotify_event) + ret->len;
+	niceassert( c->first_byte <= c->bytes, "ridiculously long filename, "
+	                                       "things will almost certainly "
+	                                       "screw up." );
+	if ( c->first_byte == c->bytes ) {
+		c->first_byte = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @internal
+ * State of one recursive walk.
+ *
+ * Directories still to be read are kept on a stack rather than the C stack,
+ * and may be read by several threads at once: each takes one off the stack,
+ * watches the directories in it and pushes them in turn.
+ */
+typedef struct {
+	inotifytools_ctx * c;
+	char **dirs;                // with a trailing '/'
+	int count;
+	int max;
+	int busy;                   // directories being read right now
+	int error;                  // stops the walk
+	int events;
+	char const **exclude_list;
+	int *exclude_len;           // without any trailing '/'
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} walk;
+
+
+/**
+ * @internal
+ * Push @a dir, which the walk takes ownership of.  Called with the lock held,
+ * or before any worker started.
+ */
+static void walk_push( walk * w, char * dir ) {
+	if ( w->count == w->max ) {
+		w->max = w->max ? w->max * 2 : 64;
+		w->dirs = (char**)realloc( w->dirs, w->max * sizeof(char*) );
+		niceassert( w->dirs, "out of memory" );
+	}
+	w->dirs[w->count++] = dir;
+}
+
+/**
+ * @internal
+ * Watch the directory @a dir.  Errors which only mean the directory went away
+ * or is off limits are ignored; anything else stops the walk.
+ *
+ * @return 1 if @a dir is now watched, 0 otherwise.
+ */
+static int walk_add_watch( walk * w, char const * dir ) {
+	int wd = inotify_add_watch( w->c->fd, dir, w->events );
+	int err = errno;
+
+	pthread_mutex_lock( &w->lock );
+	if ( wd >= 0 ) {
+		create_watch( w->c, wd, (char*)dir );
+	}
+	else if ( err != EACCES && err != ENOENT && err != ELOOP && !w->error ) {
+		w->error = err;
+	}
+	pthread_mutex_unlock( &w->lock );
+	return wd >= 0;
+}
+
+/**
+ * @internal
+ */
+static int walk_excluded( walk * w, char const * dir, int len ) {
+	int i;
+
+	for ( i = 0; w->exclude_list && w->exclude_list[i]; ++i ) {
+		if ( len == w->exclude_len[i] + 1 &&
+		     !strncmp( w->exclude_list[i], dir, w->exclude_len[i] ) )
+			return 1;
+	}
+	return 0;
+}
 
-	ret = &event[0];
-	first_byte = sizeof(struct inotify_event) + ret->len;
-	niceassert( first_byte <= bytes, "ridiculously long filename, things will "
-	                                 "almost certainly screw up." );
-	if ( first_byte == bytes ) {
-		first_byte = 0;
+/**
+ * @internal
+ * Watch every directory in @a dir, and return them in @a subdirs.  Plain files
+ * are told apart by d_type where the file system fills it in, and are never
+ * looked at any further.
+ */
+static int walk_read( walk * w, char const * dir, char *** subdirs ) {
+	int dir_len = strlen(dir);
+	int count = 0, max = 0;
+	struct dirent * ent;
+	struct stat my_stat;
+	DIR * d;
+	int fd;
+
+	fd = open( dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+	if ( fd < 0 || !(d = fdopendir( fd )) ) {
+		if ( fd >= 0 ) close( fd );
+		return 0;
 	}
 
-	RETURN(ret);
+	while ( (ent = readdir( d )) ) {
+		char * next;
+		int len;
+
+		if ( ent->d_name[0] == '.' && (ent->d_name[1] == 0 ||
+		     (ent->d_name[1] == '.' && ent->d_name[2] == 0)) )
+			continue;
+		if ( ent->d_type == DT_UNKNOWN ) {
+			if ( fstatat( fd, ent->d_name, &my_stat, AT_SYMLINK_NOFOLLOW ) ||
+			     !S_ISDIR( my_stat.st_mode ) )
+				continue;
+		}
+		else if ( ent->d_type != DT_DIR ) {
+			continue;
+		}
 
-#undef RETURN
+		len = dir_len + strlen(ent->d_name) + 1;
+		next = (char*)malloc( len + 1 );
+		niceassert( next, "out of memory" );
+		memcpy( next, dir, dir_len );
+		strcpy( next + dir_len, ent->d_name );
+		next[len-1] = '/';
+		next[len] = 0;
+
+		if ( walk_excluded( w, next, len ) ||
+		     ( w->c->walk_filter &&
+		       w->c->walk_filter( next, w->c->walk_filter_arg ) ) ||
+		     !walk_add_watch( w, next ) ) {
+			free( next );
+			if ( w->error ) break;
+			continue;
+		}
+		if ( count == max ) {
+			max = max ? max * 2 : 16;
+			*subdirs = (char**)realloc( *subdirs, max * sizeof(char*) );
+			niceassert( *subdirs, "out of memory" );
+		}
+		(*subdirs)[count++] = next;
+	}
+	closedir( d );
+	return count;
+}
+
+/**
+ * @internal
+ * Read directories off the walk's stack until there are none left.
+ */
+static void *walk_worker( void * arg ) {
+	walk * w = (walk*)arg;
+	char ** subdirs = 0;
+	char * dir;
+	int count, i;
+
+	pthread_mutex_lock( &w->lock );
+	for (;;) {
+		while ( !w->count && w->busy && !w->error )
+			pthread_cond_wait( &w->cond, &w->lock );
+		if ( !w->count || w->error ) break;
+
+		dir = w->dirs[--w->count];
+		++w->busy;
+		pthread_mutex_unlock( &w->lock );
+
+		count = walk_read( w, dir, &subdirs );
+		free( dir );
+
+		pthread_mutex_lock( &w->lock );
+		for ( i = 0; i < count; ++i ) {
+			walk_push( w, subdirs[i] );
+		}
+		--w->busy;
+		pthread_cond_broadcast( &w->cond );
+	}
+	pthread_cond_broadcast( &w->cond );
+	pthread_mutex_unlock( &w->lock );
+	free( subdirs );
+	return 0;
+}
+
+/**
+ * Set the number of threads which read directories while setting up
+ * recursive watches.
+ *
+ * On a large tree, inotifytools_watch_recursively() spends most of its time
+ * waiting on the file system for directory contents, which several threads
+ * can do at once.  The default is 1, which reads everything in the calling
+ * thread.
+ *
+ * @param threads number of threads, at least 1.
+ */
+void inotifytools_set_walk_threads( int threads ) {
+	inotifytools_set_walk_threads_r( &default_ctx, threads );
+}
+
+/**
+ * inotifytools_set_walk_threads() for the context @a c.
+ */
+void inotifytools_set_walk_threads_r( inotifytools_ctx * c, int threads ) {
+	c->walk_threads = threads < 1 ? 1 : threads;
+}
+
+/**
+ * Leave some directories out of recursive watches.
+ *
+ * @a filter is called by inotifytools_watch_recursively() with the path of
+ * each directory below the top one, ending in '/'.  If it returns non-zero,
+ * the directory is not watched, and nothing below it is read.  Unlike the
+ * exclude list, which names fixed paths, the filter can match by pattern,
+ * and it also applies to directories watched later on.  With more than one
+ * walk thread
+ * (see inotifytools_set_walk_threads()) it may be called from several
+ * threads at once.
+ *
+ * @param filter function deciding which directories to leave out, or 0 to
+ *               watch them all.
+ * @param arg    passed on to @a filter.
+ */
+void inotifytools_set_walk_filter( int (*filter)( char const * path, void * arg ),
+                                   void * arg ) {
+	inotifytools_set_walk_filter_r( &default_ctx, filter, arg );
+}
+
+/**
+ * inotifytools_set_walk_filter() for the context @a c.
+ */
+void inotifytools_set_walk_filter_r( inotifytools_ctx * c,
+                                     int (*filter)( char const * path,
+                                                    void * arg ),
+                                     void * arg ) {
+	c->walk_filter = filter;
+	c->walk_filter_arg = arg;
 }
 
 /**
@@ -1245,7 +2061,16 @@ struct inotify_event * inotifytools_next_events( int timeout, int num_events ) {
  *       as to whether or not those files will be watched.
  */
 int inotifytools_watch_recursively( char const * path, int events ) {
-	return inotifytools_watch_recursively_with_exclude( path, events, 0 );
+	return inotifytools_watch_recursively_with_exclude_r( &default_ctx, path,
+	                                                      events, 0 );
+}
+
+/**
+ * inotifytools_watch_recursively() for the context @a c.
+ */
+int inotifytools_watch_recursively_r( inotifytools_ctx * c, char const * path,
+                                      int events ) {
+	return inotifytools_watch_recursively_with_exclude_r( c, path, events, 0 );
 }
 
 /**
@@ -1282,166 +2107,161 @@ int inotifytools_watch_recursively( char const * path, int events ) {
  */
 int inotifytools_watch_recursively_with_exclude( char const * path, int events,
                                                  char const ** exclude_list ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
+	return inotifytools_watch_recursively_with_exclude_r( &default_ctx, path,
+	                                                      events,
+	                                                      exclude_list );
+}
 
-	DIR * dir;
+/**
+ * inotifytools_watch_recursively_with_exclude() for the context @a c.
+ */
+int inotifytools_watch_recursively_with_exclude_r( inotifytools_ctx * c,
+                                                   char const * path,
+                                                   int events,
+                                                   char const **
+                                                   exclude_list ) {
+	niceassert( c->init, "inotifytools_initialize not called yet" );
+
+	walk w;
+	pthread_t *threads = 0;
+	int num_threads = 0, i;
 	char * my_path;
-	error = 0;
-	dir = opendir( path );
-	if ( !dir ) {
-		// If not a directory, don't need to do anything special
-		if ( errno == ENOTDIR ) {
-			return inotifytools_watch_file( path, events );
-		}
-		else {
-			error = errno;
-			return 0;
-		}
+	struct stat my_stat;
+
+	c->error = 0;
+	if ( -1 == stat( path, &my_stat ) ) {
+		c->error = errno;
+		return 0;
+	}
+	// If not a directory, don't need to do anything special
+	if ( !S_ISDIR( my_stat.st_mode ) ) {
+		return inotifytools_watch_file_r( c, path, events );
 	}
 
 	if ( path[strlen(path)-1] != '/' ) {
 		nasprintf( &my_path, "%s/", path );
 	}
 	else {
-		my_path = (char *)path;
-	}
-
-	static struct dirent * ent;
-	char * next_file;
-	static struct stat my_stat;
-	ent = readdir( dir );
-	// Watch each directory within this directory
-	while ( ent ) {
-		if ( (0 != strcmp( ent->d_name, "." )) &&
-		     (0 != strcmp( ent->d_name, ".." )) ) {
-			nasprintf(&next_file,"%s%s", my_path, ent->d_name);
-			if ( -1 == lstat( next_file, &my_stat ) ) {
-				error = errno;
-				free( next_file );
-				if ( errno != EACCES ) {
-					error = errno;
-					if ( my_path != path ) free( my_path );
-					closedir( dir );
-					return 0;
-				}
-			}
-			else if ( S_ISDIR( my_stat.st_mode ) &&
-			          !S_ISLNK( my_stat.st_mode )) {
-				free( next_file );
-				nasprintf(&next_file,"%s%s/", my_path, ent->d_name);
-				static unsigned int no_watch;
-				static char const ** exclude_entry;
-
-				no_watch = 0;
-				for (exclude_entry = exclude_list;
-					 exclude_entry && *exclude_entry && !no_watch;
-					 ++exclude_entry) {
-					static int exclude_length;
-
-					exclude_length = strlen(*exclude_entry);
-					if ((*exclude_entry)[exclude_length-1] == '/') {
-						--exclude_length;
-					}
-					if ( strlen(next_file) == (unsigned)(exclude_length + 1) &&
-					    !strncmp(*exclude_entry, next_file, exclude_length)) {
-						// directory found in exclude list
-						no_watch = 1;
-					}
-				}
-				if (!no_watch) {
-					static int status;
-					status = inotifytools_watch_recursively_with_exclude(
-					              next_file,
-					              events,
-					              exclude_list );
-					// For some errors, we will continue.
-					if ( !status && (EACCES != error) && (ENOENT != error) &&
-					     (ELOOP != error) ) {
-						free( next_file );
-						if ( my_path != path ) free( my_path );
-						closedir( dir );
-						return 0;
-					}
-				} // if !no_watch
-				free( next_file );
-			} // if isdir and not islnk
-			else {
-				free( next_file );
+		my_path = strdup( path );
+		niceassert( my_path, "out of memory" );
+	}
+
+	memset( &w, 0, sizeof(w) );
+	w.c = c;
+	w.events = events;
+	w.exclude_list = exclude_list;
+	for ( i = 0; exclude_list && exclude_list[i]; ++i ) ;
+	if ( i ) {
+		w.exclude_len = (int*)malloc( i * sizeof(int) );
+		niceassert( w.exclude_len, "out of memory" );
+		for ( i = 0; exclude_list[i]; ++i ) {
+			w.exclude_len[i] = strlen(exclude_list[i]);
+			if ( w.exclude_len[i] && exclude_list[i][w.exclude_len[i]-1] == '/' )
+				--w.exclude_len[i];
+		}
+	}
+	pthread_mutex_init( &w.lock, 0 );
+	pthread_cond_init( &w.cond, 0 );
+
+	// unlike the ones below it, the top directory has to be watched
+	i = inotify_add_watch( c->fd, my_path, events );
+	if ( i < 0 ) {
+		w.error = errno;
+		free( my_path );
+	}
+	else {
+		create_watch( c, i, my_path );
+		walk_push( &w, my_path );
+		if ( c->walk_threads > 1 ) {
+			threads = (pthread_t*)malloc( (c->walk_threads-1) *
+			                              sizeof(pthread_t) );
+			niceassert( threads, "out of memory" );
+			for ( ; num_threads < c->walk_threads-1; ++num_threads ) {
+				if ( pthread_create( &threads[num_threads], 0, walk_worker, &w ) )
+					break;
 			}
 		}
-		ent = readdir( dir );
-		error = 0;
+		walk_worker( &w );
+		for ( i = 0; i < num_threads; ++i ) {
+			pthread_join( threads[i], 0 );
+		}
+		free( threads );
 	}
 
-	closedir( dir );
+	while ( w.count ) {
+		free( w.dirs[--w.count] );
+	}
+	free( w.dirs );
+	free( w.exclude_len );
+	pthread_mutex_destroy( &w.lock );
+	pthread_cond_destroy( &w.cond );
 
-	int ret = inotifytools_watch_file( my_path, events );
-	if ( my_path != path ) free( my_path );
-        return ret;
+	c->error = w.error;
+	return !w.error;
 }
 
 /**
  * @internal
  */
-void record_stats( struct inotify_event const * event ) {
+void record_stats( inotifytools_ctx * c, struct inotify_event const * event ) {
 	if (!event) return;
-	watch *w = watch_from_wd(event->wd);
+	watch *w = watch_from_wd(c, event->wd);
 	if (!w) return;
 	if ( IN_ACCESS & event->mask ) {
 		++w->hit_access;
-		++num_access;
+		++c->num_access;
 	}
 	if ( IN_MODIFY & event->mask ) {
 		++w->hit_modify;
-		++num_modify;
+		++c->num_modify;
 	}
 	if ( IN_ATTRIB & event->mask ) {
 		++w->hit_attrib;
-		++num_attrib;
+		++c->num_attrib;
 	}
 	if ( IN_CLOSE_WRITE & event->mask ) {
 		++w->hit_close_write;
-		++num_close_write;
+		++c->num_close_write;
 	}
 	if ( IN_CLOSE_NOWRITE & event->mask ) {
 		++w->hit_close_nowrite;
-		++num_close_nowrite;
+		++c->num_close_nowrite;
 	}
 	if ( IN_OPEN & event->mask ) {
 		++w->hit_open;
-		++num_open;
+		++c->num_open;
 	}
 	if ( IN_MOVED_FROM & event->mask ) {
 		++w->hit_moved_from;
-		++num_moved_from;
+		++c->num_moved_from;
 	}
 	if ( IN_MOVED_TO & event->mask ) {
 		++w->hit_moved_to;
-		++num_moved_to;
+		++c->num_moved_to;
 	}
 	if ( IN_CREATE & event->mask ) {
 		++w->hit_create;
-		++num_create;
+		++c->num_create;
 	}
 	if ( IN_DELETE & event->mask ) {
 		++w->hit_delete;
-		++num_delete;
+		++c->num_delete;
 	}
 	if ( IN_DELETE_SELF & event->mask ) {
 		++w->hit_delete_self;
-		++num_delete_self;
+		++c->num_delete_self;
 	}
 	if ( IN_UNMOUNT & event->mask ) {
 		++w->hit_unmount;
-		++num_unmount;
+		++c->num_unmount;
 	}
 	if ( IN_MOVE_SELF & event->mask ) {
 		++w->hit_move_self;
-		++num_move_self;
+		++c->num_move_self;
 	}
 
 	++w->hit_total;
-	++num_total;
+	++c->num_total;
 
 }
 
@@ -1494,9 +2314,16 @@ int *stat_ptr(watch *w, int event)
  *         enabled, or -1 if @a event or @a wd are invalid.
  */
 int inotifytools_get_stat_by_wd( int wd, int event ) {
-	if (!collect_stats) return -1;
+	return inotifytools_get_stat_by_wd_r( &default_ctx, wd, event );
+}
 
-	watch *w = watch_from_wd(wd);
+/**
+ * inotifytools_get_stat_by_wd() for the context @a c.
+ */
+int inotifytools_get_stat_by_wd_r( inotifytools_ctx * c, int wd, int event ) {
+	if (!c->collect_stats) return -1;
+
+	watch *w = watch_from_wd(c, wd);
 	if (!w) return -1;
 	int *i = stat_ptr(w, event);
 	if (!i) return -1;
@@ -1517,36 +2344,43 @@ int inotifytools_get_stat_by_wd( int wd, int event ) {
  *         is not a valid event.
  */
 int inotifytools_get_stat_total( int event ) {
-	if (!collect_stats) return -1;
+	return inotifytools_get_stat_total_r( &default_ctx, event );
+}
+
+/**
+ * inotifytools_get_stat_total() for the context @a c.
+ */
+int inotifytools_get_stat_total_r( inotifytools_ctx * c, int event ) {
+	if (!c->collect_stats) return -1;
 	if ( IN_ACCESS == event )
-		return num_access;
+		return c->num_access;
 	if ( IN_MODIFY == event )
-		return num_modify;
+		return c->num_modify;
 	if ( IN_ATTRIB == event )
-		return num_attrib;
+		return c->num_attrib;
 	if ( IN_CLOSE_WRITE == event )
-		return num_close_write;
+		return c->num_close_write;
 	if ( IN_CLOSE_NOWRITE == event )
-		return num_close_nowrite;
+		return c->num_close_nowrite;
 	if ( IN_OPEN == event )
-		return num_open;
+		return c->num_open;
 	if ( IN_MOVED_FROM == event )
-		return num_moved_from;
+		return c->num_moved_from;
 	if ( IN_MOVED_TO == event )
-		return num_moved_to;
+		return c->num_moved_to;
 	if ( IN_CREATE == event )
-		return num_create;
+		return c->num_create;
 	if ( IN_DELETE == event )
-		return num_delete;
+		return c->num_delete;
 	if ( IN_DELETE_SELF == event )
-		return num_delete_self;
+		return c->num_delete_self;
 	if ( IN_UNMOUNT == event )
-		return num_unmount;
+		return c->num_unmount;
 	if ( IN_MOVE_SELF == event )
-		return num_move_self;
+		return c->num_move_self;
 
 	if ( 0 == event )
-		return num_total;
+		return c->num_total;
 
 	return -1;
 }
@@ -1576,6 +2410,15 @@ int inotifytools_get_stat_by_filename( char const * filename,
 	       filename ), event );
 }
 
+/**
+ * inotifytools_get_stat_by_filename() for the context @a c.
+ */
+int inotifytools_get_stat_by_filename_r( inotifytools_ctx * c,
+                                         char const * filename, int event ) {
+	return inotifytools_get_stat_by_wd_r( c, inotifytools_wd_from_filename_r(
+	       c, filename ), event );
+}
+
 /**
  * Get the last error which occurred.
  *
@@ -1587,14 +2430,21 @@ int inotifytools_get_stat_by_filename( char const * filename,
  * @return an error code.
  */
 int inotifytools_error() {
-	return error;
+	return default_ctx.error;
+}
+
+/**
+ * inotifytools_error() for the context @a c.
+ */
+int inotifytools_error_r( inotifytools_ctx * c ) {
+	return c->error;
 }
 
 /**
  * @internal
  */
 int isdir( char const * path ) {
-	static struct stat my_stat;
+	struct stat my_stat;
 
 	if ( -1 == lstat( path, &my_stat ) ) {
 		if (errno == ENOENT) return 0;
@@ -1613,9 +2463,14 @@ int isdir( char const * path ) {
  *         inotifytools_watch_files() and inotifytools_watch_recursively().
  */
 int inotifytools_get_num_watches() {
-	int ret = 0;
-	rbwalk(tree_filename, get_num, (void*)&ret);
-	return ret;
+	return default_ctx.num_watches;
+}
+
+/**
+ * inotifytools_get_num_watches() for the context @a c.
+ */
+int inotifytools_get_num_watches_r( inotifytools_ctx * c ) {
+	return c->num_watches;
 }
 
 /**
@@ -1659,7 +2514,15 @@ int inotifytools_get_num_watches() {
  * @endcode
  */
 int inotifytools_printf( struct inotify_event* event, char* fmt ) {
-	return inotifytools_fprintf( stdout, event, fmt );
+	return inotifytools_fprintf_r( &default_ctx, stdout, event, fmt );
+}
+
+/**
+ * inotifytools_printf() for an event read from the context @a c.
+ */
+int inotifytools_printf_r( inotifytools_ctx * c, struct inotify_event* event,
+                           char* fmt ) {
+	return inotifytools_fprintf_r( c, stdout, event, fmt );
 }
 
 /**
@@ -1704,9 +2567,17 @@ int inotifytools_printf( struct inotify_event* event, char* fmt ) {
  * @endcode
  */
 int inotifytools_fprintf( FILE* file, struct inotify_event* event, char* fmt ) {
-	static char out[MAX_STRLEN+1];
-	static int ret;
-	ret = inotifytools_sprintf( out, event, fmt );
+	return inotifytools_fprintf_r( &default_ctx, file, event, fmt );
+}
+
+/**
+ * inotifytools_fprintf() for an event read from the context @a c.
+ */
+int inotifytools_fprintf_r( inotifytools_ctx * c, FILE* file,
+                            struct inotify_event* event, char* fmt ) {
+	char out[MAX_STRLEN+1];
+	int ret;
+	ret = inotifytools_snprintf_r( c, out, MAX_STRLEN, event, fmt );
 	if ( -1 != ret ) fprintf( file, "%s", out );
 	return ret;
 }
@@ -1762,7 +2633,7 @@ int inotifytools_fprintf( FILE* file, struct inotify_event* event, char* fmt ) {
  * @endcode
  */
 int inotifytools_sprintf( char * out, struct inotify_event* event, char* fmt ) {
-	return inotifytools_snprintf( out, MAX_STRLEN, event, fmt );
+	return inotifytools_snprintf_r( &default_ctx, out, MAX_STRLEN, event, fmt );
 }
 
 
@@ -1814,11 +2685,20 @@ int inotifytools_sprintf( char * out, struct inotify_event* event, char* fmt ) {
  */
 int inotifytools_snprintf( char * out, int size,
                            struct inotify_event* event, char* fmt ) {
-	static char * filename, * eventname, * eventstr;
-	static unsigned int i, ind;
-	static char ch1;
-	static char timestr[MAX_STRLEN];
-	static time_t now;
+	return inotifytools_snprintf_r( &default_ctx, out, size, event, fmt );
+}
+
+/**
+ * inotifytools_snprintf() for an event read from the context @a c.
+ */
+int inotifytools_snprintf_r( inotifytools_ctx * c, char * out, int size,
+                             struct inotify_event* event, char* fmt ) {
+	char * filename, * eventname, * eventstr;
+	unsigned int i, ind;
+	char ch1;
+	char timestr[MAX_STRLEN];
+	char events[EVENT_STR_MAX];
+	time_t now;
 
 
 	if ( event->len > 0 ) {
@@ -1829,14 +2709,14 @@ int inotifytools_snprintf( char * out, int size,
 	}
 
 
-	filename = inotifytools_filename_from_wd( event->wd );
+	filename = inotifytools_filename_from_wd_r( c, event->wd );
 
 	if ( !fmt || 0 == strlen(fmt) ) {
-		error = EINVAL;
+		c->error = EINVAL;
 		return -1;
 	}
 	if ( strlen(fmt) > MAX_STRLEN || size > MAX_STRLEN) {
-		error = EMSGSIZE;
+		c->error = EMSGSIZE;
 		return -1;
 	}
 
@@ -1850,7 +2730,7 @@ int inotifytools_snprintf( char * out, int size,
 
 		if ( i == strlen(fmt) - 1 ) {
 			// last character is %, invalid
-			error = EINVAL;
+			c->error = EINVAL;
 			return ind;
 		}
 
@@ -1881,7 +2761,7 @@ int inotifytools_snprintf( char * out, int size,
 		}
 
 		if ( ch1 == 'e' ) {
-			eventstr = inotifytools_event_to_str( event->mask );
+			eventstr = event_to_str( event->mask, ',', events );
 			strncpy( &out[ind], eventstr, size - ind );
 			ind += strlen(eventstr);
 			++i;
@@ -1890,14 +2770,14 @@ int inotifytools_snprintf( char * out, int size,
 
 		if ( ch1 == 'T' ) {
 
-			if ( timefmt ) {
+			if ( c->timefmt ) {
 
 				now = time(0);
-				if ( 0 >= strftime( timestr, MAX_STRLEN-1, timefmt,
+				if ( 0 >= strftime( timestr, MAX_STRLEN-1, c->timefmt,
 				                    localtime( &now ) ) ) {
 
 					// time format probably invalid
-					error = EINVAL;
+					c->error = EINVAL;
 					return ind;
 				}
 			}
@@ -1913,7 +2793,7 @@ int inotifytools_snprintf( char * out, int size,
 
 		// Check if next char in fmt is e
 		if ( i < strlen(fmt) - 2 && fmt[i+2] == 'e' ) {
-			eventstr = inotifytools_event_to_str_sep( event->mask, ch1 );
+			eventstr = event_to_str( event->mask, ch1, events );
 			strncpy( &out[ind], eventstr, size - ind );
 			ind += strlen(eventstr);
 			i += 2;
@@ -1940,7 +2820,14 @@ int inotifytools_snprintf( char * out, int size,
  *            incorrect results.
  */
 void inotifytools_set_printf_timefmt( char * fmt ) {
-	timefmt = fmt;
+	default_ctx.timefmt = fmt;
+}
+
+/**
+ * inotifytools_set_printf_timefmt() for the context @a c.
+ */
+void inotifytools_set_printf_timefmt_r( inotifytools_ctx * c, char * fmt ) {
+	c->timefmt = fmt;
 }
 
 /**
@@ -1999,11 +2886,21 @@ int inotifytools_get_max_user_watches() {
  * ignored.
  */
 int inotifytools_ignore_events_by_regex( char const *pattern, int flags ) {
+	return inotifytools_ignore_events_by_regex_r( &default_ctx, pattern, flags );
+}
+
+/**
+ * inotifytools_ignore_events_by_regex() for the context @a c.
+ */
+int inotifytools_ignore_events_by_regex_r( inotifytools_ctx * c,
+                                           char const *pattern, int flags ) {
+	regex_t * regex = c->regex;
+
 	if (!pattern) {
 		if (regex) {
 			regfree(regex);
 			free(regex);
-			regex = 0;
+			c->regex = 0;
 		}
 		return 1;
 	}
@@ -2011,13 +2908,14 @@ int inotifytools_ignore_events_by_regex( char const *pattern, int flags ) {
 	if (regex) { regfree(regex); }
 	else       { regex = (regex_t *)malloc(sizeof(regex_t)); }
 
+	c->regex = regex;
 	int ret = regcomp(regex, pattern, flags | REG_NOSUB);
 	if (0 == ret) return 1;
 
 	regfree(regex);
 	free(regex);
-	regex = 0;
-	error = EINVAL;
+	c->regex = 0;
+	c->error = EINVAL;
 	return 0;
 }
 
@@ -2045,15 +2943,21 @@ int event_compare(const void *p1, const void *p2, const void *config)
 }
 
 struct rbtree *inotifytools_wd_sorted_by_event(int sort_event)
+{
+	return inotifytools_wd_sorted_by_event_r(&default_ctx, sort_event);
+}
+
+struct rbtree *inotifytools_wd_sorted_by_event_r(inotifytools_ctx * c,
+                                                 int sort_event)
 {
 	struct rbtree *ret = rbinit(event_compare, (void*)sort_event);
-	RBLIST *all = rbopenlist(tree_wd);
-	void const *p = rbreadlist(all);
-	while (p) {
-		void const *r = rbsearch(p, ret);
-		niceassert((int)(r == p), "Couldn't insert watch into new tree");
-		p = rbreadlist(all);
-	}
-	rbcloselist(all);
+	unsigned i;
+	watch *w;
+	for ( i = 0; i < c->table_size; ++i ) {
+		for ( w = c->wd_table[i]; w; w = w->wd_next ) {
+			void const *r = rbsearch(w, ret);
+			niceassert((int)(r == w), "Couldn't insert watch into new tree");
+		}
+	}
 	return ret;
 }